@@ -0,0 +1,1366 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <array>
+#include <set>
+#include <vector>
+#include "analyze.h"
+#include "vm.h"
+#include "context.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "numeric.h"
+#include "parser.h"
+#include "list.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+static bool		sKeywordsReady = false;
+static Symbol	sQuote, sDefine, sSet, sIf, sLambda, sCallcc, sLet, sLetStar, sBegin;
+
+static void initKeywords()
+{
+	if (sKeywordsReady)
+	{
+		return;
+	}
+	sQuote		= gSymbolTable.GetSymbol("quote");
+	sDefine		= gSymbolTable.GetSymbol("define");
+	sSet		= gSymbolTable.GetSymbol("set!");
+	sIf			= gSymbolTable.GetSymbol("if");
+	sLambda		= gSymbolTable.GetSymbol("lambda");
+	sCallcc		= gSymbolTable.GetSymbol("callcc");
+	sLet		= gSymbolTable.GetSymbol("let");
+	sLetStar	= gSymbolTable.GetSymbol("let*");
+	sBegin		= gSymbolTable.GetSymbol("begin");
+	sKeywordsReady = true;
+}
+
+// The elements of a proper list, or false if it isn't one.
+static bool elements(const Item& list, std::vector<Item>* items)
+{
+	if (list.type() != eCell)
+	{
+		return false;
+	}
+	for (CellRef cell = boost::any_cast<CellRef>(list); cell; cell = cell->next())
+	{
+		items->push_back(cell->mCar);
+		if (cell->cdr().type() != eCell)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static Context* outward(Context* context, uint32_t depth)
+{
+	while (context && depth > 0)
+	{
+		context = context->mOuter;
+		depth--;
+	}
+	return context;
+}
+
+// A node that has to wait on a value keeps what it needs meanwhile, the frames
+// it runs in, the values it has so far and its continuation, in a record, and
+// hands on a continuation that resumes it from there. Records come from a pool
+// the collector marks, so waiting allocates nothing once the pool has grown and
+// holding a record links nothing; the copies of a continuation share its record
+// by counting. A record isn't changed once it is waited on, as resuming works
+// on a copy, so a continuation returned through twice starts from the same
+// values each time.
+struct Pending;
+
+struct Waiting : public Node
+{
+	virtual void resume(const Pending& pending, const Item& value) const = 0;
+};
+
+class PendingRef
+{
+public:
+	PendingRef() : mPending(nullptr) {}
+	explicit PendingRef(Pending* pending);
+	PendingRef(const PendingRef& other);
+	PendingRef(PendingRef&& other) : mPending(other.mPending) { other.mPending = nullptr; }
+	~PendingRef();
+	PendingRef& operator=(PendingRef other) { std::swap(mPending, other.mPending); return *this; }
+
+	Pending*	get() const { return mPending; }
+	Pending*	operator->() const { return mPending; }
+	Pending&	operator*() const { return *mPending; }
+	// gives the reference up without letting the record go
+	Pending*	detach() { Pending* pending = mPending; mPending = nullptr; return pending; }
+
+private:
+	Pending*	mPending;
+};
+
+struct Pending
+{
+	uint32_t				mRefs;
+	const Waiting*			mNode;			// what resumes from the record
+	uint32_t				mIndex;			// and what it waits on
+	Context*				mContext;
+	Context*				mFrame;			// a let's frame
+	std::vector<Item>		mValues;
+	// The continuation the node answers: the caller's own until the node waits,
+	// then a copy, or the one in the record a resumed copy was made from.
+	const Continuation*		mPassed;
+	Continuation			mK;
+	PendingRef				mKeeper;
+
+	Pending()
+		: mRefs(0)
+		, mNode(nullptr)
+		, mIndex(0)
+		, mContext(nullptr)
+		, mFrame(nullptr)
+		, mPassed(nullptr)
+	{}
+
+	const Continuation& k() const { return mPassed ? *mPassed : mKeeper.get() ? mKeeper->mK : mK; }
+};
+
+// The continuation a waiting node hands on.
+struct Resume
+{
+	PendingRef	mPending;
+
+	void operator()(Item value) const;
+};
+
+class Records : public RootSet
+{
+public:
+	Records() : mDropping(false) { gMemory.addRootSet(this); }
+
+	PendingRef	take(Context* context);
+	// a record to resume from, with the values and frames of one waited on
+	PendingRef	copy(const Pending& pending);
+	void		release(Pending* pending);
+	void		markRoots() override;
+
+private:
+	std::vector< std::unique_ptr<Pending> >	mRecords;
+	std::vector<Pending*>	mFree;
+	std::vector<Pending*>	mDropped;
+	bool					mDropping;
+};
+
+static Records& records()
+{
+	// never freed, as continuations still hold records when statics go
+	static Records* sRecords = new Records();
+	return *sRecords;
+}
+
+PendingRef::PendingRef(Pending* pending)
+	: mPending(pending)
+{
+	mPending->mRefs++;
+}
+
+PendingRef::PendingRef(const PendingRef& other)
+	: mPending(other.mPending)
+{
+	if (mPending)
+	{
+		mPending->mRefs++;
+	}
+}
+
+PendingRef::~PendingRef()
+{
+	if (mPending)
+	{
+		records().release(mPending);
+	}
+}
+
+PendingRef Records::take(Context* context)
+{
+	if (mFree.empty())
+	{
+		mRecords.push_back(std::unique_ptr<Pending>(new Pending()));
+		mFree.push_back(mRecords.back().get());
+	}
+	Pending* pending = mFree.back();
+	mFree.pop_back();
+	pending->mContext = context;
+	return PendingRef(pending);
+}
+
+PendingRef Records::copy(const Pending& pending)
+{
+	PendingRef copy = take(pending.mContext);
+	copy->mFrame = pending.mFrame;
+	copy->mValues = pending.mValues;
+	copy->mKeeper = pending.mKeeper.get() ? pending.mKeeper : PendingRef(const_cast<Pending*>(&pending));
+	return copy;
+}
+
+// A record let go lets go of those it holds, a chain of them one at a time
+// rather than by nested destructors.
+void Records::release(Pending* pending)
+{
+	if (--pending->mRefs > 0)
+	{
+		return;
+	}
+	mDropped.push_back(pending);
+	if (mDropping)
+	{
+		return;
+	}
+	mDropping = true;
+	while (!mDropped.empty())
+	{
+		pending = mDropped.back();
+		mDropped.pop_back();
+		Pending* held[2] = { pending->mKeeper.detach(), nullptr };
+		if (Resume* resume = pending->mK.target<Resume>())
+		{
+			held[1] = resume->mPending.detach();
+		}
+		// what else the continuation holds may come back here, to wait its turn
+		pending->mK = nullptr;
+		pending->mValues.clear();
+		pending->mNode = nullptr;
+		pending->mContext = nullptr;
+		pending->mFrame = nullptr;
+		pending->mPassed = nullptr;
+		mFree.push_back(pending);
+		for (auto next : held)
+		{
+			if (next && --next->mRefs == 0)
+			{
+				mDropped.push_back(next);
+			}
+		}
+	}
+	mDropping = false;
+}
+
+void Records::markRoots()
+{
+	for (auto& pending : mRecords)
+	{
+		if (pending->mRefs > 0)
+		{
+			markHeld(pending->mContext);
+			markHeld(pending->mFrame);
+			markHeld(pending->mValues);
+		}
+	}
+}
+
+static PendingRef take(Context* context, const Continuation& k)
+{
+	PendingRef pending = records().take(context);
+	pending->mPassed = &k;
+	return pending;
+}
+
+// The continuation that resumes the node from the record, at index. The
+// record is waited on from now on, and only read.
+static Continuation wait(PendingRef& pending, const Waiting* node, uint32_t index)
+{
+	Pending& waiting = *pending;
+	if (waiting.mPassed)
+	{
+		waiting.mK = *waiting.mPassed;
+		waiting.mPassed = nullptr;
+	}
+	waiting.mNode = node;
+	waiting.mIndex = index;
+	Resume resume;
+	resume.mPending = std::move(pending);
+	return resume;
+}
+
+// Analyzed code calls analyzed code, and returns to it, straight away rather
+// than from the trampoline. Every cBounce steps one goes round it instead, so
+// neither calls nor returns nest deeply on the C++ stack.
+const uint32_t cBounce = 2;
+static uint32_t sSteps = 0;
+
+void Resume::operator()(Item value) const
+{
+	// the record lives through its node's resumption, whatever becomes of this
+	PendingRef pending(mPending);
+	if (++sSteps < cBounce)
+	{
+		pending->mNode->resume(*pending, value);
+		return;
+	}
+	sSteps = 0;
+	PendingRef held = records().take(nullptr);
+	held->mValues.push_back(value);
+	yield([pending, held]() {
+		pending->mNode->resume(*pending, held->mValues[0]);
+	});
+}
+
+// Runs a closure's analyzed body in the frame binding its parameters.
+static void enter(const Node* code, Context* frame, const Continuation& k)
+{
+	if (++sSteps < cBounce)
+	{
+		code->exec(frame, k);
+		return;
+	}
+	sSteps = 0;
+	PendingRef held = records().take(frame);
+	held->mK = k;
+	yield([code, held]() {
+		code->exec(held->mContext, held->mK);
+	});
+}
+
+// Calls proc on the values in the record, answering its continuation. A
+// primitive answers on the spot and analyzed code is entered straight away;
+// anything else is applied.
+static void invoke(const Item& proc, const PendingRef& call)
+{
+	const Pending& state = *call;
+	uint32_t count = (uint32_t)state.mValues.size();
+	const Item* args = count ? &state.mValues[0] : nullptr;
+	const Proc* callee = proc.peek<Proc>();
+
+	if (callee && callee->mPrimitive && callee->mPrimitive->mFn)
+	{
+		Item result;
+		std::string error;
+		if (callPrimitive(*callee->mPrimitive, args, count, state.mContext, &result, &error))
+		{
+			state.k()(result);
+		}
+		else
+		{
+			raiseError(error, state.k());
+		}
+		return;
+	}
+
+	if (callee && !callee->mPrimitive && !callee->mNative && callee->mCode)
+	{
+		gMemory.pushRoot(proc);
+		std::string error;
+		Context* frame = bindArgs(*callee, args, count, state.mContext, &error);
+		gMemory.popRoots(1);
+		if (!frame)
+		{
+			raiseError(error, state.k());
+			return;
+		}
+		frame->mCode = callee->mCode;
+		enter(frame->mCode.get(), frame, state.k());
+		return;
+	}
+
+	apply(proc, args, count, state.mContext, state.k());
+}
+
+static void result(Assembler& out, bool tail)
+{
+	if (tail)
+	{
+		out.emit(eOpReturn);
+	}
+}
+
+static bool truthy(const Item& item)
+{
+	return item.type() != eNumber || boost::any_cast<Number>(item) != 0;
+}
+
+struct Constant : public Node
+{
+	Item	mValue;
+
+	Constant(Item value)
+		: mValue(value)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		k(mValue);
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		*result = mValue;
+		return true;
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpConst, out.constant(mValue));
+		result(out, tail);
+	}
+};
+
+// A variable bound by a known frame, 'depth' frames out.
+struct LocalRef : public Node
+{
+	Symbol		mSymbol;
+	uint32_t	mDepth;
+
+	LocalRef(Symbol symbol, uint32_t depth)
+		: mSymbol(symbol)
+		, mDepth(depth)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		Item result;
+		value(context, &result, nullptr);
+		k(result);
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		Context* frame = outward(context, mDepth);
+		auto binding = frame->mBindings.find(mSymbol);
+		if (binding != frame->mBindings.end())
+		{
+			*result = binding->second;
+		}
+		else
+		{
+			// a parameter that was never passed
+			*result = frame->mOuter ? frame->mOuter->Lookup(mSymbol) : Item(Unspecified());
+		}
+		return true;
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpLocal, mDepth, out.constant(Item(mSymbol)));
+		result(out, tail);
+	}
+};
+
+// A variable no known frame binds: the search starts past all of them.
+struct GlobalRef : public Node
+{
+	Symbol		mSymbol;
+	uint32_t	mDepth;
+
+	GlobalRef(Symbol symbol, uint32_t depth)
+		: mSymbol(symbol)
+		, mDepth(depth)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		Item result;
+		value(context, &result, nullptr);
+		k(result);
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		Context* frame = outward(context, mDepth);
+		*result = frame ? frame->Lookup(mSymbol) : Item(Unspecified());
+		return true;
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpGlobal, mDepth, out.constant(Item(mSymbol)));
+		result(out, tail);
+	}
+};
+
+// A variable the form assigns somewhere, so any frame may come to bind it.
+struct DynamicRef : public Node
+{
+	Symbol	mSymbol;
+
+	DynamicRef(Symbol symbol)
+		: mSymbol(symbol)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		k(context->Lookup(mSymbol));
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		*result = context->Lookup(mSymbol);
+		return true;
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpDynamic, out.constant(Item(mSymbol)));
+		result(out, tail);
+	}
+};
+
+// Whether the node only reads, so evaluating it changes nothing and can't fail.
+static bool reads(const NodeRef& node)
+{
+	const Node* read = node.get();
+	return dynamic_cast<const Constant*>(read) || dynamic_cast<const LocalRef*>(read) || dynamic_cast<const GlobalRef*>(read) || dynamic_cast<const DynamicRef*>(read);
+}
+
+struct If : public Waiting
+{
+	NodeRef	mTest;
+	NodeRef	mConsequent;
+	NodeRef	mAlternative;		// may be null
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		Item test;
+		std::string error;
+		if (mTest->value(context, &test, &error))
+		{
+			branch(test, context, k);
+		}
+		else if (!error.empty())
+		{
+			raiseError(error, k);
+		}
+		else
+		{
+			PendingRef pending = take(context, k);
+			mTest->exec(context, wait(pending, this, 0));
+		}
+	}
+
+	void resume(const Pending& pending, const Item& test) const override
+	{
+		branch(test, pending.mContext, pending.k());
+	}
+
+	void branch(const Item& test, Context* context, const Continuation& k) const
+	{
+		if (truthy(test))
+		{
+			mConsequent->exec(context, k);
+		}
+		else if (mAlternative)
+		{
+			mAlternative->exec(context, k);
+		}
+		else
+		{
+			k(Unspecified());
+		}
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		mTest->compile(out, false);
+		size_t otherwise = out.jump(eOpJumpIfFalse);
+		mConsequent->compile(out, tail);
+		size_t end = tail ? 0 : out.jump(eOpJump);
+		out.patch(otherwise);
+		if (mAlternative)
+		{
+			mAlternative->compile(out, tail);
+		}
+		else
+		{
+			out.emit(eOpConst, out.constant(Item(Unspecified())));
+			result(out, tail);
+		}
+		if (!tail)
+		{
+			out.patch(end);
+		}
+	}
+};
+
+// define and set!: both bind in the innermost frame.
+struct Assign : public Waiting
+{
+	Symbol	mSymbol;
+	NodeRef	mValue;
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		Item value;
+		std::string error;
+		if (mValue->value(context, &value, &error))
+		{
+			context->Set(mSymbol, value);
+			k(value);
+		}
+		else if (!error.empty())
+		{
+			raiseError(error, k);
+		}
+		else
+		{
+			PendingRef pending = take(context, k);
+			mValue->exec(context, wait(pending, this, 0));
+		}
+	}
+
+	void resume(const Pending& pending, const Item& value) const override
+	{
+		pending.mContext->Set(mSymbol, value);
+		pending.k()(value);
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		mValue->compile(out, false);
+		out.emit(eOpAssign, out.constant(Item(mSymbol)));
+		result(out, tail);
+	}
+};
+
+// Makes a closure that carries its analyzed body. A lambda form is its own
+// source; (define (f ...) body) needs a (params body) pair made each time, as
+// the evaluator does.
+struct Lambda : public Node
+{
+	CellRef	mSource;		// null for a define
+	Item	mParams;
+	Item	mBody;
+	NodeRef	mCode;
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		Item proc;
+		value(context, &proc, nullptr);
+		k(proc);
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		CellRef source = mSource;
+		if (!source)
+		{
+			gMemory.reserveCells(context, 2);
+			source = gMemory.allocCell(context, mParams, Item(gMemory.allocCell(context, mBody)));
+		}
+		Proc proc(source, context);
+		proc.mCode = mCode;
+		*result = Item(proc);
+		return true;
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		Assembler body(out.globals());
+		mCode->compile(body, true);
+		ChunkLambda lambda = { mSource, mParams, mBody, body.finish(mCode) };
+		out.emit(eOpClosure, out.lambda(lambda));
+		result(out, tail);
+	}
+};
+
+struct Sequence : public Waiting
+{
+	std::vector<NodeRef>	mBody;
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		step(0, context, k);
+	}
+
+	void resume(const Pending& pending, const Item& value) const override
+	{
+		step(pending.mIndex + 1, pending.mContext, pending.k());
+	}
+
+	void step(size_t index, Context* context, const Continuation& k) const
+	{
+		Item value;
+		std::string error;
+		for (; index + 1 < mBody.size(); index++)
+		{
+			if (mBody[index]->value(context, &value, &error))
+			{
+				continue;
+			}
+			if (!error.empty())
+			{
+				raiseError(error, k);
+				return;
+			}
+			PendingRef pending = take(context, k);
+			mBody[index]->exec(context, wait(pending, this, (uint32_t)index));
+			return;
+		}
+		mBody[index]->exec(context, k);
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		for (size_t i = 0; i + 1 < mBody.size(); i++)
+		{
+			mBody[i]->compile(out, false);
+			out.emit(eOpPop);
+		}
+		mBody.back()->compile(out, tail);
+	}
+};
+
+// let evaluates every init in the enclosing frame and binds them in one new
+// frame; let* gives each binding a frame of its own, in which the next init is
+// evaluated. The record's context is where the next init is evaluated.
+struct Let : public Waiting
+{
+	std::vector<Symbol>		mNames;
+	std::vector<NodeRef>	mInits;
+	NodeRef					mBody;
+	bool					mSequential;
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		PendingRef let = take(context, k);
+		if (!mSequential)
+		{
+			let->mFrame = gMemory.allocContext(context, context);
+			if (!let->mFrame)
+			{
+				raiseError("&out-of-memory", k);
+				return;
+			}
+		}
+		step(let, 0);
+	}
+
+	void resume(const Pending& pending, const Item& value) const override
+	{
+		PendingRef let = records().copy(pending);
+		bind(*let, pending.mIndex, value);
+		step(let, pending.mIndex + 1);
+	}
+
+	void step(PendingRef& let, size_t index) const
+	{
+		Pending& state = *let;
+		Item value;
+		std::string error;
+		for (; index < mInits.size(); index++)
+		{
+			if (mSequential)
+			{
+				state.mFrame = gMemory.allocContext(state.mContext, state.mContext);
+				if (!state.mFrame)
+				{
+					raiseError("&out-of-memory", state.k());
+					return;
+				}
+			}
+			if (!mInits[index]->value(state.mContext, &value, &error))
+			{
+				if (!error.empty())
+				{
+					raiseError(error, state.k());
+					return;
+				}
+				Context* context = state.mContext;
+				mInits[index]->exec(context, wait(let, this, (uint32_t)index));
+				return;
+			}
+			bind(state, index, value);
+		}
+		mBody->exec(mSequential ? state.mContext : state.mFrame, state.k());
+	}
+
+	void bind(Pending& state, size_t index, const Item& value) const
+	{
+		state.mFrame->Set(mNames[index], value);
+		if (mSequential)
+		{
+			state.mContext = state.mFrame;
+		}
+	}
+
+	// let pushes every init, then binds them last to first in one frame.
+	void compile(Assembler& out, bool tail) const override
+	{
+		for (size_t i = 0; i < mInits.size(); i++)
+		{
+			mInits[i]->compile(out, false);
+			if (mSequential)
+			{
+				out.emit(eOpEnter);
+				out.emit(eOpBind, out.constant(Item(mNames[i])));
+			}
+		}
+		if (!mSequential)
+		{
+			out.emit(eOpEnter);
+			for (size_t i = mNames.size(); i > 0; i--)
+			{
+				out.emit(eOpBind, out.constant(Item(mNames[i - 1])));
+			}
+		}
+		mBody->compile(out, tail);
+		uint32_t frames = mSequential ? (uint32_t)mNames.size() : 1;
+		if (!tail && frames > 0)
+		{
+			out.emit(eOpLeave, frames);
+		}
+	}
+};
+
+// An application of n arguments. They are evaluated left to right into the
+// record, then the operator, so its value isn't carried through the arguments.
+// A native gets the values rather than the forms, so the forms never drop back
+// to the evaluator. A primitive called on what only reads answers from value,
+// with the arguments in Values, a fixed array for the usual few and a vector
+// beyond that.
+template<typename Values>
+struct Call : public Waiting
+{
+	NodeRef					mOperator;
+	std::vector<NodeRef>	mArgs;
+	bool					mReads;			// the operator and every argument only read
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		PendingRef call = take(context, k);
+		call->mValues.resize(mArgs.size());
+		step(call, 0);
+	}
+
+	bool value(Context* context, Item* result, std::string* error) const override
+	{
+		Item proc;
+		if (!mReads || !mOperator->value(context, &proc, error))
+		{
+			return false;
+		}
+		const Proc* callee = proc.peek<Proc>();
+		if (!callee || !callee->mPrimitive || !callee->mPrimitive->mFn)
+		{
+			return false;
+		}
+		Values values;
+		size(values);
+		for (size_t i = 0; i < mArgs.size(); i++)
+		{
+			mArgs[i]->value(context, &values[i], error);
+		}
+		return callPrimitive(*callee->mPrimitive, values.data(), (uint32_t)values.size(), context, result, error);
+	}
+
+	// the operator is waited on as one past the last argument
+	void resume(const Pending& pending, const Item& value) const override
+	{
+		PendingRef call = records().copy(pending);
+		if (pending.mIndex == mArgs.size())
+		{
+			invoke(value, call);
+			return;
+		}
+		call->mValues[pending.mIndex] = value;
+		step(call, pending.mIndex + 1);
+	}
+
+	void step(PendingRef& call, size_t index) const
+	{
+		Pending& state = *call;
+		std::string error;
+		for (; index < mArgs.size(); index++)
+		{
+			if (mArgs[index]->value(state.mContext, &state.mValues[index], &error))
+			{
+				continue;
+			}
+			if (!error.empty())
+			{
+				raiseError(error, state.k());
+				return;
+			}
+			Context* context = state.mContext;
+			mArgs[index]->exec(context, wait(call, this, (uint32_t)index));
+			return;
+		}
+
+		Item proc;
+		if (mOperator->value(state.mContext, &proc, &error))
+		{
+			invoke(proc, call);
+		}
+		else if (!error.empty())
+		{
+			raiseError(error, state.k());
+		}
+		else
+		{
+			Context* context = state.mContext;
+			mOperator->exec(context, wait(call, this, (uint32_t)mArgs.size()));
+		}
+	}
+
+	void size(std::vector<Item>& values) const { values.resize(mArgs.size()); }
+	template<size_t N>
+	void size(std::array<Item, N>& values) const { assert(mArgs.size() == N); }
+
+	// The machine has the operator below its arguments; order of evaluation
+	// is unspecified either way. A tail call to anything but compiled code
+	// comes back like any other, to the return after it. A primitive the
+	// assembler can inline takes its operator from the instruction instead.
+	void compile(Assembler& out, bool tail) const override
+	{
+		const GlobalRef* global = dynamic_cast<const GlobalRef*>(mOperator.get());
+		Op primitive = global ? out.primitive(global->mSymbol, (uint32_t)mArgs.size()) : cOpCount;
+		if (primitive != cOpCount)
+		{
+			for (auto& arg : mArgs)
+			{
+				arg->compile(out, false);
+			}
+			out.emit(primitive, global->mDepth, out.constant(Item(global->mSymbol)));
+			result(out, tail);
+			return;
+		}
+
+		mOperator->compile(out, false);
+		for (auto& arg : mArgs)
+		{
+			arg->compile(out, false);
+		}
+		if (tail)
+		{
+			out.emit(eOpTailCall, (uint32_t)mArgs.size());
+			out.emit(eOpReturn);
+		}
+		else
+		{
+			out.emit(eOpCall, (uint32_t)mArgs.size());
+		}
+	}
+};
+
+// What analysis leaves to the evaluator: callcc, and natives that take their
+// arguments unevaluated.
+struct Interpret : public Node
+{
+	Item	mForm;
+
+	Interpret(Item form)
+		: mForm(form)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		eval(mForm, context, k);
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpEval, out.constant(mForm));
+		result(out, tail);
+	}
+};
+
+struct Fail : public Node
+{
+	std::string	mError;
+
+	Fail(const std::string& error)
+		: mError(error)
+	{}
+
+	void exec(Context* context, const Continuation& k) const override
+	{
+		raiseError(mError, k);
+	}
+
+	void compile(Assembler& out, bool tail) const override
+	{
+		out.emit(eOpFail, out.error(mError));
+	}
+};
+
+// The names a frame binds, for resolving variables while analyzing.
+struct Scope
+{
+	std::vector<Symbol>	mNames;
+	const Scope*		mOuter;
+
+	Scope(const Scope* outer)
+		: mOuter(outer)
+	{}
+
+	bool binds(Symbol symbol) const
+	{
+		return std::find(mNames.begin(), mNames.end(), symbol) != mNames.end();
+	}
+};
+
+class Analyzer
+{
+public:
+	Analyzer(const Item& form)
+		: mOpaque(false)
+	{
+		scan(form);
+	}
+
+	NodeRef analyze(const Item& form, const Scope* scope);
+
+private:
+	// Variables the form defines or set!s anywhere. Those bindings appear in
+	// whatever frame is innermost when they run, so they are looked up by name;
+	// everything else is found from the frames the analysis can see. A native
+	// taking its arguments unevaluated may bind anything, which makes the whole
+	// form opaque.
+	std::set<Symbol>	mAssigned;
+	bool				mOpaque;
+
+	void	scan(const Item& form);
+	NodeRef	reference(Symbol symbol, const Scope* scope);
+	NodeRef	lambda(CellRef source, const Item& params, const Item& body, const Scope* scope);
+	NodeRef	let(bool sequential, const std::vector<Item>& parts, const Scope* scope);
+	NodeRef	call(const std::vector<Item>& parts, const Scope* scope);
+};
+
+void Analyzer::scan(const Item& form)
+{
+	if (form.type() != eCell || !boost::any_cast<CellRef>(form))
+	{
+		return;
+	}
+
+	CellRef cell = boost::any_cast<CellRef>(form);
+	if (cell->mCar.type() == eSymbol)
+	{
+		Symbol head = boost::any_cast<Symbol>(cell->mCar);
+		if (head == sQuote)
+		{
+			return;
+		}
+		if ((head == sDefine || head == sSet || head == sCallcc) && cell->cdr().type() == eCell && boost::any_cast<CellRef>(cell->cdr()))
+		{
+			Item target = car(cell->cdr());
+			if (target.type() == eCell && boost::any_cast<CellRef>(target))
+			{
+				target = car(target);
+			}
+			if (target.type() == eSymbol)
+			{
+				mAssigned.insert(boost::any_cast<Symbol>(target));
+			}
+		}
+		else if (isSyntax(head))
+		{
+			mOpaque = true;
+		}
+	}
+
+	for (;;)
+	{
+		scan(cell->mCar);
+		Item rest = cell->cdr();
+		if (rest.type() != eCell || !boost::any_cast<CellRef>(rest))
+		{
+			return;
+		}
+		cell = boost::any_cast<CellRef>(rest);
+	}
+}
+
+NodeRef Analyzer::reference(Symbol symbol, const Scope* scope)
+{
+	if (mOpaque || mAssigned.count(symbol))
+	{
+		return std::make_shared<DynamicRef>(symbol);
+	}
+
+	uint32_t depth = 0;
+	for (; scope; scope = scope->mOuter, depth++)
+	{
+		if (scope->binds(symbol))
+		{
+			return std::make_shared<LocalRef>(symbol, depth);
+		}
+	}
+	return std::make_shared<GlobalRef>(symbol, depth);
+}
+
+static void parameterNames(Item params, std::vector<Symbol>* names)
+{
+	while (params.type() == eCell && boost::any_cast<CellRef>(params))
+	{
+		CellRef cell = boost::any_cast<CellRef>(params);
+		if (cell->mCar.type() == eSymbol)
+		{
+			names->push_back(boost::any_cast<Symbol>(cell->mCar));
+		}
+		params = cell->cdr();
+	}
+	if (params.type() == eSymbol)
+	{
+		names->push_back(boost::any_cast<Symbol>(params));
+	}
+}
+
+// Like the evaluator, a closure runs only the first form of its body.
+NodeRef Analyzer::lambda(CellRef source, const Item& params, const Item& body, const Scope* scope)
+{
+	Scope frame(scope);
+	parameterNames(params, &frame.mNames);
+
+	auto node = std::make_shared<Lambda>();
+	node->mSource = source;
+	node->mParams = params;
+	node->mBody = body;
+	node->mCode = analyze(body, &frame);
+	return node;
+}
+
+NodeRef Analyzer::let(bool sequential, const std::vector<Item>& parts, const Scope* scope)
+{
+	std::vector<Item> bindings;
+	if (parts.size() < 3 || (!elements(parts[1], &bindings) && !(parts[1].type() == eCell && !boost::any_cast<CellRef>(parts[1]))))
+	{
+		return std::make_shared<Fail>("&malformed-let");
+	}
+
+	auto node = std::make_shared<Let>();
+	node->mSequential = sequential;
+	// let* frames nest, so each needs its own scope, alive until the body is analyzed
+	std::vector< std::unique_ptr<Scope> > frames;
+	Scope* frame = sequential ? nullptr : new Scope(scope);
+	if (frame)
+	{
+		frames.push_back(std::unique_ptr<Scope>(frame));
+	}
+	const Scope* inner = scope;
+	for (auto& binding : bindings)
+	{
+		std::vector<Item> pair;
+		if (!elements(binding, &pair) || pair.size() < 2 || pair[0].type() != eSymbol)
+		{
+			return std::make_shared<Fail>("&malformed-let-binding");
+		}
+		Symbol name = boost::any_cast<Symbol>(pair[0]);
+		node->mNames.push_back(name);
+		node->mInits.push_back(analyze(pair[1], sequential ? inner : scope));
+		if (sequential)
+		{
+			frames.push_back(std::unique_ptr<Scope>(new Scope(inner)));
+			inner = frames.back().get();
+		}
+		frames.back()->mNames.push_back(name);
+	}
+	node->mBody = analyze(parts[2], sequential ? inner : frame);
+	return node;
+}
+
+template<typename Values>
+static NodeRef makeCall(const NodeRef& op, std::vector<NodeRef>& args)
+{
+	auto call = std::make_shared< Call<Values> >();
+	call->mOperator = op;
+	call->mArgs.swap(args);
+	call->mReads = reads(op) && std::all_of(call->mArgs.begin(), call->mArgs.end(), reads);
+	return call;
+}
+
+NodeRef Analyzer::call(const std::vector<Item>& parts, const Scope* scope)
+{
+	NodeRef op = analyze(parts[0], scope);
+	std::vector<NodeRef> args;
+	for (size_t i = 1; i < parts.size(); i++)
+	{
+		args.push_back(analyze(parts[i], scope));
+	}
+
+	switch (args.size())
+	{
+	case 0:		return makeCall< std::array<Item, 0> >(op, args);
+	case 1:		return makeCall< std::array<Item, 1> >(op, args);
+	case 2:		return makeCall< std::array<Item, 2> >(op, args);
+	case 3:		return makeCall< std::array<Item, 3> >(op, args);
+	default:	return makeCall< std::vector<Item> >(op, args);
+	}
+}
+
+NodeRef Analyzer::analyze(const Item& form, const Scope* scope)
+{
+	if (form.type() == eSymbol)
+	{
+		return reference(boost::any_cast<Symbol>(form), scope);
+	}
+	else if (form.type() != eCell || !boost::any_cast<CellRef>(form))
+	{
+		// numbers, the empty list and every other atom evaluate to themselves
+		return std::make_shared<Constant>(form);
+	}
+
+	std::vector<Item> parts;
+	if (!elements(form, &parts))
+	{
+		return std::make_shared<Fail>("&improper-form");
+	}
+
+	if (parts[0].type() == eSymbol)
+	{
+		Symbol head = boost::any_cast<Symbol>(parts[0]);
+		if (head == sQuote)
+		{
+			return std::make_shared<Constant>(parts.size() > 1 ? parts[1] : Item(Unspecified()));
+		}
+		else if (head == sIf)
+		{
+			if (parts.size() < 3)
+			{
+				return std::make_shared<Fail>("&malformed-if");
+			}
+			auto node = std::make_shared<If>();
+			node->mTest = analyze(parts[1], scope);
+			node->mConsequent = analyze(parts[2], scope);
+			if (parts.size() > 3)
+			{
+				node->mAlternative = analyze(parts[3], scope);
+			}
+			return node;
+		}
+		else if (head == sDefine || head == sSet)
+		{
+			if (parts.size() < 2)
+			{
+				return std::make_shared<Fail>("&invalid-define");
+			}
+			auto node = std::make_shared<Assign>();
+			if (parts[1].type() == eSymbol)
+			{
+				node->mSymbol = boost::any_cast<Symbol>(parts[1]);
+				node->mValue = parts.size() == 3 ? analyze(parts[2], scope) : std::make_shared<Constant>(Item(Unspecified()));
+			}
+			else if (head == sDefine && parts[1].type() == eCell && boost::any_cast<CellRef>(parts[1]) && car(parts[1]).type() == eSymbol && parts.size() > 2)
+			{
+				node->mSymbol = boost::any_cast<Symbol>(car(parts[1]));
+				node->mValue = lambda(nullptr, cdr(parts[1]), parts[2], scope);
+			}
+			else
+			{
+				return std::make_shared<Fail>("&invalid-define");
+			}
+			return node;
+		}
+		else if (head == sLambda)
+		{
+			if (parts.size() < 3)
+			{
+				return std::make_shared<Fail>("&malformed-lambda");
+			}
+			return lambda(boost::any_cast<CellRef>(cdr(form)), parts[1], parts[2], scope);
+		}
+		else if (head == sLet || head == sLetStar)
+		{
+			return let(head == sLetStar, parts, scope);
+		}
+		else if (head == sBegin)
+		{
+			if (parts.size() == 1)
+			{
+				return std::make_shared<Constant>(Item(Unspecified()));
+			}
+			auto node = std::make_shared<Sequence>();
+			for (size_t i = 1; i < parts.size(); i++)
+			{
+				node->mBody.push_back(analyze(parts[i], scope));
+			}
+			return node;
+		}
+		else if (head == sCallcc || isSyntax(head))
+		{
+			return std::make_shared<Interpret>(form);
+		}
+	}
+
+	return call(parts, scope);
+}
+
+NodeRef analyze(Item form)
+{
+	initKeywords();
+	Analyzer analyzer(form);
+	return analyzer.analyze(form, nullptr);
+}
+
+void execute(Item form, Context* context, Continuation k)
+{
+	NodeRef code = analyze(form);
+	// the tree and the form its constants come from live until the form's
+	// value is delivered
+	Held<Item> source(form);
+	code->exec(context, [code, source, k](Item value) {
+		k(value);
+	});
+}
+
+template<typename T>
+static const T* nodeAs(const NodeRef& node)
+{
+	return dynamic_cast<const T*>(node.get());
+}
+
+void test_analyze()
+{
+	char* rest;
+	Context* context = gMemory.getRoot();
+
+	// parameters resolve to their frame, free variables past every known frame
+	NodeRef code = analyze(Parser::parseForm(context, "(lambda (x) (let ((y 1)) (+ x y z)))", &rest).mV);
+	const Lambda* lambda = nodeAs<Lambda>(code);
+	assert(lambda);
+	const Let* let = nodeAs<Let>(lambda->mCode);
+	assert(let && !let->mSequential && let->mNames.size() == 1);
+	auto call = nodeAs< Call< std::array<Item, 3> > >(let->mBody);
+	assert(call);
+	const GlobalRef* plus = nodeAs<GlobalRef>(call->mOperator);
+	assert(plus && plus->mDepth == 2);
+	const LocalRef* x = nodeAs<LocalRef>(call->mArgs[0]);
+	const LocalRef* y = nodeAs<LocalRef>(call->mArgs[1]);
+	assert(x && x->mDepth == 1 && y && y->mDepth == 0);
+	assert(nodeAs<GlobalRef>(call->mArgs[2]));
+
+	// each let* binding is a frame
+	code = analyze(Parser::parseForm(context, "(let* ((a 1) (b a)) (list a b))", &rest).mV);
+	let = nodeAs<Let>(code);
+	assert(let && let->mSequential);
+	const LocalRef* a = nodeAs<LocalRef>(let->mInits[1]);
+	assert(a && a->mDepth == 0);
+	auto list = nodeAs< Call< std::array<Item, 2> > >(let->mBody);
+	assert(list && nodeAs<LocalRef>(list->mArgs[0])->mDepth == 1 && nodeAs<GlobalRef>(list->mOperator)->mDepth == 2);
+
+	// an assigned variable is looked up by name; so is everything near a native
+	// that takes its arguments unevaluated
+	code = analyze(Parser::parseForm(context, "(lambda (n) (begin (set! n 1) n))", &rest).mV);
+	const Sequence* body = nodeAs<Sequence>(nodeAs<Lambda>(code)->mCode);
+	assert(body && nodeAs<Assign>(body->mBody[0]) && nodeAs<DynamicRef>(body->mBody[1]));
+	code = analyze(Parser::parseForm(context, "(lambda (n) (begin (define-record-type p (make-p n) p? (n p-n)) n))", &rest).mV);
+	body = nodeAs<Sequence>(nodeAs<Lambda>(code)->mCode);
+	assert(nodeAs<Interpret>(body->mBody[0]) && nodeAs<DynamicRef>(body->mBody[1]));
+
+	// quoted data isn't code, and a wide call keeps its values in a vector
+	code = analyze(Parser::parseForm(context, "(f '(define g 1) 2 3 4 g)", &rest).mV);
+	auto wide = nodeAs< Call< std::vector<Item> > >(code);
+	assert(wide && wide->mArgs.size() == 5 && nodeAs<Constant>(wide->mArgs[0]) && nodeAs<GlobalRef>(wide->mArgs[4]));
+	assert(nodeAs<Fail>(analyze(Parser::parseForm(context, "(if)", &rest).mV)));
+
+	// a primitive called on what only reads answers without a continuation,
+	// or says why it failed; a call that may wait is left to exec
+	Item result;
+	std::string error;
+	code = analyze(Parser::parseForm(context, "(+ 1 2)", &rest).mV);
+	assert(code->value(context, &result, &error) && result.get<Number>() == 3);
+	code = analyze(Parser::parseForm(context, "(car 1)", &rest).mV);
+	assert(!code->value(context, &result, &error) && !error.empty());
+	error.clear();
+	code = analyze(Parser::parseForm(context, "(+ 1 (car '(2)))", &rest).mV);
+	assert(!code->value(context, &result, &error) && error.empty());
+}
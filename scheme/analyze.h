@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "schemetypes.h"
+
+// A form analyzed once into a tree of nodes, each specialised to what its part
+// of the form does, so running it again decides nothing that could have been
+// decided the first time. Nodes keep the evaluator's contract: a value goes to
+// the continuation, and calls and returns go round the trampoline often enough
+// that they never nest deeply on the C++ stack.
+class Assembler;
+
+struct Node
+{
+	virtual ~Node() {}
+	virtual void exec(Context* context, const Continuation& k) const = 0;
+	// A node that answers without waiting on anything, a constant, a variable,
+	// a lambda or a primitive called on those, gives its value here without a
+	// continuation; the rest answer false. So does a primitive that fails,
+	// with the error set.
+	virtual bool value(Context* context, Item* result, std::string* error) const { return false; }
+	// Emits bytecode leaving the node's value on the stack, or returning it
+	// from a tail position.
+	virtual void compile(Assembler& out, bool tail) const = 0;
+};
+
+typedef std::shared_ptr<const Node>	NodeRef;
+
+NodeRef	analyze(Item form);
+// analyzes the form and runs it
+void	execute(Item form, Context* context, Continuation k);
+void	test_analyze();
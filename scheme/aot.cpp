@@ -0,0 +1,781 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <ctype.h>
+#include <algorithm>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include "aot.h"
+#include "context.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "parser.h"
+#include "list.h"
+#include "vector.h"
+#include "schemestring.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+Program::Program(Context* context)
+	: mContext(context)
+	, mStale(false)
+{
+	gMemory.addRootSet(this);
+}
+
+Program::~Program()
+{
+	gMemory.removeRootSet(this);
+}
+
+void Program::markRoots()
+{
+	for (auto& chunk : mChunks)
+	{
+		for (auto& constant : chunk->mConstants)
+		{
+			markItem(constant);
+		}
+		for (auto& lambda : chunk->mLambdas)
+		{
+			markItem(Item(lambda.mSource));
+			markItem(lambda.mParams);
+			markItem(lambda.mBody);
+		}
+	}
+	for (auto& item : mBuilding)
+	{
+		markItem(item);
+	}
+}
+
+Chunk* Program::chunk(CompiledChunk compiled)
+{
+	auto chunk = std::make_shared<Chunk>();
+	chunk->mCompiled = compiled;
+	mChunks.push_back(chunk);
+	return chunk.get();
+}
+
+void Program::number(Number value)
+{
+	mBuilding.push_back(Item(value));
+}
+
+void Program::flonum(Flonum value)
+{
+	mBuilding.push_back(Item(value));
+}
+
+void Program::symbol(const char* name)
+{
+	mBuilding.push_back(Item(gSymbolTable.GetSymbol(name)));
+}
+
+void Program::string(const char* text)
+{
+	mBuilding.push_back(Item(gMemory.allocString(mContext, text)));
+}
+
+void Program::null()
+{
+	mBuilding.push_back(Item((CellRef)nullptr));
+}
+
+void Program::unspecified()
+{
+	mBuilding.push_back(Item(Unspecified()));
+}
+
+// The list is built from its end in a slot of its own, so every part of it is
+// rooted while the next cell is allocated.
+void Program::list(uint32_t count, bool dotted)
+{
+	size_t first = mBuilding.size() - count;
+	mBuilding.push_back(dotted ? mBuilding[first - 1] : Item((CellRef)nullptr));
+	for (size_t i = first + count; i-- > first;)
+	{
+		Item cell = Item(gMemory.allocCell(mContext, mBuilding[i], mBuilding.back()));
+		mBuilding.back() = cell;
+	}
+	Item list = mBuilding.back();
+	mBuilding.resize(first - (dotted ? 1 : 0));
+	mBuilding.push_back(list);
+}
+
+void Program::vector(uint32_t count)
+{
+	std::vector<Item> elements(mBuilding.end() - count, mBuilding.end());
+	Item vector = Item(makeVector(mContext, elements));
+	mBuilding.resize(mBuilding.size() - count);
+	mBuilding.push_back(vector);
+}
+
+Item Program::take()
+{
+	Item item = mBuilding.back();
+	mBuilding.pop_back();
+	return item;
+}
+
+void Program::constant(Chunk* chunk)
+{
+	chunk->mConstants.push_back(take());
+}
+
+// A closure's source is (params body), as the evaluator makes for a define.
+void Program::lambda(Chunk* chunk, Chunk* body)
+{
+	mBuilding.push_back(Item(gMemory.allocCell(mContext, mBuilding.back())));
+	CellRef source = gMemory.allocCell(mContext, mBuilding[mBuilding.size() - 3], mBuilding.back());
+	mBuilding.pop_back();
+	Item form = take();
+	Item params = take();
+
+	for (auto& owned : mChunks)
+	{
+		if (owned.get() == body)
+		{
+			ChunkLambda lambda = { source, params, form, owned };
+			chunk->mLambdas.push_back(lambda);
+			return;
+		}
+	}
+	assert(!"the body is a chunk of this program");
+}
+
+void Program::error(Chunk* chunk, const char* error)
+{
+	chunk->mErrors.push_back(error);
+}
+
+void Program::inlined(const char* name, Op op)
+{
+	Assembler out(mContext);
+	if (out.primitive(gSymbolTable.GetSymbol(name), op == eOpNullP ? 1 : 2) != op)
+	{
+		mStale = true;
+	}
+}
+
+void Program::form(Chunk* chunk)
+{
+	for (auto& owned : mChunks)
+	{
+		if (owned.get() == chunk)
+		{
+			mForms.push_back(owned);
+			return;
+		}
+	}
+	assert(!"the form is a chunk of this program");
+}
+
+// Inlined primitives hold from here on; if one of them was already bound to
+// something else, moving the epoch past the chunks leaves them calling it.
+void Program::finish()
+{
+	for (auto& chunk : mChunks)
+	{
+		chunk->mEpoch = gBindingEpoch;
+	}
+	if (mStale)
+	{
+		gBindingEpoch++;
+	}
+}
+
+void Program::run(Context* context, const Continuation& k)
+{
+	if (mForms.empty())
+	{
+		k(Item(Unspecified()));
+		return;
+	}
+	run(0, context, k);
+}
+
+void Program::run(size_t form, Context* context, const Continuation& k)
+{
+	auto machine = std::make_shared<Machine>(mForms[form], context, [this, form, context, k](Item result) {
+		if (form + 1 == mForms.size())
+		{
+			k(result);
+		}
+		else
+		{
+			run(form + 1, context, k);
+		}
+	});
+	machine->run();
+}
+
+struct Script
+{
+	const char*					mName;
+	ProgramLoader				mLoad;
+	Program*					mProgram;		// loaded on first run, and kept for the closures it made
+};
+
+static std::vector<Script>& scripts()
+{
+	static std::vector<Script> sScripts;
+	return sScripts;
+}
+
+CompiledScript::CompiledScript(const char* name, ProgramLoader load)
+{
+	Script script = { name, load, nullptr };
+	scripts().push_back(script);
+}
+
+bool runScript(const std::string& name, Context* context, const Continuation& k)
+{
+	for (auto& script : scripts())
+	{
+		if (name != script.mName)
+		{
+			continue;
+		}
+		// never freed: the collector may outlive any static that could own it
+		if (!script.mProgram)
+		{
+			script.mProgram = new Program(context);
+			script.mLoad(*script.mProgram);
+			script.mProgram->finish();
+		}
+		Program* program = script.mProgram;
+		yield([program, context, k]() { program->run(context, k); });
+		trampoline();
+		return true;
+	}
+	return false;
+}
+
+// A C++ string literal. Octal escapes are always three digits, so a digit
+// after one can't be read as part of it.
+static std::string literal(const std::string& text)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		unsigned char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			out.push_back('\\');
+			out.push_back(c);
+		}
+		else if (c == '\n')
+		{
+			out += "\\n";
+		}
+		else if (c == '\t')
+		{
+			out += "\\t";
+		}
+		else if (c < 0x20 || c >= 0x7f || c == '?')
+		{
+			std::stringstream escape;
+			escape << '\\' << std::oct << std::setw(3) << std::setfill('0') << (int)c;
+			out += escape.str();
+		}
+		else
+		{
+			out.push_back(c);
+		}
+	}
+	return out + "\"";
+}
+
+// A form as it would be written, for the comment over its loader code.
+static std::string source(const Item& item)
+{
+	if (item.type() == eSymbol)
+	{
+		return gSymbolTable.GetString(item.get<Symbol>());
+	}
+	if (item.type() == eString)
+	{
+		return literal(item.get<StringRef>()->str());
+	}
+	if (isNumber(item))
+	{
+		return numToString(item);
+	}
+	if (item.type() != eCell)
+	{
+		return print(item);
+	}
+
+	std::string out = "(";
+	Item rest = item;
+	for (; rest.type() == eCell && rest.get<CellRef>(); rest = rest.get<CellRef>()->cdr())
+	{
+		out += (out.size() > 1 ? " " : "") + source(rest.get<CellRef>()->mCar);
+	}
+	if (rest.type() != eCell)
+	{
+		out += " . " + source(rest);
+	}
+	return out + ")";
+}
+
+class Translator
+{
+public:
+	Translator(const std::string& name)
+		: mName(name)
+		, mCount(0)
+	{}
+
+	bool		chunk(const Chunk& chunk, uint32_t* index);
+	bool		form(const Item& form, const Chunk& chunk);
+	std::string	finish();
+
+	std::string	mError;
+
+private:
+	std::string						mName;
+	uint32_t						mCount;
+	std::stringstream				mFunctions;
+	std::stringstream				mLoader;
+	std::set<std::pair<Symbol, Op>>	mInlined;
+
+	bool		item(const Item& item);
+	void		function(const Chunk& chunk, uint32_t index);
+};
+
+static uint32_t operand(const std::vector<uint8_t>& code, size_t at)
+{
+	return code[at] | (code[at + 1] << 8);
+}
+
+static uint32_t operandCount(uint8_t op)
+{
+	switch (op)
+	{
+	case eOpPop:
+	case eOpReturn:
+	case eOpEnter:
+		return 0;
+	case eOpLocal:
+	case eOpGlobal:
+	case eOpAdd:
+	case eOpSub:
+	case eOpMul:
+	case eOpNumEqual:
+	case eOpNullP:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static bool resumes(uint8_t op)
+{
+	return op == eOpCall || op == eOpTailCall || op == eOpEval || op >= eOpAdd;
+}
+
+static const char* sPrimitiveOps[] = { "eOpAdd", "eOpSub", "eOpMul", "eOpNumEqual", "eOpNullP" };
+
+// Each instruction becomes the machine member the bytecode loop would call.
+// The frame's pc is only kept up to date where the machine may leave the
+// function, and a label stands wherever it may come back in.
+void Translator::function(const Chunk& chunk, uint32_t index)
+{
+	const std::vector<uint8_t>& code = chunk.mCode;
+	std::set<uint32_t> entries;
+	std::set<uint32_t> labels;
+	entries.insert(0);
+	bool calls = false;
+	bool scoped = false;
+	for (size_t pc = 0; pc < code.size();)
+	{
+		uint8_t op = code[pc];
+		scoped = scoped || (op != eOpConst && op != eOpPop && op != eOpJump && op != eOpJumpIfFalse &&
+			op != eOpCall && op != eOpTailCall && op != eOpReturn && op != eOpEval && op != eOpFail);
+		size_t next = pc + 1 + 2 * operandCount(op);
+		if (op == eOpJump || op == eOpJumpIfFalse)
+		{
+			labels.insert(operand(code, pc + 1));
+		}
+		if (resumes(op))
+		{
+			entries.insert((uint32_t)next);
+		}
+		calls = calls || op == eOpCall || op >= eOpAdd;
+		pc = next;
+	}
+	labels.insert(entries.begin(), entries.end());
+
+	std::stringstream& out = mFunctions;
+	out << "static bool chunk" << index << "(Machine& m)\n{\n";
+	out << "\tMachine::Frame& frame = m.frame();\n";
+	if (!chunk.mLambdas.empty() || !chunk.mErrors.empty())
+	{
+		out << "\tconst Chunk& chunk = *frame.mChunk;\n";
+	}
+	if (!chunk.mConstants.empty())
+	{
+		out << "\tconst Item* k = frame.mChunk->mConstants.data();\n";
+	}
+	if (scoped)
+	{
+		out << "\tContext* context = frame.mContext;\n";
+	}
+	if (calls)
+	{
+		out << "\tsize_t depth = m.depth();\n";
+	}
+	out << "\tswitch (frame.mPc)\n\t{\n";
+	for (auto entry : entries)
+	{
+		out << "\tcase " << entry << ": goto L" << entry << ";\n";
+	}
+	out << "\t}\n";
+
+	for (size_t pc = 0; pc < code.size();)
+	{
+		uint8_t op = code[pc];
+		uint32_t first = operandCount(op) > 0 ? operand(code, pc + 1) : 0;
+		uint32_t second = operandCount(op) > 1 ? operand(code, pc + 3) : 0;
+		uint32_t next = (uint32_t)(pc + 1 + 2 * operandCount(op));
+		if (labels.count((uint32_t)pc))
+		{
+			out << "L" << pc << ":\n";
+		}
+
+		switch (op)
+		{
+		case eOpConst:
+			out << "\tm.push(k[" << first << "]);\n";
+			break;
+		case eOpLocal:
+			out << "\tm.local(context, " << first << ", k[" << second << "].get<Symbol>());\n";
+			break;
+		case eOpGlobal:
+			out << "\tm.global(context, " << first << ", k[" << second << "].get<Symbol>());\n";
+			break;
+		case eOpDynamic:
+			out << "\tm.dynamic(context, k[" << first << "].get<Symbol>());\n";
+			break;
+		case eOpAssign:
+			out << "\tm.assign(context, k[" << first << "].get<Symbol>());\n";
+			break;
+		case eOpPop:
+			out << "\tm.pop();\n";
+			break;
+		case eOpJump:
+			out << "\tgoto L" << first << ";\n";
+			break;
+		case eOpJumpIfFalse:
+			out << "\tif (!m.test()) goto L" << first << ";\n";
+			break;
+		case eOpClosure:
+			out << "\tm.closure(context, chunk.mLambdas[" << first << "]);\n";
+			break;
+		case eOpCall:
+			out << "\tframe.mPc = " << next << ";\n";
+			out << "\tif (!m.call(" << first << ", false)) return false;\n";
+			out << "\tif (m.depth() != depth) return true;\n";
+			break;
+		case eOpTailCall:
+			out << "\tframe.mPc = " << next << ";\n";
+			out << "\treturn m.call(" << first << ", true);\n";
+			break;
+		case eOpReturn:
+			out << "\treturn m.ret();\n";
+			break;
+		case eOpEnter:
+			out << "\tcontext = m.enter();\n";
+			out << "\tif (!context) return false;\n";
+			break;
+		case eOpBind:
+			out << "\tm.bind(context, k[" << first << "].get<Symbol>());\n";
+			break;
+		case eOpLeave:
+			out << "\tcontext = m.leave(" << first << ");\n";
+			break;
+		case eOpEval:
+			out << "\tframe.mPc = " << next << ";\n";
+			out << "\tif (!m.eval(k[" << first << "]" << (next < code.size() && code[next] == eOpReturn ? ", true" : "") << ")) return false;\n";
+			break;
+		case eOpFail:
+			out << "\tm.fail(chunk.mErrors[" << first << "]);\n";
+			out << "\treturn false;\n";
+			break;
+		default:
+		{
+			const char* name = sPrimitiveOps[op - eOpAdd];
+			mInlined.insert(std::make_pair(chunk.mConstants[second].get<Symbol>(), (Op)op));
+			out << "\tif (!m.primitive(" << name << "))\n\t{\n";
+			out << "\t\tframe.mPc = " << next << ";\n";
+			out << "\t\tif (!m.callGlobal(context, " << first << ", k[" << second << "].get<Symbol>(), " << (op == eOpNullP ? 1 : 2) << ")) return false;\n";
+			out << "\t\tif (m.depth() != depth) return true;\n";
+			out << "\t}\n";
+			break;
+		}
+		}
+		pc = next;
+	}
+	out << "}\n\n";
+}
+
+bool Translator::item(const Item& item)
+{
+	std::stringstream& out = mLoader;
+	if (item.type() == eNumber)
+	{
+		Number number = item.get<Number>();
+		if (number == INT32_MIN)
+		{
+			out << "\tp.number(-2147483647 - 1);\n";
+		}
+		else
+		{
+			out << "\tp.number(" << number << ");\n";
+		}
+	}
+	else if (item.type() == eFlonum)
+	{
+		Flonum flonum = item.get<Flonum>();
+		if (flonum != flonum || flonum - flonum != 0)
+		{
+			mError = "can't translate " + print(item);
+			return false;
+		}
+		std::stringstream text;
+		text << std::setprecision(17) << flonum;
+		out << "\tp.flonum(" << text.str() << ");\n";
+	}
+	else if (item.type() == eSymbol)
+	{
+		out << "\tp.symbol(" << literal(gSymbolTable.GetString(item.get<Symbol>())) << ");\n";
+	}
+	else if (item.type() == eString)
+	{
+		out << "\tp.string(" << literal(item.get<StringRef>()->str()) << ");\n";
+	}
+	else if (item.type() == eVector)
+	{
+		auto& elements = item.get<VectorRef>()->mElements;
+		for (auto& element : elements)
+		{
+			if (!this->item(element))
+			{
+				return false;
+			}
+		}
+		out << "\tp.vector(" << elements.size() << ");\n";
+	}
+	else if (item.type() == eCell)
+	{
+		uint32_t count = 0;
+		Item rest = item;
+		while (rest.type() == eCell && rest.get<CellRef>())
+		{
+			count++;
+			rest = rest.get<CellRef>()->cdr();
+		}
+		bool dotted = !(rest.type() == eCell);
+		if (dotted && !this->item(rest))
+		{
+			return false;
+		}
+		if (count == 0)
+		{
+			out << "\tp.null();\n";
+			return true;
+		}
+		for (Item cell = item; cell.type() == eCell && cell.get<CellRef>(); cell = cell.get<CellRef>()->cdr())
+		{
+			if (!this->item(cell.get<CellRef>()->mCar))
+			{
+				return false;
+			}
+		}
+		out << "\tp.list(" << count << (dotted ? ", true" : "") << ");\n";
+	}
+	else if (item.type() == eUnspecified)
+	{
+		out << "\tp.unspecified();\n";
+	}
+	else
+	{
+		mError = "can't translate " + print(item);
+		return false;
+	}
+	return true;
+}
+
+// Lambda bodies come first, so the loader has made their chunks by the time it
+// makes the closures over them.
+bool Translator::chunk(const Chunk& chunk, uint32_t* index)
+{
+	std::vector<uint32_t> bodies;
+	for (auto& lambda : chunk.mLambdas)
+	{
+		uint32_t body;
+		if (!this->chunk(*lambda.mChunk, &body))
+		{
+			return false;
+		}
+		bodies.push_back(body);
+	}
+
+	*index = mCount++;
+	function(chunk, *index);
+
+	std::stringstream& out = mLoader;
+	out << "\tChunk* c" << *index << " = p.chunk(chunk" << *index << ");\n";
+	for (auto& constant : chunk.mConstants)
+	{
+		if (!item(constant))
+		{
+			return false;
+		}
+		out << "\tp.constant(c" << *index << ");\n";
+	}
+	for (size_t i = 0; i < chunk.mLambdas.size(); i++)
+	{
+		if (!item(chunk.mLambdas[i].mParams) || !item(chunk.mLambdas[i].mBody))
+		{
+			return false;
+		}
+		out << "\tp.lambda(c" << *index << ", c" << bodies[i] << ");\n";
+	}
+	for (auto& error : chunk.mErrors)
+	{
+		out << "\tp.error(c" << *index << ", " << literal(error) << ");\n";
+	}
+	return true;
+}
+
+bool Translator::form(const Item& form, const Chunk& chunk)
+{
+	std::string text = source(form);
+	for (auto& c : text)
+	{
+		if (c == '\n' || c == '\r')
+		{
+			c = ' ';
+		}
+	}
+	mLoader << "\n\t// " << text << (text.back() != '\\' ? "" : " ") << "\n";
+
+	uint32_t index;
+	if (!this->chunk(chunk, &index))
+	{
+		return false;
+	}
+	mLoader << "\tp.form(c" << index << ");\n";
+	return true;
+}
+
+std::string Translator::finish()
+{
+	std::stringstream out;
+	out << "// Generated by scheme -aot from " << mName << ". Run it with scheme -run " << mName << ".\n";
+	out << "#include \"stdafx.h\"\n";
+	out << "#include \"aot.h\"\n\n";
+	out << mFunctions.str();
+	out << "static void load(Program& p)\n{\n";
+	for (auto& inlined : mInlined)
+	{
+		out << "\tp.inlined(" << literal(gSymbolTable.GetString(inlined.first)) << ", " << sPrimitiveOps[inlined.second - eOpAdd] << ");\n";
+	}
+	out << mLoader.str();
+	out << "}\n\n";
+	out << "static CompiledScript sScript(" << literal(mName) << ", load);\n";
+	return out.str();
+}
+
+// Each form is compiled against the root frame, as it will run, so the
+// primitives its globals are bound to now are inlined.
+bool translate(const std::string& source, const std::string& name, std::string* out, std::string* error)
+{
+	Context* context = gMemory.getRoot();
+	Translator translator(name);
+	std::vector<char> text(source.begin(), source.end());
+	text.push_back('\0');
+
+	char* cs = text.data();
+	for (;;)
+	{
+		while (isspace((unsigned char)*cs))
+		{
+			cs++;
+		}
+		if (*cs == '\0')
+		{
+			break;
+		}
+
+		char* rest;
+		Maybe<Item> form = Parser::parseForm(context, cs, &rest);
+		if (!form.mValid)
+		{
+			*error = "parse error at " + std::string(cs, std::min<size_t>(strlen(cs), 20));
+			return false;
+		}
+		cs = rest;
+
+		gMemory.pushRoot(form.mV);
+		Assembler assembler(context);
+		analyze(form.mV)->compile(assembler, true);
+		bool translated = translator.form(form.mV, *assembler.finish());
+		gMemory.popRoots(1);
+		if (!translated)
+		{
+			*error = translator.mError;
+			return false;
+		}
+	}
+
+	*out = translator.finish();
+	return true;
+}
+
+void test_aot()
+{
+	// a closure's chunk becomes a function, with a label where calls come back
+	// to and where its jumps go
+	std::string out;
+	std::string error;
+	bool translated = translate("(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))", "fact", &out, &error);
+	assert(translated);
+	assert(out.find(
+		"static bool chunk0(Machine& m)\n"
+		"{\n"
+		"\tMachine::Frame& frame = m.frame();\n"
+		"\tconst Item* k = frame.mChunk->mConstants.data();\n"
+		"\tContext* context = frame.mContext;\n"
+		"\tsize_t depth = m.depth();\n"
+		"\tswitch (frame.mPc)\n"
+		"\t{\n"
+		"\tcase 0: goto L0;\n"
+		"\tcase 13: goto L13;\n") != std::string::npos);
+	assert(out.find(
+		"\tif (!m.test()) goto L20;\n"
+		"\tm.push(k[3]);\n"
+		"\treturn m.ret();\n"
+		"L20:\n"
+		"\tm.local(context, 0, k[0].get<Symbol>());\n") != std::string::npos);
+	assert(out.find("\tp.inlined(\"*\", eOpMul);\n") != std::string::npos);
+	assert(out.find("\tp.lambda(c1, c0);\n\tp.form(c1);\n") != std::string::npos);
+	assert(out.find("static CompiledScript sScript(\"fact\", load);\n") != std::string::npos);
+	assert(literal("a\"b\\c\n\x01" "7?") == "\"a\\\"b\\\\c\\n\\0017\\077\"");
+	translated = translate("(define x", "broken", &out, &error);
+	assert(!translated);
+
+	// aotsample.cpp, translated from aotsample.scm and linked in, runs without
+	// the parser: closures, calls out to natives, an escape through callcc and
+	// a primitive rebound under code that inlined it. Each of six checks adds 1.
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+	Number result = 0;
+	bool ran = runScript("aotsample", context, [&result](Item item) { result = item.get<Number>(); });
+	assert(ran && result == 6);
+	ran = runScript("missing", context, [](Item) {});
+	assert(!ran);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "numeric.h"
+#include "machine.h"
+
+// Ahead of time compilation. translate turns a file of forms into C++: a
+// function for each chunk, doing what its bytecode does with the bytecode
+// loop's own machine members, and a loader that builds the chunks' constants
+// and closures without the parser. Linked into the interpreter, the file
+// registers the program by name and scheme -run <name> runs it.
+
+// What a loader fills in. The program roots every constant it holds, as
+// nothing else does for chunks that were never parsed.
+class Program : public RootSet
+{
+public:
+	Program(Context* context);
+	~Program();
+
+	void	markRoots() override;
+
+	Chunk*	chunk(CompiledChunk compiled);
+	// push a constant being built
+	void	number(Number value);
+	void	flonum(Flonum value);
+	void	symbol(const char* name);
+	void	string(const char* text);
+	void	null();
+	void	unspecified();
+	// pop count items into a list, onto the tail popped before them if dotted
+	void	list(uint32_t count, bool dotted = false);
+	void	vector(uint32_t count);
+	// pop into a chunk's constants
+	void	constant(Chunk* chunk);
+	// pop a lambda's body and its params, which go before it
+	void	lambda(Chunk* chunk, Chunk* body);
+	void	error(Chunk* chunk, const char* error);
+	// a global the translator inlined a primitive for, which must still name it
+	void	inlined(const char* name, Op op);
+	// a top level form, run in order
+	void	form(Chunk* chunk);
+	// after the loader, when what it inlined is checked
+	void	finish();
+
+	// runs the forms one after another, k getting the last value
+	void	run(Context* context, const Continuation& k);
+
+private:
+	Context*							mContext;
+	std::vector<std::shared_ptr<Chunk>>	mChunks;
+	std::vector<ChunkRef>				mForms;
+	std::vector<Item>					mBuilding;
+	bool								mStale;			// an inlined global named something else
+
+	Item	take();
+	void	run(size_t form, Context* context, const Continuation& k);
+};
+
+typedef void (*ProgramLoader)(Program& program);
+
+// A translated file declares one of these at namespace scope.
+struct CompiledScript
+{
+	CompiledScript(const char* name, ProgramLoader load);
+};
+
+// false if no program of that name was linked in
+bool	runScript(const std::string& name, Context* context, const Continuation& k);
+// false, with the reason in error, if the source doesn't parse
+bool	translate(const std::string& source, const std::string& name, std::string* out, std::string* error);
+void	test_aot();
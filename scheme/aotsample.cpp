@@ -0,0 +1,737 @@
+// Generated by scheme -aot from aotsample. Run it with scheme -run aotsample.
+#include "stdafx.h"
+#include "aot.h"
+
+static bool chunk0(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 13: goto L13;
+	case 33: goto L33;
+	case 56: goto L56;
+	case 59: goto L59;
+	case 75: goto L75;
+	case 78: goto L78;
+	case 83: goto L83;
+	}
+L0:
+	m.local(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 13;
+		if (!m.callGlobal(context, 1, k[2].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L13:
+	if (!m.test()) goto L20;
+	m.push(k[1]);
+	return m.ret();
+L20:
+	m.local(context, 0, k[0].get<Symbol>());
+	m.push(k[3]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 33;
+		if (!m.callGlobal(context, 1, k[2].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L33:
+	if (!m.test()) goto L40;
+	m.push(k[3]);
+	return m.ret();
+L40:
+	m.dynamic(context, k[4].get<Symbol>());
+	m.local(context, 0, k[0].get<Symbol>());
+	m.push(k[3]);
+	if (!m.primitive(eOpSub))
+	{
+		frame.mPc = 56;
+		if (!m.callGlobal(context, 1, k[5].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L56:
+	frame.mPc = 59;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L59:
+	m.dynamic(context, k[4].get<Symbol>());
+	m.local(context, 0, k[0].get<Symbol>());
+	m.push(k[6]);
+	if (!m.primitive(eOpSub))
+	{
+		frame.mPc = 75;
+		if (!m.callGlobal(context, 1, k[5].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L75:
+	frame.mPc = 78;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L78:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 83;
+		if (!m.callGlobal(context, 1, k[7].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L83:
+	return m.ret();
+}
+
+static bool chunk1(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	m.assign(context, k[0].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk2(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 15: goto L15;
+	}
+L0:
+	m.local(context, 0, k[0].get<Symbol>());
+	m.local(context, 1, k[1].get<Symbol>());
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 15;
+		if (!m.callGlobal(context, 2, k[2].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L15:
+	return m.ret();
+}
+
+static bool chunk3(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	return m.ret();
+}
+
+static bool chunk4(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	m.assign(context, k[0].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk5(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 11: goto L11;
+	}
+L0:
+	m.global(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	frame.mPc = 11;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L11:
+	m.assign(context, k[2].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk6(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 3: goto L3;
+	}
+L0:
+	frame.mPc = 3;
+	if (!m.eval(k[0], true)) return false;
+L3:
+	return m.ret();
+}
+
+static bool chunk7(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	m.assign(context, k[0].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk8(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 13: goto L13;
+	}
+L0:
+	m.local(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	if (!m.primitive(eOpMul))
+	{
+		frame.mPc = 13;
+		if (!m.callGlobal(context, 1, k[2].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L13:
+	return m.ret();
+}
+
+static bool chunk9(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	m.assign(context, k[0].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk10(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 11: goto L11;
+	}
+L0:
+	m.global(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	frame.mPc = 11;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L11:
+	m.assign(context, k[2].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk11(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 15: goto L15;
+	}
+L0:
+	m.local(context, 0, k[0].get<Symbol>());
+	m.local(context, 0, k[1].get<Symbol>());
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 15;
+		if (!m.callGlobal(context, 1, k[2].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L15:
+	return m.ret();
+}
+
+static bool chunk12(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Chunk& chunk = *frame.mChunk;
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.closure(context, chunk.mLambdas[0]);
+	m.assign(context, k[0].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk13(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 11: goto L11;
+	}
+L0:
+	m.global(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	frame.mPc = 11;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L11:
+	m.assign(context, k[2].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk14(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	}
+L0:
+	m.push(k[0]);
+	m.assign(context, k[1].get<Symbol>());
+	return m.ret();
+}
+
+static bool chunk15(Machine& m)
+{
+	Machine::Frame& frame = m.frame();
+	const Item* k = frame.mChunk->mConstants.data();
+	Context* context = frame.mContext;
+	size_t depth = m.depth();
+	switch (frame.mPc)
+	{
+	case 0: goto L0;
+	case 11: goto L11;
+	case 19: goto L19;
+	case 30: goto L30;
+	case 38: goto L38;
+	case 49: goto L49;
+	case 57: goto L57;
+	case 73: goto L73;
+	case 76: goto L76;
+	case 84: goto L84;
+	case 97: goto L97;
+	case 110: goto L110;
+	case 115: goto L115;
+	case 120: goto L120;
+	case 125: goto L125;
+	case 130: goto L130;
+	case 135: goto L135;
+	}
+L0:
+	m.global(context, 0, k[0].get<Symbol>());
+	m.push(k[1]);
+	frame.mPc = 11;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L11:
+	m.push(k[2]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 19;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L19:
+	m.global(context, 0, k[4].get<Symbol>());
+	m.push(k[5]);
+	frame.mPc = 30;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L30:
+	m.push(k[6]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 38;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L38:
+	m.global(context, 0, k[7].get<Symbol>());
+	m.push(k[8]);
+	frame.mPc = 49;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L49:
+	m.push(k[8]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 57;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L57:
+	m.global(context, 0, k[9].get<Symbol>());
+	m.global(context, 0, k[10].get<Symbol>());
+	m.push(k[11]);
+	frame.mPc = 73;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L73:
+	frame.mPc = 76;
+	if (!m.call(1, false)) return false;
+	if (m.depth() != depth) return true;
+L76:
+	m.push(k[12]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 84;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L84:
+	m.global(context, 0, k[13].get<Symbol>());
+	m.push(k[8]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 97;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L97:
+	m.global(context, 0, k[14].get<Symbol>());
+	m.push(k[15]);
+	if (!m.primitive(eOpNumEqual))
+	{
+		frame.mPc = 110;
+		if (!m.callGlobal(context, 0, k[3].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L110:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 115;
+		if (!m.callGlobal(context, 0, k[16].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L115:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 120;
+		if (!m.callGlobal(context, 0, k[16].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L120:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 125;
+		if (!m.callGlobal(context, 0, k[16].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L125:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 130;
+		if (!m.callGlobal(context, 0, k[16].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L130:
+	if (!m.primitive(eOpAdd))
+	{
+		frame.mPc = 135;
+		if (!m.callGlobal(context, 0, k[16].get<Symbol>(), 2)) return false;
+		if (m.depth() != depth) return true;
+	}
+L135:
+	return m.ret();
+}
+
+static void load(Program& p)
+{
+	p.inlined("=", eOpNumEqual);
+	p.inlined("+", eOpAdd);
+	p.inlined("-", eOpSub);
+	p.inlined("*", eOpMul);
+
+	// (define (fib n) (if (= n 0) 0 (if (= n 1) 1 (+ (fib (- n 1)) (fib (- n 2))))))
+	Chunk* c0 = p.chunk(chunk0);
+	p.symbol("n");
+	p.constant(c0);
+	p.number(0);
+	p.constant(c0);
+	p.symbol("=");
+	p.constant(c0);
+	p.number(1);
+	p.constant(c0);
+	p.symbol("fib");
+	p.constant(c0);
+	p.symbol("-");
+	p.constant(c0);
+	p.number(2);
+	p.constant(c0);
+	p.symbol("+");
+	p.constant(c0);
+	Chunk* c1 = p.chunk(chunk1);
+	p.symbol("fib");
+	p.constant(c1);
+	p.symbol("n");
+	p.list(1);
+	p.symbol("if");
+	p.symbol("=");
+	p.symbol("n");
+	p.number(0);
+	p.list(3);
+	p.number(0);
+	p.symbol("if");
+	p.symbol("=");
+	p.symbol("n");
+	p.number(1);
+	p.list(3);
+	p.number(1);
+	p.symbol("+");
+	p.symbol("fib");
+	p.symbol("-");
+	p.symbol("n");
+	p.number(1);
+	p.list(3);
+	p.list(2);
+	p.symbol("fib");
+	p.symbol("-");
+	p.symbol("n");
+	p.number(2);
+	p.list(3);
+	p.list(2);
+	p.list(3);
+	p.list(4);
+	p.list(4);
+	p.lambda(c1, c0);
+	p.form(c1);
+
+	// (define (make-adder n) (lambda (x) (+ x n)))
+	Chunk* c2 = p.chunk(chunk2);
+	p.symbol("x");
+	p.constant(c2);
+	p.symbol("n");
+	p.constant(c2);
+	p.symbol("+");
+	p.constant(c2);
+	Chunk* c3 = p.chunk(chunk3);
+	p.symbol("x");
+	p.list(1);
+	p.symbol("+");
+	p.symbol("x");
+	p.symbol("n");
+	p.list(3);
+	p.lambda(c3, c2);
+	Chunk* c4 = p.chunk(chunk4);
+	p.symbol("make-adder");
+	p.constant(c4);
+	p.symbol("n");
+	p.list(1);
+	p.symbol("lambda");
+	p.symbol("x");
+	p.list(1);
+	p.symbol("+");
+	p.symbol("x");
+	p.symbol("n");
+	p.list(3);
+	p.list(3);
+	p.lambda(c4, c3);
+	p.form(c4);
+
+	// (define add5 (make-adder 5))
+	Chunk* c5 = p.chunk(chunk5);
+	p.symbol("make-adder");
+	p.constant(c5);
+	p.number(5);
+	p.constant(c5);
+	p.symbol("add5");
+	p.constant(c5);
+	p.form(c5);
+
+	// (define (escape x) (callcc ret (+ 1 (ret x))))
+	Chunk* c6 = p.chunk(chunk6);
+	p.symbol("callcc");
+	p.symbol("ret");
+	p.symbol("+");
+	p.number(1);
+	p.symbol("ret");
+	p.symbol("x");
+	p.list(2);
+	p.list(3);
+	p.list(3);
+	p.constant(c6);
+	Chunk* c7 = p.chunk(chunk7);
+	p.symbol("escape");
+	p.constant(c7);
+	p.symbol("x");
+	p.list(1);
+	p.symbol("callcc");
+	p.symbol("ret");
+	p.symbol("+");
+	p.number(1);
+	p.symbol("ret");
+	p.symbol("x");
+	p.list(2);
+	p.list(3);
+	p.list(3);
+	p.lambda(c7, c6);
+	p.form(c7);
+
+	// (define (double n) (* n 2))
+	Chunk* c8 = p.chunk(chunk8);
+	p.symbol("n");
+	p.constant(c8);
+	p.number(2);
+	p.constant(c8);
+	p.symbol("*");
+	p.constant(c8);
+	Chunk* c9 = p.chunk(chunk9);
+	p.symbol("double");
+	p.constant(c9);
+	p.symbol("n");
+	p.list(1);
+	p.symbol("*");
+	p.symbol("n");
+	p.number(2);
+	p.list(3);
+	p.lambda(c9, c8);
+	p.form(c9);
+
+	// (define before (double 5))
+	Chunk* c10 = p.chunk(chunk10);
+	p.symbol("double");
+	p.constant(c10);
+	p.number(5);
+	p.constant(c10);
+	p.symbol("before");
+	p.constant(c10);
+	p.form(c10);
+
+	// (define (* a b) (+ a b))
+	Chunk* c11 = p.chunk(chunk11);
+	p.symbol("a");
+	p.constant(c11);
+	p.symbol("b");
+	p.constant(c11);
+	p.symbol("+");
+	p.constant(c11);
+	Chunk* c12 = p.chunk(chunk12);
+	p.symbol("*");
+	p.constant(c12);
+	p.symbol("a");
+	p.symbol("b");
+	p.list(2);
+	p.symbol("+");
+	p.symbol("a");
+	p.symbol("b");
+	p.list(3);
+	p.lambda(c12, c11);
+	p.form(c12);
+
+	// (define after (double 5))
+	Chunk* c13 = p.chunk(chunk13);
+	p.symbol("double");
+	p.constant(c13);
+	p.number(5);
+	p.constant(c13);
+	p.symbol("after");
+	p.constant(c13);
+	p.form(c13);
+
+	// (define greeting "hi\077")
+	Chunk* c14 = p.chunk(chunk14);
+	p.string("hi\077");
+	p.constant(c14);
+	p.symbol("greeting");
+	p.constant(c14);
+	p.form(c14);
+
+	// (+ (= (fib 15) 610) (+ (= (add5 1) 6) (+ (= (escape 10) 10) (+ (= (car (cdr (quote (7 8 . 9)))) 8) (+ (= before 10) (= after 7))))))
+	Chunk* c15 = p.chunk(chunk15);
+	p.symbol("fib");
+	p.constant(c15);
+	p.number(15);
+	p.constant(c15);
+	p.number(610);
+	p.constant(c15);
+	p.symbol("=");
+	p.constant(c15);
+	p.symbol("add5");
+	p.constant(c15);
+	p.number(1);
+	p.constant(c15);
+	p.number(6);
+	p.constant(c15);
+	p.symbol("escape");
+	p.constant(c15);
+	p.number(10);
+	p.constant(c15);
+	p.symbol("car");
+	p.constant(c15);
+	p.symbol("cdr");
+	p.constant(c15);
+	p.number(9);
+	p.number(7);
+	p.number(8);
+	p.list(2, true);
+	p.constant(c15);
+	p.number(8);
+	p.constant(c15);
+	p.symbol("before");
+	p.constant(c15);
+	p.symbol("after");
+	p.constant(c15);
+	p.number(7);
+	p.constant(c15);
+	p.symbol("+");
+	p.constant(c15);
+	p.form(c15);
+}
+
+static CompiledScript sScript("aotsample", load);
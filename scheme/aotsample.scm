@@ -0,0 +1,10 @@
+(define (fib n) (if (= n 0) 0 (if (= n 1) 1 (+ (fib (- n 1)) (fib (- n 2))))))
+(define (make-adder n) (lambda (x) (+ x n)))
+(define add5 (make-adder 5))
+(define (escape x) (callcc ret (+ 1 (ret x))))
+(define (double n) (* n 2))
+(define before (double 5))
+(define (* a b) (+ a b))
+(define after (double 5))
+(define greeting "hi?")
+(+ (= (fib 15) 610) (+ (= (add5 1) 6) (+ (= (escape 10) 10) (+ (= (car (cdr '(7 8 . 9))) 8) (+ (= before 10) (= after 7))))))
@@ -0,0 +1,534 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <chrono>
+#include "schemetypes.h"
+#include "collectable.h"
+#include "cellheap.h"
+#include "list.h"
+#include "numvector.h"
+#include "rope.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "btree.h"
+#include "pqueue.h"
+#include "context.h"
+#include "memory.h"
+#include "parser.h"
+#include "eval.h"
+#include "vm.h"
+#include "jit.h"
+#include "bench.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+void tcoeval(Item form, Context* context, std::function<void(Item)> k);
+
+static double millisecondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static void report(const char* name, double freelistMs, double soaMs)
+{
+	printf("%-24s Freelist<WideCell> %8.2fms   CellHeap %8.2fms   (%.2fx)\n", name, freelistMs, soaMs, freelistMs / soaMs);
+}
+
+// Half of the cells built each round are garbage, so the sweep has real work.
+static void benchCellHeap()
+{
+	const uint32_t cListLength	= 250000;
+	const uint32_t cRounds		= 10;
+
+	Freelist<WideCell> cells(cListLength * 2, 0, pagePolicyFromEnvironment());
+	CellHeap heap(cListLength * 2);
+
+	double freelistWalk = 0, soaWalk = 0, freelistGC = 0, soaGC = 0;
+	uint32_t checksum = 0;
+	for (uint32_t round = 0; round < cRounds; round++)
+	{
+		CellRef live = nullptr, garbage = nullptr;
+		CellId liveId = CellHeap::cNil, garbageId = CellHeap::cNil;
+		for (uint32_t i = 0; i < cListLength; i++)
+		{
+			live	= cells.alloc(Item(Number(i)), Item(live));
+			garbage = cells.alloc(Item(Number(i)), Item(garbage));
+			liveId		= heap.alloc(Item(Number(i)), liveId);
+			garbageId	= heap.alloc(Item(Number(i)), garbageId);
+		}
+
+		auto start = Clock::now();
+		checksum += length(live);
+		freelistWalk += millisecondsSince(start);
+
+		start = Clock::now();
+		checksum -= heap.length(liveId);
+		soaWalk += millisecondsSince(start);
+
+		start = Clock::now();
+		live->mark();
+		cells.collect();
+		freelistGC += millisecondsSince(start);
+
+		start = Clock::now();
+		heap.mark(liveId);
+		heap.collect();
+		soaGC += millisecondsSince(start);
+
+		// drop the surviving half before the next round
+		cells.collect();
+		heap.collect();
+	}
+
+	printf("cell heap layout, %d rounds of %d live + %d garbage cells, %s pages\n", cRounds, cListLength, cListLength, pagePolicyName(pagePolicyFromEnvironment()));
+	report("list traversal", freelistWalk, soaWalk);
+	report("mark and sweep", freelistGC, soaGC);
+	if (checksum != 0)
+	{
+		puts("cell heap benchmark lengths disagree\n");
+	}
+}
+
+// Lists in the heap's cells against the same list in cells that all hold
+// their cdr, as every cons did before cdr-coding. One is consed tail first, as
+// the parser and the list natives build them, so its cells run back to back;
+// two more are consed in turn, so each cdr is a cell away.
+static double walk(CellRef list, uint32_t rounds, uint32_t* checksum)
+{
+	auto start = Clock::now();
+	for (uint32_t round = 0; round < rounds; round++)
+	{
+		*checksum += list->length();
+	}
+	return millisecondsSince(start);
+}
+
+static void benchCdrCoding()
+{
+	const uint32_t cLength	= 200000;
+	const uint32_t cRounds	= 20;
+
+	Freelist<WideCell> cells(cLength, 0, pagePolicyFromEnvironment());
+	CellRef wide = nullptr;
+	for (uint32_t i = cLength; i > 0; i--)
+	{
+		wide = cells.alloc(Item(Number(i)), Item(wide));
+	}
+
+	Context* context = gMemory.getRoot();
+	gMemory.reserveCells(context, cLength * 3);
+	size_t before = gMemory.cellBytes();
+	CellRef run = nullptr;
+	for (uint32_t i = cLength; i > 0; i--)
+	{
+		run = gMemory.allocCell(context, Item(Number(i)), Item(run));
+	}
+	double runBytes = (double)(gMemory.cellBytes() - before) / cLength;
+
+	before = gMemory.cellBytes();
+	CellRef turn = nullptr, other = nullptr;
+	for (uint32_t i = cLength; i > 0; i--)
+	{
+		turn = gMemory.allocCell(context, Item(Number(i)), Item(turn));
+		other = gMemory.allocCell(context, Item(Number(i)), Item(other));
+	}
+	double turnBytes = (double)(gMemory.cellBytes() - before) / (2 * cLength);
+
+	uint32_t checksum = 0;
+	double wideMs = walk(wide, cRounds, &checksum);
+	double runMs = walk(run, cRounds, &checksum);
+	double turnMs = walk(turn, cRounds, &checksum);
+	double wideBytes = (double)sizeof(WideCell);
+
+	printf("cdr-coding, lists of %d, %d walks each\n", cLength, cRounds);
+	printf("%-24s %6.1f bytes/element %8.2fms\n", "every cdr held", wideBytes, wideMs);
+	printf("%-24s %6.1f bytes/element %8.2fms   (%.2fx the bytes)\n", "consed tail first", runBytes, runMs, runBytes / wideBytes);
+	printf("%-24s %6.1f bytes/element %8.2fms   (%.2fx the bytes)\n", "consed in turn", turnBytes, turnMs, turnBytes / wideBytes);
+	if (checksum != 3 * cRounds * cLength)
+	{
+		puts("cdr-coding benchmark lengths disagree\n");
+	}
+}
+
+// The same dot product over a list of boxed numbers and over f64vectors with
+// each kernel level the CPU has.
+static void benchNumVectors()
+{
+	const uint32_t cLength	= 1000000;
+	const uint32_t cRounds	= 20;
+
+	Freelist<WideCell> cells(cLength * 2, 0, pagePolicyFromEnvironment());
+	F64Vector a(cLength), b(cLength);
+	CellRef listA = nullptr, listB = nullptr;
+	for (uint32_t i = cLength; i > 0; i--)
+	{
+		a.mData[i - 1] = (double)(i % 100);
+		b.mData[i - 1] = (double)(i % 7);
+		listA = cells.alloc(Item(a.mData[i - 1]), Item(listA));
+		listB = cells.alloc(Item(b.mData[i - 1]), Item(listB));
+	}
+
+	double listSum = 0;
+	auto start = Clock::now();
+	for (uint32_t round = 0; round < cRounds; round++)
+	{
+		listSum = 0;
+		for (CellRef x = listA, y = listB; x; x = x->next(), y = y->next())
+		{
+			listSum += boost::any_cast<double>(x->mCar) * boost::any_cast<double>(y->mCar);
+		}
+	}
+	double listMs = millisecondsSince(start);
+
+	printf("dot product of %d flonums, %d rounds\n", cLength, cRounds);
+	printf("%-24s %8.2fms\n", "cons list", listMs);
+
+	bool agree = true;
+	SimdLevel original = simdLevel();
+	for (int level = eSimdScalar; level <= simdSupported(); level++)
+	{
+		setSimdLevel((SimdLevel)level);
+		start = Clock::now();
+		for (uint32_t round = 0; round < cRounds; round++)
+		{
+			agree = agree && f64Dot(a.mData, b.mData, cLength) == listSum;
+		}
+		double vectorMs = millisecondsSince(start);
+		printf("f64vector %-14s %8.2fms   (%.2fx)\n", simdLevelName((SimdLevel)level), vectorMs, listMs / vectorMs);
+	}
+	setSimdLevel(original);
+
+	if (!agree)
+	{
+		puts("numeric vector benchmark sums disagree\n");
+	}
+}
+
+// Appending many short pieces: a fresh flat string per append copies
+// everything so far each time, a rope only touches its right spine.
+static void benchRopes()
+{
+	const uint32_t cPieces = 20000;
+	auto piece = std::make_shared<const std::string>("a line of report output, some 48 bytes long.\n");
+
+	auto start = Clock::now();
+	std::shared_ptr<const std::string> flat = std::make_shared<const std::string>();
+	for (uint32_t i = 0; i < cPieces; i++)
+	{
+		flat = std::make_shared<const std::string>(*flat + *piece);
+	}
+	double flatMs = millisecondsSince(start);
+
+	start = Clock::now();
+	RopeTree rope;
+	for (uint32_t i = 0; i < cPieces; i++)
+	{
+		rope = ropeConcat(rope, ropeLeaf(piece, 0, (uint32_t)piece->size(), (uint32_t)piece->size()));
+	}
+	std::string text;
+	ropeAppendTo(rope, text);
+	double ropeMs = millisecondsSince(start);
+
+	printf("%d appends of %d bytes\n", cPieces, (uint32_t)piece->size());
+	printf("%-24s %8.2fms\n", "flat string copies", flatMs);
+	printf("%-24s %8.2fms   (%.2fx)\n", "rope, then flattened", ropeMs, flatMs / ropeMs);
+	if (text != *flat)
+	{
+		puts("rope benchmark texts disagree\n");
+	}
+}
+
+// Looking up symbol keys in a 100k entry association list, walked as assoc
+// would, and in an eq hash table.
+static void benchHashTables()
+{
+	const uint32_t cEntries	= 100000;
+	const uint32_t cLookups	= 2000;
+
+	Freelist<WideCell> cells(cEntries * 2, 0, pagePolicyFromEnvironment());
+	HashTable table(eHashEq, 0);
+	CellRef alist = nullptr;
+	for (Symbol key = 0; key < cEntries; key++)
+	{
+		CellRef entry = cells.alloc(Item(key), Item(Number(key)));
+		alist = cells.alloc(Item(entry), Item(alist));
+		table.set(Item(key), Item(Number(key)));
+	}
+
+	int64_t alistSum = 0;
+	auto start = Clock::now();
+	for (uint32_t i = 0; i < cLookups; i++)
+	{
+		Item key((Symbol)(i * 7919 % cEntries));
+		for (CellRef x = alist; x; x = x->next())
+		{
+			CellRef entry = boost::any_cast<CellRef>(x->mCar);
+			if (compareShallow(entry->mCar, key))
+			{
+				alistSum += boost::any_cast<Number>(entry->cdr());
+				break;
+			}
+		}
+	}
+	double alistMs = millisecondsSince(start);
+
+	int64_t tableSum = 0;
+	start = Clock::now();
+	for (uint32_t i = 0; i < cLookups; i++)
+	{
+		uint32_t slot = table.find(Item((Symbol)(i * 7919 % cEntries)));
+		tableSum += boost::any_cast<Number>(table.mValues[slot]);
+	}
+	double tableMs = millisecondsSince(start);
+
+	printf("%d lookups among %d symbol keys\n", cLookups, cEntries);
+	printf("%-24s %8.2fms\n", "association list", alistMs);
+	printf("%-24s %8.2fms   (%.2fx)\n", "eq hash table", tableMs, alistMs / tableMs);
+	if (alistSum != tableSum)
+	{
+		puts("hash table benchmark sums disagree\n");
+	}
+}
+
+// Functional updates of a 100k entry map: a copied association list with the
+// one entry replaced, and a HAMT path copy.
+static void benchHamt()
+{
+	const uint32_t cEntries	= 100000;
+	const uint32_t cUpdates	= 20;
+
+	Freelist<WideCell> cells(cEntries * (cUpdates + 2) + cUpdates, 0, pagePolicyFromEnvironment());
+	CellRef alist = nullptr;
+	HamtTree map;
+	for (Symbol key = 0; key < cEntries; key++)
+	{
+		alist = cells.alloc(Item((CellRef)cells.alloc(Item(key), Item(Number(key)))), Item(alist));
+		bool added;
+		map = hamtSet(map, HashTable::hash(eHashEqual, Item(key)), Item(key), Item(Number(key)), 0, &added);
+	}
+
+	auto start = Clock::now();
+	CellRef version = alist;
+	for (uint32_t i = 0; i < cUpdates; i++)
+	{
+		Symbol key = i * 7919 % cEntries;
+		CellRef copy = nullptr;
+		for (CellRef x = version; x; x = x->next())
+		{
+			CellRef entry = boost::any_cast<CellRef>(x->mCar);
+			if (boost::any_cast<Symbol>(entry->mCar) == key)
+			{
+				entry = cells.alloc(Item(key), Item(Number(-1)));
+			}
+			copy = cells.alloc(Item(entry), Item(copy));
+		}
+		version = copy;
+	}
+	double alistMs = millisecondsSince(start);
+
+	start = Clock::now();
+	HamtTree updated = map;
+	for (uint32_t i = 0; i < cUpdates; i++)
+	{
+		Symbol key = i * 7919 % cEntries;
+		bool added;
+		updated = hamtSet(updated, HashTable::hash(eHashEqual, Item(key)), Item(key), Item(Number(-1)), 0, &added);
+	}
+	double hamtMs = millisecondsSince(start);
+
+	printf("%d functional updates of a %d entry map\n", cUpdates, cEntries);
+	printf("%-24s %8.2fms\n", "copied association list", alistMs);
+	printf("%-24s %8.2fms   (%.2fx)\n", "HAMT path copy", hamtMs, alistMs / hamtMs);
+}
+
+// Range queries over a 100k entry map: every entry of a hash table tested
+// against the range, and a B-tree seek followed by a walk along its leaves.
+static void benchBTree()
+{
+	const Number cEntries	= 100000;
+	const Number cQueries	= 200;
+	const Number cWidth		= 500;
+
+	HashTable table(eHashEq, 0);
+	BTree tree;
+	for (Number i = 0; i < cEntries; i++)
+	{
+		Number key = i * 7919 % cEntries;
+		table.set(Item(key), Item(Number(1)));
+		BTreeKey bkey;
+		BTree::keyOf(Item(key), &bkey);
+		tree.set(bkey, Item(Number(1)));
+	}
+
+	int64_t tableSum = 0;
+	auto start = Clock::now();
+	for (Number q = 0; q < cQueries; q++)
+	{
+		Number low = q * 433 % (cEntries - cWidth);
+		for (uint32_t i = 0; i < table.capacity(); i++)
+		{
+			if (table.mHashes[i])
+			{
+				Number key = boost::any_cast<Number>(table.mKeys[i]);
+				tableSum += key >= low && key < low + cWidth ? boost::any_cast<Number>(table.mValues[i]) : 0;
+			}
+		}
+	}
+	double tableMs = millisecondsSince(start);
+
+	int64_t treeSum = 0;
+	start = Clock::now();
+	for (Number q = 0; q < cQueries; q++)
+	{
+		Number low = q * 433 % (cEntries - cWidth);
+		BTreeKey from, to;
+		BTree::keyOf(Item(low), &from);
+		BTree::keyOf(Item(Number(low + cWidth)), &to);
+		uint32_t index;
+		for (BTreeNode* leaf = tree.lowerBound(from, &index); leaf; leaf = leaf->mNext, index = 0)
+		{
+			for (; index < leaf->mCount && leaf->mPrefixes[index] < to.mPrefix; index++)
+			{
+				treeSum += boost::any_cast<Number>(leaf->mValues[index]);
+			}
+			if (index < leaf->mCount)
+			{
+				break;
+			}
+		}
+	}
+	double treeMs = millisecondsSince(start);
+	assert(tableSum == treeSum && treeSum == cQueries * cWidth);
+
+	printf("%d range queries of %d keys in a %d entry map\n", cQueries, cWidth, cEntries);
+	printf("%-24s %8.2fms\n", "hash table scan", tableMs);
+	printf("%-24s %8.2fms   (%.2fx)\n", "B-tree seek and walk", treeMs, tableMs / treeMs);
+}
+
+// A scheduling loop: pop the earliest event, push one later in its place.
+// The queue is a sorted list with a linear insert, then a 4-ary heap.
+static void benchPriorityQueue()
+{
+	const Number cEvents	= 5000;
+	const Number cSteps		= 20000;
+
+	Freelist<WideCell> cells(cEvents + cSteps, 0, pagePolicyFromEnvironment());
+	CellRef list = nullptr;
+	PriorityQueue queue;
+	for (Number i = cEvents; i > 0; i--)
+	{
+		list = cells.alloc(Item(i * 2), Item(list));
+		queue.append(Item(i * 2), Item(i));
+	}
+	queue.heapify();
+
+	int64_t listSum = 0;
+	auto start = Clock::now();
+	for (Number i = 0; i < cSteps; i++)
+	{
+		Number time = boost::any_cast<Number>(list->mCar);
+		listSum += time;
+		list = list->next();
+		Number later = time + i * 7919 % 3000 + 1;
+		CellRef previous = nullptr;
+		CellRef x = list;
+		while (x && boost::any_cast<Number>(x->mCar) <= later)
+		{
+			previous = x;
+			x = x->next();
+		}
+		CellRef event = cells.alloc(Item(later), Item(x));
+		if (previous)
+		{
+			previous->setCdr(Item(event));
+		}
+		else
+		{
+			list = event;
+		}
+	}
+	double listMs = millisecondsSince(start);
+
+	int64_t heapSum = 0;
+	start = Clock::now();
+	for (Number i = 0; i < cSteps; i++)
+	{
+		Number time = queue.mRanks[0];
+		heapSum += time;
+		queue.setPriority(0, Item(Number(time + i * 7919 % 3000 + 1)));
+		queue.siftDown(0);
+	}
+	double heapMs = millisecondsSince(start);
+	assert(listSum == heapSum);
+
+	printf("%d steps of a %d event schedule\n", cSteps, cEvents);
+	printf("%-24s %8.2fms\n", "sorted list", listMs);
+	printf("%-24s %8.2fms   (%.2fx)\n", "4-ary heap", heapMs, listMs / heapMs);
+}
+
+// Doubly recursive fib in each mode, with fib defined in that mode, so its
+// body is walked, analyzed or compiled. Each run is deep and long enough to
+// collect along the way.
+static void benchEvalModes()
+{
+	const uint32_t cRounds = 5;
+	const char* cModes[] = { "walking the forms", "analyzed nodes", "bytecode", "bytecode, hot tier", "machine code, hot tier" };
+
+	char* rest;
+	Context* context = gMemory.getRoot();
+	Item define = Parser::parseForm(context, "(define (fib n) (if (= n 0) 0 (if (= n 1) 1 (+ (fib (- n 1)) (fib (- n 2))))))", &rest).mV;
+	gMemory.pushRoot(define);
+	Item call = Parser::parseForm(context, "(fib 20)", &rest).mV;
+	gMemory.pushRoot(call);
+
+	printf("%d rounds of (fib 20)\n", cRounds);
+	EvalMode evalMode = gEvalMode;
+	bool tierUp = gTierUp;
+	bool native = gJit;
+	double walkMs = 0;
+	for (int mode = eWalk; mode <= eBytecode + 2; mode++)
+	{
+		// the last runs are bytecode again, with hot closures recompiled, and
+		// then made machine code
+		gEvalMode = mode > eBytecode ? eBytecode : (EvalMode)mode;
+		gTierUp = mode > eBytecode;
+		gJit = mode > eBytecode + 1;
+		tcoeval(define, context, [](Item){});
+		Number result = 0;
+		double ms = 0;
+		for (uint32_t round = 0; round < cRounds; round++)
+		{
+			gMemory.gc(context);
+			auto start = Clock::now();
+			tcoeval(call, context, [&result](Item item){ result = boost::any_cast<Number>(item); });
+			ms += millisecondsSince(start);
+		}
+		assert(result == 6765);
+
+		if (mode == eWalk)
+		{
+			walkMs = ms;
+			printf("%-24s %8.2fms\n", cModes[mode], ms);
+		}
+		else
+		{
+			printf("%-24s %8.2fms   (%.2fx)\n", cModes[mode], ms, walkMs / ms);
+		}
+	}
+	gMemory.popRoots(2);
+	gEvalMode = evalMode;
+	gTierUp = tierUp;
+	gJit = native;
+}
+
+void runBenchmarks()
+{
+	benchCellHeap();
+	benchCdrCoding();
+	benchNumVectors();
+	benchRopes();
+	benchHashTables();
+	benchHamt();
+	benchBTree();
+	benchPriorityQueue();
+	benchEvalModes();
+}
@@ -0,0 +1,448 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include "bignum.h"
+
+static void trim(Limbs& limbs)
+{
+	while (!limbs.empty() && limbs.back() == 0)
+	{
+		limbs.pop_back();
+	}
+}
+
+static int compareMagnitude(const Limbs& first, const Limbs& second)
+{
+	if (first.size() != second.size())
+	{
+		return first.size() < second.size() ? -1 : 1;
+	}
+
+	for (size_t i = first.size(); i > 0; i--)
+	{
+		if (first[i - 1] != second[i - 1])
+		{
+			return first[i - 1] < second[i - 1] ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+static Limbs addMagnitude(const Limbs& first, const Limbs& second)
+{
+	const Limbs& longer = first.size() >= second.size() ? first : second;
+	const Limbs& shorter = first.size() >= second.size() ? second : first;
+
+	Limbs sum(longer.size() + 1);
+	uint64_t carry = 0;
+	for (size_t i = 0; i < longer.size(); i++)
+	{
+		carry += (uint64_t)longer[i] + (i < shorter.size() ? shorter[i] : 0);
+		sum[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	sum[longer.size()] = (uint32_t)carry;
+	trim(sum);
+	return sum;
+}
+
+// first must not be smaller than second
+static Limbs subMagnitude(const Limbs& first, const Limbs& second)
+{
+	Limbs difference(first.size());
+	int64_t borrow = 0;
+	for (size_t i = 0; i < first.size(); i++)
+	{
+		int64_t t = (int64_t)first[i] - (i < second.size() ? second[i] : 0) - borrow;
+		borrow = t < 0 ? 1 : 0;
+		difference[i] = (uint32_t)t;
+	}
+	assert(borrow == 0);
+	trim(difference);
+	return difference;
+}
+
+// adds addend * 2^(32 * shift) into sum, which must be long enough
+static void addShifted(Limbs& sum, const Limbs& addend, size_t shift)
+{
+	uint64_t carry = 0;
+	size_t i = 0;
+	for (; i < addend.size(); i++)
+	{
+		carry += (uint64_t)sum[i + shift] + addend[i];
+		sum[i + shift] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	for (; carry && i + shift < sum.size(); i++)
+	{
+		carry += sum[i + shift];
+		sum[i + shift] = (uint32_t)carry;
+		carry >>= 32;
+	}
+}
+
+static Limbs mulSchoolbook(const Limbs& first, const Limbs& second)
+{
+	Limbs product(first.size() + second.size());
+	for (size_t i = 0; i < first.size(); i++)
+	{
+		uint64_t carry = 0;
+		for (size_t j = 0; j < second.size(); j++)
+		{
+			carry += (uint64_t)first[i] * second[j] + product[i + j];
+			product[i + j] = (uint32_t)carry;
+			carry >>= 32;
+		}
+		product[i + second.size()] = (uint32_t)carry;
+	}
+	trim(product);
+	return product;
+}
+
+static Limbs slice(const Limbs& limbs, size_t from, size_t to)
+{
+	from = std::min(from, limbs.size());
+	to = std::min(to, limbs.size());
+	Limbs part(limbs.begin() + from, limbs.begin() + to);
+	trim(part);
+	return part;
+}
+
+// Karatsuba: three half-size products instead of four once both operands are long
+static Limbs mulMagnitude(const Limbs& first, const Limbs& second)
+{
+	if (first.empty() || second.empty())
+	{
+		return Limbs();
+	}
+
+	if (first.size() < Bignum::cKaratsubaThreshold || second.size() < Bignum::cKaratsubaThreshold)
+	{
+		return mulSchoolbook(first, second);
+	}
+
+	size_t half = std::max(first.size(), second.size()) / 2;
+	Limbs low0 = slice(first, 0, half), high0 = slice(first, half, first.size());
+	Limbs low1 = slice(second, 0, half), high1 = slice(second, half, second.size());
+
+	Limbs z0 = mulMagnitude(low0, low1);
+	Limbs z2 = mulMagnitude(high0, high1);
+	Limbs z1 = mulMagnitude(addMagnitude(low0, high0), addMagnitude(low1, high1));
+	z1 = subMagnitude(subMagnitude(z1, z0), z2);
+
+	Limbs product(first.size() + second.size() + 1);
+	addShifted(product, z0, 0);
+	addShifted(product, z1, half);
+	addShifted(product, z2, half * 2);
+	trim(product);
+	return product;
+}
+
+static Limbs divSmall(const Limbs& dividend, uint32_t divisor, uint32_t* remainder)
+{
+	Limbs quotient(dividend.size());
+	uint64_t rest = 0;
+	for (size_t i = dividend.size(); i > 0; i--)
+	{
+		rest = (rest << 32) | dividend[i - 1];
+		quotient[i - 1] = (uint32_t)(rest / divisor);
+		rest %= divisor;
+	}
+	trim(quotient);
+	*remainder = (uint32_t)rest;
+	return quotient;
+}
+
+static uint32_t leadingZeros(uint32_t limb)
+{
+	uint32_t count = 0;
+	while (!(limb & 0x80000000u))
+	{
+		limb <<= 1;
+		count++;
+	}
+	return count;
+}
+
+// Knuth's algorithm D, as laid out in Hacker's Delight (divmnu)
+static void divmodMagnitude(const Limbs& dividend, const Limbs& divisor, Limbs* quotient, Limbs* remainder)
+{
+	assert(!divisor.empty());
+	if (compareMagnitude(dividend, divisor) < 0)
+	{
+		*quotient = Limbs();
+		*remainder = dividend;
+		return;
+	}
+
+	if (divisor.size() == 1)
+	{
+		uint32_t rest;
+		*quotient = divSmall(dividend, divisor[0], &rest);
+		*remainder = rest ? Limbs(1, rest) : Limbs();
+		return;
+	}
+
+	size_t n = divisor.size();
+	size_t m = dividend.size() - n;
+	uint32_t shift = leadingZeros(divisor.back());
+
+	Limbs vn(n), un(dividend.size() + 1);
+	for (size_t i = n - 1; i > 0; i--)
+	{
+		vn[i] = (divisor[i] << shift) | (shift ? (uint32_t)((uint64_t)divisor[i - 1] >> (32 - shift)) : 0);
+	}
+	vn[0] = divisor[0] << shift;
+	un[dividend.size()] = shift ? (uint32_t)((uint64_t)dividend.back() >> (32 - shift)) : 0;
+	for (size_t i = dividend.size() - 1; i > 0; i--)
+	{
+		un[i] = (dividend[i] << shift) | (shift ? (uint32_t)((uint64_t)dividend[i - 1] >> (32 - shift)) : 0);
+	}
+	un[0] = dividend[0] << shift;
+
+	const uint64_t base = 0x100000000ull;
+	Limbs q(m + 1);
+	for (size_t j = m + 1; j > 0; j--)
+	{
+		size_t at = j - 1;
+		uint64_t numerator = ((uint64_t)un[at + n] << 32) | un[at + n - 1];
+		uint64_t qhat = numerator / vn[n - 1];
+		uint64_t rhat = numerator % vn[n - 1];
+		while (qhat >= base || qhat * vn[n - 2] > ((rhat << 32) | un[at + n - 2]))
+		{
+			qhat--;
+			rhat += vn[n - 1];
+			if (rhat >= base)
+			{
+				break;
+			}
+		}
+
+		int64_t borrow = 0, t;
+		for (size_t i = 0; i < n; i++)
+		{
+			uint64_t p = qhat * vn[i];
+			t = (int64_t)un[i + at] - borrow - (int64_t)(p & 0xffffffffu);
+			un[i + at] = (uint32_t)t;
+			borrow = (int64_t)(p >> 32) - (t >> 32);
+		}
+		t = (int64_t)un[at + n] - borrow;
+		un[at + n] = (uint32_t)t;
+
+		q[at] = (uint32_t)qhat;
+		if (t < 0)
+		{
+			// qhat was one too large: add the divisor back
+			q[at]--;
+			uint64_t carry = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				carry += (uint64_t)un[i + at] + vn[i];
+				un[i + at] = (uint32_t)carry;
+				carry >>= 32;
+			}
+			un[at + n] += (uint32_t)carry;
+		}
+	}
+
+	Limbs r(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		r[i] = (un[i] >> shift) | (shift ? (uint32_t)((uint64_t)un[i + 1] << (32 - shift)) : 0);
+	}
+	trim(q);
+	trim(r);
+	*quotient = q;
+	*remainder = r;
+}
+
+Bignum::Bignum(int64_t value)
+	: mNegative(value < 0)
+{
+	uint64_t magnitude = value < 0 ? (uint64_t)(-(value + 1)) + 1 : (uint64_t)value;
+	Limbs limbs;
+	while (magnitude)
+	{
+		limbs.push_back((uint32_t)magnitude);
+		magnitude >>= 32;
+	}
+	mMagnitude = std::make_shared<const Limbs>(limbs);
+}
+
+Bignum::Bignum(bool negative, Limbs magnitude)
+{
+	trim(magnitude);
+	mNegative = negative && !magnitude.empty();
+	mMagnitude = std::make_shared<const Limbs>(std::move(magnitude));
+}
+
+Bignum Bignum::fromDecimal(const char* digits, size_t count, bool negative)
+{
+	Limbs magnitude;
+	size_t i = 0;
+	while (i < count)
+	{
+		// fold in up to nine digits at a time: magnitude = magnitude * 10^k + chunk
+		uint32_t chunk = 0, scale = 1;
+		for (size_t k = 0; k < 9 && i < count; k++, i++)
+		{
+			chunk = chunk * 10 + (digits[i] - '0');
+			scale *= 10;
+		}
+
+		uint64_t carry = chunk;
+		for (size_t l = 0; l < magnitude.size(); l++)
+		{
+			carry += (uint64_t)magnitude[l] * scale;
+			magnitude[l] = (uint32_t)carry;
+			carry >>= 32;
+		}
+		if (carry)
+		{
+			magnitude.push_back((uint32_t)carry);
+		}
+	}
+	return Bignum(negative, magnitude);
+}
+
+bool Bignum::fitsInt32() const
+{
+	if (mMagnitude->size() > 1)
+	{
+		return false;
+	}
+	uint32_t limb = mMagnitude->empty() ? 0 : (*mMagnitude)[0];
+	return mNegative ? limb <= 0x80000000u : limb < 0x80000000u;
+}
+
+int32_t Bignum::toInt32() const
+{
+	assert(fitsInt32());
+	int64_t limb = mMagnitude->empty() ? 0 : (*mMagnitude)[0];
+	return (int32_t)(mNegative ? -limb : limb);
+}
+
+double Bignum::toDouble() const
+{
+	double value = 0;
+	for (size_t i = mMagnitude->size(); i > 0; i--)
+	{
+		value = value * 4294967296.0 + (*mMagnitude)[i - 1];
+	}
+	return mNegative ? -value : value;
+}
+
+std::string Bignum::toString() const
+{
+	if (zero())
+	{
+		return "0";
+	}
+
+	// peel off nine decimal digits per division
+	std::vector<uint32_t> chunks;
+	Limbs rest = *mMagnitude;
+	while (!rest.empty())
+	{
+		uint32_t chunk;
+		rest = divSmall(rest, 1000000000u, &chunk);
+		chunks.push_back(chunk);
+	}
+
+	std::string text = mNegative ? "-" : "";
+	text += std::to_string((unsigned long long)chunks.back());
+	for (size_t i = chunks.size() - 1; i > 0; i--)
+	{
+		std::string digits = std::to_string((unsigned long long)chunks[i - 1]);
+		text += std::string(9 - digits.size(), '0') + digits;
+	}
+	return text;
+}
+
+int Bignum::compare(const Bignum& first, const Bignum& second)
+{
+	if (first.mNegative != second.mNegative)
+	{
+		return first.mNegative ? -1 : 1;
+	}
+	int order = compareMagnitude(*first.mMagnitude, *second.mMagnitude);
+	return first.mNegative ? -order : order;
+}
+
+Bignum Bignum::add(const Bignum& first, const Bignum& second)
+{
+	if (first.mNegative == second.mNegative)
+	{
+		return Bignum(first.mNegative, addMagnitude(*first.mMagnitude, *second.mMagnitude));
+	}
+
+	if (compareMagnitude(*first.mMagnitude, *second.mMagnitude) >= 0)
+	{
+		return Bignum(first.mNegative, subMagnitude(*first.mMagnitude, *second.mMagnitude));
+	}
+	return Bignum(second.mNegative, subMagnitude(*second.mMagnitude, *first.mMagnitude));
+}
+
+Bignum Bignum::sub(const Bignum& first, const Bignum& second)
+{
+	return add(first, Bignum(!second.mNegative, *second.mMagnitude));
+}
+
+Bignum Bignum::mul(const Bignum& first, const Bignum& second)
+{
+	return Bignum(first.mNegative != second.mNegative, mulMagnitude(*first.mMagnitude, *second.mMagnitude));
+}
+
+void Bignum::divmod(const Bignum& dividend, const Bignum& divisor, Bignum* quotient, Bignum* remainder)
+{
+	Limbs q, r;
+	divmodMagnitude(*dividend.mMagnitude, *divisor.mMagnitude, &q, &r);
+	if (quotient)
+	{
+		*quotient = Bignum(dividend.mNegative != divisor.mNegative, q);
+	}
+	if (remainder)
+	{
+		*remainder = Bignum(dividend.mNegative, r);
+	}
+}
+
+void Bignum::test()
+{
+	assert(Bignum(0).toString() == "0");
+	assert(Bignum(-1).toString() == "-1");
+	assert(Bignum(INT64_MIN).toString() == "-9223372036854775808");
+	assert(Bignum::fromDecimal("123456789012345678901234567890", 30, false).toString() == "123456789012345678901234567890");
+	assert(Bignum(2147483647).fitsInt32() && Bignum(-2147483647 - 1).fitsInt32() && !Bignum(2147483648ll).fitsInt32());
+
+	Bignum big = Bignum::fromDecimal("340282366920938463463374607431768211456", 39, false);	// 2^128
+	Bignum one(1);
+	assert(Bignum::sub(big, one).toString() == "340282366920938463463374607431768211455");
+	assert(Bignum::add(Bignum::sub(big, one), one).toString() == big.toString());
+	assert(Bignum::compare(Bignum::sub(one, big), Bignum(0)) < 0);
+
+	Bignum quotient(0), remainder(0);
+	Bignum::divmod(big, Bignum(-1000000007), &quotient, &remainder);
+	assert(Bignum::add(Bignum::mul(quotient, Bignum(-1000000007)), remainder).toString() == big.toString());
+	assert(!remainder.negative());
+
+	// Karatsuba must agree with the schoolbook product on operands past the threshold
+	Limbs first, second;
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < cKaratsubaThreshold * 5; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		first.push_back(seed);
+		if (i < cKaratsubaThreshold * 3)
+		{
+			seed = seed * 1103515245 + 12345;
+			second.push_back(seed | 1);
+		}
+	}
+	assert(mulMagnitude(first, second) == mulSchoolbook(first, second));
+	assert(mulMagnitude(second, second) == mulSchoolbook(second, second));
+
+	Bignum product = Bignum::mul(Bignum(true, first), Bignum(false, second));
+	Bignum::divmod(product, Bignum(false, second), &quotient, &remainder);
+	assert(Bignum::compare(quotient, Bignum(true, first)) == 0 && remainder.zero());
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// little-endian base 2^32 magnitude without leading zero limbs
+typedef std::vector<uint32_t> Limbs;
+
+// Arbitrary precision integer. The magnitude is shared and never modified once
+// built, so copying a Bignum (and so an Item holding one) is cheap.
+class Bignum
+{
+public:
+	const static size_t cKaratsubaThreshold = 32;		// limbs
+
+	Bignum(int64_t value);
+	Bignum(bool negative, Limbs magnitude);
+
+	static Bignum	fromDecimal(const char* digits, size_t count, bool negative);
+
+	bool			negative() const { return mNegative; }
+	bool			zero() const { return mMagnitude->empty(); }
+	const Limbs&	magnitude() const { return *mMagnitude; }
+	bool			fitsInt32() const;
+	int32_t			toInt32() const;
+	double			toDouble() const;
+	std::string		toString() const;
+
+	static int		compare(const Bignum& first, const Bignum& second);
+	static Bignum	add(const Bignum& first, const Bignum& second);
+	static Bignum	sub(const Bignum& first, const Bignum& second);
+	static Bignum	mul(const Bignum& first, const Bignum& second);
+	// truncating division, remainder takes the sign of the dividend
+	static void		divmod(const Bignum& dividend, const Bignum& divisor, Bignum* quotient, Bignum* remainder);
+
+	static void		test();
+
+private:
+	bool							mNegative;
+	std::shared_ptr<const Limbs>	mMagnitude;
+};
@@ -0,0 +1,906 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "btree.h"
+#include "schemestring.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+const type_info& eBTree = typeid(BTreeRef);
+
+BTreeNode::~BTreeNode()
+{
+	if (!mLeaf)
+	{
+		for (uint32_t i = 0; i <= mCount; i++)
+		{
+			delete mChildren[i];
+		}
+	}
+}
+
+BTreeKey BTreeNode::key(uint32_t index) const
+{
+	BTreeKey key;
+	key.mPrefix = mPrefixes[index];
+	key.mItem = mKeys[index];
+	return key;
+}
+
+void BTreeNode::set(uint32_t index, const BTreeKey& key)
+{
+	mPrefixes[index] = key.mPrefix;
+	mKeys[index] = key.mItem;
+}
+
+static uint64_t textPrefix(uint64_t rank, const char* text, size_t bytes)
+{
+	uint64_t prefix = rank << 62;
+	for (size_t i = 0; i < 7 && i < bytes; i++)
+	{
+		prefix |= (uint64_t)(uint8_t)text[i] << (48 - 8 * i);
+	}
+	return prefix;
+}
+
+bool BTree::keyOf(const Item& item, BTreeKey* key)
+{
+	if (item.type() == eNumber)
+	{
+		key->mPrefix = (uint64_t)((int64_t)boost::any_cast<Number>(item) + 0x80000000ll);
+	}
+	else if (item.type() == eSymbol)
+	{
+		std::string name = gSymbolTable.GetString(boost::any_cast<Symbol>(item));
+		key->mPrefix = textPrefix(1, name.data(), name.size());
+	}
+	else if (item.type() == eString)
+	{
+		StringRef string = boost::any_cast<StringRef>(item);
+		key->mPrefix = textPrefix(2, string->data(), string->mBytes);
+	}
+	else
+	{
+		return false;
+	}
+	key->mItem = item;
+	return true;
+}
+
+static int compareText(const char* first, size_t firstBytes, const char* second, size_t secondBytes)
+{
+	int order = memcmp(first, second, std::min(firstBytes, secondBytes));
+	if (order != 0)
+	{
+		return order;
+	}
+	return firstBytes < secondBytes ? -1 : (firstBytes > secondBytes ? 1 : 0);
+}
+
+// Orders two keys whose prefixes are equal, and so whose types are too.
+static int compareTie(const Item& first, const Item& second)
+{
+	if (first.type() == eSymbol)
+	{
+		Symbol a = boost::any_cast<Symbol>(first), b = boost::any_cast<Symbol>(second);
+		if (a == b)
+		{
+			return 0;
+		}
+		std::string nameA = gSymbolTable.GetString(a), nameB = gSymbolTable.GetString(b);
+		return compareText(nameA.data(), nameA.size(), nameB.data(), nameB.size());
+	}
+	else if (first.type() == eString)
+	{
+		StringRef a = boost::any_cast<StringRef>(first), b = boost::any_cast<StringRef>(second);
+		return compareText(a->data(), a->mBytes, b->data(), b->mBytes);
+	}
+	// a fixnum is all prefix
+	return 0;
+}
+
+int compareKeys(const BTreeKey& first, const BTreeKey& second)
+{
+	if (first.mPrefix != second.mPrefix)
+	{
+		return first.mPrefix < second.mPrefix ? -1 : 1;
+	}
+	return compareTie(first.mItem, second.mItem);
+}
+
+static int compareAt(const BTreeNode* node, uint32_t index, const BTreeKey& key)
+{
+	if (node->mPrefixes[index] != key.mPrefix)
+	{
+		return node->mPrefixes[index] < key.mPrefix ? -1 : 1;
+	}
+	return compareTie(node->mKeys[index], key.mItem);
+}
+
+// the first key >= key
+static uint32_t lowerIndex(const BTreeNode* node, const BTreeKey& key)
+{
+	uint32_t i = 0;
+	while (i < node->mCount && compareAt(node, i, key) < 0)
+	{
+		i++;
+	}
+	return i;
+}
+
+// the child whose range holds key: separators are the first keys of the
+// children to their right, so a key equal to one goes right
+static uint32_t childIndex(const BTreeNode* node, const BTreeKey& key)
+{
+	uint32_t i = 0;
+	while (i < node->mCount && compareAt(node, i, key) <= 0)
+	{
+		i++;
+	}
+	return i;
+}
+
+BTree::BTree()
+	: mRoot(nullptr)
+	, mSize(0)
+	, mVersion(0)
+{}
+
+BTree::~BTree()
+{
+	delete mRoot;
+}
+
+BTreeNode* BTree::lowerBound(const BTreeKey& key, uint32_t* index) const
+{
+	BTreeNode* node = mRoot;
+	if (!node)
+	{
+		return nullptr;
+	}
+	while (!node->mLeaf)
+	{
+		node = node->mChildren[childIndex(node, key)];
+	}
+	*index = lowerIndex(node, key);
+	return node;
+}
+
+BTreeNode* BTree::first(uint32_t* index) const
+{
+	BTreeNode* node = mRoot;
+	while (node && !node->mLeaf)
+	{
+		node = node->mChildren[0];
+	}
+	*index = 0;
+	return node;
+}
+
+const Item* BTree::find(const BTreeKey& key) const
+{
+	uint32_t index;
+	BTreeNode* leaf = lowerBound(key, &index);
+	if (leaf && index < leaf->mCount && compareAt(leaf, index, key) == 0)
+	{
+		return &leaf->mValues[index];
+	}
+	return nullptr;
+}
+
+struct Split
+{
+	BTreeNode*	mRight;
+	BTreeKey	mSeparator;
+};
+
+// Inserts into the subtree at node. A full node is split in half first; the
+// new right half and the key that separates it go back to the parent.
+static bool insert(BTreeNode* node, const BTreeKey& key, const Item& value, bool* added, Split* split)
+{
+	const uint32_t cKeys = BTreeNode::cKeys;
+
+	if (node->mLeaf)
+	{
+		uint32_t pos = lowerIndex(node, key);
+		if (pos < node->mCount && compareAt(node, pos, key) == 0)
+		{
+			node->mValues[pos] = value;
+			return false;
+		}
+		*added = true;
+
+		BTreeNode* target = node;
+		bool splits = node->mCount == cKeys;
+		if (splits)
+		{
+			const uint32_t half = cKeys / 2;
+			BTreeNode* right = new BTreeNode(true);
+			for (uint32_t i = half; i < cKeys; i++)
+			{
+				right->set(i - half, node->key(i));
+				right->mValues[i - half] = std::move(node->mValues[i]);
+				node->mKeys[i] = Item();
+			}
+			right->mCount = cKeys - half;
+			node->mCount = half;
+			right->mNext = node->mNext;
+			node->mNext = right;
+			if (pos > half)
+			{
+				target = right;
+				pos -= half;
+			}
+			split->mRight = right;
+		}
+
+		for (uint32_t i = target->mCount; i > pos; i--)
+		{
+			target->mPrefixes[i] = target->mPrefixes[i - 1];
+			target->mKeys[i] = std::move(target->mKeys[i - 1]);
+			target->mValues[i] = std::move(target->mValues[i - 1]);
+		}
+		target->set(pos, key);
+		target->mValues[pos] = value;
+		target->mCount++;
+
+		if (splits)
+		{
+			split->mSeparator = split->mRight->key(0);
+		}
+		return splits;
+	}
+
+	uint32_t child = childIndex(node, key);
+	Split below;
+	if (!insert(node->mChildren[child], key, value, added, &below))
+	{
+		return false;
+	}
+
+	// all the separators and children this node should have, in order
+	BTreeKey keys[cKeys + 1];
+	BTreeNode* children[cKeys + 2];
+	for (uint32_t i = 0, j = 0; i < node->mCount; i++, j++)
+	{
+		if (i == child)
+		{
+			keys[j++] = below.mSeparator;
+		}
+		keys[j] = node->key(i);
+	}
+	if (child == node->mCount)
+	{
+		keys[child] = below.mSeparator;
+	}
+	for (uint32_t i = 0, j = 0; i <= node->mCount; i++, j++)
+	{
+		children[j] = node->mChildren[i];
+		if (i == child)
+		{
+			children[++j] = below.mRight;
+		}
+	}
+	uint32_t count = node->mCount + 1;
+
+	if (count <= cKeys)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			node->set(i, keys[i]);
+			node->mChildren[i] = children[i];
+		}
+		node->mChildren[count] = children[count];
+		node->mCount = count;
+		return false;
+	}
+
+	// the middle separator moves up; the halves either side of it stay
+	const uint32_t middle = count / 2;
+	BTreeNode* right = new BTreeNode(false);
+	for (uint32_t i = 0; i < middle; i++)
+	{
+		node->set(i, keys[i]);
+		node->mChildren[i] = children[i];
+	}
+	node->mChildren[middle] = children[middle];
+	for (uint32_t i = middle; i < cKeys; i++)
+	{
+		node->mKeys[i] = Item();
+	}
+	node->mCount = middle;
+
+	for (uint32_t i = middle + 1; i < count; i++)
+	{
+		right->set(i - middle - 1, keys[i]);
+		right->mChildren[i - middle - 1] = children[i];
+	}
+	right->mChildren[count - middle - 1] = children[count];
+	right->mCount = count - middle - 1;
+
+	split->mRight = right;
+	split->mSeparator = keys[middle];
+	return true;
+}
+
+bool BTree::set(const BTreeKey& key, const Item& value)
+{
+	if (!mRoot)
+	{
+		mRoot = new BTreeNode(true);
+	}
+
+	bool added = false;
+	Split split;
+	if (insert(mRoot, key, value, &added, &split))
+	{
+		BTreeNode* root = new BTreeNode(false);
+		root->set(0, split.mSeparator);
+		root->mChildren[0] = mRoot;
+		root->mChildren[1] = split.mRight;
+		root->mCount = 1;
+		mRoot = root;
+	}
+	mSize += added ? 1 : 0;
+	mVersion++;
+	return added;
+}
+
+bool BTree::remove(const BTreeKey& key)
+{
+	uint32_t index;
+	BTreeNode* leaf = lowerBound(key, &index);
+	if (!leaf || index >= leaf->mCount || compareAt(leaf, index, key) != 0)
+	{
+		return false;
+	}
+
+	for (uint32_t i = index + 1; i < leaf->mCount; i++)
+	{
+		leaf->mPrefixes[i - 1] = leaf->mPrefixes[i];
+		leaf->mKeys[i - 1] = std::move(leaf->mKeys[i]);
+		leaf->mValues[i - 1] = std::move(leaf->mValues[i]);
+	}
+	leaf->mCount--;
+	leaf->mKeys[leaf->mCount] = Item();
+	leaf->mValues[leaf->mCount] = Item();
+	mSize--;
+	mVersion++;
+	return true;
+}
+
+// Splits 'count' items into groups of at most 'most', as evenly as possible,
+// so that no group is left with a single item.
+static std::vector<uint32_t> groupSizes(uint32_t count, uint32_t most)
+{
+	uint32_t groups = (count + most - 1) / most;
+	std::vector<uint32_t> sizes(groups, count / groups);
+	for (uint32_t i = 0; i < count % groups; i++)
+	{
+		sizes[i]++;
+	}
+	return sizes;
+}
+
+// Bottom up: full leaves first, then each level of internal nodes over the one
+// below, with each child's smallest key as its separator.
+void BTree::load(const std::vector<BTreeKey>& keys, const std::vector<Item>& values)
+{
+	delete mRoot;
+	mRoot = nullptr;
+	mSize = (uint32_t)keys.size();
+	mVersion++;
+	if (keys.empty())
+	{
+		return;
+	}
+
+	std::vector<BTreeNode*> level;
+	std::vector<BTreeKey> smallest;
+	BTreeNode* previous = nullptr;
+	uint32_t next = 0;
+	for (uint32_t size : groupSizes((uint32_t)keys.size(), BTreeNode::cKeys))
+	{
+		BTreeNode* leaf = new BTreeNode(true);
+		for (uint32_t i = 0; i < size; i++, next++)
+		{
+			leaf->set(i, keys[next]);
+			leaf->mValues[i] = values[next];
+		}
+		leaf->mCount = size;
+		if (previous)
+		{
+			previous->mNext = leaf;
+		}
+		previous = leaf;
+		level.push_back(leaf);
+		smallest.push_back(leaf->key(0));
+	}
+
+	while (level.size() > 1)
+	{
+		std::vector<BTreeNode*> parents;
+		std::vector<BTreeKey> parentSmallest;
+		next = 0;
+		for (uint32_t size : groupSizes((uint32_t)level.size(), BTreeNode::cKeys + 1))
+		{
+			BTreeNode* parent = new BTreeNode(false);
+			parentSmallest.push_back(smallest[next]);
+			parent->mChildren[0] = level[next++];
+			for (uint32_t i = 1; i < size; i++, next++)
+			{
+				parent->set(i - 1, smallest[next]);
+				parent->mChildren[i] = level[next];
+			}
+			parent->mCount = size - 1;
+			parents.push_back(parent);
+		}
+		level.swap(parents);
+		smallest.swap(parentSmallest);
+	}
+	mRoot = level[0];
+}
+
+// Separators are keys too: a string separator must outlive the entry it was
+// copied from.
+static void markNode(const BTreeNode* node)
+{
+	for (uint32_t i = 0; i < node->mCount; i++)
+	{
+		markItem(node->mKeys[i]);
+		if (node->mLeaf)
+		{
+			markItem(node->mValues[i]);
+		}
+	}
+	if (!node->mLeaf)
+	{
+		for (uint32_t i = 0; i <= node->mCount; i++)
+		{
+			markNode(node->mChildren[i]);
+		}
+	}
+}
+
+void BTree::mark()
+{
+	if (mReachable)
+	{
+		return;
+	}
+
+	mReachable = true;
+	if (mRoot)
+	{
+		markNode(mRoot);
+	}
+}
+
+static BTreeRef treeArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != eBTree)
+	{
+		return nullptr;
+	}
+	return boost::any_cast<BTreeRef>(args[index]);
+}
+
+static bool keyArg(const Item* args, uint32_t count, size_t index, BTreeKey* key)
+{
+	return index < count && BTree::keyOf(args[index], key);
+}
+
+Item makeBTree(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(gMemory.allocBTree(context));
+}
+
+Item btreep(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(treeArg(args, count, 0) ? 1 : 0));
+}
+
+Item btreeSize(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	if (!tree)
+	{
+		*error = "&arg0-must-eval-to-btree";
+		return Item();
+	}
+	return Item(Number(tree->mSize));
+}
+
+// (btree-ref tree key [default]); the default default is #f
+Item btreeRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	BTreeKey key;
+	if (!tree)
+	{
+		*error = "&arg0-must-eval-to-btree";
+	}
+	else if (!keyArg(args, count, 1, &key))
+	{
+		*error = "&arg1-must-eval-to-fixnum-symbol-or-string";
+	}
+	else
+	{
+		const Item* value = tree->find(key);
+		return value ? *value : (count > 2 ? args[2] : Item(Number(0)));
+	}
+	return Item();
+}
+
+Item btreeSet(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	BTreeKey key;
+	if (!tree)
+	{
+		*error = "&arg0-must-eval-to-btree";
+	}
+	else if (!keyArg(args, count, 1, &key))
+	{
+		*error = "&arg1-must-eval-to-fixnum-symbol-or-string";
+	}
+	else
+	{
+		tree->set(key, args[2]);
+		return Unspecified();
+	}
+	return Item();
+}
+
+Item btreeDelete(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	BTreeKey key;
+	if (!tree)
+	{
+		*error = "&arg0-must-eval-to-btree";
+	}
+	else if (!keyArg(args, count, 1, &key))
+	{
+		*error = "&arg1-must-eval-to-fixnum-symbol-or-string";
+	}
+	else
+	{
+		tree->remove(key);
+		return Unspecified();
+	}
+	return Item();
+}
+
+// The state of a scan between calls of its procedure.
+struct RangeScan
+{
+	BTreeRef		mTree;
+	Item			mProc;
+	BTreeKey		mHigh;
+	bool			mBounded;
+	Context*		mContext;
+	Continuation	mK;
+};
+
+// Calls the procedure on each entry from (leaf, index) on, in key order, up to
+// the scan's high key. Each call continues the scan through the trampoline, so
+// a long scan doesn't grow the C++ stack. If the procedure changes the tree the
+// cursor may be stale, so the scan finds its place again from the last key.
+static void scanFrom(std::shared_ptr<RangeScan> scan, BTreeNode* leaf, uint32_t index)
+{
+	// past the end of a leaf, or a leaf emptied by deletion
+	while (leaf && index >= leaf->mCount)
+	{
+		leaf = leaf->mNext;
+		index = 0;
+	}
+	if (!leaf || (scan->mBounded && compareAt(leaf, index, scan->mHigh) >= 0))
+	{
+		gMemory.popRoots(2);
+		scan->mK(Unspecified());
+		return;
+	}
+
+	BTreeKey key = leaf->key(index);
+	uint32_t version = scan->mTree->mVersion;
+	std::vector<Item> args(2);
+	args[0] = key.mItem;
+	args[1] = leaf->mValues[index];
+
+	// the key outlives its entry if the procedure deletes it
+	gMemory.pushRoot(key.mItem);
+	apply(scan->mProc, args, scan->mContext, [scan, leaf, index, key, version](Item) {
+		gMemory.popRoots(1);
+		yield([scan, leaf, index, key, version]() {
+			if (scan->mTree->mVersion == version)
+			{
+				scanFrom(scan, leaf, index + 1);
+				return;
+			}
+			uint32_t at;
+			BTreeNode* from = scan->mTree->lowerBound(key, &at);
+			if (from && at < from->mCount && compareAt(from, at, key) == 0)
+			{
+				at++;
+			}
+			scanFrom(scan, from, at);
+		});
+	});
+}
+
+static void startScan(const Item& treeItem, BTreeRef tree, BTreeNode* leaf, uint32_t index, const BTreeKey* high, const Item& proc, Context* context, Continuation k)
+{
+	auto scan = std::make_shared<RangeScan>();
+	scan->mTree = tree;
+	scan->mProc = proc;
+	scan->mBounded = high != nullptr;
+	if (high)
+	{
+		scan->mHigh = *high;
+	}
+	scan->mContext = context;
+	scan->mK = k;
+
+	// the tree and the procedure may be reachable from nowhere else
+	gMemory.pushRoot(treeItem);
+	gMemory.pushRoot(proc);
+	scanFrom(scan, leaf, index);
+}
+
+// (btree-range tree low high proc) calls (proc key value) for each entry with
+// low <= key < high, in order.
+void btreeRange(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	BTreeKey low, high;
+	if (!tree)
+	{
+		raiseError("&arg0-must-eval-to-btree", k);
+	}
+	else if (!keyArg(args, count, 1, &low) || !keyArg(args, count, 2, &high))
+	{
+		raiseError("&range-must-be-fixnums-symbols-or-strings", k);
+	}
+	else if (args[3].type() != eProc)
+	{
+		raiseError("&arg3-must-eval-to-proc", k);
+	}
+	else
+	{
+		uint32_t index = 0;
+		BTreeNode* leaf = tree->lowerBound(low, &index);
+		startScan(args[0], tree, leaf, index, &high, args[3], context, k);
+	}
+}
+
+// (btree-for-each tree proc) over every entry
+void btreeForEach(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	if (!tree)
+	{
+		raiseError("&arg0-must-eval-to-btree", k);
+	}
+	else if (args[1].type() != eProc)
+	{
+		raiseError("&arg1-must-eval-to-proc", k);
+	}
+	else
+	{
+		uint32_t index;
+		BTreeNode* leaf = tree->first(&index);
+		startScan(args[0], tree, leaf, index, nullptr, args[1], context, k);
+	}
+}
+
+// Bulk loads an alist sorted by strictly increasing key.
+Item alistToBTree(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eCell)
+	{
+		*error = "&arg0-must-eval-to-list";
+		return Item();
+	}
+
+	std::vector<BTreeKey> keys;
+	std::vector<Item> values;
+	for (CellRef cell = boost::any_cast<CellRef>(args[0]); cell; cell = cell->next())
+	{
+		BTreeKey key;
+		if (cell->mCar.type() != eCell || !boost::any_cast<CellRef>(cell->mCar) || !BTree::keyOf(boost::any_cast<CellRef>(cell->mCar)->mCar, &key))
+		{
+			*error = "&arg0-must-eval-to-alist-of-fixnum-symbol-or-string-keys";
+			return Item();
+		}
+		if (!keys.empty() && compareKeys(keys.back(), key) >= 0)
+		{
+			*error = "&alist-keys-must-be-strictly-increasing";
+			return Item();
+		}
+		keys.push_back(key);
+		values.push_back(boost::any_cast<CellRef>(cell->mCar)->cdr());
+	}
+
+	BTreeRef tree = gMemory.allocBTree(context);
+	tree->load(keys, values);
+	return Item(tree);
+}
+
+Item btreeToAlist(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BTreeRef tree = treeArg(args, count, 0);
+	if (!tree)
+	{
+		*error = "&arg0-must-eval-to-btree";
+		return Item();
+	}
+
+	std::vector<BTreeNode*> leaves;
+	uint32_t index;
+	for (BTreeNode* leaf = tree->first(&index); leaf; leaf = leaf->mNext)
+	{
+		leaves.push_back(leaf);
+	}
+
+	gMemory.reserveCells(context, tree->mSize * 2);
+	CellRef list = nullptr;
+	for (size_t i = leaves.size(); i > 0; i--)
+	{
+		for (uint32_t j = leaves[i - 1]->mCount; j > 0; j--)
+		{
+			CellRef entry = gMemory.allocCell(context, leaves[i - 1]->mKeys[j - 1], leaves[i - 1]->mValues[j - 1]);
+			list = gMemory.allocCell(context, Item(entry), Item(list));
+		}
+	}
+	return Item(list);
+}
+
+void addBTreeNatives()
+{
+	definePrimitive("make-btree", makeBTree, 0, 0, true);
+	definePrimitive("btree?", btreep, 1, 1, false);
+	definePrimitive("btree-size", btreeSize, 1, 1, false);
+	definePrimitive("btree-ref", btreeRef, 2, 3, false);
+	definePrimitive("btree-set!", btreeSet, 3, 3, false);
+	definePrimitive("btree-delete!", btreeDelete, 2, 2, false);
+	defineCallingPrimitive("btree-range", btreeRange, 4, 4);
+	defineCallingPrimitive("btree-for-each", btreeForEach, 2, 2);
+	definePrimitive("alist->btree", alistToBTree, 1, 1, true);
+	definePrimitive("btree->alist", btreeToAlist, 1, 1, true);
+}
+
+// Checks ordering, separator bounds and leaf links; returns the height.
+static uint32_t check(const BTreeNode* node, const BTreeKey* low, const BTreeKey* high, const BTreeNode** leaf)
+{
+	for (uint32_t i = 0; i < node->mCount; i++)
+	{
+		assert(i == 0 || compareAt(node, i - 1, node->key(i)) < 0);
+		assert(!low || compareKeys(*low, node->key(i)) <= 0);
+		assert(!high || compareKeys(node->key(i), *high) < 0);
+	}
+	if (node->mLeaf)
+	{
+		assert(*leaf == node);
+		*leaf = node->mNext;
+		return 1;
+	}
+
+	uint32_t height = 0;
+	for (uint32_t i = 0; i <= node->mCount; i++)
+	{
+		BTreeKey below, above;
+		if (i > 0)
+		{
+			below = node->key(i - 1);
+		}
+		if (i < node->mCount)
+		{
+			above = node->key(i);
+		}
+		uint32_t child = check(node->mChildren[i], i > 0 ? &below : low, i < node->mCount ? &above : high, leaf);
+		assert(height == 0 || child == height);
+		height = child;
+	}
+	return height + 1;
+}
+
+static uint32_t check(const BTree& tree)
+{
+	uint32_t index;
+	const BTreeNode* leaf = tree.first(&index);
+	uint32_t height = tree.mRoot ? check(tree.mRoot, nullptr, nullptr, &leaf) : 0;
+	assert(!leaf);
+	return height;
+}
+
+static BTreeKey numberKey(Number n)
+{
+	BTreeKey key;
+	BTree::keyOf(Item(n), &key);
+	return key;
+}
+
+void test_btree()
+{
+	// inserts in a scrambled order come out sorted
+	BTree tree;
+	for (Number i = 0; i < 5000; i++)
+	{
+		bool added = tree.set(numberKey((i * 7919) % 5000 - 2500), Item(i));
+		assert(added);
+	}
+	bool added = tree.set(numberKey(-2500), Item(Number(-1)));
+	assert(!added && tree.mSize == 5000);
+	uint32_t height = check(tree);
+	assert(height >= 4 && height <= 7);
+
+	uint32_t index;
+	Number expected = -2500;
+	for (BTreeNode* leaf = tree.first(&index); leaf; leaf = leaf->mNext)
+	{
+		for (uint32_t i = 0; i < leaf->mCount; i++, expected++)
+		{
+			assert(boost::any_cast<Number>(leaf->mKeys[i]) == expected);
+		}
+	}
+	assert(expected == 2500);
+	assert(boost::any_cast<Number>(*tree.find(numberKey(-2500))) == -1);
+	assert(!tree.find(numberKey(2500)));
+
+	// deletion leaves the rest findable and in order
+	for (Number i = -2500; i < 2500; i += 2)
+	{
+		bool removed = tree.remove(numberKey(i));
+		assert(removed);
+	}
+	assert(tree.mSize == 2500);
+	check(tree);
+	for (Number i = -2500; i < 2500; i++)
+	{
+		assert((tree.find(numberKey(i)) != nullptr) == (i % 2 != 0));
+	}
+
+	// fixnums sort before symbols, symbols before strings; both by their text
+	BTreeKey number = numberKey(2000000000), a, ab, abcdefgh, abcdefgi, text;
+	BTree::keyOf(Item(gSymbolTable.GetSymbol("a")), &a);
+	BTree::keyOf(Item(gSymbolTable.GetSymbol("ab")), &ab);
+	BTree::keyOf(Item(gSymbolTable.GetSymbol("abcdefgh")), &abcdefgh);
+	BTree::keyOf(Item(gSymbolTable.GetSymbol("abcdefgi")), &abcdefgi);
+	assert(compareKeys(numberKey(-1), numberKey(0)) < 0);
+	assert(compareKeys(number, a) < 0 && compareKeys(a, ab) < 0);
+	assert(abcdefgh.mPrefix == abcdefgi.mPrefix && compareKeys(abcdefgh, abcdefgi) < 0);
+	assert(compareKeys(abcdefgi, abcdefgi) == 0);
+	String string(std::make_shared<const std::string>("a"), 0, 1, 1);
+	BTree::keyOf(Item(&string), &text);
+	assert(compareKeys(abcdefgi, text) < 0);
+
+	// bulk loading builds full leaves and a balanced tree
+	for (uint32_t count = 0; count < 200; count++)
+	{
+		std::vector<BTreeKey> keys;
+		std::vector<Item> values;
+		for (Number i = 0; i < (Number)count; i++)
+		{
+			keys.push_back(numberKey(i * 3));
+			values.push_back(Item(i));
+		}
+		BTree loaded;
+		loaded.load(keys, values);
+		check(loaded);
+		assert(loaded.mSize == count);
+		for (Number i = 0; i < (Number)count; i++)
+		{
+			assert(boost::any_cast<Number>(*loaded.find(numberKey(i * 3))) == i);
+			assert(!loaded.find(numberKey(i * 3 + 1)));
+		}
+		loaded.set(numberKey(1), Item(Number(0)));
+		check(loaded);
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// A key with its order-preserving 64 bit prefix: the type's rank in the top
+// two bits (fixnums, then symbols, then strings), then the fixnum's value or
+// the first seven bytes of the name or text. Most comparisons are settled by
+// the prefixes alone; only equal prefixes need the keys themselves.
+struct BTreeKey
+{
+	uint64_t	mPrefix;
+	Item		mItem;
+};
+
+// A B+-tree node. Internal nodes hold separators and children, leaves hold the
+// entries and are linked in key order. The prefixes a search reads are kept
+// together and fill one cache line.
+struct BTreeNode
+{
+	const static uint32_t cKeys = 8;
+
+	uint64_t	mPrefixes[cKeys];
+	uint32_t	mCount;
+	bool		mLeaf;
+	Item		mKeys[cKeys];
+	Item		mValues[cKeys];				// leaves
+	BTreeNode*	mChildren[cKeys + 1];		// internal nodes: mCount + 1 of them
+	BTreeNode*	mNext;						// leaves: the next leaf in key order
+
+	BTreeNode(bool leaf)
+		: mCount(0)
+		, mLeaf(leaf)
+		, mNext(nullptr)
+	{}
+	~BTreeNode();
+
+	BTreeKey	key(uint32_t index) const;
+	void		set(uint32_t index, const BTreeKey& key);
+};
+
+// An ordered map on fixnum, symbol and string keys. Deletion takes entries out
+// of their leaf without merging leaves, which keeps separators valid; a tree
+// that shrinks a lot keeps its shape until it is rebuilt.
+struct BTree : public Collectable<BTree>
+{
+	BTreeNode*	mRoot;
+	uint32_t	mSize;
+	uint32_t	mVersion;		// changes whenever the entries do
+
+	BTree();
+	~BTree();
+
+	static bool	keyOf(const Item& item, BTreeKey* key);
+
+	// the leaf and index of the first entry >= key; the index may be the leaf's count
+	BTreeNode*	lowerBound(const BTreeKey& key, uint32_t* index) const;
+	BTreeNode*	first(uint32_t* index) const;
+	const Item*	find(const BTreeKey& key) const;
+	bool		set(const BTreeKey& key, const Item& value);		// true if added
+	bool		remove(const BTreeKey& key);
+	// builds the tree from entries in strictly increasing key order
+	void		load(const std::vector<BTreeKey>& keys, const std::vector<Item>& values);
+	void		mark() override;
+
+private:
+	BTree(const BTree&);
+	BTree& operator=(const BTree&);
+};
+
+typedef BTree*		BTreeRef;
+
+extern const type_info& eBTree;
+
+int			compareKeys(const BTreeKey& first, const BTreeKey& second);
+void		addBTreeNatives();
+void		test_btree();
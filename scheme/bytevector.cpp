@@ -0,0 +1,487 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <vector>
+#include "bytevector.h"
+#include "schemestring.h"
+#include "symboltable.h"
+#include "numeric.h"
+#include "memory.h"
+#include "pages.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+const type_info& eBytevector = typeid(BytevectorRef);
+
+size_t ByteStore::sMappedBytes = 0;
+
+ByteStore::ByteStore(size_t bytes)
+	: mData((uint8_t*)calloc(std::max(bytes, (size_t)1), 1))
+	, mBytes(bytes)
+	, mMapped(false)
+{
+	assert(mData);
+}
+
+ByteStore::ByteStore(const void* view, size_t bytes)
+	: mData((uint8_t*)view)
+	, mBytes(bytes)
+	, mMapped(true)
+{
+	sMappedBytes += bytes;
+}
+
+ByteStore::~ByteStore()
+{
+	if (mMapped)
+	{
+		unmapFile(mData, mBytes);
+		sMappedBytes -= mBytes;
+	}
+	else
+	{
+		free(mData);
+	}
+}
+
+std::string bytevectorToString(BytevectorRef bytevector)
+{
+	std::ostringstream text;
+	text << "#u8( ";
+	for (size_t i = 0; i < bytevector->mLength; i++)
+	{
+		text << (uint32_t)bytevector->mData[i] << " ";
+	}
+	text << ") ";
+	return text.str();
+}
+
+bool bytevectorEqual(BytevectorRef first, BytevectorRef second)
+{
+	return first->mLength == second->mLength && (first->mData == second->mData || memcmp(first->mData, second->mData, first->mLength) == 0);
+}
+
+static bool hostLittleEndian()
+{
+	uint16_t one = 1;
+	return *(uint8_t*)&one == 1;
+}
+
+// Unaligned and in either byte order; memcpy compiles to a plain load or store.
+template<typename T>
+static T load(const uint8_t* data, bool little)
+{
+	uint8_t bytes[sizeof(T)];
+	memcpy(bytes, data, sizeof(T));
+	if (little != hostLittleEndian())
+	{
+		std::reverse(bytes, bytes + sizeof(T));
+	}
+	T value;
+	memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+template<typename T>
+static void store(uint8_t* data, T value, bool little)
+{
+	uint8_t bytes[sizeof(T)];
+	memcpy(bytes, &value, sizeof(T));
+	if (little != hostLittleEndian())
+	{
+		std::reverse(bytes, bytes + sizeof(T));
+	}
+	memcpy(data, bytes, sizeof(T));
+}
+
+static Item unsignedItem(uint64_t value)
+{
+	if (value <= (uint64_t)std::numeric_limits<int64_t>::max())
+	{
+		return makeInteger((int64_t)value);
+	}
+	Limbs magnitude;
+	magnitude.push_back((uint32_t)value);
+	magnitude.push_back((uint32_t)(value >> 32));
+	return Item(Bignum(false, magnitude));
+}
+
+// An exact integer whose magnitude fits in 64 bits.
+static bool integerArg(const Item* args, uint32_t count, size_t index, uint64_t* magnitude, bool* negative)
+{
+	if (index >= count)
+	{
+		return false;
+	}
+	else if (args[index].type() == eNumber)
+	{
+		Number number = boost::any_cast<Number>(args[index]);
+		*negative = number < 0;
+		*magnitude = number < 0 ? 0 - (uint64_t)(int64_t)number : (uint64_t)number;
+		return true;
+	}
+	else if (args[index].type() == eBignum)
+	{
+		Bignum number = boost::any_cast<Bignum>(args[index]);
+		const Limbs& limbs = number.magnitude();
+		if (limbs.size() > 2)
+		{
+			return false;
+		}
+		*negative = number.negative();
+		*magnitude = (limbs.size() > 0 ? limbs[0] : 0) | (limbs.size() > 1 ? (uint64_t)limbs[1] << 32 : 0);
+		return true;
+	}
+	return false;
+}
+
+// An offset into the bytevector, 0 <= value <= limit.
+static bool offsetArg(const Item* args, uint32_t count, size_t index, size_t limit, size_t* value)
+{
+	uint64_t magnitude;
+	bool negative;
+	if (!integerArg(args, count, index, &magnitude, &negative) || negative || magnitude > limit)
+	{
+		return false;
+	}
+	*value = (size_t)magnitude;
+	return true;
+}
+
+static bool byteArg(const Item* args, uint32_t count, size_t index, uint8_t* value)
+{
+	size_t byte;
+	if (!offsetArg(args, count, index, 255, &byte))
+	{
+		return false;
+	}
+	*value = (uint8_t)byte;
+	return true;
+}
+
+// 'little or 'big, little when left out
+static bool endiannessArg(const Item* args, uint32_t count, size_t index, bool* little)
+{
+	if (index >= count)
+	{
+		*little = true;
+		return true;
+	}
+	else if (args[index].type() != eSymbol)
+	{
+		return false;
+	}
+	std::string name = gSymbolTable.GetString(boost::any_cast<Symbol>(args[index]));
+	*little = name == "little";
+	return *little || name == "big";
+}
+
+static BytevectorRef bytevectorArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != eBytevector)
+	{
+		return nullptr;
+	}
+	return boost::any_cast<BytevectorRef>(args[index]);
+}
+
+Item bytevectorp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(bytevectorArg(args, count, 0) ? 1 : 0));
+}
+
+// (make-bytevector n [byte])
+Item makeBytevector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	size_t length;
+	uint8_t fill = 0;
+	if (!offsetArg(args, count, 0, std::numeric_limits<size_t>::max() / 2, &length))
+	{
+		*error = "&arg0-must-eval-to-length";
+		return Item();
+	}
+	else if (count > 1 && !byteArg(args, count, 1, &fill))
+	{
+		*error = "&arg1-must-eval-to-byte";
+		return Item();
+	}
+
+	BytevectorRef bytevector = gMemory.allocBytevector(context, length);
+	memset(bytevector->mData, fill, length);
+	return Item(bytevector);
+}
+
+Item bytevectorProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	std::vector<uint8_t> bytes(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!byteArg(args, count, i, &bytes[i]))
+		{
+			*error = "&args-must-eval-to-bytes";
+			return Item();
+		}
+	}
+
+	BytevectorRef bytevector = gMemory.allocBytevector(context, bytes.size());
+	std::copy(bytes.begin(), bytes.end(), bytevector->mData);
+	return Item(bytevector);
+}
+
+Item bytevectorLength(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+		return Item();
+	}
+	return unsignedItem(bytevector->mLength);
+}
+
+// (bytevector-u32-ref bv index ['little|'big]) and the like for every width
+template<typename T>
+Item bytevectorRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	size_t index;
+	bool little;
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+	}
+	else if (!offsetArg(args, count, 1, bytevector->mLength, &index) || bytevector->mLength - index < sizeof(T))
+	{
+		*error = "&index-out-of-range";
+	}
+	else if (!endiannessArg(args, count, 2, &little))
+	{
+		*error = "&arg2-must-eval-to-endianness";
+	}
+	else
+	{
+		T value = load<T>(bytevector->mData + index, little);
+		return std::numeric_limits<T>::is_signed ? makeInteger((int64_t)value) : unsignedItem((uint64_t)value);
+	}
+	return Item();
+}
+
+template<typename T>
+static bool fitsIn(uint64_t magnitude, bool negative)
+{
+	uint64_t largest = (uint64_t)std::numeric_limits<T>::max();
+	if (negative)
+	{
+		return std::numeric_limits<T>::is_signed && magnitude <= largest + 1;
+	}
+	return magnitude <= largest;
+}
+
+// (bytevector-u32-set! bv index value ['little|'big])
+template<typename T>
+Item bytevectorSet(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	size_t index;
+	uint64_t magnitude;
+	bool negative, little;
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+	}
+	else if (bytevector->readOnly())
+	{
+		*error = "&bytevector-is-read-only";
+	}
+	else if (!offsetArg(args, count, 1, bytevector->mLength, &index) || bytevector->mLength - index < sizeof(T))
+	{
+		*error = "&index-out-of-range";
+	}
+	else if (!integerArg(args, count, 2, &magnitude, &negative) || !fitsIn<T>(magnitude, negative))
+	{
+		*error = "&arg2-out-of-range";
+	}
+	else if (!endiannessArg(args, count, 3, &little))
+	{
+		*error = "&arg3-must-eval-to-endianness";
+	}
+	else
+	{
+		store<T>(bytevector->mData + index, (T)(negative ? 0 - magnitude : magnitude), little);
+		return Unspecified();
+	}
+	return Item();
+}
+
+// (bytevector-slice bv start [end]) shares bv's store, mapped or not
+Item bytevectorSlice(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+		return Item();
+	}
+
+	size_t start, end = bytevector->mLength;
+	if (!offsetArg(args, count, 1, end, &start) || (count > 2 && !offsetArg(args, count, 2, end, &end)) || end < start)
+	{
+		*error = "&index-out-of-range";
+		return Item();
+	}
+
+	ByteStorePtr store = bytevector->mStore;
+	size_t offset = bytevector->mData - store->mData + start;
+	return Item(gMemory.allocBytevector(context, store, offset, end - start));
+}
+
+// A writable heap copy, of a mapped bytevector say.
+Item bytevectorCopy(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+		return Item();
+	}
+
+	BytevectorRef copy = gMemory.allocBytevector(context, bytevector->mLength);
+	memcpy(copy->mData, bytevector->mData, bytevector->mLength);
+	return Item(copy);
+}
+
+// (file->bytevector path) maps the file rather than reading it, so only the
+// pages that are touched are ever read in.
+Item fileToBytevector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eString)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+
+	std::string path = boost::any_cast<StringRef>(args[0])->str();
+	BytevectorRef bytevector = gMemory.mapBytevector(context, path.c_str());
+	if (!bytevector)
+	{
+		*error = "&file-cannot-be-mapped";
+		return Item();
+	}
+	return Item(bytevector);
+}
+
+// (utf8->string bv [start [end]])
+Item utf8ToString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	BytevectorRef bytevector = bytevectorArg(args, count, 0);
+	if (!bytevector)
+	{
+		*error = "&arg0-must-eval-to-bytevector";
+		return Item();
+	}
+
+	size_t start = 0, end = bytevector->mLength;
+	if ((count > 1 && !offsetArg(args, count, 1, end, &start)) || (count > 2 && !offsetArg(args, count, 2, end, &end)) || end < start || end - start > 0xffffffff)
+	{
+		*error = "&index-out-of-range";
+		return Item();
+	}
+	return Item(gMemory.allocString(context, std::string((const char*)bytevector->mData + start, end - start)));
+}
+
+Item stringToUtf8(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eString)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+
+	std::string text = boost::any_cast<StringRef>(args[0])->str();
+	BytevectorRef bytevector = gMemory.allocBytevector(context, text.size());
+	memcpy(bytevector->mData, text.data(), text.size());
+	return Item(bytevector);
+}
+
+void addBytevectorNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("bytevector?", bytevectorp, 1, 1, false);
+	definePrimitive("make-bytevector", makeBytevector, 1, 2, true);
+	definePrimitive("bytevector", bytevectorProc, 0, any, true);
+	definePrimitive("bytevector-length", bytevectorLength, 1, 1, false);
+	definePrimitive("bytevector-u8-ref", bytevectorRef<uint8_t>, 2, 3, false);
+	definePrimitive("bytevector-s8-ref", bytevectorRef<int8_t>, 2, 3, false);
+	definePrimitive("bytevector-u16-ref", bytevectorRef<uint16_t>, 2, 3, false);
+	definePrimitive("bytevector-s16-ref", bytevectorRef<int16_t>, 2, 3, false);
+	definePrimitive("bytevector-u32-ref", bytevectorRef<uint32_t>, 2, 3, false);
+	definePrimitive("bytevector-s32-ref", bytevectorRef<int32_t>, 2, 3, false);
+	definePrimitive("bytevector-u64-ref", bytevectorRef<uint64_t>, 2, 3, false);
+	definePrimitive("bytevector-s64-ref", bytevectorRef<int64_t>, 2, 3, false);
+	definePrimitive("bytevector-u8-set!", bytevectorSet<uint8_t>, 3, 4, false);
+	definePrimitive("bytevector-s8-set!", bytevectorSet<int8_t>, 3, 4, false);
+	definePrimitive("bytevector-u16-set!", bytevectorSet<uint16_t>, 3, 4, false);
+	definePrimitive("bytevector-s16-set!", bytevectorSet<int16_t>, 3, 4, false);
+	definePrimitive("bytevector-u32-set!", bytevectorSet<uint32_t>, 3, 4, false);
+	definePrimitive("bytevector-s32-set!", bytevectorSet<int32_t>, 3, 4, false);
+	definePrimitive("bytevector-u64-set!", bytevectorSet<uint64_t>, 3, 4, false);
+	definePrimitive("bytevector-s64-set!", bytevectorSet<int64_t>, 3, 4, false);
+	definePrimitive("bytevector-slice", bytevectorSlice, 2, 3, true);
+	definePrimitive("bytevector-copy", bytevectorCopy, 1, 1, true);
+	definePrimitive("file->bytevector", fileToBytevector, 1, 1, true);
+	definePrimitive("utf8->string", utf8ToString, 1, 3, true);
+	definePrimitive("string->utf8", stringToUtf8, 1, 1, true);
+}
+
+void test_bytevectors()
+{
+	uint8_t bytes[9] = { 0xff, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x80 };
+	assert(load<uint16_t>(bytes + 1, true) == 0x0201);
+	assert(load<uint16_t>(bytes + 1, false) == 0x0102);
+	assert(load<int32_t>(bytes, true) == 0x030201ff);
+	assert(load<uint64_t>(bytes + 1, false) == 0x0102030405060780ull);
+	assert(load<int64_t>(bytes + 1, true) == (int64_t)0x8007060504030201ull);
+	assert(load<int8_t>(bytes, true) == -1);
+
+	store<uint32_t>(bytes + 3, 0xdeadbeef, false);
+	assert(bytes[3] == 0xde && bytes[6] == 0xef);
+	assert(load<uint32_t>(bytes + 3, true) == 0xefbeadde);
+
+	assert(fitsIn<uint8_t>(255, false) && !fitsIn<uint8_t>(256, false) && !fitsIn<uint8_t>(1, true));
+	assert(fitsIn<int8_t>(128, true) && !fitsIn<int8_t>(128, false));
+	assert(fitsIn<int64_t>(0x8000000000000000ull, true) && !fitsIn<int64_t>(0x8000000000000000ull, false));
+	assert(fitsIn<uint64_t>(0xffffffffffffffffull, false));
+
+	// a mapped store is counted until it is released, and empty files map too
+	const char* path = "bytevector-test.tmp";
+	FILE* file = fopen(path, "wb");
+	assert(file);
+	fwrite("mapped", 1, 6, file);
+	fclose(file);
+
+	const void* view;
+	size_t size;
+	bool mapped = mapFile(path, &view, &size);
+	assert(mapped && view && size == 6);
+	size_t before = ByteStore::sMappedBytes;
+	{
+		ByteStorePtr mapped = std::make_shared<ByteStore>(view, size);
+		assert(ByteStore::sMappedBytes == before + 6);
+		assert(memcmp(mapped->mData, "mapped", 6) == 0);
+	}
+	assert(ByteStore::sMappedBytes == before);
+
+	file = fopen(path, "wb");
+	fclose(file);
+	mapped = mapFile(path, &view, &size);
+	assert(mapped && !view && size == 0);
+	remove(path);
+	mapped = mapFile(path, &view, &size);
+	assert(!mapped);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// The bytes behind one or more bytevectors: a zeroed heap block, or a read-only
+// view of a mapped file. It is released when the last bytevector slicing it is
+// collected.
+struct ByteStore
+{
+	uint8_t*	mData;
+	size_t		mBytes;
+	bool		mMapped;
+
+	explicit ByteStore(size_t bytes);
+	ByteStore(const void* view, size_t bytes);
+	~ByteStore();
+
+	// bytes of files currently mapped by live stores
+	static size_t	sMappedBytes;
+
+private:
+	ByteStore(const ByteStore&);
+	ByteStore& operator=(const ByteStore&);
+};
+
+typedef std::shared_ptr<ByteStore>	ByteStorePtr;
+
+// A window [mData, mData + mLength) onto a store. Slices are new windows onto
+// the same store, so neither slicing nor mapping a file copies anything.
+struct Bytevector : public Collectable<Bytevector>
+{
+	ByteStorePtr	mStore;
+	uint8_t*		mData;
+	size_t			mLength;
+
+	Bytevector()
+		: mData(nullptr)
+		, mLength(0)
+	{}
+	Bytevector(ByteStorePtr store, size_t offset, size_t length)
+		: mStore(store)
+		, mData(store->mData + offset)
+		, mLength(length)
+	{}
+
+	bool	readOnly() const { return mStore && mStore->mMapped; }
+	void	mark() override { mReachable = true; }
+};
+
+typedef Bytevector*		BytevectorRef;
+
+extern const type_info& eBytevector;
+
+std::string	bytevectorToString(BytevectorRef bytevector);
+bool		bytevectorEqual(BytevectorRef first, BytevectorRef second);
+void		addBytevectorNatives();
+void		test_bytevectors();
@@ -0,0 +1,164 @@
+#include "stdafx.h"
+#include <assert.h>
+#include "cellheap.h"
+
+const CellId CellHeap::cNil;
+const CellId CellHeap::cAtom;
+
+CellHeap::CellHeap(uint32_t size)
+	: mCars(size)
+	, mCarCells(size, cAtom)
+	, mCdrs(size)
+	, mLive((size + 31) / 32, 0)
+	, mMarks((size + 31) / 32, 0)
+	, mFreeList(cNil)
+	, mLiveCount(0)
+{
+	// thread the free list through the cdr array, lowest id first
+	for (uint32_t i = size; i > 0; i--)
+	{
+		mCdrs[i - 1] = mFreeList;
+		mFreeList = i - 1;
+	}
+}
+
+CellId CellHeap::take()
+{
+	assert(mFreeList != cNil);
+	CellId cell = mFreeList;
+	mFreeList = mCdrs[cell];
+	mLive[cell >> 5] |= 1u << (cell & 31);
+	mLiveCount++;
+	return cell;
+}
+
+CellId CellHeap::alloc(Item car, CellId cdr)
+{
+	CellId cell = take();
+	mCars[cell] = car;
+	mCarCells[cell] = cAtom;
+	mCdrs[cell] = cdr;
+	return cell;
+}
+
+CellId CellHeap::allocPair(CellId car, CellId cdr)
+{
+	CellId cell = take();
+	mCarCells[cell] = car;
+	mCdrs[cell] = cdr;
+	return cell;
+}
+
+CellId CellHeap::allocDotted(Item car, Item cdr)
+{
+	CellId cell = alloc(car, cAtom);
+	mDottedCdrs[cell] = cdr;
+	return cell;
+}
+
+Item CellHeap::dottedCdr(CellId cell) const
+{
+	auto dotted = mDottedCdrs.find(cell);
+	assert(dotted != mDottedCdrs.end());
+	return dotted->second;
+}
+
+uint32_t CellHeap::length(CellId cell) const
+{
+	uint32_t count = 0;
+	while (cell < cAtom)
+	{
+		count++;
+		cell = mCdrs[cell];
+	}
+
+	return count;
+}
+
+void CellHeap::mark(CellId root)
+{
+	mMarkStack.push_back(root);
+	while (!mMarkStack.empty())
+	{
+		CellId cell = mMarkStack.back();
+		mMarkStack.pop_back();
+
+		// follow the cdr chain in place; only cars that are cells need the stack
+		while (cell < cAtom && !isMarked(cell))
+		{
+			setMarked(cell);
+			CellId car = mCarCells[cell];
+			if (car < cAtom && !isMarked(car))
+			{
+				mMarkStack.push_back(car);
+			}
+			cell = mCdrs[cell];
+		}
+	}
+}
+
+uint32_t CellHeap::collect()
+{
+	uint32_t collected = 0;
+	for (uint32_t word = 0; word < mLive.size(); word++)
+	{
+		uint32_t garbage = mLive[word] & ~mMarks[word];
+		while (garbage)
+		{
+			uint32_t bit = 0;
+			while (!(garbage & (1u << bit)))
+			{
+				bit++;
+			}
+			garbage &= ~(1u << bit);
+
+			CellId cell = word * 32 + bit;
+			if (mCdrs[cell] == cAtom)
+			{
+				mDottedCdrs.erase(cell);
+			}
+			mCars[cell] = Item();
+			mCarCells[cell] = cAtom;
+			mCdrs[cell] = mFreeList;
+			mFreeList = cell;
+			collected++;
+		}
+
+		mLive[word] = mMarks[word];
+		mMarks[word] = 0;
+	}
+
+	mLiveCount -= collected;
+	return collected;
+}
+
+void CellHeap::test()
+{
+	CellHeap heap(100);
+
+	// (1 2 3)
+	CellId list = heap.alloc(Item(Number(3)));
+	list = heap.alloc(Item(Number(2)), list);
+	list = heap.alloc(Item(Number(1)), list);
+	assert(heap.length(list) == 3);
+	assert(boost::any_cast<Number>(heap.car(heap.cdr(list))) == 2);
+
+	// ((1 2 3) 4 . 5)
+	CellId nested = heap.allocPair(list, heap.allocDotted(Item(Number(4)), Item(Number(5))));
+	assert(heap.carCell(nested) == list);
+	assert(boost::any_cast<Number>(heap.dottedCdr(heap.cdr(nested))) == 5);
+	assert(heap.length(nested) == 2);
+
+	heap.alloc(Item(Number(6)), heap.alloc(Item(Number(7))));
+	assert(heap.liveCount() == 7);
+
+	heap.mark(nested);
+	uint32_t collected = heap.collect();
+	assert(collected == 2);
+	assert(heap.liveCount() == 5);
+	assert(heap.length(list) == 3);
+
+	// nothing marked: everything goes back to the free list
+	heap.collect();
+	assert(heap.liveCount() == 0);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include "schemetypes.h"
+
+typedef uint32_t CellId;
+
+// Structure-of-arrays cell heap. Cars, cdrs and mark bits live in parallel
+// arrays indexed by a CellId, so there is no per-cell header: marking and
+// list walks read only the id arrays and bitsets, and the sweep only touches
+// the car of a cell it actually frees.
+class CellHeap
+{
+public:
+	const static CellId cNil  = 0xffffffff;		// empty list
+	const static CellId cAtom = 0xfffffffe;		// car/cdr is not a cell of this heap
+
+	CellHeap(uint32_t size);
+
+	CellId		alloc(Item car, CellId cdr = cNil);
+	CellId		allocPair(CellId car, CellId cdr = cNil);
+	CellId		allocDotted(Item car, Item cdr);
+
+	Item		car(CellId cell) const		{ return mCars[cell]; }
+	CellId		carCell(CellId cell) const	{ return mCarCells[cell]; }
+	CellId		cdr(CellId cell) const		{ return mCdrs[cell]; }
+	Item		dottedCdr(CellId cell) const;
+
+	uint32_t	length(CellId cell) const;
+	void		mark(CellId root);
+	uint32_t	collect();
+	uint32_t	liveCount() const { return mLiveCount; }
+
+	static void test();
+
+private:
+	std::vector<Item>		mCars;
+	std::vector<CellId>		mCarCells;
+	std::vector<CellId>		mCdrs;
+	std::map<CellId, Item>	mDottedCdrs;
+	std::vector<uint32_t>	mLive;
+	std::vector<uint32_t>	mMarks;
+	std::vector<CellId>		mMarkStack;
+	CellId					mFreeList;
+	uint32_t				mLiveCount;
+
+	CellId		take();
+	bool		isMarked(CellId cell) const { return (mMarks[cell >> 5] & (1u << (cell & 31))) != 0; }
+	void		setMarked(CellId cell)		{ mMarks[cell >> 5] |= 1u << (cell & 31); }
+};
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include "pages.h"
+
 struct ICollectable
 {
 	bool					mReachable;
@@ -12,39 +17,86 @@ struct Collectable : public ICollectable
 {
 	T*						mNext;
 	bool					mReachable;
+	bool					mInUse;
 	Collectable()
 		: mReachable(false)
+		, mInUse(false)
 		, mNext(nullptr)
 	{}
 };
 
+// Objects live in cSegmentBytes segments mapped according to a PagePolicy.
+// Every slot always holds a constructed T: free slots are default constructed
+// and threaded through mNext in address order. The heap starts with enough
+// segments for 'size' objects and grows a segment at a time up to 'maxSize';
+// segments beyond the initial ones are discarded when a collection finds them
+// empty, so the resident size falls again after a spike.
 template<class T>
 class Freelist
 {
+	struct Segment
+	{
+		T*			mSlots;
+		bool		mCommitted;
+	};
+
 public:
-	T*					mAllocList;
 	T*					mFreeList;
-	Freelist(size_t size)
-		: mAllocList( nullptr )
+
+	Freelist(size_t size, size_t maxSize = 0, PagePolicy policy = eSmallPages)
+		: mFreeList( nullptr )
+		, mPolicy( policy )
+		, mAllocated( 0 )
+		, mCapacity( 0 )
 	{
-		mFreeList = new T[size];
-		for (uint32_t i = 0; i < size - 1; i++)
+		mSlotsPerSegment = cSegmentBytes / sizeof(T);
+		mMinSegments = (size + mSlotsPerSegment - 1) / mSlotsPerSegment;
+		mMaxSegments = (maxSize + mSlotsPerSegment - 1) / mSlotsPerSegment;
+		if (mMaxSegments < mMinSegments)
+		{
+			mMaxSegments = mMinSegments;
+		}
+
+		for (size_t i = 0; i < mMinSegments; i++)
 		{
-			mFreeList[i].mNext = &mFreeList[i + 1];
+			grow();
 		}
 	}
 
+	~Freelist()
+	{
+		for (size_t i = 0; i < mSegments.size(); i++)
+		{
+			if (mSegments[i].mCommitted)
+			{
+				release(mSegments[i]);
+			}
+			unmapSegment(mSegments[i].mSlots);
+		}
+	}
+
+	T* alloc()
+	{
+		T* slot = take();
+		if (slot != nullptr)
+		{
+			slot->mInUse = true;
+			return slot;
+		}
+
+		return nullptr;
+	}
+
 	template<typename A>
 	T* alloc(A a0)
 	{
-		if (mFreeList != nullptr)
+		T* slot = take();
+		if (slot != nullptr)
 		{
-			auto next = mFreeList->mNext;
-			auto context = new (mFreeList)T(a0);
-			mFreeList = next;
-			context->mNext = mAllocList;
-			mAllocList = context;
-			return context;
+			slot->~T();
+			auto object = new (slot)T(a0);
+			object->mInUse = true;
+			return object;
 		}
 
 		return nullptr;
@@ -53,14 +105,13 @@ public:
 	template<typename A, typename B>
 	T* alloc( A a0, B a1  )
 	{
-		if (mFreeList != nullptr)
+		T* slot = take();
+		if (slot != nullptr)
 		{
-			auto next = mFreeList->mNext;
-			auto context = new (mFreeList)T(a0,a1);
-			mFreeList = next;
-			context->mNext = mAllocList;
-			mAllocList = context;
-			return context;
+			slot->~T();
+			auto object = new (slot)T(a0,a1);
+			object->mInUse = true;
+			return object;
 		}
 
 		return nullptr;
@@ -69,64 +120,183 @@ public:
 	template<typename A, typename B, typename C>
 	T* alloc(A a0, B a1, C a2)
 	{
-		if (mFreeList != nullptr)
+		T* slot = take();
+		if (slot != nullptr)
+		{
+			slot->~T();
+			auto object = new (slot)T(a0, a1,a2);
+			object->mInUse = true;
+			return object;
+		}
+
+		return nullptr;
+	}
+
+	template<typename A, typename B, typename C, typename D>
+	T* alloc(A a0, B a1, C a2, D a3)
+	{
+		T* slot = take();
+		if (slot != nullptr)
 		{
-			auto next = mFreeList->mNext;
-			auto context = new (mFreeList)T(a0, a1,a2);
-			mFreeList = next;
-			context->mNext = mAllocList;
-			mAllocList = context;
-			return context;
+			slot->~T();
+			auto object = new (slot)T(a0, a1, a2, a3);
+			object->mInUse = true;
+			return object;
 		}
 
 		return nullptr;
 	}
 
+	template<typename A, typename B, typename C, typename D, typename E>
+	T* alloc(A a0, B a1, C a2, D a3, E a4)
+	{
+		T* slot = take();
+		if (slot != nullptr)
+		{
+			slot->~T();
+			auto object = new (slot)T(a0, a1, a2, a3, a4);
+			object->mInUse = true;
+			return object;
+		}
+
+		return nullptr;
+	}
+
+	// Commits one more segment, reusing a discarded one before mapping a new one.
+	bool grow()
+	{
+		for (size_t i = 0; i < mSegments.size(); i++)
+		{
+			if (!mSegments[i].mCommitted && recommitSegment(mSegments[i].mSlots, mPolicy))
+			{
+				construct(mSegments[i]);
+				return true;
+			}
+		}
+
+		if (mSegments.size() >= mMaxSegments)
+		{
+			return false;
+		}
+
+		Segment segment;
+		segment.mSlots = (T*)mapSegment(mPolicy);
+		if (!segment.mSlots)
+		{
+			return false;
+		}
+		mSegments.push_back(segment);
+		construct(mSegments.back());
+		return true;
+	}
+
+	// Sweeps every committed segment in address order. Unreachable objects are
+	// destroyed and reset, survivors have their mark cleared for the next cycle.
 	uint32_t collect()
 	{
-		auto i = mAllocList;
-		T* prev = nullptr;
 		uint32_t collected = 0;
-		while (i)
+		mFreeList = nullptr;
+		mAllocated = 0;
+
+		for (size_t s = mSegments.size(); s > 0; s--)
 		{
-			auto next = i->mNext;
-			if (!i->mReachable)
+			Segment& segment = mSegments[s - 1];
+			if (!segment.mCommitted)
 			{
-				if (!prev)
-				{
-					mAllocList = i->mNext;
-				}
-				else
+				continue;
+			}
+
+			T* segmentFreeList = mFreeList;
+			uint32_t live = 0;
+			for (size_t i = mSlotsPerSegment; i > 0; i--)
+			{
+				T* slot = &segment.mSlots[i - 1];
+				if (slot->mInUse)
 				{
-					prev->mNext = i->mNext;
+					if (slot->mReachable)
+					{
+						slot->mReachable = false;
+						live++;
+						continue;
+					}
+
+					slot->~T();
+					new (slot)T();
+					collected++;
 				}
 
-				i->mNext = mFreeList;
-				mFreeList = i;
-				collected++;
+				slot->mNext = mFreeList;
+				mFreeList = slot;
 			}
-			else
+
+			if (live == 0 && s > mMinSegments)
 			{
-				prev = i;
+				mFreeList = segmentFreeList;
+				release(segment);
+				continue;
 			}
-
-			i = next;
+			mAllocated += live;
 		}
 
 		return collected;
 	}
 
-	uint32_t markUnreachable()
+	uint32_t allocated() const { return mAllocated; }
+	size_t   capacity() const { return mCapacity; }
+
+	// Segments already mapped stay; only mapping new ones stops at the limit.
+	void	 setMaxSize(size_t maxSize)
+	{
+		mMaxSegments = (maxSize + mSlotsPerSegment - 1) / mSlotsPerSegment;
+		if (mMaxSegments < mMinSegments)
+		{
+			mMaxSegments = mMinSegments;
+		}
+	}
+
+private:
+	PagePolicy				mPolicy;
+	std::vector<Segment>	mSegments;
+	size_t					mSlotsPerSegment;
+	size_t					mMinSegments;
+	size_t					mMaxSegments;
+	uint32_t				mAllocated;
+	size_t					mCapacity;
+
+	T* take()
+	{
+		if (mFreeList == nullptr)
+		{
+			return nullptr;
+		}
+
+		T* slot = mFreeList;
+		mFreeList = static_cast<T*>(slot->mNext);
+		mAllocated++;
+		return slot;
+	}
+
+	// Constructs a fresh segment's slots and puts them at the head of the free list.
+	void construct(Segment& segment)
 	{
-		uint32_t count = 0;
-		auto collectable = mAllocList;
-		while (collectable)
+		for (size_t i = mSlotsPerSegment; i > 0; i--)
 		{
-			collectable->mReachable = false;
-			collectable = collectable->mNext;
-			count++;
+			T* slot = new (&segment.mSlots[i - 1])T();
+			slot->mNext = mFreeList;
+			mFreeList = slot;
 		}
+		segment.mCommitted = true;
+		mCapacity += mSlotsPerSegment;
+	}
 
-		return count;
+	void release(Segment& segment)
+	{
+		for (size_t i = 0; i < mSlotsPerSegment; i++)
+		{
+			segment.mSlots[i].~T();
+		}
+		discardSegment(segment.mSlots, mPolicy);
+		segment.mCommitted = false;
+		mCapacity -= mSlotsPerSegment;
 	}
 };
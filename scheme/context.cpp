@@ -14,6 +14,18 @@ extern SymbolTable gSymbolTable;
 
 extern std::string print(Item);
 
+uint32_t gBindingEpoch = 0;
+static std::vector<bool> sWatched;
+
+void watchBinding(Symbol symbol)
+{
+	if (symbol >= sWatched.size())
+	{
+		sWatched.resize(symbol + 1);
+	}
+	sWatched[symbol] = true;
+}
+
 Context::Context()
 	: mOuter(nullptr)
 	, mBindings()
@@ -23,42 +35,33 @@ Context::Context(Context* context)
 		: mOuter(context)
 {}
 
-Context::Context(Item variables, CellRef params, Context* outer)
+// Binds parameters to values already evaluated, so no argument list has to be
+// consed. A rest parameter gets rest, the values past the named ones.
+Context::Context(Item variables, const Item* values, uint32_t count, Item rest, Context* outer)
 		: mOuter(outer)
 {
-	// variable is symbol: any number of arguments; arguments bound to symbol
-	if (variables.type() == eSymbol)
-	{
-		mBindings[boost::any_cast<Symbol>(variables)] = params;
-	}
-	else
+	uint32_t i = 0;
+	while (variables.type() == eCell)
 	{
-		// variable is list
-		assert(variables.type() == eCell);
-		CellRef variablelist = boost::any_cast<CellRef>(variables);
-		while (variablelist) {
-			if (gTrace)
-			{
-				std::stringstream sstream;
-				sstream << "Binding: " << print(variablelist->mCar) << " = " << print(params->mCar) << std::endl;
-				puts(sstream.str().c_str());
-			}
-			mBindings[boost::any_cast<Symbol>(variablelist->mCar)] = params->mCar;
-
-			if (variablelist->mCdr.type() == eCell)
-			{
-				variablelist = boost::any_cast<CellRef>(variablelist->mCdr);
-				params = boost::any_cast<CellRef>(params->mCdr);
-			}
-			// pattern matching
-			else
-			{
-				assert(variablelist->mCdr.type() == eSymbol);
-				mBindings[boost::any_cast<Symbol>(variablelist->mCdr)] = params->mCdr;
-				return;
-			}
+		CellRef variable = boost::any_cast<CellRef>(variables);
+		if (!variable)
+		{
+			return;
 		}
+		if (gTrace)
+		{
+			std::stringstream sstream;
+			sstream << "Binding: " << print(variable->mCar) << " = " << print(values[i]) << std::endl;
+			puts(sstream.str().c_str());
+		}
+		assert(i < count);
+		mBindings[boost::any_cast<Symbol>(variable->mCar)] = values[i];
+		variables = variable->cdr();
+		i++;
 	}
+
+	assert(variables.type() == eSymbol);
+	mBindings[boost::any_cast<Symbol>(variables)] = rest;
 }
 
 Item Context::Lookup(Symbol symbol)
@@ -79,6 +82,10 @@ Item Context::Lookup(Symbol symbol)
 
 void Context::Set(uint32_t symbol, Item value)
 {
+	if (symbol < sWatched.size() && sWatched[symbol])
+	{
+		gBindingEpoch++;
+	}
 	mBindings[symbol] = value;
 }
 
@@ -97,24 +104,7 @@ void Context::mark()
 		{
 			printf("(%x) marking %s\n", this, gSymbolTable.GetString(pair.first).c_str());
 		}
-		if (pair.second.type() == eCell && boost::any_cast<CellRef>(pair.second))
-		{
-			auto cell = boost::any_cast<CellRef>(pair.second);
-			cell->mark();
-		}
-		else if (pair.second.type() == eProc)
-		{
-			if (!boost::any_cast<Proc>(pair.second).mNative)
-			{
-				auto cell = boost::any_cast<Proc>(pair.second).mProc;
-				cell->mark();
-			}
-			if (boost::any_cast<Proc>(pair.second).mClosure)
-			{
-				auto cell = boost::any_cast<Proc>(pair.second).mClosure;
-				cell->mark();
-			}
-		}
+		markItem(pair.second);
 	}
 
 	if ( mOuter)
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <map>
+#include <memory>
+#include <vector>
 #include "schemetypes.h"
 #include "collectable.h"
 
@@ -8,16 +10,22 @@ extern bool gTrace;
 extern bool gVerboseGC;
 extern std::string print(Item);
 
+// Code that inlined what a symbol was bound to watches it. Binding a watched
+// symbol again, in any frame, moves the epoch on, which invalidates that code.
+extern uint32_t gBindingEpoch;
+void watchBinding(Symbol symbol);
+
 struct Context : public Collectable<Context>
 {
 	std::map< Symbol, Item >	mBindings;
 	Context*					mOuter;
+	std::shared_ptr<const Node>	mCode;		// the analyzed body running in this frame, kept alive by it
 
 	Context();
 
 	Context(Context* context);
 
-	Context(Item variables, CellRef params, Context* outer);
+	Context(Item variables, const Item* values, uint32_t count, Item rest, Context* outer);
 
 	Item Lookup(Symbol symbol);
 
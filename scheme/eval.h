@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+
+class Memory;
+extern Memory gMemory;
+
+// How tcoeval runs a form: walking it, as a tree of analyzed nodes, or as
+// bytecode.
+enum EvalMode
+{
+	eWalk,
+	eAnalyze,
+	eBytecode
+};
+
+extern EvalMode gEvalMode;
+
+// What a file defining natives for its own types needs from the evaluator.
+// Natives get their arguments unevaluated and answer through k.
+void	eval(Item item, Context* context, Continuation k);
+void	mapeval(Item in, Context* context, Continuation k);
+// evaluates the argument list left to right and hands k the values
+void	evalArgs(Item pair, Context* context, std::function<void(const std::vector<Item>&)> k);
+// calls a procedure on evaluated arguments
+void	apply(Item proc, const std::vector<Item>& args, Context* context, Continuation k);
+void	apply(Item proc, const Item* args, uint32_t count, Context* context, Continuation k);
+// the frame a closure's body runs in, binding its parameters to the values;
+// null with *error set if the values don't fit or there's no room for it
+Context* bindArgs(const Proc& callee, const Item* args, uint32_t count, Context* context, std::string* error);
+// runs k from the trampoline, once the current step has returned
+void	yield(std::function<void(void)> k);
+// runs the steps yielded until none is left
+void	trampoline();
+void	raiseError(const std::string& ex, Continuation k);
+void	defineNative(const char* name, Native native);
+// a native taking between minArgs and maxArgs arguments, evaluated
+void	definePrimitive(const char* name, PrimitiveFn fn, uint32_t minArgs, uint32_t maxArgs, bool allocates);
+// one that answers through k, for natives that call back into Scheme
+void	defineCallingPrimitive(const char* name, PrimitiveCalls calls, uint32_t minArgs, uint32_t maxArgs);
+// an unnamed calling primitive, for procs made at run time
+Item	callingPrimitiveProc(PrimitiveCalls calls, uint32_t minArgs, uint32_t maxArgs);
+// calls a primitive that answers straight away on evaluated arguments; false,
+// with the error, if it fails
+bool	callPrimitive(const Primitive& primitive, const Item* args, uint32_t count, Context* context, Item* result, std::string* error);
+// calls either kind of primitive, answering through k
+void	callPrimitive(const Primitive& primitive, const Item* args, uint32_t count, Context* context, Continuation k);
+// a native that takes its arguments unevaluated, as syntax
+void	defineSyntax(const char* name, Native native);
+bool	isSyntax(Symbol symbol);
+// identity, with numbers by value (1 or 0), and structural equality
+int		compareShallow(Item first, Item second);
+bool	compareDeep(Item first, Item second);
@@ -0,0 +1,593 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include "hamt.h"
+#include "hashtable.h"
+#include "memory.h"
+#include "eval.h"
+
+const type_info& eHamt = typeid(HamtRef);
+
+// Portable SWAR popcount; compilers turn it into the instruction where they
+// may assume it.
+static uint32_t popcount(uint32_t bits)
+{
+	bits = bits - ((bits >> 1) & 0x55555555);
+	bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+	return (((bits + (bits >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+static bool collides(uint32_t shift)
+{
+	return shift >= 32;
+}
+
+uint64_t hamtNewEdit()
+{
+	static uint64_t sEdits = 0;
+	return ++sEdits;
+}
+
+// The node itself if the transient owns it, otherwise a copy that it does.
+static HamtTree editable(const HamtTree& node, uint64_t edit)
+{
+	if (edit != 0 && node->mEdit == edit)
+	{
+		return node;
+	}
+	HamtTree copy = std::make_shared<HamtNode>(*node);
+	copy->mEdit = edit;
+	copy->mMarked = 0;
+	return copy;
+}
+
+static HamtSlot entry(uint32_t hash, const Item& key, const Item& value)
+{
+	HamtSlot slot;
+	slot.mHash = hash;
+	slot.mKey = key;
+	slot.mValue = value;
+	return slot;
+}
+
+// A subtree for two entries whose hashes agree up to 'shift'.
+static HamtTree pair(uint32_t shift, const HamtSlot& first, const HamtSlot& second, uint64_t edit)
+{
+	HamtTree node = std::make_shared<HamtNode>();
+	node->mEdit = edit;
+	if (collides(shift))
+	{
+		node->mSlots.push_back(first);
+		node->mSlots.push_back(second);
+		return node;
+	}
+
+	uint32_t digit0 = (first.mHash >> shift) & 31, digit1 = (second.mHash >> shift) & 31;
+	if (digit0 == digit1)
+	{
+		HamtSlot slot;
+		slot.mHash = first.mHash;
+		slot.mChild = pair(shift + HamtNode::cBits, first, second, edit);
+		node->mSlots.push_back(slot);
+	}
+	else
+	{
+		node->mSlots.push_back(digit0 < digit1 ? first : second);
+		node->mSlots.push_back(digit0 < digit1 ? second : first);
+	}
+	node->mBitmap = (1u << digit0) | (1u << digit1);
+	return node;
+}
+
+const HamtSlot* hamtFind(const HamtTree& root, uint32_t hash, const Item& key)
+{
+	const HamtNode* node = root.get();
+	for (uint32_t shift = 0; node; shift += HamtNode::cBits)
+	{
+		if (collides(shift))
+		{
+			for (auto& slot : node->mSlots)
+			{
+				if (compareDeep(slot.mKey, key))
+				{
+					return &slot;
+				}
+			}
+			return nullptr;
+		}
+
+		uint32_t bit = 1u << ((hash >> shift) & 31);
+		if (!(node->mBitmap & bit))
+		{
+			return nullptr;
+		}
+		const HamtSlot& slot = node->mSlots[popcount(node->mBitmap & (bit - 1))];
+		if (!slot.mChild)
+		{
+			return slot.mHash == hash && compareDeep(slot.mKey, key) ? &slot : nullptr;
+		}
+		node = slot.mChild.get();
+	}
+	return nullptr;
+}
+
+static HamtTree set(const HamtTree& node, uint32_t shift, const HamtSlot& added, uint64_t edit, bool* grew)
+{
+	if (collides(shift))
+	{
+		HamtTree copy = editable(node, edit);
+		for (auto& slot : copy->mSlots)
+		{
+			if (compareDeep(slot.mKey, added.mKey))
+			{
+				slot.mValue = added.mValue;
+				return copy;
+			}
+		}
+		copy->mSlots.push_back(added);
+		*grew = true;
+		return copy;
+	}
+
+	uint32_t bit = 1u << ((added.mHash >> shift) & 31);
+	uint32_t index = popcount(node->mBitmap & (bit - 1));
+	if (!(node->mBitmap & bit))
+	{
+		HamtTree copy = editable(node, edit);
+		copy->mSlots.insert(copy->mSlots.begin() + index, added);
+		copy->mBitmap |= bit;
+		*grew = true;
+		return copy;
+	}
+
+	const HamtSlot& slot = node->mSlots[index];
+	if (slot.mChild)
+	{
+		HamtTree child = set(slot.mChild, shift + HamtNode::cBits, added, edit, grew);
+		if (child == slot.mChild)
+		{
+			return node;
+		}
+		HamtTree copy = editable(node, edit);
+		copy->mSlots[index].mChild = child;
+		return copy;
+	}
+
+	HamtTree copy = editable(node, edit);
+	HamtSlot& target = copy->mSlots[index];
+	if (target.mHash == added.mHash && compareDeep(target.mKey, added.mKey))
+	{
+		target.mValue = added.mValue;
+	}
+	else
+	{
+		// two entries share this digit: push both down a level
+		HamtTree child = pair(shift + HamtNode::cBits, target, added, edit);
+		target = HamtSlot();
+		target.mHash = added.mHash;
+		target.mChild = child;
+		*grew = true;
+	}
+	return copy;
+}
+
+HamtTree hamtSet(const HamtTree& root, uint32_t hash, const Item& key, const Item& value, uint64_t edit, bool* added)
+{
+	*added = false;
+	HamtSlot slot = entry(hash, key, value);
+	if (!root)
+	{
+		HamtTree node = std::make_shared<HamtNode>();
+		node->mEdit = edit;
+		node->mBitmap = 1u << (hash & 31);
+		node->mSlots.push_back(slot);
+		*added = true;
+		return node;
+	}
+	return set(root, 0, slot, edit, added);
+}
+
+// A subtree left holding a single entry is replaced by the entry, so paths stay
+// no longer than the hashes need.
+static HamtTree remove(const HamtTree& node, uint32_t shift, uint32_t hash, const Item& key, uint64_t edit, bool* removed)
+{
+	uint32_t index = 0, bit = 0;
+	if (collides(shift))
+	{
+		while (index < node->mSlots.size() && !compareDeep(node->mSlots[index].mKey, key))
+		{
+			index++;
+		}
+		if (index == node->mSlots.size())
+		{
+			return node;
+		}
+	}
+	else
+	{
+		bit = 1u << ((hash >> shift) & 31);
+		if (!(node->mBitmap & bit))
+		{
+			return node;
+		}
+		index = popcount(node->mBitmap & (bit - 1));
+
+		const HamtSlot& slot = node->mSlots[index];
+		if (slot.mChild)
+		{
+			HamtTree child = remove(slot.mChild, shift + HamtNode::cBits, hash, key, edit, removed);
+			if (!*removed)
+			{
+				return node;
+			}
+			HamtTree copy = editable(node, edit);
+			if (child->mSlots.size() == 1 && !child->mSlots[0].mChild)
+			{
+				copy->mSlots[index] = child->mSlots[0];
+			}
+			else
+			{
+				copy->mSlots[index].mChild = child;
+			}
+			return copy;
+		}
+		else if (slot.mHash != hash || !compareDeep(slot.mKey, key))
+		{
+			return node;
+		}
+	}
+
+	*removed = true;
+	if (node->mSlots.size() == 1)
+	{
+		return HamtTree();
+	}
+	HamtTree copy = editable(node, edit);
+	copy->mSlots.erase(copy->mSlots.begin() + index);
+	copy->mBitmap &= ~bit;
+	return copy;
+}
+
+HamtTree hamtRemove(const HamtTree& root, uint32_t hash, const Item& key, uint64_t edit, bool* removed)
+{
+	*removed = false;
+	return root ? remove(root, 0, hash, key, edit, removed) : root;
+}
+
+// Versions of a map share most of their nodes, so a node already marked in
+// this collection isn't walked again.
+static void markNode(HamtNode* node, uint32_t collection)
+{
+	if (node->mMarked == collection)
+	{
+		return;
+	}
+	node->mMarked = collection;
+	for (auto& slot : node->mSlots)
+	{
+		if (slot.mChild)
+		{
+			markNode(slot.mChild.get(), collection);
+		}
+		else
+		{
+			markItem(slot.mKey);
+			markItem(slot.mValue);
+		}
+	}
+}
+
+void Hamt::mark()
+{
+	mReachable = true;
+	if (mRoot)
+	{
+		markNode(mRoot.get(), gMemory.collections());
+	}
+}
+
+bool hamtEqual(HamtRef first, HamtRef second, bool (*equal)(Item, Item))
+{
+	if (first->mSize != second->mSize)
+	{
+		return false;
+	}
+	bool same = true;
+	second->forEach([&](const HamtSlot& slot) {
+		const HamtSlot* other = same ? hamtFind(first->mRoot, slot.mHash, slot.mKey) : nullptr;
+		same = other && equal(other->mValue, slot.mValue);
+	});
+	return same;
+}
+
+static uint32_t keyHash(const Item& key)
+{
+	return HashTable::hash(eHashEqual, key);
+}
+
+static HamtRef hamtArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != eHamt)
+	{
+		return nullptr;
+	}
+	return boost::any_cast<HamtRef>(args[index]);
+}
+
+// (hamt key value ...)
+Item hamtProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (count % 2 != 0)
+	{
+		*error = "&args-must-be-keys-and-values";
+		return Item();
+	}
+
+	HamtRef hamt = gMemory.allocHamt(context);
+	uint64_t edit = hamtNewEdit();
+	for (size_t i = 0; i < count; i += 2)
+	{
+		bool added;
+		hamt->mRoot = hamtSet(hamt->mRoot, keyHash(args[i]), args[i], args[i + 1], edit, &added);
+		hamt->mSize += added ? 1 : 0;
+	}
+	return Item(hamt);
+}
+
+Item hamtp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(hamtArg(args, count, 0) ? 1 : 0));
+}
+
+Item hamtSize(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt)
+	{
+		*error = "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+	return Item(Number(hamt->mSize));
+}
+
+// (hamt-ref map key [default]); the default default is #f
+Item hamtRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt)
+	{
+		*error = "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+	const HamtSlot* slot = hamtFind(hamt->mRoot, keyHash(args[1]), args[1]);
+	return slot ? slot->mValue : (count > 2 ? args[2] : Item(Number(0)));
+}
+
+Item hamtContains(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt)
+	{
+		*error = "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+	return Item(Number(hamtFind(hamt->mRoot, keyHash(args[1]), args[1]) ? 1 : 0));
+}
+
+// (hamt-set map key value) is a new map sharing all but one path with map;
+// (hamt-set! transient key value) updates the transient in place.
+template<bool Transient>
+Item hamtSetProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt || (hamt->mEdit != 0) != Transient)
+	{
+		*error = Transient ? "&arg0-must-eval-to-transient-hamt" : "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+
+	HamtRef result = Transient ? hamt : gMemory.allocHamt(context);
+	bool added;
+	result->mRoot = hamtSet(hamt->mRoot, keyHash(args[1]), args[1], args[2], hamt->mEdit, &added);
+	result->mSize = hamt->mSize + (added ? 1 : 0);
+	return Transient ? Item(Unspecified()) : Item(result);
+}
+
+template<bool Transient>
+Item hamtDeleteProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt || (hamt->mEdit != 0) != Transient)
+	{
+		*error = Transient ? "&arg0-must-eval-to-transient-hamt" : "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+
+	HamtRef result = Transient ? hamt : gMemory.allocHamt(context);
+	bool removed;
+	result->mRoot = hamtRemove(hamt->mRoot, keyHash(args[1]), args[1], hamt->mEdit, &removed);
+	result->mSize = hamt->mSize - (removed ? 1 : 0);
+	return Transient ? Item(Unspecified()) : Item(result);
+}
+
+// A transient copy of a map: its first updates copy the nodes they touch, as
+// usual, but stamp the copies so later updates can reuse them.
+Item hamtTransient(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt || hamt->mEdit != 0)
+	{
+		*error = "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+
+	HamtRef transient = gMemory.allocHamt(context);
+	transient->mRoot = hamt->mRoot;
+	transient->mSize = hamt->mSize;
+	transient->mEdit = hamtNewEdit();
+	return Item(transient);
+}
+
+// The transient becomes an ordinary map. Its edit token is never used again,
+// so no later update can change the nodes it stamped.
+Item hamtPersistent(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt || hamt->mEdit == 0)
+	{
+		*error = "&arg0-must-eval-to-transient-hamt";
+		return Item();
+	}
+	hamt->mEdit = 0;
+	return args[0];
+}
+
+// Builds the whole map through one transient; later pairs win.
+Item alistToHamt(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eCell)
+	{
+		*error = "&arg0-must-eval-to-list";
+		return Item();
+	}
+
+	HamtRef hamt = gMemory.allocHamt(context);
+	uint64_t edit = hamtNewEdit();
+	for (CellRef cell = boost::any_cast<CellRef>(args[0]); cell; cell = cell->next())
+	{
+		if (cell->mCar.type() != eCell || !boost::any_cast<CellRef>(cell->mCar))
+		{
+			*error = "&arg0-must-eval-to-alist";
+			return Item();
+		}
+		CellRef entry = boost::any_cast<CellRef>(cell->mCar);
+		bool added;
+		hamt->mRoot = hamtSet(hamt->mRoot, keyHash(entry->mCar), entry->mCar, entry->cdr(), edit, &added);
+		hamt->mSize += added ? 1 : 0;
+	}
+	return Item(hamt);
+}
+
+Item hamtToAlist(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HamtRef hamt = hamtArg(args, count, 0);
+	if (!hamt)
+	{
+		*error = "&arg0-must-eval-to-hamt";
+		return Item();
+	}
+
+	gMemory.reserveCells(context, hamt->mSize * 2);
+	CellRef list = nullptr;
+	hamt->forEach([context, &list](const HamtSlot& slot) {
+		CellRef entry = gMemory.allocCell(context, slot.mKey, slot.mValue);
+		list = gMemory.allocCell(context, Item(entry), Item(list));
+	});
+	return Item(list);
+}
+
+void addHamtNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("hamt", hamtProc, 0, any, true);
+	definePrimitive("hamt?", hamtp, 1, 1, false);
+	definePrimitive("hamt-size", hamtSize, 1, 1, false);
+	definePrimitive("hamt-ref", hamtRef, 2, 3, false);
+	definePrimitive("hamt-contains?", hamtContains, 2, 2, false);
+	definePrimitive("hamt-set", hamtSetProc<false>, 3, 3, true);
+	definePrimitive("hamt-delete", hamtDeleteProc<false>, 2, 2, true);
+	definePrimitive("hamt-transient", hamtTransient, 1, 1, true);
+	definePrimitive("hamt-set!", hamtSetProc<true>, 3, 3, false);
+	definePrimitive("hamt-delete!", hamtDeleteProc<true>, 2, 2, false);
+	definePrimitive("hamt-persistent!", hamtPersistent, 1, 1, false);
+	definePrimitive("alist->hamt", alistToHamt, 1, 1, true);
+	definePrimitive("hamt->alist", hamtToAlist, 1, 1, true);
+}
+
+static uint32_t depth(const HamtTree& node)
+{
+	uint32_t deepest = 0;
+	for (auto& slot : node->mSlots)
+	{
+		if (slot.mChild)
+		{
+			deepest = std::max(deepest, depth(slot.mChild));
+		}
+	}
+	return deepest + 1;
+}
+
+void test_hamt()
+{
+	assert(popcount(0) == 0 && popcount(0xffffffff) == 32 && popcount(0x80000101) == 3);
+
+	// each version keeps its own entries while sharing the rest
+	std::vector<HamtTree> versions;
+	HamtTree current;
+	bool changed;
+	for (Number i = 0; i < 20000; i++)
+	{
+		current = hamtSet(current, keyHash(Item(i)), Item(i), Item(i * 3), 0, &changed);
+		assert(changed);
+		if (i % 1000 == 999)
+		{
+			versions.push_back(current);
+		}
+	}
+	HamtTree full = versions.back();
+	// seven levels of digits, then a collision node for hashes equal in all 32 bits
+	assert(depth(full) <= 8);
+	for (Number i = 0; i < 20000; i++)
+	{
+		const HamtSlot* slot = hamtFind(full, keyHash(Item(i)), Item(i));
+		assert(slot && boost::any_cast<Number>(slot->mValue) == i * 3);
+		assert((hamtFind(versions[4], keyHash(Item(i)), Item(i)) != nullptr) == (i < 5000));
+	}
+
+	// an update copies one path: the root's other subtrees are shared
+	HamtTree updated = hamtSet(full, keyHash(Item(7)), Item(7), Item(Number(-1)), 0, &changed);
+	assert(!changed);
+	assert(boost::any_cast<Number>(hamtFind(full, keyHash(Item(7)), Item(7))->mValue) == 21);
+	assert(boost::any_cast<Number>(hamtFind(updated, keyHash(Item(7)), Item(7))->mValue) == -1);
+	uint32_t shared = 0;
+	for (size_t i = 0; i < full->mSlots.size(); i++)
+	{
+		shared += full->mSlots[i].mChild == updated->mSlots[i].mChild ? 1 : 0;
+	}
+	assert(shared == full->mSlots.size() - 1);
+
+	// deleting everything collapses back to nothing
+	HamtTree shrinking = full;
+	for (Number i = 0; i < 20000; i++)
+	{
+		shrinking = hamtRemove(shrinking, keyHash(Item(i)), Item(i), 0, &changed);
+		assert(changed);
+	}
+	assert(!shrinking);
+	assert(hamtFind(full, keyHash(Item(19999)), Item(19999)));
+
+	// whole hash collisions end in a list
+	HamtTree collisions;
+	for (Number i = 0; i < 4; i++)
+	{
+		collisions = hamtSet(collisions, 0x12345678, Item(i), Item(i), 0, &changed);
+	}
+	assert(depth(collisions) == 8 && hamtFind(collisions, 0x12345678, Item(Number(3))));
+	assert(!hamtFind(collisions, 0x12345678, Item(Number(4))));
+	for (Number i = 0; i < 3; i++)
+	{
+		collisions = hamtRemove(collisions, 0x12345678, Item(i), 0, &changed);
+	}
+	assert(depth(collisions) == 1 && hamtFind(collisions, 0x12345678, Item(Number(3))));
+
+	// a transient reuses the nodes it has already copied
+	uint64_t edit = hamtNewEdit();
+	HamtTree transient = hamtSet(full, keyHash(Item(1)), Item(1), Item(Number(0)), edit, &changed);
+	assert(transient != full);
+	HamtTree again = hamtSet(transient, keyHash(Item(2)), Item(2), Item(Number(0)), edit, &changed);
+	assert(again == transient);
+	assert(boost::any_cast<Number>(hamtFind(full, keyHash(Item(2)), Item(2))->mValue) == 6);
+	HamtTree persistent = hamtSet(transient, keyHash(Item(3)), Item(3), Item(Number(0)), 0, &changed);
+	assert(persistent != transient);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+struct HamtNode;
+typedef std::shared_ptr<HamtNode>	HamtTree;
+
+// An entry, or (with mChild set) a subtree of the entries whose hashes share
+// this slot's digits.
+struct HamtSlot
+{
+	uint32_t	mHash;
+	Item		mKey;
+	Item		mValue;
+	HamtTree	mChild;
+};
+
+// One level of a hash array mapped trie. Each level consumes five bits of the
+// key's hash; mBitmap has a bit for each of those 32 digits present, and the
+// slots are kept in digit order, so a digit's slot is the number of bits set
+// below its own. Below the last digit a node is a list of entries whose whole
+// hashes collide.
+//
+// Nodes are reference counted and shared between versions of a map; an update
+// copies only the path from the root to the changed slot. A node stamped with
+// a transient's edit token belongs to that transient alone, which may then
+// change it in place.
+struct HamtNode
+{
+	const static uint32_t cBits = 5;
+
+	uint32_t	mBitmap;
+	std::vector<HamtSlot>	mSlots;
+	uint64_t	mEdit;			// 0 once shared
+	uint32_t	mMarked;		// the collection that last marked the entries
+
+	HamtNode()
+		: mBitmap(0)
+		, mEdit(0)
+		, mMarked(0)
+	{}
+};
+
+// Keys are compared as equal? compares them.
+const HamtSlot*	hamtFind(const HamtTree& root, uint32_t hash, const Item& key);
+HamtTree	hamtSet(const HamtTree& root, uint32_t hash, const Item& key, const Item& value, uint64_t edit, bool* added);
+HamtTree	hamtRemove(const HamtTree& root, uint32_t hash, const Item& key, uint64_t edit, bool* removed);
+uint64_t	hamtNewEdit();
+
+// A map as a heap object. A transient (mEdit != 0) is updated in place by the
+// ! natives until hamt-persistent! turns it back into an ordinary map.
+struct Hamt : public Collectable<Hamt>
+{
+	HamtTree	mRoot;
+	uint32_t	mSize;
+	uint64_t	mEdit;
+
+	Hamt()
+		: mSize(0)
+		, mEdit(0)
+	{}
+
+	void	mark() override;
+	template<typename F>
+	void	forEach(F f) const { forEach(mRoot, f); }
+
+private:
+	template<typename F>
+	static void forEach(const HamtTree& node, F& f)
+	{
+		if (!node)
+		{
+			return;
+		}
+		for (auto& slot : node->mSlots)
+		{
+			if (slot.mChild)
+			{
+				forEach(slot.mChild, f);
+			}
+			else
+			{
+				f(slot);
+			}
+		}
+	}
+};
+
+typedef Hamt*	HamtRef;
+
+extern const type_info& eHamt;
+
+bool	hamtEqual(HamtRef first, HamtRef second, bool (*equal)(Item, Item));
+void	addHamtNatives();
+void	test_hamt();
@@ -0,0 +1,92 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <functional>
+#include "hashcons.h"
+
+// Only immediate values and cells can be keys; procedures are compared by
+// their code, not their identity, so they can't be hash-consed.
+bool HashConsTable::hashable(const Item& item)
+{
+	return item.type() == eNumber || item.type() == eSymbol || item.type() == eCell || item.type() == eUnspecified;
+}
+
+size_t HashConsTable::hash(const Item& item)
+{
+	if (item.type() == eNumber)
+	{
+		return std::hash<Number>()(boost::any_cast<Number>(item));
+	}
+	else if (item.type() == eSymbol)
+	{
+		return std::hash<Symbol>()(boost::any_cast<Symbol>(item)) * 31 + 1;
+	}
+	else if (item.type() == eCell)
+	{
+		return std::hash<CellRef>()(boost::any_cast<CellRef>(item));
+	}
+	return 0;
+}
+
+size_t HashConsTable::hash(const Item& car, const Item& cdr)
+{
+	size_t seed = hash(car);
+	return seed ^ (hash(cdr) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+bool HashConsTable::same(const Item& first, const Item& second)
+{
+	if (first.type() != second.type())
+	{
+		return false;
+	}
+	else if (first.type() == eNumber)
+	{
+		return boost::any_cast<Number>(first) == boost::any_cast<Number>(second);
+	}
+	else if (first.type() == eSymbol)
+	{
+		return boost::any_cast<Symbol>(first) == boost::any_cast<Symbol>(second);
+	}
+	else if (first.type() == eCell)
+	{
+		return boost::any_cast<CellRef>(first) == boost::any_cast<CellRef>(second);
+	}
+	return true;
+}
+
+Cell* HashConsTable::find(const Item& car, const Item& cdr) const
+{
+	auto range = mCells.equal_range(hash(car, cdr));
+	for (auto i = range.first; i != range.second; ++i)
+	{
+		if (same(i->second->mCar, car) && same(i->second->cdr(), cdr))
+		{
+			return i->second;
+		}
+	}
+	return nullptr;
+}
+
+void HashConsTable::insert(Cell* cell)
+{
+	assert(!find(cell->mCar, cell->cdr()));
+	mCells.insert(std::make_pair(hash(cell->mCar, cell->cdr()), cell));
+}
+
+uint32_t HashConsTable::sweep()
+{
+	uint32_t dropped = 0;
+	for (auto i = mCells.begin(); i != mCells.end();)
+	{
+		if (!i->second->mReachable)
+		{
+			i = mCells.erase(i);
+			dropped++;
+		}
+		else
+		{
+			++i;
+		}
+	}
+	return dropped;
+}
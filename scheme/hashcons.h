@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <unordered_map>
+#include "schemetypes.h"
+
+// Weak table of hash-consed cells keyed on the identity of their car and cdr.
+// Entries don't keep cells alive: Memory::gc sweeps out unreachable cells
+// after marking and before the freelist reclaims them.
+class HashConsTable
+{
+public:
+	static bool	hashable(const Item& item);
+
+	Cell*		find(const Item& car, const Item& cdr) const;
+	void		insert(Cell* cell);
+	uint32_t	sweep();
+	size_t		size() const { return mCells.size(); }
+
+private:
+	static size_t hash(const Item& item);
+	static size_t hash(const Item& car, const Item& cdr);
+	static bool   same(const Item& first, const Item& second);
+
+	std::unordered_multimap<size_t, Cell*> mCells;
+};
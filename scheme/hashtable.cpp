@@ -0,0 +1,517 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "hashtable.h"
+#include "numeric.h"
+#include "vector.h"
+#include "schemestring.h"
+#include "rope.h"
+#include "bytevector.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+const type_info& eHashTable = typeid(HashTableRef);
+
+// MurmurHash3's finaliser: every input bit affects every output bit.
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t combine(uint64_t seed, uint64_t h)
+{
+	return mix(seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+static uint64_t hashBytes(const void* data, size_t bytes)
+{
+	// FNV-1a
+	const uint8_t* p = (const uint8_t*)data;
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < bytes; i++)
+	{
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	return mix(h);
+}
+
+// Consistent with compareShallow: the item's type and its inline payload,
+// except where that compares by value rather than by bits.
+static uint64_t hashShallow(const Item& item)
+{
+	uint64_t type = (uintptr_t)&item.type();
+	if (item.type() == eFlonum)
+	{
+		// 0.0 and -0.0 are the same key
+		Flonum value = boost::any_cast<Flonum>(item);
+		return combine(type, value == 0 ? 0 : item.bits());
+	}
+	else if (item.type() == eBignum)
+	{
+		Bignum number = boost::any_cast<Bignum>(item);
+		const Limbs& limbs = number.magnitude();
+		return combine(type, hashBytes(limbs.data(), limbs.size() * sizeof(uint32_t)) + number.negative());
+	}
+	else if (item.type() == eProc)
+	{
+		return combine(type, (uintptr_t)boost::any_cast<Proc>(item).mProc);
+	}
+	return combine(type, item.bits());
+}
+
+// Consistent with compareDeep. Structure is walked with an explicit stack and
+// only so far, which keeps a long list or a cyclic one from costing more than
+// a short one; keys that differ only beyond that collide and are told apart by
+// compareDeep.
+static uint64_t hashDeep(const Item& root)
+{
+	const uint32_t cMaxNodes = 64;
+
+	uint64_t h = 0;
+	uint32_t visited = 0;
+	std::vector<Item> pending(1, root);
+	while (!pending.empty() && visited++ < cMaxNodes)
+	{
+		Item item = pending.back();
+		pending.pop_back();
+		uint64_t type = (uintptr_t)&item.type();
+
+		if (item.type() == eCell)
+		{
+			CellRef cell = boost::any_cast<CellRef>(item);
+			h = combine(h, cell ? type : 0);
+			if (cell)
+			{
+				pending.push_back(cell->cdr());
+				pending.push_back(cell->mCar);
+			}
+		}
+		else if (item.type() == eVector)
+		{
+			VectorRef vector = boost::any_cast<VectorRef>(item);
+			h = combine(h, combine(type, vector->length()));
+			for (uint32_t i = std::min(vector->length(), cMaxNodes); i > 0; i--)
+			{
+				pending.push_back(vector->mElements[i - 1]);
+			}
+		}
+		else if (item.type() == eString)
+		{
+			StringRef string = boost::any_cast<StringRef>(item);
+			h = combine(h, combine(type, hashBytes(string->data(), string->mBytes)));
+		}
+		else if (item.type() == eRope)
+		{
+			std::string text = boost::any_cast<RopeRef>(item)->str();
+			h = combine(h, combine(type, hashBytes(text.data(), text.size())));
+		}
+		else if (item.type() == eBytevector)
+		{
+			BytevectorRef bytevector = boost::any_cast<BytevectorRef>(item);
+			h = combine(h, combine(type, hashBytes(bytevector->mData, bytevector->mLength)));
+		}
+		else
+		{
+			h = combine(h, hashShallow(item));
+		}
+	}
+	return h;
+}
+
+// Never 0, which marks an empty slot.
+uint32_t HashTable::hash(HashKind kind, const Item& key)
+{
+	uint32_t h = (uint32_t)(kind == eHashEqual ? hashDeep(key) : hashShallow(key));
+	return h ? h : 1;
+}
+
+HashTable::HashTable(HashKind kind, uint32_t capacity)
+	: mKind(kind)
+	, mSize(0)
+{
+	uint32_t slots = cMinCapacity;
+	while (slots < capacity + capacity / 4)
+	{
+		slots *= 2;
+	}
+	mHashes.resize(slots, 0);
+	mKeys.resize(slots);
+	mValues.resize(slots);
+}
+
+bool HashTable::same(const Item& first, const Item& second) const
+{
+	return mKind == eHashEqual ? compareDeep(first, second) : compareShallow(first, second) != 0;
+}
+
+uint32_t HashTable::find(const Item& key) const
+{
+	uint32_t h = hash(mKind, key);
+	uint32_t mask = capacity() - 1;
+	for (uint32_t slot = h & mask, probe = 0; ; slot = (slot + 1) & mask, probe++)
+	{
+		uint32_t stored = mHashes[slot];
+		// an entry nearer its home than the key would be means the key isn't here
+		if (stored == 0 || distance(stored, slot) < probe)
+		{
+			return cNotFound;
+		}
+		if (stored == h && same(mKeys[slot], key))
+		{
+			return slot;
+		}
+	}
+}
+
+void HashTable::insert(uint32_t hash, Item key, Item value)
+{
+	uint32_t mask = capacity() - 1;
+	for (uint32_t slot = hash & mask, probe = 0; ; slot = (slot + 1) & mask, probe++)
+	{
+		if (mHashes[slot] == 0)
+		{
+			mHashes[slot] = hash;
+			mKeys[slot] = std::move(key);
+			mValues[slot] = std::move(value);
+			return;
+		}
+
+		// take from the rich: the resident is closer to home, so it moves on instead
+		uint32_t resident = distance(mHashes[slot], slot);
+		if (resident < probe)
+		{
+			std::swap(hash, mHashes[slot]);
+			std::swap(key, mKeys[slot]);
+			std::swap(value, mValues[slot]);
+			probe = resident;
+		}
+	}
+}
+
+// The table keeps its identity; only its slot arrays are rebuilt, at twice the
+// size, and the entries are moved across rather than copied.
+void HashTable::grow()
+{
+	std::vector<uint32_t> hashes(capacity() * 2, 0);
+	std::vector<Item> keys(capacity() * 2);
+	std::vector<Item> values(capacity() * 2);
+	hashes.swap(mHashes);
+	keys.swap(mKeys);
+	values.swap(mValues);
+
+	for (size_t i = 0; i < hashes.size(); i++)
+	{
+		if (hashes[i] != 0)
+		{
+			insert(hashes[i], std::move(keys[i]), std::move(values[i]));
+		}
+	}
+}
+
+void HashTable::set(const Item& key, const Item& value)
+{
+	uint32_t slot = find(key);
+	if (slot != cNotFound)
+	{
+		mValues[slot] = value;
+		return;
+	}
+
+	// keep the load factor under 7/8
+	if ((mSize + 1) * 8 > capacity() * 7)
+	{
+		grow();
+	}
+	insert(hash(mKind, key), key, value);
+	mSize++;
+}
+
+// Backward shift deletion: the entries after the hole that aren't at home move
+// back one, so no tombstones are left to lengthen later probes.
+bool HashTable::remove(const Item& key)
+{
+	uint32_t slot = find(key);
+	if (slot == cNotFound)
+	{
+		return false;
+	}
+
+	uint32_t mask = capacity() - 1;
+	for (uint32_t next = (slot + 1) & mask; mHashes[next] != 0 && distance(mHashes[next], next) > 0; slot = next, next = (next + 1) & mask)
+	{
+		mHashes[slot] = mHashes[next];
+		mKeys[slot] = std::move(mKeys[next]);
+		mValues[slot] = std::move(mValues[next]);
+	}
+	mHashes[slot] = 0;
+	mKeys[slot] = Item();
+	mValues[slot] = Item();
+	mSize--;
+	return true;
+}
+
+void HashTable::clear()
+{
+	std::fill(mHashes.begin(), mHashes.end(), 0);
+	std::fill(mKeys.begin(), mKeys.end(), Item());
+	std::fill(mValues.begin(), mValues.end(), Item());
+	mSize = 0;
+}
+
+void HashTable::mark()
+{
+	mReachable = true;
+	for (size_t i = 0; i < mHashes.size(); i++)
+	{
+		if (mHashes[i] != 0)
+		{
+			markItem(mKeys[i]);
+			markItem(mValues[i]);
+		}
+	}
+}
+
+static HashTableRef tableArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != eHashTable)
+	{
+		return nullptr;
+	}
+	return boost::any_cast<HashTableRef>(args[index]);
+}
+
+// (make-eq-hashtable [capacity]) and the eqv and equal versions
+template<HashKind Kind>
+Item makeHashTable(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	Number capacity = count > 0 && args[0].type() == eNumber ? boost::any_cast<Number>(args[0]) : 0;
+	if (capacity < 0 || capacity > 0x10000000)
+	{
+		*error = "&arg0-must-eval-to-capacity";
+		return Item();
+	}
+	return Item(gMemory.allocHashTable(context, Kind, capacity));
+}
+
+Item hashTablep(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(tableArg(args, count, 0) ? 1 : 0));
+}
+
+Item hashTableSize(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	return Item(Number(table->mSize));
+}
+
+// (hashtable-ref table key [default]); the default default is #f
+Item hashTableRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	uint32_t slot = table->find(args[1]);
+	return slot != HashTable::cNotFound ? table->mValues[slot] : (count > 2 ? args[2] : Item(Number(0)));
+}
+
+Item hashTableSet(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	table->set(args[1], args[2]);
+	return Unspecified();
+}
+
+Item hashTableDelete(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	table->remove(args[1]);
+	return Unspecified();
+}
+
+Item hashTableContains(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	return Item(Number(table->find(args[1]) != HashTable::cNotFound ? 1 : 0));
+}
+
+Item hashTableClear(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+	table->clear();
+	return Unspecified();
+}
+
+// The keys as a vector, in no particular order.
+Item hashTableKeys(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+
+	std::vector<Item> keys;
+	keys.reserve(table->mSize);
+	for (uint32_t i = 0; i < table->capacity(); i++)
+	{
+		if (table->mHashes[i] != 0)
+		{
+			keys.push_back(table->mKeys[i]);
+		}
+	}
+	return Item(makeVector(context, keys));
+}
+
+Item hashTableToAlist(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	HashTableRef table = tableArg(args, count, 0);
+	if (!table)
+	{
+		*error = "&arg0-must-eval-to-hashtable";
+		return Item();
+	}
+
+	gMemory.reserveCells(context, table->mSize * 2);
+	CellRef list = nullptr;
+	for (uint32_t i = table->capacity(); i > 0; i--)
+	{
+		if (table->mHashes[i - 1] != 0)
+		{
+			CellRef entry = gMemory.allocCell(context, table->mKeys[i - 1], table->mValues[i - 1]);
+			list = gMemory.allocCell(context, Item(entry), Item(list));
+		}
+	}
+	return Item(list);
+}
+
+void addHashTableNatives()
+{
+	definePrimitive("make-eq-hashtable", makeHashTable<eHashEq>, 0, 1, true);
+	definePrimitive("make-eqv-hashtable", makeHashTable<eHashEqv>, 0, 1, true);
+	definePrimitive("make-equal-hashtable", makeHashTable<eHashEqual>, 0, 1, true);
+	definePrimitive("hashtable?", hashTablep, 1, 1, false);
+	definePrimitive("hashtable-size", hashTableSize, 1, 1, false);
+	definePrimitive("hashtable-ref", hashTableRef, 2, 3, false);
+	definePrimitive("hashtable-set!", hashTableSet, 3, 3, false);
+	definePrimitive("hashtable-delete!", hashTableDelete, 2, 2, false);
+	definePrimitive("hashtable-contains?", hashTableContains, 2, 2, false);
+	definePrimitive("hashtable-clear!", hashTableClear, 1, 1, false);
+	definePrimitive("hashtable-keys", hashTableKeys, 1, 1, true);
+	definePrimitive("hashtable->alist", hashTableToAlist, 1, 1, true);
+}
+
+static uint32_t longestProbe(const HashTable& table)
+{
+	uint32_t longest = 0;
+	for (uint32_t i = 0; i < table.capacity(); i++)
+	{
+		if (table.mHashes[i] != 0)
+		{
+			longest = std::max(longest, (i - table.mHashes[i]) & (table.capacity() - 1));
+		}
+	}
+	return longest;
+}
+
+void test_hashtables()
+{
+	// symbol keys: grows from the minimum and every key is found again
+	HashTable symbols(eHashEq, 0);
+	assert(symbols.capacity() == HashTable::cMinCapacity);
+	for (Symbol i = 0; i < 100000; i++)
+	{
+		symbols.set(Item(i), Item(Number(i * 2)));
+	}
+	assert(symbols.mSize == 100000);
+	assert(symbols.capacity() == 131072);
+	for (Symbol i = 0; i < 100000; i += 7)
+	{
+		uint32_t slot = symbols.find(Item(i));
+		assert(slot != HashTable::cNotFound);
+		assert(boost::any_cast<Number>(symbols.mValues[slot]) == Number(i * 2));
+	}
+	assert(symbols.find(Item(Symbol(100000))) == HashTable::cNotFound);
+	assert(symbols.find(Item(Number(5))) == HashTable::cNotFound);
+	assert(longestProbe(symbols) < 64);
+
+	// deletion shifts entries back, so the rest stay reachable
+	for (Symbol i = 0; i < 100000; i += 2)
+	{
+		bool removed = symbols.remove(Item(i));
+		assert(removed);
+	}
+	bool removed = symbols.remove(Item(Symbol(0)));
+	assert(!removed);
+	assert(symbols.mSize == 50000);
+	for (Symbol i = 0; i < 100000; i++)
+	{
+		assert((symbols.find(Item(i)) != HashTable::cNotFound) == (i % 2 == 1));
+	}
+
+	// numbers by value in any table; -0.0 is 0.0
+	HashTable numbers(eHashEqv, 16);
+	numbers.set(Item(Flonum(0.0)), Item(Number(1)));
+	numbers.set(makeInteger(int64_t(1) << 40), Item(Number(2)));
+	assert(numbers.find(Item(Flonum(-0.0))) != HashTable::cNotFound);
+	assert(numbers.find(makeInteger(int64_t(1) << 40)) != HashTable::cNotFound);
+	assert(numbers.find(Item(Number(0))) == HashTable::cNotFound);
+	numbers.clear();
+	assert(numbers.mSize == 0 && numbers.find(Item(Flonum(0.0))) == HashTable::cNotFound);
+
+	// structural keys hash alike however they were built
+	Cell tail(Item(Number(2)));
+	Cell head(Item(Number(1)), Item(&tail));
+	Cell tail2(Item(Number(2)));
+	Cell head2(Item(Number(1)), Item(&tail2));
+	assert(HashTable::hash(eHashEqual, Item(&head)) == HashTable::hash(eHashEqual, Item(&head2)));
+	assert(HashTable::hash(eHashEq, Item(&head)) != HashTable::hash(eHashEq, Item(&head2)));
+	HashTable lists(eHashEqual, 0);
+	lists.set(Item(&head), Item(Number(3)));
+	assert(lists.find(Item(&head2)) != HashTable::cNotFound);
+	tail2.mCar = Item(Number(4));
+	assert(lists.find(Item(&head2)) == HashTable::cNotFound);
+
+	// a cycle hashes in bounded time
+	tail.setCdr(Item(&head));
+	HashTable::hash(eHashEqual, Item(&head));
+	tail.setCdr(Item((CellRef)nullptr));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// Which keys a table treats as the same: identical objects (eq), identical
+// objects or equal numbers (eqv), or structurally equal data (equal).
+enum HashKind
+{
+	eHashEq,
+	eHashEqv,
+	eHashEqual,
+};
+
+// An open addressing table with Robin Hood probing: an entry displaced further
+// from its home slot than the one it meets takes that slot, so probe lengths
+// stay short and even at high load, and a lookup can stop as soon as it meets
+// an entry closer to home than the key would be. Each slot keeps its key's hash
+// so most mismatches are rejected without comparing keys.
+struct HashTable : public Collectable<HashTable>
+{
+	const static uint32_t cMinCapacity = 8;
+	const static uint32_t cNotFound = 0xffffffff;
+
+	HashKind			mKind;
+	std::vector<uint32_t>	mHashes;	// 0 marks an empty slot
+	std::vector<Item>	mKeys;
+	std::vector<Item>	mValues;
+	uint32_t			mSize;
+
+	HashTable()
+		: mKind(eHashEq)
+		, mSize(0)
+	{}
+	HashTable(HashKind kind, uint32_t capacity);
+
+	uint32_t	capacity() const { return (uint32_t)mHashes.size(); }
+	uint32_t	find(const Item& key) const;		// slot index or cNotFound
+	void		set(const Item& key, const Item& value);
+	bool		remove(const Item& key);
+	void		clear();
+	void		mark() override;
+
+	static uint32_t	hash(HashKind kind, const Item& key);
+
+private:
+	bool		same(const Item& first, const Item& second) const;
+	uint32_t	distance(uint32_t hash, uint32_t slot) const { return (slot - hash) & (capacity() - 1); }
+	void		insert(uint32_t hash, Item key, Item value);
+	void		grow();
+};
+
+typedef HashTable*		HashTableRef;
+
+extern const type_info& eHashTable;
+
+void	addHashTableNatives();
+void	test_hashtables();
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <typeinfo>
+#include <type_traits>
+#include "boost\any.hpp"
+
+// A dynamically typed value with the interface of boost::any. Values that are
+// trivially copyable and fit in eight bytes - fixnums, flonums, symbols and
+// heap references - are stored inline next to their type, so making, copying
+// and casting them never allocates. Anything else is boxed in a boost::any.
+class Item
+{
+	template<typename T>
+	struct Inline
+	{
+		static const bool value = std::is_trivially_copyable<T>::value && sizeof(T) <= sizeof(uint64_t);
+	};
+
+public:
+	// Machine code reads items in place: the type word, whose low bit marks a
+	// boxed value (type_info objects are at least word aligned), then the payload.
+	const static uintptr_t cBoxed = 1;
+
+	Item()
+		: mType((uintptr_t)&typeid(void))
+		, mBits(0)
+	{}
+
+	template<typename T>
+	Item(const T& value)
+	{
+		set(value, std::integral_constant<bool, Inline<T>::value>());
+	}
+
+	Item(const Item& other)
+	{
+		copy(other);
+	}
+
+	Item(Item&& other)
+		: mType(other.mType)
+		, mBits(other.mBits)
+	{
+		other.mType = (uintptr_t)&typeid(void);
+	}
+
+	~Item()
+	{
+		release();
+	}
+
+	Item& operator=(const Item& other)
+	{
+		if (this != &other)
+		{
+			release();
+			copy(other);
+		}
+		return *this;
+	}
+
+	Item& operator=(Item&& other)
+	{
+		if (this != &other)
+		{
+			release();
+			mType = other.mType;
+			mBits = other.mBits;
+			other.mType = (uintptr_t)&typeid(void);
+		}
+		return *this;
+	}
+
+	const std::type_info& type() const
+	{
+		return *(const std::type_info*)(mType & ~cBoxed);
+	}
+
+	bool empty() const
+	{
+		return type() == typeid(void);
+	}
+
+	// whether the value lives in a boost::any of its own
+	bool boxed() const
+	{
+		return (mType & cBoxed) != 0;
+	}
+
+	// The payload of an inline item: the value itself, or the address of the
+	// object a reference points at. Boxed items have none and give 0.
+	uint64_t bits() const
+	{
+		return (mType & cBoxed) ? 0 : mBits;
+	}
+
+	template<typename T>
+	T get() const
+	{
+		return get<T>(std::integral_constant<bool, Inline<T>::value>());
+	}
+
+	// A boxed value where it lies, without the copy get() makes; null if the
+	// item holds anything else.
+	template<typename T>
+	const T* peek() const
+	{
+		return (mType & cBoxed) ? boost::any_cast<T>((const boost::any*)mBoxed) : nullptr;
+	}
+
+private:
+	uintptr_t		mType;
+	union
+	{
+		uint64_t	mBits;
+		boost::any*	mBoxed;
+	};
+
+	template<typename T>
+	void set(const T& value, std::true_type)
+	{
+		mType = (uintptr_t)&typeid(T);
+		mBits = 0;
+		memcpy(&mBits, &value, sizeof(T));
+	}
+
+	template<typename T>
+	void set(const T& value, std::false_type)
+	{
+		mBoxed = new boost::any(value);
+		mType = (uintptr_t)&mBoxed->type() | cBoxed;
+	}
+
+	template<typename T>
+	T get(std::true_type) const
+	{
+		if (type() != typeid(T))
+		{
+			throw boost::bad_any_cast();
+		}
+		T value;
+		memcpy(&value, &mBits, sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	T get(std::false_type) const
+	{
+		if (!(mType & cBoxed))
+		{
+			throw boost::bad_any_cast();
+		}
+		return boost::any_cast<T>(*mBoxed);
+	}
+
+	void copy(const Item& other)
+	{
+		mType = other.mType;
+		if (other.mType & cBoxed)
+		{
+			mBoxed = new boost::any(*other.mBoxed);
+		}
+		else
+		{
+			mBits = other.mBits;
+		}
+	}
+
+	void release()
+	{
+		if (mType & cBoxed)
+		{
+			delete mBoxed;
+		}
+	}
+};
+
+// Lets the existing boost::any_cast<T>(item) call sites work unchanged on Items.
+namespace boost
+{
+	template<typename T>
+	T any_cast(const ::Item& item)
+	{
+		return item.get<T>();
+	}
+}
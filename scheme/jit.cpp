@@ -0,0 +1,855 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include "jit.h"
+#include "machine.h"
+#include "pages.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "parser.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+bool gJit = true;
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_X64 1
+#else
+#define JIT_X64 0
+#endif
+
+NativeCode::NativeCode()
+	: mBase(nullptr)
+	, mBytes(0)
+{}
+
+NativeCode::~NativeCode()
+{
+	if (mBase)
+	{
+		unmapCode(mBase, mBytes);
+	}
+}
+
+#if JIT_X64
+
+// The helpers generated code calls. Those that may leave the frame answer how
+// the code goes on: as a compiled chunk answers, false when the machine stops
+// and true when another frame is on top, or on to the next instruction. No
+// unwind information is registered for generated code, so nothing may throw
+// through it; the machine raises errors through its continuation.
+enum Onward
+{
+	eStopped,
+	eSwitched,
+	eOnward,
+};
+
+static Context* jitContext(Machine* m)
+{
+	return m->frame().mContext;
+}
+
+static size_t jitDepth(Machine* m)
+{
+	return m->depth();
+}
+
+static uint32_t jitPc(Machine* m)
+{
+	return m->frame().mPc;
+}
+
+static OperandStack* jitStack(Machine* m)
+{
+	return &m->stack();
+}
+
+static void jitPush(Machine* m, const Item* item)
+{
+	m->push(*item);
+}
+
+static void jitLocal(Machine* m, Context* context, uint32_t depth, Symbol symbol)
+{
+	m->local(context, depth, symbol);
+}
+
+static void jitGlobal(Machine* m, Context* context, uint32_t depth, Symbol symbol)
+{
+	m->global(context, depth, symbol);
+}
+
+static void jitDynamic(Machine* m, Context* context, Symbol symbol)
+{
+	m->dynamic(context, symbol);
+}
+
+static void jitAssign(Machine* m, Context* context, Symbol symbol)
+{
+	m->assign(context, symbol);
+}
+
+static void jitPop(Machine* m)
+{
+	m->pop();
+}
+
+static uint32_t jitTest(Machine* m)
+{
+	return m->test() ? 1 : 0;
+}
+
+static void jitClosure(Machine* m, Context* context, const ChunkLambda* lambda)
+{
+	m->closure(context, *lambda);
+}
+
+static uint32_t jitCall(Machine* m, uint32_t pc, uint32_t count, size_t depth)
+{
+	m->frame().mPc = pc;
+	if (!m->call(count, false))
+	{
+		return eStopped;
+	}
+	return m->depth() != depth ? eSwitched : eOnward;
+}
+
+static uint32_t jitTailCall(Machine* m, uint32_t pc, uint32_t count)
+{
+	m->frame().mPc = pc;
+	return m->call(count, true) ? eSwitched : eStopped;
+}
+
+static uint32_t jitReturn(Machine* m)
+{
+	return m->ret() ? eSwitched : eStopped;
+}
+
+static Context* jitEnter(Machine* m)
+{
+	return m->enter();
+}
+
+static void jitBind(Machine* m, Context* context, Symbol symbol)
+{
+	m->bind(context, symbol);
+}
+
+static Context* jitLeave(Machine* m, uint32_t count)
+{
+	return m->leave(count);
+}
+
+static uint32_t jitEval(Machine* m, const NativeCode::Site* site)
+{
+	m->frame().mPc = site->mPc;
+	return m->eval(*site->mForm, site->mTail) ? eOnward : eStopped;
+}
+
+static void jitFail(Machine* m, const std::string* error)
+{
+	m->fail(*error);
+}
+
+template<Op op>
+static uint32_t jitPrimitive(Machine* m, Context* context, const NativeCode::Site* site, size_t depth)
+{
+	if (m->primitive(op))
+	{
+		return eOnward;
+	}
+	m->frame().mPc = site->mPc;
+	if (!m->callGlobal(context, site->mDepth, site->mSymbol, op == eOpNullP ? 1 : 2))
+	{
+		return eStopped;
+	}
+	return m->depth() != depth ? eSwitched : eOnward;
+}
+
+typedef uint32_t (*PrimitiveHelper)(Machine* m, Context* context, const NativeCode::Site* site, size_t depth);
+static const PrimitiveHelper sPrimitives[] = {
+	jitPrimitive<eOpAdd>, jitPrimitive<eOpSub>, jitPrimitive<eOpMul>, jitPrimitive<eOpNumEqual>, jitPrimitive<eOpNullP>
+};
+
+// Registers by their encoding.
+enum Reg
+{
+	eRax, eRcx, eRdx, eRbx, eRsp, eRbp, eRsi, eRdi,
+	eR8, eR9, eR10, eR11, eR12, eR13, eR14, eR15,
+};
+
+// The registers the first four integer arguments go in.
+#ifdef _WIN32
+static const Reg sArgs[] = { eRcx, eRdx, eR8, eR9 };
+#else
+static const Reg sArgs[] = { eRdi, eRsi, eRdx, eRcx };
+#endif
+
+// The machine, its operand stack, the innermost frame and the depth the chunk
+// runs at live in registers calls preserve, as the locals of a translated
+// chunk would. The inline paths work in registers no argument is passed in,
+// so a slow path can call its helper with the arguments already set up.
+const Reg cMachine = eR12;
+const Reg cStack = eR14;
+const Reg cContext = eRbx;
+const Reg cDepth = eR13;
+
+const int32_t cTop = offsetof(OperandStack, mTop);
+const int32_t cLimit = offsetof(OperandStack, mLimit);
+const int32_t cItem = sizeof(Item);
+const int32_t cBits = 8;
+
+enum Cond
+{
+	eAlways,
+	eOverflow = 0x80,
+	eEqual = 0x84,
+	eNotEqual = 0x85,
+};
+
+// Just the instructions the templates use, encoded into a buffer.
+class Emitter
+{
+public:
+	std::vector<uint8_t>	mCode;
+
+	size_t	size() const { return mCode.size(); }
+
+	void	byte(uint8_t value) { mCode.push_back(value); }
+	void	word(uint32_t value);
+	void	load(Reg reg, uint64_t value);
+	void	move(Reg to, Reg from);
+	void	push(Reg reg);
+	void	pop(Reg reg);
+	void	arg(int index, Reg from) { move(sArgs[index], from); }
+	void	arg(int index, uint64_t value) { load(sArgs[index], value); }
+	void	arg(int index, const void* pointer) { load(sArgs[index], (uint64_t)(uintptr_t)pointer); }
+	template<typename Fn>
+	void	call(Fn fn);
+	void	compare(uint32_t value);	// eax with value
+	void	test(Reg reg);				// the register with itself
+	void	clear();					// eax
+	// an instruction with a [base + disp] operand; opcodes past a byte are 0f-prefixed
+	void	memory(uint32_t opcode, Reg reg, Reg base, int32_t disp, bool wide = true);
+	void	read(Reg to, Reg base, int32_t disp) { memory(0x8b, to, base, disp); }
+	void	write(Reg base, int32_t disp, Reg from) { memory(0x89, from, base, disp); }
+	void	compare(Reg reg, Reg base, int32_t disp) { memory(0x3b, reg, base, disp); }
+	void	adjust(Reg reg, int8_t value);	// adds the value to the register
+	void	zero(Reg reg);
+	void	set(Cond cond, Reg reg);	// the low byte to whether cond holds
+	// returns where the offset goes, for bind
+	size_t	jump(Cond cond);
+	void	bind(size_t at, size_t target);
+};
+
+void Emitter::word(uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		byte((uint8_t)(value >> (8 * i)));
+	}
+}
+
+// A value that fits in 32 bits takes the shorter move, which clears the top half.
+void Emitter::load(Reg reg, uint64_t value)
+{
+	if (value <= 0xffffffff)
+	{
+		if (reg >= eR8)
+		{
+			byte(0x41);
+		}
+		byte((uint8_t)(0xb8 + (reg & 7)));
+		word((uint32_t)value);
+		return;
+	}
+	byte((uint8_t)(0x48 | (reg >> 3)));
+	byte((uint8_t)(0xb8 + (reg & 7)));
+	word((uint32_t)value);
+	word((uint32_t)(value >> 32));
+}
+
+void Emitter::move(Reg to, Reg from)
+{
+	if (to == from)
+	{
+		return;
+	}
+	byte((uint8_t)(0x48 | ((from >> 3) << 2) | (to >> 3)));
+	byte(0x89);
+	byte((uint8_t)(0xc0 | ((from & 7) << 3) | (to & 7)));
+}
+
+void Emitter::push(Reg reg)
+{
+	if (reg >= eR8)
+	{
+		byte(0x41);
+	}
+	byte((uint8_t)(0x50 + (reg & 7)));
+}
+
+void Emitter::pop(Reg reg)
+{
+	if (reg >= eR8)
+	{
+		byte(0x41);
+	}
+	byte((uint8_t)(0x58 + (reg & 7)));
+}
+
+template<typename Fn>
+void Emitter::call(Fn fn)
+{
+	load(eRax, (uint64_t)(uintptr_t)fn);
+	byte(0xff);
+	byte(0xd0);
+}
+
+void Emitter::compare(uint32_t value)
+{
+	byte(0x3d);
+	word(value);
+}
+
+void Emitter::test(Reg reg)
+{
+	byte((uint8_t)(0x48 | ((reg >> 3) << 2) | (reg >> 3)));
+	byte(0x85);
+	byte((uint8_t)(0xc0 | ((reg & 7) << 3) | (reg & 7)));
+}
+
+void Emitter::clear()
+{
+	byte(0x31);
+	byte(0xc0);
+}
+
+void Emitter::memory(uint32_t opcode, Reg reg, Reg base, int32_t disp, bool wide)
+{
+	// rsp and r12 as a base need an index byte, which nothing here emits
+	assert((base & 7) != eRsp && disp == (int8_t)disp);
+	uint8_t rex = (uint8_t)((wide ? 0x48 : 0x40) | ((reg >> 3) << 2) | (base >> 3));
+	if (rex != 0x40)
+	{
+		byte(rex);
+	}
+	if (opcode > 0xff)
+	{
+		byte((uint8_t)(opcode >> 8));
+	}
+	byte((uint8_t)opcode);
+	byte((uint8_t)(0x40 | ((reg & 7) << 3) | (base & 7)));
+	byte((uint8_t)disp);
+}
+
+void Emitter::adjust(Reg reg, int8_t value)
+{
+	byte((uint8_t)(0x48 | (reg >> 3)));
+	byte(0x83);
+	byte((uint8_t)(0xc0 | (reg & 7)));
+	byte((uint8_t)value);
+}
+
+void Emitter::zero(Reg reg)
+{
+	if (reg >= eR8)
+	{
+		byte(0x45);
+	}
+	byte(0x31);
+	byte((uint8_t)(0xc0 | ((reg & 7) << 3) | (reg & 7)));
+}
+
+void Emitter::set(Cond cond, Reg reg)
+{
+	if (reg >= eR8)
+	{
+		byte(0x41);
+	}
+	byte(0x0f);
+	byte((uint8_t)(cond + 0x10));
+	byte((uint8_t)(0xc0 | (reg & 7)));
+}
+
+size_t Emitter::jump(Cond cond)
+{
+	if (cond == eAlways)
+	{
+		byte(0xe9);
+	}
+	else
+	{
+		byte(0x0f);
+		byte((uint8_t)cond);
+	}
+	word(0);
+	return size() - 4;
+}
+
+void Emitter::bind(size_t at, size_t target)
+{
+	uint32_t offset = (uint32_t)(target - (at + 4));
+	for (int i = 0; i < 4; i++)
+	{
+		mCode[at + i] = (uint8_t)(offset >> (8 * i));
+	}
+}
+
+static uint32_t operandCount(uint8_t op)
+{
+	switch (op)
+	{
+	case eOpPop:
+	case eOpReturn:
+	case eOpEnter:
+		return 0;
+	case eOpLocal:
+	case eOpGlobal:
+	case eOpAdd:
+	case eOpSub:
+	case eOpMul:
+	case eOpNumEqual:
+	case eOpNullP:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static bool resumes(uint8_t op)
+{
+	return op == eOpCall || op == eOpTailCall || op == eOpEval || op >= eOpAdd;
+}
+
+// Inline paths for the instructions that dominate hot code. Each leaves the
+// jumps to take when the case is one it doesn't handle; the helper then runs
+// as it would have anyway. Type words are compared with the type_info the
+// item would have been made with, so a miss only costs the call.
+
+// pushes an inline constant while there is room
+static void pushInline(Emitter& out, const Item& item, std::vector<size_t>* slow)
+{
+	out.read(eRax, cStack, cTop);
+	out.compare(eRax, cStack, cLimit);
+	slow->push_back(out.jump(eEqual));
+	out.load(eR11, (uint64_t)(uintptr_t)&item.type());
+	out.write(eRax, 0, eR11);
+	out.load(eR11, item.bits());
+	out.write(eRax, cBits, eR11);
+	out.adjust(eRax, cItem);
+	out.write(cStack, cTop, eRax);
+}
+
+// pops an inline item, which has nothing to release
+static void popInline(Emitter& out, std::vector<size_t>* slow)
+{
+	out.read(eRax, cStack, cTop);
+	out.memory(0xf6, eRax, eRax, -cItem, false);	// test byte, imm8
+	out.byte((uint8_t)Item::cBoxed);
+	slow->push_back(out.jump(eNotEqual));
+	out.adjust(eRax, -cItem);
+	out.write(cStack, cTop, eRax);
+}
+
+// pops a fixnum, taking the false jumps if it is 0
+static void testInline(Emitter& out, std::vector<size_t>* slow, std::vector<size_t>* false_)
+{
+	out.read(eRax, cStack, cTop);
+	out.load(eR11, (uint64_t)(uintptr_t)&typeid(Number));
+	out.compare(eR11, eRax, -cItem);
+	slow->push_back(out.jump(eNotEqual));
+	out.adjust(eRax, -cItem);
+	out.write(cStack, cTop, eRax);
+	out.memory(0x83, eRdi, eRax, cBits, false);		// cmp dword, imm8
+	out.byte(0);
+	false_->push_back(out.jump(eEqual));
+}
+
+// Machine::primitive on fixnums and lists, while the chunk's epoch holds. A
+// sum or product past a fixnum overflows, and the helper makes the bignum.
+static void primitiveInline(Emitter& out, const Chunk& chunk, uint8_t op, std::vector<size_t>* slow)
+{
+	out.load(eRax, (uint64_t)(uintptr_t)&chunk.mEpoch);
+	out.memory(0x8b, eR10, eRax, 0, false);
+	out.load(eRax, (uint64_t)(uintptr_t)&gBindingEpoch);
+	out.memory(0x3b, eR10, eRax, 0, false);
+	slow->push_back(out.jump(eNotEqual));
+	out.read(eRax, cStack, cTop);
+
+	if (op == eOpNullP)
+	{
+		out.load(eR11, (uint64_t)(uintptr_t)&typeid(CellRef));
+		out.compare(eR11, eRax, -cItem);
+		slow->push_back(out.jump(eNotEqual));
+		out.zero(eR10);
+		out.memory(0x83, eRdi, eRax, cBits - cItem);	// cmp qword, imm8
+		out.byte(0);
+		out.set(eEqual, eR10);
+		out.load(eR11, (uint64_t)(uintptr_t)&typeid(Number));
+		out.write(eRax, -cItem, eR11);
+		out.write(eRax, cBits - cItem, eR10);
+		return;
+	}
+
+	out.load(eR11, (uint64_t)(uintptr_t)&typeid(Number));
+	out.compare(eR11, eRax, -cItem);
+	slow->push_back(out.jump(eNotEqual));
+	out.compare(eR11, eRax, -2 * cItem);
+	slow->push_back(out.jump(eNotEqual));
+	out.memory(0x8b, eR10, eRax, cBits - 2 * cItem, false);
+	switch (op)
+	{
+	case eOpAdd:
+		out.memory(0x03, eR10, eRax, cBits - cItem, false);
+		slow->push_back(out.jump(eOverflow));
+		break;
+	case eOpSub:
+		out.memory(0x2b, eR10, eRax, cBits - cItem, false);
+		slow->push_back(out.jump(eOverflow));
+		break;
+	case eOpMul:
+		out.memory(0x0faf, eR10, eRax, cBits - cItem, false);
+		slow->push_back(out.jump(eOverflow));
+		break;
+	default:
+		out.zero(eR11);
+		out.memory(0x3b, eR10, eRax, cBits - cItem, false);
+		out.set(eEqual, eR11);
+		out.move(eR10, eR11);
+		break;
+	}
+	// a 32-bit result clears the top half, as a Number's payload has it
+	out.write(eRax, cBits - 2 * cItem, eR10);
+	out.adjust(eRax, -cItem);
+	out.write(cStack, cTop, eRax);
+}
+
+// Ends an inline path: jumps over the helper call that follows, and points
+// the slow jumps at it. Answers the jump to bind past the call.
+static size_t slowPath(Emitter& out, std::vector<size_t>* slow)
+{
+	size_t over = out.jump(eAlways);
+	for (auto jump : *slow)
+	{
+		out.bind(jump, out.size());
+	}
+	slow->clear();
+	return over;
+}
+
+#endif
+
+NativeCodeRef jit(const Chunk& chunk)
+{
+#if JIT_X64
+	if (!gJit)
+	{
+		return NativeCodeRef();
+	}
+
+	const std::vector<uint8_t>& code = chunk.mCode;
+	const Item* k = chunk.mConstants.data();
+	auto native = std::make_shared<NativeCode>();
+	std::vector<uint32_t> entries(1, 0);
+	size_t sites = 0;
+	for (size_t pc = 0; pc < code.size();)
+	{
+		uint8_t op = code[pc];
+		pc += 1 + 2 * operandCount(op);
+		if (resumes(op))
+		{
+			entries.push_back((uint32_t)pc);
+		}
+		if (op == eOpEval || op >= eOpAdd)
+		{
+			sites++;
+		}
+	}
+	// the code points into the sites, so they mustn't move
+	native->mSites.reserve(sites);
+
+	Emitter out;
+	std::vector<size_t> offsets(code.size(), SIZE_MAX);
+	std::vector< std::pair<size_t, uint32_t> > jumps;
+	std::vector<size_t> exits;
+	std::vector<size_t> slow;
+	std::vector<size_t> false_;
+
+	// four pushes after the return address and 40 bytes more leave the stack
+	// aligned, and the 32 bytes at the bottom are the home for a Win64 callee's
+	// arguments
+	out.push(cContext);
+	out.push(cMachine);
+	out.push(cDepth);
+	out.push(cStack);
+	out.byte(0x48); out.byte(0x83); out.byte(0xec); out.byte(40);
+	out.move(cMachine, sArgs[0]);
+	out.call(jitStack);
+	out.move(cStack, eRax);
+	out.arg(0, cMachine);
+	out.call(jitContext);
+	out.move(cContext, eRax);
+	out.arg(0, cMachine);
+	out.call(jitDepth);
+	out.move(cDepth, eRax);
+	out.arg(0, cMachine);
+	out.call(jitPc);
+	for (auto entry : entries)
+	{
+		out.compare(entry);
+		jumps.push_back(std::make_pair(out.jump(eEqual), entry));
+	}
+
+	for (size_t pc = 0; pc < code.size();)
+	{
+		uint8_t op = code[pc];
+		uint32_t first = operandCount(op) > 0 ? code[pc + 1] | (code[pc + 2] << 8) : 0;
+		uint32_t second = operandCount(op) > 1 ? code[pc + 3] | (code[pc + 4] << 8) : 0;
+		uint32_t next = (uint32_t)(pc + 1 + 2 * operandCount(op));
+		size_t over = SIZE_MAX;
+		offsets[pc] = out.size();
+		out.arg(0, cMachine);
+
+		switch (op)
+		{
+		case eOpConst:
+			if (!k[first].boxed())
+			{
+				pushInline(out, k[first], &slow);
+				over = slowPath(out, &slow);
+			}
+			out.arg(1, &k[first]);
+			out.call(jitPush);
+			break;
+		case eOpLocal:
+		case eOpGlobal:
+			out.arg(1, cContext);
+			out.arg(2, (uint64_t)first);
+			out.arg(3, (uint64_t)k[second].get<Symbol>());
+			if (op == eOpLocal)
+			{
+				out.call(jitLocal);
+			}
+			else
+			{
+				out.call(jitGlobal);
+			}
+			break;
+		case eOpDynamic:
+		case eOpAssign:
+		case eOpBind:
+			out.arg(1, cContext);
+			out.arg(2, (uint64_t)k[first].get<Symbol>());
+			if (op == eOpDynamic)
+			{
+				out.call(jitDynamic);
+			}
+			else if (op == eOpAssign)
+			{
+				out.call(jitAssign);
+			}
+			else
+			{
+				out.call(jitBind);
+			}
+			break;
+		case eOpPop:
+			popInline(out, &slow);
+			over = slowPath(out, &slow);
+			out.call(jitPop);
+			break;
+		case eOpJump:
+			jumps.push_back(std::make_pair(out.jump(eAlways), first));
+			break;
+		case eOpJumpIfFalse:
+			testInline(out, &slow, &false_);
+			for (auto jump : false_)
+			{
+				jumps.push_back(std::make_pair(jump, first));
+			}
+			false_.clear();
+			over = slowPath(out, &slow);
+			out.call(jitTest);
+			out.test(eRax);
+			jumps.push_back(std::make_pair(out.jump(eEqual), first));
+			break;
+		case eOpClosure:
+			out.arg(1, cContext);
+			out.arg(2, &chunk.mLambdas[first]);
+			out.call(jitClosure);
+			break;
+		case eOpCall:
+			out.arg(1, (uint64_t)next);
+			out.arg(2, (uint64_t)first);
+			out.arg(3, cDepth);
+			out.call(jitCall);
+			out.compare(eOnward);
+			exits.push_back(out.jump(eNotEqual));
+			break;
+		case eOpTailCall:
+			out.arg(1, (uint64_t)next);
+			out.arg(2, (uint64_t)first);
+			out.call(jitTailCall);
+			exits.push_back(out.jump(eAlways));
+			break;
+		case eOpReturn:
+			out.call(jitReturn);
+			exits.push_back(out.jump(eAlways));
+			break;
+		case eOpEnter:
+			// a null frame is out of memory, and stops the machine as false does
+			out.call(jitEnter);
+			out.move(cContext, eRax);
+			out.test(eRax);
+			exits.push_back(out.jump(eEqual));
+			break;
+		case eOpLeave:
+			out.arg(1, (uint64_t)first);
+			out.call(jitLeave);
+			out.move(cContext, eRax);
+			break;
+		case eOpEval:
+		{
+			NativeCode::Site site = { next, 0, 0, &k[first], next < code.size() && code[next] == eOpReturn };
+			native->mSites.push_back(site);
+			out.arg(1, &native->mSites.back());
+			out.call(jitEval);
+			out.compare(eOnward);
+			exits.push_back(out.jump(eNotEqual));
+			break;
+		}
+		case eOpFail:
+			out.arg(1, &chunk.mErrors[first]);
+			out.call(jitFail);
+			out.clear();
+			exits.push_back(out.jump(eAlways));
+			break;
+		default:
+		{
+			NativeCode::Site site = { next, first, k[second].get<Symbol>(), nullptr, false };
+			native->mSites.push_back(site);
+			primitiveInline(out, chunk, op, &slow);
+			over = slowPath(out, &slow);
+			out.arg(1, cContext);
+			out.arg(2, &native->mSites.back());
+			out.arg(3, cDepth);
+			out.call(sPrimitives[op - eOpAdd]);
+			out.compare(eOnward);
+			exits.push_back(out.jump(eNotEqual));
+			break;
+		}
+		}
+		if (over != SIZE_MAX)
+		{
+			out.bind(over, out.size());
+		}
+		pc = next;
+	}
+
+	for (auto& jump : jumps)
+	{
+		assert(offsets[jump.second] != SIZE_MAX);
+		out.bind(jump.first, offsets[jump.second]);
+	}
+	for (auto exit : exits)
+	{
+		out.bind(exit, out.size());
+	}
+	out.byte(0x48); out.byte(0x83); out.byte(0xc4); out.byte(40);
+	out.pop(cStack);
+	out.pop(cDepth);
+	out.pop(cMachine);
+	out.pop(cContext);
+	out.byte(0xc3);
+
+	void* base = mapCode(out.size());
+	if (!base)
+	{
+		return NativeCodeRef();
+	}
+	memcpy(base, out.mCode.data(), out.size());
+	native->mBase = base;
+	native->mBytes = out.size();
+	if (!protectCode(base, out.size()))
+	{
+		return NativeCodeRef();
+	}
+	return native;
+#else
+	return NativeCodeRef();
+#endif
+}
+
+static const Chunk* hotChunk(Context* context, const char* name)
+{
+	Item proc = context->Lookup(gSymbolTable.GetSymbol(name));
+	const Proc* closure = proc.peek<Proc>();
+	const Chunk* cold = dynamic_cast<const Chunk*>(closure->mCode.get());
+	ChunkRef hot = cold->hot(closure->mClosure);
+	return hot.get();
+}
+
+// compiles the form and runs it to the end, through any steps it yields
+static Item runs(const char* text, Context* context)
+{
+	char* rest;
+	Item form = Parser::parseForm(context, text, &rest).mV;
+	Item answer;
+	yield([form, context, &answer]() {
+		runCompiled(form, context, [&answer](Item result) {
+			answer = result;
+		});
+	});
+	trampoline();
+	return answer;
+}
+
+void test_jit()
+{
+	Context* context = gMemory.getRoot();
+
+	// once hot, closures run as machine code: calls that push a frame come back
+	// in at the instruction after them, lets make and leave frames, closures
+	// are made, and what the machine can't do is evaluated
+	runs("(define (jfib n) (if (= n 0) 0 (if (= n 1) 1 (+ (jfib (- n 1)) (jfib (- n 2))))))", context);
+	assert(runs("(jfib 15)", context).get<Number>() == 610);
+	const bool native = JIT_X64 == 1;
+	const Chunk* fib = hotChunk(context, "jfib");
+	assert(fib && (fib->mCompiled != nullptr) == native && (fib->mNative != nullptr) == native);
+	assert(runs("(jfib 20)", context).get<Number>() == 6765);
+
+	runs("(define (jlet n) (let ((a n) (b 2)) (let* ((c (* a b))) (+ c ((lambda (x) (+ x 1)) a)))))", context);
+	runs("(define (jcc n) (+ 1 (callcc k (k n))))", context);
+	runs("(define (jbad n) (if (= n 0) (if) n))", context);
+	runs("(define (jadd a b) (+ a b))", context);
+	runs("(define (jlen l) (if (null? l) 0 (+ 1 (jlen (cdr l)))))", context);
+	runs("(define (jloop i) (if (= i 0) 0 (begin (jlet i) (jcc i) (jbad i) (jadd i i) (jlen '(1 2)) (jloop (- i 1)))))", context);
+	assert(runs("(jloop 100)", context).get<Number>() == 0);
+	for (auto name : { "jlet", "jcc", "jbad", "jadd", "jlen" })
+	{
+		const Chunk* hot = hotChunk(context, name);
+		assert(hot && (hot->mNative != nullptr) == native);
+	}
+	assert(runs("(jlet 5)", context).get<Number>() == 16);
+	assert(runs("(jcc 5)", context).get<Number>() == 6);
+	assert(runs("(jbad 5)", context).get<Number>() == 5);
+	// past the fixnums, an inlined primitive calls what its global is bound to
+	assert(runs("(jadd 1.5 2)", context).get<Flonum>() == 3.5);
+	// a sum past a fixnum overflows into the call, which makes the bignum
+	assert(runs("(= (jadd 2147483647 1) (* 65536 32768))", context).get<Number>() == 1);
+	assert(runs("(jlen '(1 2 3 4 5))", context).get<Number>() == 5);
+	assert(runs("(null? (jlen '()))", context).get<Number>() == 0);
+
+	// without the JIT the hot copy stays bytecode
+	gJit = false;
+	runs("(define (jinc n) (+ n 1))", context);
+	runs("(define (jcount i) (if (= i 0) 0 (begin (jinc i) (jcount (- i 1)))))", context);
+	assert(runs("(jcount 100)", context).get<Number>() == 0);
+	const Chunk* bytecode = hotChunk(context, "jinc");
+	assert(bytecode && !bytecode->mCompiled && !bytecode->mNative);
+	gJit = true;
+}
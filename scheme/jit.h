@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include "vm.h"
+
+// A template JIT for hot chunks. Each instruction becomes a call straight to
+// the machine member the bytecode loop would run, with its operands as
+// immediates; jumps become branches, and the places the machine may come back
+// in are entered through a compare on the frame's pc, as in a translated
+// chunk. Constants, pops, tests and the inlined primitives work on the
+// operand stack inline for fixnums and other unboxed items, and make the call
+// only for anything else. Only x86-64 code is generated. Elsewhere, or if the
+// pages can't be had, the chunk runs as bytecode.
+
+extern bool gJit;
+
+// Machine code for one chunk, in executable pages of its own.
+class NativeCode
+{
+public:
+	NativeCode();
+	~NativeCode();
+
+	CompiledChunk	entry() const { return (CompiledChunk)mBase; }
+	size_t			bytes() const { return mBytes; }
+
+	// what an instruction needs past its operands, addressed by the code
+	struct Site
+	{
+		uint32_t	mPc;			// where the machine comes back in after it
+		uint32_t	mDepth;
+		Symbol		mSymbol;
+		const Item*	mForm;
+		bool		mTail;
+	};
+
+private:
+	friend NativeCodeRef jit(const Chunk& chunk);
+
+	void*				mBase;
+	size_t				mBytes;
+	std::vector<Site>	mSites;
+
+	NativeCode(const NativeCode&);
+	NativeCode& operator=(const NativeCode&);
+};
+
+// null if no machine code can be made for the chunk here
+NativeCodeRef	jit(const Chunk& chunk);
+void			test_jit();
@@ -4,14 +4,14 @@
 
 uint32_t length(CellRef cell)
 {
-	if (cell == nullptr)
+	uint32_t count = 0;
+	while (cell != nullptr)
 	{
-		return 0;
-	}
-	else
-	{
-		return 1 + length(boost::any_cast<CellRef>(cell->mCdr));
+		count++;
+		cell = cell->next();
 	}
+
+	return count;
 }
 
 Item car(Item pair)
@@ -23,6 +23,6 @@ Item car(Item pair)
 Item cdr(Item pair)
 {
 	assert(pair.type() == eCell && boost::any_cast<CellRef>(pair) != nullptr);
-	return boost::any_cast<CellRef>(pair)->mCdr;
+	return boost::any_cast<CellRef>(pair)->cdr();
 }
 
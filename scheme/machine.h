@@ -0,0 +1,285 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "context.h"
+#include "memory.h"
+#include "numeric.h"
+#include "eval.h"
+#include "vm.h"
+
+// The machine's operand stack. Its ends are plain pointers at fixed offsets,
+// so machine code can push and pop inline items without calling out; only
+// the slots below mTop hold items.
+struct OperandStack
+{
+	Item*		mBase;
+	Item*		mTop;
+	Item*		mLimit;
+
+	OperandStack() : mBase(nullptr), mTop(nullptr), mLimit(nullptr) {}
+	~OperandStack();
+
+	size_t		size() const { return mTop - mBase; }
+	Item*		begin() const { return mBase; }
+	Item*		end() const { return mTop; }
+	Item&		operator[](size_t index) { return mBase[index]; }
+	Item&		back() { return mTop[-1]; }
+	void		push_back(const Item& item);
+	void		pop_back() { (--mTop)->~Item(); }
+	void		insert(Item* at, const Item& item);
+	void		resize(size_t count);
+	void		clear() { resize(0); }
+
+private:
+	void		grow();
+
+	OperandStack(const OperandStack&);
+	OperandStack& operator=(const OperandStack&);
+};
+
+inline void OperandStack::push_back(const Item& item)
+{
+	if (mTop == mLimit)
+	{
+		// the item may be on the stack itself
+		Item copy(item);
+		grow();
+		new (mTop++) Item(std::move(copy));
+		return;
+	}
+	new (mTop++) Item(item);
+}
+
+inline void OperandStack::resize(size_t count)
+{
+	while (size() > count)
+	{
+		pop_back();
+	}
+	while (size() < count)
+	{
+		push_back(Item());
+	}
+}
+
+// Runs chunks on an operand stack and a stack of frames, both contiguous, so a
+// call from compiled code to compiled code builds no continuation. Anything
+// else is called with a continuation that resumes the machine: straight away
+// if it answers before returning, from the trampoline if it yields first. A
+// machine is registered with the collector for as long as it lives, which is
+// as long as a continuation may resume it.
+//
+// Each instruction is a member, shared by the bytecode loop and by chunks
+// compiled to C++. Those that may leave the frame answer false when the
+// machine stops, to wait or because it has handed its continuation on.
+class Machine : public RootSet, public std::enable_shared_from_this<Machine>
+{
+public:
+	struct Frame
+	{
+		const Chunk*	mChunk;			// kept alive by the frame's context, or mTop
+		uint32_t		mPc;
+		Context*		mContext;
+		uint32_t		mBase;			// stack size when the call returns
+	};
+
+	Machine(const ChunkRef& chunk, Context* context, const Continuation& k);
+	~Machine();
+
+	void		run();
+	void		markRoots() override;
+
+	Frame&		frame() { return mFrames.back(); }
+	size_t		depth() const { return mFrames.size(); }
+	OperandStack&	stack() { return mStack; }
+
+	void		push(const Item& item) { mStack.push_back(item); }
+	void		local(Context* context, uint32_t depth, Symbol symbol);
+	void		global(Context* context, uint32_t depth, Symbol symbol);
+	void		dynamic(Context* context, Symbol symbol) { mStack.push_back(context->Lookup(symbol)); }
+	void		assign(Context* context, Symbol symbol) { context->Set(symbol, mStack.back()); }
+	void		pop() { mStack.pop_back(); }
+	// pops the top, answering whether it is true
+	bool		test();
+	void		closure(Context* context, const ChunkLambda& lambda);
+	bool		call(uint32_t count, bool tail);
+	bool		ret();
+	Context*	enter();
+	void		bind(Context* context, Symbol symbol);
+	Context*	leave(uint32_t count);
+	// in tail position in the outermost chunk, the form answers for the machine
+	bool		eval(const Item& form, bool tail = false);
+	void		fail(const std::string& error);
+	// an inlined primitive on the top of the stack; false if it has to be called
+	bool		primitive(Op op);
+	// calls what the global is bound to now on the top count items
+	bool		callGlobal(Context* context, uint32_t depth, Symbol symbol, uint32_t count);
+
+private:
+	ChunkRef			mTop;
+	OperandStack		mStack;
+	std::vector<Frame>	mFrames;
+	Continuation		mDone;
+	uint32_t			mTicket;		// which resumer may resume the machine
+	bool				mWaiting;
+	bool				mCalling;		// inside a call out, so an answer is picked up on return
+	bool				mAnswered;
+	Item				mAnswer;
+
+	Continuation		resumer();
+	void				resume(uint32_t ticket, const Item& value);
+	bool				await(uint32_t base);
+	// runs frames of compiled chunks until a bytecode one is on top
+	bool				compiled();
+
+	static Context*		outward(Context* context, uint32_t depth);
+	static Item			fixnum(int64_t value);
+};
+
+inline Context* Machine::outward(Context* context, uint32_t depth)
+{
+	while (context && depth > 0)
+	{
+		context = context->mOuter;
+		depth--;
+	}
+	return context;
+}
+
+inline Item Machine::fixnum(int64_t value)
+{
+	return value == (Number)value ? Item(Number(value)) : makeInteger(value);
+}
+
+inline void Machine::local(Context* context, uint32_t depth, Symbol symbol)
+{
+	Context* scope = outward(context, depth);
+	auto binding = scope->mBindings.find(symbol);
+	if (binding != scope->mBindings.end())
+	{
+		mStack.push_back(binding->second);
+	}
+	else
+	{
+		// a parameter that was never passed
+		mStack.push_back(scope->mOuter ? scope->mOuter->Lookup(symbol) : Item(Unspecified()));
+	}
+}
+
+inline void Machine::global(Context* context, uint32_t depth, Symbol symbol)
+{
+	Context* scope = outward(context, depth);
+	mStack.push_back(scope ? scope->Lookup(symbol) : Item(Unspecified()));
+}
+
+inline bool Machine::test()
+{
+	const Item& top = mStack.back();
+	bool result = top.type() != eNumber || top.get<Number>() != 0;
+	mStack.pop_back();
+	return result;
+}
+
+inline void Machine::closure(Context* context, const ChunkLambda& lambda)
+{
+	CellRef source = lambda.mSource;
+	if (!source)
+	{
+		// so the body's cell isn't collected while the one holding it is made
+		gMemory.reserveCells(context, 2);
+		source = gMemory.allocCell(context, lambda.mParams, Item(gMemory.allocCell(context, lambda.mBody)));
+	}
+	Proc proc(source, context);
+	proc.mCode = lambda.mChunk;
+	mStack.push_back(Item(proc));
+}
+
+inline bool Machine::ret()
+{
+	Item result = mStack.back();
+	uint32_t base = mFrames.back().mBase;
+	mFrames.pop_back();
+	mStack.resize(base);
+	if (mFrames.empty())
+	{
+		mDone(result);
+		return false;
+	}
+	mStack.push_back(result);
+	return true;
+}
+
+inline Context* Machine::enter()
+{
+	Frame& frame = mFrames.back();
+	Context* context = gMemory.allocContext(frame.mContext, frame.mContext);
+	if (!context)
+	{
+		fail("&out-of-memory");
+		return nullptr;
+	}
+	frame.mContext = context;
+	return context;
+}
+
+inline void Machine::bind(Context* context, Symbol symbol)
+{
+	context->Set(symbol, mStack.back());
+	mStack.pop_back();
+}
+
+inline Context* Machine::leave(uint32_t count)
+{
+	Frame& frame = mFrames.back();
+	frame.mContext = outward(frame.mContext, count);
+	return frame.mContext;
+}
+
+inline void Machine::fail(const std::string& error)
+{
+	raiseError(error, mDone);
+}
+
+inline bool Machine::primitive(Op op)
+{
+	if (mFrames.back().mChunk->mEpoch != gBindingEpoch)
+	{
+		return false;
+	}
+	if (op == eOpNullP)
+	{
+		const Item& top = mStack.back();
+		mStack.back() = Item(Number(top.type() == eCell && top.get<CellRef>() == nullptr ? 1 : 0));
+		return true;
+	}
+
+	Item* args = &mStack.back() - 1;
+	if (args[0].type() != eNumber || args[1].type() != eNumber)
+	{
+		return false;
+	}
+	int64_t a = args[0].get<Number>();
+	int64_t b = args[1].get<Number>();
+	switch (op)
+	{
+	case eOpAdd:		args[0] = fixnum(a + b); break;
+	case eOpSub:		args[0] = fixnum(a - b); break;
+	case eOpMul:		args[0] = fixnum(a * b); break;
+	default:			args[0] = Item(Number(a == b ? 1 : 0)); break;
+	}
+	mStack.pop_back();
+	return true;
+}
+
+// What the global is bound to now goes below the arguments, as for a call.
+inline bool Machine::callGlobal(Context* context, uint32_t depth, Symbol symbol, uint32_t count)
+{
+	Context* scope = outward(context, depth);
+	mStack.insert(mStack.end() - count, scope ? scope->Lookup(symbol) : Item(Unspecified()));
+	return call(count, false);
+}
@@ -1,38 +1,131 @@
 #include "stdafx.h"
 #include <stdint.h>
 #include <assert.h>
+#include <algorithm>
 #include "schemetypes.h"
 #include "context.h"
 #include "memory.h"
 
 Memory::Memory()
-	: mContexts( cMaxContexts )
-	, mCells( cMaxCells )
+	: mPagePolicy( pagePolicyFromEnvironment() )
+	, mCells( cMaxCells, cMaxHeapCells, mPagePolicy )
+	, mWideCells( cMaxWideCells, cMaxHeapCells, mPagePolicy )
+	, mContexts( cMaxContexts, cMaxHeapContexts, mPagePolicy )
+	, mF64Vectors( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mS32Vectors( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mVectors( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mStrings( cMaxStrings, cMaxHeapStrings, mPagePolicy )
+	, mPorts( cMaxStrings, cMaxHeapStrings, mPagePolicy )
+	, mRopes( cMaxStrings, cMaxHeapStrings, mPagePolicy )
+	, mBytevectors( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mHashTables( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mHamts( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mRecords( cMaxVectors, cMaxHeapCells, mPagePolicy )
+	, mBTrees( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mPriorityQueues( cMaxVectors, cMaxHeapVectors, mPagePolicy )
+	, mExternalBytes( 0 )
+	, mCollections( 0 )
 {
 	mRootContext = mContexts.alloc(nullptr);
 }
 
+HeldLink* HeldLink::sFirst = nullptr;
+
+HeldLink::HeldLink()
+	: mPrevious(nullptr)
+	, mNext(sFirst)
+{
+	if (sFirst)
+	{
+		sFirst->mPrevious = this;
+	}
+	sFirst = this;
+}
+
+HeldLink::HeldLink(const HeldLink&)
+	: mPrevious(nullptr)
+	, mNext(sFirst)
+{
+	if (sFirst)
+	{
+		sFirst->mPrevious = this;
+	}
+	sFirst = this;
+}
+
+HeldLink::~HeldLink()
+{
+	if (mPrevious)
+	{
+		mPrevious->mNext = mNext;
+	}
+	else
+	{
+		sFirst = mNext;
+	}
+	if (mNext)
+	{
+		mNext->mPrevious = mPrevious;
+	}
+}
+
+void HeldLink::markAll()
+{
+	for (HeldLink* held = sFirst; held; held = held->mNext)
+	{
+		held->mark();
+	}
+}
+
+void markHeld(const Item& item)
+{
+	markItem(item);
+}
+
+void markHeld(Context* context)
+{
+	if (context)
+	{
+		context->mark();
+	}
+}
+
+void markHeld(const std::vector<Item>& items)
+{
+	for (auto& item : items)
+	{
+		markItem(item);
+	}
+}
+
+// After a collection, grow the heap if less than a quarter of it is free so
+// that a nearly full heap doesn't collect on every allocation.
+template<typename T>
+void Memory::afterCollect(Freelist<T>& freelist)
+{
+	while (freelist.allocated() > freelist.capacity() * 3 / 4 && freelist.grow())
+	{}
+}
+
 Context* Memory::allocContext(Context* current, Context* outer)
 {
 	Context* context = mContexts.alloc( outer);
 	if (!context)
 	{
 		gc(current);
-		Context* context = mContexts.alloc( outer);
-		assert(context);
+		context = mContexts.alloc( outer);
 	}
 
 	return context;
 }
 
-Context* Memory::allocContext(Context* current, Item variables, Cell* params, Context* outer)
+Context* Memory::allocContext(Context* current, Item variables, const Item* values, uint32_t count, Item rest, Context* outer)
 {
-	Context* context = mContexts.alloc( variables, params, outer );
+	Context* context = mContexts.alloc(variables, values, count, rest, outer);
 	if (!context)
 	{
 		gc(current);
-		Context* context = mContexts.alloc(variables, params, outer);
-		assert(context);
+		context = mContexts.alloc(variables, values, count, rest, outer);
 	}
 
 	return context;
@@ -40,34 +133,399 @@ Context* Memory::allocContext(Context* current, Item variables, Cell* params, Co
 
 Cell* Memory::allocCell(Context* current, Item car, Item cdr )
 {
-	Cell* cell = mCells.alloc(car,cdr);
+	Cell* cell = takeCell(car, cdr);
 	if (!cell)
 	{
 		gc(current);
-		cell = mCells.alloc(car,cdr);
+		cell = takeCell(car, cdr);
 		assert(cell);
 	}
 
 	return cell;
 }
 
+// The free list is in address order, so its head is where the cell would go.
+Cell* Memory::takeCell(Item car, Item cdr)
+{
+	if (mCells.mFreeList && Cell::code(mCells.mFreeList, cdr) != eCdrAside)
+	{
+		return mCells.alloc(car, cdr);
+	}
+	return mWideCells.alloc(car, cdr);
+}
+
+// Returns the existing cell for an identical car/cdr pair, so equal structure
+// built only from hcons is shared and can be compared by pointer. Pairs whose
+// parts can't be hashed get a fresh, ordinary cell.
+Cell* Memory::hcons(Context* current, Item car, Item cdr)
+{
+	if (!HashConsTable::hashable(car) || !HashConsTable::hashable(cdr))
+	{
+		return allocCell(current, car, cdr);
+	}
+
+	Cell* cell = mHashCons.find(car, cdr);
+	if (!cell)
+	{
+		cell = allocCell(current, car, cdr);
+		cell->mHashConsed = true;
+		mHashCons.insert(cell);
+	}
+
+	return cell;
+}
+
+// Collects once enough memory outside the segments has been allocated since
+// the last collection, which the freelists alone wouldn't notice.
+void Memory::chargeExternal(Context* current, size_t bytes)
+{
+	mExternalBytes += bytes;
+	if (mExternalBytes > cExternalBytesPerCollection)
+	{
+		gc(current);
+	}
+}
+
+template<typename T>
+NumVector<T>* Memory::allocNumVector(Freelist< NumVector<T> >& freelist, Context* current, uint32_t length)
+{
+	chargeExternal(current, length * sizeof(T));
+
+	NumVector<T>* vector = freelist.alloc(length);
+	if (!vector)
+	{
+		gc(current);
+		vector = freelist.alloc(length);
+		assert(vector);
+	}
+
+	return vector;
+}
+
+F64Vector* Memory::allocF64Vector(Context* current, uint32_t length)
+{
+	return allocNumVector(mF64Vectors, current, length);
+}
+
+S32Vector* Memory::allocS32Vector(Context* current, uint32_t length)
+{
+	return allocNumVector(mS32Vectors, current, length);
+}
+
+VectorRef Memory::allocVector(Context* current, uint32_t length, Item fill)
+{
+	chargeExternal(current, length * sizeof(Item));
+
+	VectorRef vector = mVectors.alloc(length, fill);
+	if (!vector)
+	{
+		gc(current);
+		vector = mVectors.alloc(length, fill);
+		assert(vector);
+	}
+
+	return vector;
+}
+
+StringRef Memory::allocString(Context* current, const std::string& text)
+{
+	chargeExternal(current, text.size());
+	StringBuffer buffer = std::make_shared<const std::string>(text);
+	uint32_t length = String::countCodePoints(text.data(), text.size());
+
+	StringRef string = mStrings.alloc(buffer, 0, (uint32_t)text.size(), length);
+	if (!string)
+	{
+		gc(current);
+		string = mStrings.alloc(buffer, 0, (uint32_t)text.size(), length);
+		assert(string);
+	}
+
+	return string;
+}
+
+// A slice of an existing buffer; only the slot is new.
+StringRef Memory::allocString(Context* current, StringBuffer buffer, uint32_t offset, uint32_t bytes, uint32_t length)
+{
+	StringRef string = mStrings.alloc(buffer, offset, bytes, length);
+	if (!string)
+	{
+		gc(current);
+		string = mStrings.alloc(buffer, offset, bytes, length);
+		assert(string);
+	}
+
+	return string;
+}
+
+PortRef Memory::allocPort(Context* current)
+{
+	PortRef port = mPorts.alloc();
+	if (!port)
+	{
+		gc(current);
+		port = mPorts.alloc();
+		assert(port);
+	}
+
+	return port;
+}
+
+PortRef Memory::allocPort(Context* current, StringRef input)
+{
+	StringBuffer buffer = input->mBuffer;
+	uint32_t begin = input->mOffset, end = input->mOffset + input->mBytes;
+
+	PortRef port = mPorts.alloc(buffer, begin, end);
+	if (!port)
+	{
+		gc(current);
+		port = mPorts.alloc(buffer, begin, end);
+		assert(port);
+	}
+
+	return port;
+}
+
+RopeRef Memory::allocRope(Context* current, RopeTree tree)
+{
+	RopeRef rope = mRopes.alloc(tree);
+	if (!rope)
+	{
+		gc(current);
+		rope = mRopes.alloc(tree);
+		assert(rope);
+	}
+
+	return rope;
+}
+
+BytevectorRef Memory::allocBytevector(Context* current, size_t length)
+{
+	chargeExternal(current, length);
+	return allocBytevector(current, std::make_shared<ByteStore>(length), 0, length);
+}
+
+// A window onto an existing store; only the slot is new.
+BytevectorRef Memory::allocBytevector(Context* current, ByteStorePtr store, size_t offset, size_t length)
+{
+	BytevectorRef bytevector = mBytevectors.alloc(store, offset, length);
+	if (!bytevector)
+	{
+		gc(current);
+		bytevector = mBytevectors.alloc(store, offset, length);
+		assert(bytevector);
+	}
+
+	return bytevector;
+}
+
+BytevectorRef Memory::mapBytevector(Context* current, const char* path)
+{
+	// unmap whatever dead bytevectors still hold before taking more address space
+	if (ByteStore::sMappedBytes > cMappedBytesPerCollection)
+	{
+		gc(current);
+	}
+
+	const void* view;
+	size_t bytes;
+	if (!mapFile(path, &view, &bytes))
+	{
+		return nullptr;
+	}
+	if (!view)
+	{
+		return allocBytevector(current, 0);
+	}
+	return allocBytevector(current, std::make_shared<ByteStore>(view, bytes), 0, bytes);
+}
+
+HashTableRef Memory::allocHashTable(Context* current, HashKind kind, uint32_t capacity)
+{
+	chargeExternal(current, capacity * (2 * sizeof(Item) + sizeof(uint32_t)));
+
+	HashTableRef table = mHashTables.alloc(kind, capacity);
+	if (!table)
+	{
+		gc(current);
+		table = mHashTables.alloc(kind, capacity);
+		assert(table);
+	}
+
+	return table;
+}
+
+HamtRef Memory::allocHamt(Context* current)
+{
+	HamtRef hamt = mHamts.alloc();
+	if (!hamt)
+	{
+		gc(current);
+		hamt = mHamts.alloc();
+		assert(hamt);
+	}
+
+	return hamt;
+}
+
+RecordRef Memory::allocRecord(Context* current, RecordTypeRef type)
+{
+	chargeExternal(current, type->mFields.size() * sizeof(Item));
+
+	RecordRef record = mRecords.alloc(type);
+	if (!record)
+	{
+		gc(current);
+		record = mRecords.alloc(type);
+		assert(record);
+	}
+
+	return record;
+}
+
+BTreeRef Memory::allocBTree(Context* current)
+{
+	BTreeRef tree = mBTrees.alloc();
+	if (!tree)
+	{
+		gc(current);
+		tree = mBTrees.alloc();
+		assert(tree);
+	}
+
+	return tree;
+}
+
+PriorityQueueRef Memory::allocPriorityQueue(Context* current)
+{
+	PriorityQueueRef queue = mPriorityQueues.alloc();
+	if (!queue)
+	{
+		gc(current);
+		queue = mPriorityQueues.alloc();
+		assert(queue);
+	}
+
+	return queue;
+}
+
+void Memory::removeRootSet(RootSet* roots)
+{
+	auto found = std::find(mRootSets.begin(), mRootSets.end(), roots);
+	assert(found != mRootSets.end());
+	mRootSets.erase(found);
+}
+
+// Either heap may be asked for every cell, so both get the room.
+void Memory::reserveCells(Context* current, uint32_t count)
+{
+	if (mCells.capacity() - mCells.allocated() >= count && mWideCells.capacity() - mWideCells.allocated() >= count)
+	{
+		return;
+	}
+
+	gc(current);
+	while (mCells.capacity() - mCells.allocated() < count && mCells.grow())
+	{}
+	while (mWideCells.capacity() - mWideCells.allocated() < count && mWideCells.grow())
+	{}
+	assert(mCells.capacity() - mCells.allocated() >= count);
+	assert(mWideCells.capacity() - mWideCells.allocated() >= count);
+}
+
 void Memory::gc(Context* context)
 {
-	uint32_t cellcount		= mCells.markUnreachable();
-	uint32_t contextcount	= mContexts.markUnreachable();
+	uint32_t cellcount		= mCells.allocated() + mWideCells.allocated();
+	uint32_t contextcount	= mContexts.allocated();
 
 	if (gVerboseGC)
 	{
 		printf("considering %d cells and %d contexts during GC\n", cellcount, contextcount);
 	}
 
+	mCollections++;
 	context->mark();
+	for (auto& root : mRoots)
+	{
+		markItem(root);
+	}
+	for (auto roots : mRootSets)
+	{
+		roots->markRoots();
+	}
+	HeldLink::markAll();
+	uint32_t unconsed = mHashCons.sweep();
 
-	uint32_t gc_cellcount	 = mCells.collect();
+	uint32_t gc_cellcount	 = mCells.collect() + mWideCells.collect();
 	uint32_t gc_contextcount = mContexts.collect();
+	uint32_t gc_vectorcount	 = mF64Vectors.collect() + mS32Vectors.collect() + mVectors.collect() + mHashTables.collect() + mHamts.collect() + mRecords.collect() + mBTrees.collect() + mPriorityQueues.collect();
+	uint32_t gc_stringcount	 = mStrings.collect() + mPorts.collect() + mRopes.collect();
+	uint32_t gc_bytevectorcount = mBytevectors.collect();
+	mExternalBytes = 0;
+
+	afterCollect(mCells);
+	afterCollect(mWideCells);
+	afterCollect(mContexts);
+	afterCollect(mF64Vectors);
+	afterCollect(mS32Vectors);
+	afterCollect(mVectors);
+	afterCollect(mStrings);
+	afterCollect(mPorts);
+	afterCollect(mRopes);
+	afterCollect(mBytevectors);
+	afterCollect(mHashTables);
+	afterCollect(mHamts);
+	afterCollect(mRecords);
+	afterCollect(mBTrees);
+	afterCollect(mPriorityQueues);
 
 	if (gVerboseGC)
 	{
-		printf("return %d cells and %d contexts to the free lists\n", gc_cellcount, gc_contextcount);
+		printf("return %d cells, %d contexts, %d vectors, maps or records and %d strings, ports or ropes to the free lists\n", gc_cellcount, gc_contextcount, gc_vectorcount, gc_stringcount);
+		printf("return %d bytevectors, %llu bytes of mapped files still live\n", gc_bytevectorcount, (unsigned long long)ByteStore::sMappedBytes);
+		printf("dropped %d of %d hash-consed cells\n", unconsed, (uint32_t)(mHashCons.size() + unconsed));
+		printf("heap capacity %d cells and %d contexts on %s pages\n", (uint32_t)(mCells.capacity() + mWideCells.capacity()), (uint32_t)mContexts.capacity(), pagePolicyName(mPagePolicy));
+	}
+}
+
+void Memory::test()
+{
+	// one segment to start with, room to grow to three
+	size_t perSegment = cSegmentBytes / sizeof(Cell);
+	Freelist<Cell> cells(1, perSegment * 3);
+	assert(cells.capacity() == perSegment);
+
+	CellRef list = nullptr;
+	for (size_t i = 0; i < perSegment * 2; i++)
+	{
+		Cell* cell = cells.alloc(Item(Number(i)), Item(list));
+		if (!cell)
+		{
+			bool grown = cells.grow();
+			assert(grown);
+			cell = cells.alloc(Item(Number(i)), Item(list));
+		}
+		list = cell;
 	}
+	assert(cells.capacity() == perSegment * 2);
+	assert(cells.allocated() == perSegment * 2);
+
+	// keep the newest cell only: it lives in the grown segment, which must survive
+	list->setCdr(Item((CellRef)nullptr));
+	list->mark();
+	uint32_t collected = cells.collect();
+	assert(collected == perSegment * 2 - 1);
+	assert(cells.allocated() == 1);
+	assert(cells.capacity() == perSegment * 2);
+	assert(boost::any_cast<Number>(list->mCar) == Number(perSegment * 2 - 1));
+
+	// nothing reachable: the grown segment is discarded, then recommitted on demand
+	collected = cells.collect();
+	assert(collected == 1);
+	assert(cells.capacity() == perSegment);
+	bool grown = cells.grow();
+	assert(grown);
+	assert(cells.capacity() == perSegment * 2);
+	assert(cells.allocated() == 0);
 }
@@ -1,27 +1,171 @@
 #pragma once
 
 #include <stdint.h>
+#include <array>
 #include <memory>
+#include <vector>
 #include "schemetypes.h"
 #include "context.h"
 #include "collectable.h"
+#include "pages.h"
+#include "hashcons.h"
+#include "numvector.h"
+#include "vector.h"
+#include "schemestring.h"
+#include "rope.h"
+#include "bytevector.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "record.h"
+#include "btree.h"
+#include "pqueue.h"
+
+// Items held outside the heap, on a machine's stack say, which a collection
+// marks for as long as they are registered.
+struct RootSet
+{
+	virtual ~RootSet() {}
+	virtual void markRoots() = 0;
+};
+
+// Something a continuation captured: a value, a frame or an argument array.
+// The collector can't look inside a std::function, so every live copy links
+// itself into one list that each collection marks.
+class HeldLink
+{
+public:
+	static void markAll();
+protected:
+	HeldLink();
+	HeldLink(const HeldLink&);
+	HeldLink& operator=(const HeldLink&) { return *this; }
+	virtual ~HeldLink();
+	virtual void mark() const = 0;
+private:
+	HeldLink*			mPrevious;
+	HeldLink*			mNext;
+	static HeldLink*	sFirst;
+};
+
+void markHeld(const Item& item);
+void markHeld(Context* context);
+void markHeld(const std::vector<Item>& items);
+template<size_t N>
+void markHeld(const std::array<Item, N>& items)
+{
+	for (auto& item : items)
+	{
+		markItem(item);
+	}
+}
+
+template<typename T>
+class Held : public HeldLink
+{
+public:
+	Held() : mValue() {}
+	explicit Held(const T& value) : mValue(value) {}
+
+	T&			get() { return mValue; }
+	const T&	get() const { return mValue; }
+private:
+	T	mValue;
+
+	void mark() const override { markHeld(mValue); }
+};
 
 class Memory
 {
 	const static uint32_t cMaxCells = 1000000;
+	// most conses code their cdr, so fewer cells start out wide
+	const static uint32_t cMaxWideCells = cMaxCells / 4;
 	const static uint32_t cMaxContexts = 1000;
+	const static uint32_t cMaxHeapCells = sizeof(void*) == 8 ? 64 * 1000000 : 16 * 1000000;
+	const static uint32_t cMaxHeapContexts = sizeof(void*) == 8 ? 16 * 1000000 : 1000000;
+	const static uint32_t cMaxVectors = 1000;
+	const static uint32_t cMaxHeapVectors = 1000000;
+	const static uint32_t cMaxStrings = 1000;
+	const static uint32_t cMaxHeapStrings = 4000000;
+	// vector elements and string text live outside the segments, so their bytes
+	// also trigger a collection
+	const static size_t   cExternalBytesPerCollection = 64 * 1024 * 1024;
+	// mapped files cost address space rather than memory, so dead mappings are
+	// only collected once this much of it is held
+	const static size_t   cMappedBytesPerCollection = (size_t)1 << (sizeof(void*) == 8 ? 34 : 28);
 
+	PagePolicy				mPagePolicy;
+	// before the heaps, so it outlives a machine that only goes with them
+	std::vector<RootSet*>	mRootSets;
 	Freelist<Cell>			mCells;
+	Freelist<WideCell>		mWideCells;
 	Freelist<Context>		mContexts;
 	Context*				mRootContext;
+	HashConsTable			mHashCons;
+	Freelist<F64Vector>		mF64Vectors;
+	Freelist<S32Vector>		mS32Vectors;
+	Freelist<Vector>		mVectors;
+	Freelist<String>		mStrings;
+	Freelist<Port>			mPorts;
+	Freelist<Rope>			mRopes;
+	Freelist<Bytevector>	mBytevectors;
+	Freelist<HashTable>		mHashTables;
+	Freelist<Hamt>			mHamts;
+	Freelist<Record>		mRecords;
+	Freelist<BTree>			mBTrees;
+	Freelist<PriorityQueue>	mPriorityQueues;
+	size_t					mExternalBytes;
+	std::vector<Item>		mRoots;
+	uint32_t				mCollections;
 public:
 	Memory();
+	// nullptr once the context heap is full and can't grow, which deep enough
+	// recursion reaches; the caller raises &out-of-memory
 	Context* allocContext(Context* current, Context* outer);
-	Context* allocContext(Context* current, Item variables, Cell* params, Context* outer);
+	Context* allocContext(Context* current, Item variables, const Item* values, uint32_t count, Item rest, Context* outer);
+	// a Cell if the one it would take can code the cdr, a WideCell otherwise
 	Cell*	 allocCell(Context* current, Item car, Item cdr = (CellRef)nullptr);
+	Cell*	 hcons(Context* current, Item car, Item cdr = (CellRef)nullptr);
+	F64Vector* allocF64Vector(Context* current, uint32_t length);
+	S32Vector* allocS32Vector(Context* current, uint32_t length);
+	VectorRef  allocVector(Context* current, uint32_t length, Item fill = Unspecified());
+	StringRef  allocString(Context* current, const std::string& text);
+	StringRef  allocString(Context* current, StringBuffer buffer, uint32_t offset, uint32_t bytes, uint32_t length);
+	PortRef	   allocPort(Context* current);
+	PortRef	   allocPort(Context* current, StringRef input);
+	RopeRef	   allocRope(Context* current, RopeTree tree);
+	BytevectorRef allocBytevector(Context* current, size_t length);
+	BytevectorRef allocBytevector(Context* current, ByteStorePtr store, size_t offset, size_t length);
+	// nullptr if the file can't be mapped
+	BytevectorRef mapBytevector(Context* current, const char* path);
+	HashTableRef  allocHashTable(Context* current, HashKind kind, uint32_t capacity);
+	HamtRef		  allocHamt(Context* current);
+	RecordRef	  allocRecord(Context* current, RecordTypeRef type);
+	BTreeRef	  allocBTree(Context* current);
+	PriorityQueueRef allocPriorityQueue(Context* current);
 	void     gc(Context* context);
+	// Makes sure 'count' cells can be allocated without a collection, so a
+	// native can build a list that nothing refers to yet.
+	void	 reserveCells(Context* current, uint32_t count);
+	// Items only a native holds survive a collection while pushed here.
+	void	 pushRoot(const Item& item) { mRoots.push_back(item); }
+	void	 popRoots(size_t count) { mRoots.resize(mRoots.size() - count); }
+	void	 addRootSet(RootSet* roots) { mRootSets.push_back(roots); }
+	void	 removeRootSet(RootSet* roots);
 	Context* getRoot() { return mRootContext;  }
+	// Caps how far the context heap grows, so a test can reach the limit soon.
+	void	 limitContexts(size_t count = cMaxHeapContexts) { mContexts.setMaxSize(count); }
+	// counts collections, so structure shared between objects can tell whether
+	// this one has already marked it
+	uint32_t collections() const { return mCollections; }
+	// what the cells in use take up
+	size_t	 cellBytes() const { return mCells.allocated() * sizeof(Cell) + mWideCells.allocated() * sizeof(WideCell); }
+
+	static void test();
 private:
-	//uint32_t mark(ICollectable* collectables);
-	//uint32_t collect(ICollectable** alloclist, ICollectable** freelist);
+	template<typename T>
+	void	 afterCollect(Freelist<T>& freelist);
+	Cell*	 takeCell(Item car, Item cdr);
+	void	 chargeExternal(Context* current, size_t bytes);
+	template<typename T>
+	NumVector<T>* allocNumVector(Freelist< NumVector<T> >& freelist, Context* current, uint32_t length);
 };
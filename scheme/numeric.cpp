@@ -0,0 +1,314 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sstream>
+#include "numeric.h"
+
+const type_info& eBignum = typeid(Bignum);
+const type_info& eFlonum = typeid(Flonum);
+
+static bool fits(int64_t value)
+{
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+bool isNumber(const Item& item)
+{
+	return item.type() == eNumber || item.type() == eFlonum || item.type() == eBignum;
+}
+
+bool isExact(const Item& number)
+{
+	return number.type() != eFlonum;
+}
+
+Flonum toFlonum(const Item& number)
+{
+	if (number.type() == eFlonum)
+	{
+		return boost::any_cast<Flonum>(number);
+	}
+	else if (number.type() == eNumber)
+	{
+		return boost::any_cast<Number>(number);
+	}
+	return boost::any_cast<Bignum>(number).toDouble();
+}
+
+static bool inexact(const Item& first, const Item& second)
+{
+	return first.type() == eFlonum || second.type() == eFlonum;
+}
+
+Item makeInteger(int64_t value)
+{
+	if (fits(value))
+	{
+		return Item(Number(value));
+	}
+	return Item(Bignum(value));
+}
+
+Item makeInteger(const Bignum& value)
+{
+	if (value.fitsInt32())
+	{
+		return Item(Number(value.toInt32()));
+	}
+	return Item(value);
+}
+
+Bignum toBignum(const Item& number)
+{
+	if (number.type() == eNumber)
+	{
+		return Bignum(boost::any_cast<Number>(number));
+	}
+	return boost::any_cast<Bignum>(number);
+}
+
+Item numAdd(const Item& first, const Item& second)
+{
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		return makeInteger((int64_t)boost::any_cast<Number>(first) + boost::any_cast<Number>(second));
+	}
+	else if (inexact(first, second))
+	{
+		return Item(toFlonum(first) + toFlonum(second));
+	}
+	return makeInteger(Bignum::add(toBignum(first), toBignum(second)));
+}
+
+Item numSub(const Item& first, const Item& second)
+{
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		return makeInteger((int64_t)boost::any_cast<Number>(first) - boost::any_cast<Number>(second));
+	}
+	else if (inexact(first, second))
+	{
+		return Item(toFlonum(first) - toFlonum(second));
+	}
+	return makeInteger(Bignum::sub(toBignum(first), toBignum(second)));
+}
+
+Item numMul(const Item& first, const Item& second)
+{
+	// a 32x32 bit product can't overflow 64 bits
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		return makeInteger((int64_t)boost::any_cast<Number>(first) * boost::any_cast<Number>(second));
+	}
+	else if (inexact(first, second))
+	{
+		return Item(toFlonum(first) * toFlonum(second));
+	}
+	return makeInteger(Bignum::mul(toBignum(first), toBignum(second)));
+}
+
+Item numQuotient(const Item& first, const Item& second)
+{
+	// INT32_MIN / -1 is the one fixnum quotient that overflows; widening catches it
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		return makeInteger((int64_t)boost::any_cast<Number>(first) / boost::any_cast<Number>(second));
+	}
+	else if (inexact(first, second))
+	{
+		return Item(toFlonum(first) / toFlonum(second));
+	}
+	Bignum quotient(0);
+	Bignum::divmod(toBignum(first), toBignum(second), &quotient, nullptr);
+	return makeInteger(quotient);
+}
+
+Item numRemainder(const Item& first, const Item& second)
+{
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		return makeInteger((int64_t)boost::any_cast<Number>(first) % boost::any_cast<Number>(second));
+	}
+	else if (inexact(first, second))
+	{
+		return Item(fmod(toFlonum(first), toFlonum(second)));
+	}
+	Bignum remainder(0);
+	Bignum::divmod(toBignum(first), toBignum(second), nullptr, &remainder);
+	return makeInteger(remainder);
+}
+
+bool numZero(const Item& number)
+{
+	return number.type() == eNumber && boost::any_cast<Number>(number) == 0;
+}
+
+int numCompare(const Item& first, const Item& second)
+{
+	if (first.type() == eNumber && second.type() == eNumber)
+	{
+		Number a = boost::any_cast<Number>(first), b = boost::any_cast<Number>(second);
+		return a < b ? -1 : (a > b ? 1 : 0);
+	}
+	else if (inexact(first, second))
+	{
+		Flonum a = toFlonum(first), b = toFlonum(second);
+		return a < b ? -1 : (a > b ? 1 : 0);
+	}
+	return Bignum::compare(toBignum(first), toBignum(second));
+}
+
+// numeric =, which unlike numCompare is false whenever a NaN is involved
+bool numEqual(const Item& first, const Item& second)
+{
+	if (inexact(first, second))
+	{
+		return toFlonum(first) == toFlonum(second);
+	}
+	return numCompare(first, second) == 0;
+}
+
+std::string numToString(const Item& number)
+{
+	if (number.type() == eNumber)
+	{
+		return std::to_string((long long)boost::any_cast<Number>(number));
+	}
+	else if (number.type() == eFlonum)
+	{
+		return flonumToString(boost::any_cast<Flonum>(number));
+	}
+	return boost::any_cast<Bignum>(number).toString();
+}
+
+static bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// Decimal literals with a point or an exponent. Up to 18 significant digits
+// are gathered into an integer; when that and the power of ten are both exact
+// doubles a single multiply or divide is correctly rounded (Clinger's fast
+// path), anything else goes to strtod.
+Maybe<Flonum> parseFlonum(const char* cs, char** rest)
+{
+	static const double cPowersOfTen[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	const char* p = cs;
+	bool negative = (*p == '-');
+	if (negative)
+	{
+		p++;
+	}
+	if (!isDigit(*p))
+	{
+		return Maybe<Flonum>();
+	}
+
+	uint64_t mantissa = 0;
+	int32_t exponent = 0;
+	bool truncated = false;
+	for (; isDigit(*p); p++)
+	{
+		if (mantissa < 100000000000000000ull)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+		else
+		{
+			truncated = true;
+			exponent++;
+		}
+	}
+
+	bool point = (*p == '.' && isDigit(p[1]));
+	if (point)
+	{
+		for (p++; isDigit(*p); p++)
+		{
+			if (mantissa < 100000000000000000ull)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+			else
+			{
+				truncated = true;
+			}
+		}
+	}
+
+	bool scaled = (*p == 'e' || *p == 'E') && (isDigit(p[1]) || ((p[1] == '+' || p[1] == '-') && isDigit(p[2])));
+	if (scaled)
+	{
+		p++;
+		bool negativeExponent = (*p == '-');
+		if (*p == '+' || *p == '-')
+		{
+			p++;
+		}
+		int32_t written = 0;
+		for (; isDigit(*p); p++)
+		{
+			if (written < 100000)
+			{
+				written = written * 10 + (*p - '0');
+			}
+		}
+		exponent += negativeExponent ? -written : written;
+	}
+
+	if (!point && !scaled)
+	{
+		return Maybe<Flonum>();
+	}
+	*rest = (char*)p;
+
+	Flonum value;
+	if (!truncated && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+	{
+		value = exponent < 0 ? (Flonum)mantissa / cPowersOfTen[-exponent] : (Flonum)mantissa * cPowersOfTen[exponent];
+		return Maybe<Flonum>(negative ? -value : value);
+	}
+
+	value = strtod(std::string(cs, p).c_str(), nullptr);
+	return Maybe<Flonum>(value);
+}
+
+// Shortest decimal that reads back as the same double. A double that round
+// trips at all within 15 significant digits prints at its shortest with
+// trailing zeros removed, so at most three widths are tried.
+std::string flonumToString(Flonum value)
+{
+	if (value != value)
+	{
+		return "+nan.0";
+	}
+	else if (value == HUGE_VAL || value == -HUGE_VAL)
+	{
+		return value > 0 ? "+inf.0" : "-inf.0";
+	}
+
+	std::string text;
+	for (int precision = 15; precision <= 17; precision++)
+	{
+		std::ostringstream stream;
+		stream.precision(precision);
+		stream << value;
+		text = stream.str();
+		if (strtod(text.c_str(), nullptr) == value)
+		{
+			break;
+		}
+	}
+
+	if (text.find_first_of(".e") == std::string::npos)
+	{
+		text += ".0";
+	}
+	return text;
+}
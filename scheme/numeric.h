@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include "schemetypes.h"
+#include "bignum.h"
+#include "maybe.h"
+
+typedef double Flonum;
+
+extern const type_info& eBignum;
+extern const type_info& eFlonum;
+
+// Integers are fixnums (Number) whenever they fit and Bignums only when they
+// don't; every operation here returns a normalised result. The fixnum case is
+// tried first and costs one widening operation and a range check. Flonums are
+// IEEE doubles held inline in the Item; any flonum operand makes the result a
+// flonum, and the all-flonum case is tried straight after the fixnum one.
+bool		isNumber(const Item& item);
+bool		isExact(const Item& number);
+Flonum		toFlonum(const Item& number);
+Item		makeInteger(int64_t value);
+Item		makeInteger(const Bignum& value);
+Bignum		toBignum(const Item& number);
+
+Item		numAdd(const Item& first, const Item& second);
+Item		numSub(const Item& first, const Item& second);
+Item		numMul(const Item& first, const Item& second);
+Item		numQuotient(const Item& first, const Item& second);
+Item		numRemainder(const Item& first, const Item& second);
+bool		numZero(const Item& number);
+int			numCompare(const Item& first, const Item& second);
+bool		numEqual(const Item& first, const Item& second);
+std::string	numToString(const Item& number);
+
+Maybe<Flonum>	parseFlonum(const char* cs, char** rest);
+std::string		flonumToString(Flonum value);
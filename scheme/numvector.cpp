@@ -0,0 +1,1218 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+#include "numvector.h"
+#include "numeric.h"
+#include "memory.h"
+#include "list.h"
+#include "eval.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SCHEME_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+const type_info& eF64Vector = typeid(F64Vector*);
+const type_info& eS32Vector = typeid(S32Vector*);
+
+const static size_t cVectorAlignment = 32;
+
+void* allocAligned(size_t bytes)
+{
+	if (bytes == 0)
+	{
+		return nullptr;
+	}
+#if defined(_WIN32)
+	void* block = _aligned_malloc(bytes, cVectorAlignment);
+#else
+	void* block = nullptr;
+	if (posix_memalign(&block, cVectorAlignment, bytes) != 0)
+	{
+		block = nullptr;
+	}
+#endif
+	assert(block);
+	return block;
+}
+
+void freeAligned(void* block)
+{
+#if defined(_WIN32)
+	_aligned_free(block);
+#else
+	free(block);
+#endif
+}
+
+// scalar kernels, also the tails of the vector ones
+
+static void f64AddScalar(double* out, const double* a, const double* b, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = a[i] + b[i];
+	}
+}
+
+static void f64MulScalar(double* out, const double* a, const double* b, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = a[i] * b[i];
+	}
+}
+
+static void f64ScaleScalar(double* out, const double* a, double k, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = a[i] * k;
+	}
+}
+
+static void f64FillScalar(double* out, double k, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = k;
+	}
+}
+
+static double f64DotScalar(const double* a, const double* b, size_t count)
+{
+	double sum = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+static double f64SumScalar(const double* a, size_t count)
+{
+	double sum = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		sum += a[i];
+	}
+	return sum;
+}
+
+static double f64MinScalar(const double* a, size_t count)
+{
+	double least = a[0];
+	for (size_t i = 1; i < count; i++)
+	{
+		least = a[i] < least ? a[i] : least;
+	}
+	return least;
+}
+
+static double f64MaxScalar(const double* a, size_t count)
+{
+	double most = a[0];
+	for (size_t i = 1; i < count; i++)
+	{
+		most = a[i] > most ? a[i] : most;
+	}
+	return most;
+}
+
+// s32 arithmetic goes through uint32_t so that wrapping is defined
+static void s32AddScalar(int32_t* out, const int32_t* a, const int32_t* b, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+	}
+}
+
+static void s32MulScalar(int32_t* out, const int32_t* a, const int32_t* b, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)b[i]);
+	}
+}
+
+static void s32ScaleScalar(int32_t* out, const int32_t* a, int32_t k, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)k);
+	}
+}
+
+static void s32FillScalar(int32_t* out, int32_t k, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = k;
+	}
+}
+
+static int64_t s32SumScalar(const int32_t* a, size_t count)
+{
+	int64_t sum = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		sum += a[i];
+	}
+	return sum;
+}
+
+static int32_t s32MinScalar(const int32_t* a, size_t count)
+{
+	int32_t least = a[0];
+	for (size_t i = 1; i < count; i++)
+	{
+		least = a[i] < least ? a[i] : least;
+	}
+	return least;
+}
+
+static int32_t s32MaxScalar(const int32_t* a, size_t count)
+{
+	int32_t most = a[0];
+	for (size_t i = 1; i < count; i++)
+	{
+		most = a[i] > most ? a[i] : most;
+	}
+	return most;
+}
+
+#if defined(SCHEME_X86)
+
+TARGET_SSE2 static void f64AddSSE2(double* out, const double* a, const double* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		_mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	f64AddScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_SSE2 static void f64MulSSE2(double* out, const double* a, const double* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	f64MulScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_SSE2 static void f64ScaleSSE2(double* out, const double* a, double k, size_t count)
+{
+	__m128d scale = _mm_set1_pd(k);
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), scale));
+	}
+	f64ScaleScalar(out + i, a + i, k, count - i);
+}
+
+TARGET_SSE2 static void f64FillSSE2(double* out, double k, size_t count)
+{
+	__m128d fill = _mm_set1_pd(k);
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		_mm_storeu_pd(out + i, fill);
+	}
+	f64FillScalar(out + i, k, count - i);
+}
+
+TARGET_SSE2 static double f64DotSSE2(const double* a, const double* b, size_t count)
+{
+	__m128d sum = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, sum);
+	return lanes[0] + lanes[1] + f64DotScalar(a + i, b + i, count - i);
+}
+
+TARGET_SSE2 static double f64SumSSE2(const double* a, size_t count)
+{
+	__m128d sum = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		sum = _mm_add_pd(sum, _mm_loadu_pd(a + i));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, sum);
+	return lanes[0] + lanes[1] + f64SumScalar(a + i, count - i);
+}
+
+TARGET_SSE2 static double f64MinSSE2(const double* a, size_t count)
+{
+	if (count < 2)
+	{
+		return f64MinScalar(a, count);
+	}
+	__m128d least = _mm_loadu_pd(a);
+	size_t i = 2;
+	for (; i + 2 <= count; i += 2)
+	{
+		least = _mm_min_pd(_mm_loadu_pd(a + i), least);
+	}
+	double lanes[3];
+	_mm_storeu_pd(lanes, least);
+	lanes[2] = (i < count) ? f64MinScalar(a + i, count - i) : lanes[0];
+	return f64MinScalar(lanes, 3);
+}
+
+TARGET_SSE2 static double f64MaxSSE2(const double* a, size_t count)
+{
+	if (count < 2)
+	{
+		return f64MaxScalar(a, count);
+	}
+	__m128d most = _mm_loadu_pd(a);
+	size_t i = 2;
+	for (; i + 2 <= count; i += 2)
+	{
+		most = _mm_max_pd(_mm_loadu_pd(a + i), most);
+	}
+	double lanes[3];
+	_mm_storeu_pd(lanes, most);
+	lanes[2] = (i < count) ? f64MaxScalar(a + i, count - i) : lanes[0];
+	return f64MaxScalar(lanes, 3);
+}
+
+TARGET_SSE2 static void s32AddSSE2(int32_t* out, const int32_t* a, const int32_t* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		_mm_storeu_si128((__m128i*)(out + i), sum);
+	}
+	s32AddScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_SSE2 static void s32FillSSE2(int32_t* out, int32_t k, size_t count)
+{
+	__m128i fill = _mm_set1_epi32(k);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_si128((__m128i*)(out + i), fill);
+	}
+	s32FillScalar(out + i, k, count - i);
+}
+
+TARGET_SSE2 static int64_t s32SumSSE2(const int32_t* a, size_t count)
+{
+	// sign extend each lane to 64 bits by interleaving it with its sign
+	__m128i sum = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i values = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i signs = _mm_srai_epi32(values, 31);
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(values, signs));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(values, signs));
+	}
+	int64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, sum);
+	return lanes[0] + lanes[1] + s32SumScalar(a + i, count - i);
+}
+
+TARGET_AVX2 static void f64AddAVX2(double* out, const double* a, const double* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	}
+	f64AddScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void f64MulAVX2(double* out, const double* a, const double* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	}
+	f64MulScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void f64ScaleAVX2(double* out, const double* a, double k, size_t count)
+{
+	__m256d scale = _mm256_set1_pd(k);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), scale));
+	}
+	f64ScaleScalar(out + i, a + i, k, count - i);
+}
+
+TARGET_AVX2 static void f64FillAVX2(double* out, double k, size_t count)
+{
+	__m256d fill = _mm256_set1_pd(k);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm256_storeu_pd(out + i, fill);
+	}
+	f64FillScalar(out + i, k, count - i);
+}
+
+// two accumulators hide the latency of the adds
+TARGET_AVX2 static double f64DotAVX2(const double* a, const double* b, size_t count)
+{
+	__m256d sum0 = _mm256_setzero_pd();
+	__m256d sum1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f64DotScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static double f64SumAVX2(const double* a, size_t count)
+{
+	__m256d sum0 = _mm256_setzero_pd();
+	__m256d sum1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(a + i));
+		sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(a + i + 4));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f64SumScalar(a + i, count - i);
+}
+
+TARGET_AVX2 static double f64MinAVX2(const double* a, size_t count)
+{
+	if (count < 4)
+	{
+		return f64MinScalar(a, count);
+	}
+	__m256d least = _mm256_loadu_pd(a);
+	size_t i = 4;
+	for (; i + 4 <= count; i += 4)
+	{
+		least = _mm256_min_pd(_mm256_loadu_pd(a + i), least);
+	}
+	double lanes[5];
+	_mm256_storeu_pd(lanes, least);
+	lanes[4] = (i < count) ? f64MinScalar(a + i, count - i) : lanes[0];
+	return f64MinScalar(lanes, 5);
+}
+
+TARGET_AVX2 static double f64MaxAVX2(const double* a, size_t count)
+{
+	if (count < 4)
+	{
+		return f64MaxScalar(a, count);
+	}
+	__m256d most = _mm256_loadu_pd(a);
+	size_t i = 4;
+	for (; i + 4 <= count; i += 4)
+	{
+		most = _mm256_max_pd(_mm256_loadu_pd(a + i), most);
+	}
+	double lanes[5];
+	_mm256_storeu_pd(lanes, most);
+	lanes[4] = (i < count) ? f64MaxScalar(a + i, count - i) : lanes[0];
+	return f64MaxScalar(lanes, 5);
+}
+
+TARGET_AVX2 static void s32AddAVX2(int32_t* out, const int32_t* a, const int32_t* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+		_mm256_storeu_si256((__m256i*)(out + i), sum);
+	}
+	s32AddScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void s32MulAVX2(int32_t* out, const int32_t* a, const int32_t* b, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i product = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+		_mm256_storeu_si256((__m256i*)(out + i), product);
+	}
+	s32MulScalar(out + i, a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void s32ScaleAVX2(int32_t* out, const int32_t* a, int32_t k, size_t count)
+{
+	__m256i scale = _mm256_set1_epi32(k);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), scale));
+	}
+	s32ScaleScalar(out + i, a + i, k, count - i);
+}
+
+TARGET_AVX2 static void s32FillAVX2(int32_t* out, int32_t k, size_t count)
+{
+	__m256i fill = _mm256_set1_epi32(k);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_si256((__m256i*)(out + i), fill);
+	}
+	s32FillScalar(out + i, k, count - i);
+}
+
+TARGET_AVX2 static int64_t s32SumAVX2(const int32_t* a, size_t count)
+{
+	__m256i sum = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i values = _mm256_loadu_si256((const __m256i*)(a + i));
+		sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(values)));
+		sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(values, 1)));
+	}
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + s32SumScalar(a + i, count - i);
+}
+
+TARGET_AVX2 static int32_t s32MinAVX2(const int32_t* a, size_t count)
+{
+	if (count < 8)
+	{
+		return s32MinScalar(a, count);
+	}
+	__m256i least = _mm256_loadu_si256((const __m256i*)a);
+	size_t i = 8;
+	for (; i + 8 <= count; i += 8)
+	{
+		least = _mm256_min_epi32(least, _mm256_loadu_si256((const __m256i*)(a + i)));
+	}
+	int32_t lanes[9];
+	_mm256_storeu_si256((__m256i*)lanes, least);
+	lanes[8] = (i < count) ? s32MinScalar(a + i, count - i) : lanes[0];
+	return s32MinScalar(lanes, 9);
+}
+
+TARGET_AVX2 static int32_t s32MaxAVX2(const int32_t* a, size_t count)
+{
+	if (count < 8)
+	{
+		return s32MaxScalar(a, count);
+	}
+	__m256i most = _mm256_loadu_si256((const __m256i*)a);
+	size_t i = 8;
+	for (; i + 8 <= count; i += 8)
+	{
+		most = _mm256_max_epi32(most, _mm256_loadu_si256((const __m256i*)(a + i)));
+	}
+	int32_t lanes[9];
+	_mm256_storeu_si256((__m256i*)lanes, most);
+	lanes[8] = (i < count) ? s32MaxScalar(a + i, count - i) : lanes[0];
+	return s32MaxScalar(lanes, 9);
+}
+
+#endif
+
+// AVX2 has no 64 bit arithmetic shift to split the products with, so the exact
+// s32 dot product is the same at every level.
+void s32Dot(const int32_t* a, const int32_t* b, size_t count, int64_t* high, uint64_t* low)
+{
+	int64_t highSum = 0;
+	uint64_t lowSum = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		int64_t product = (int64_t)a[i] * b[i];
+		highSum += product >> 32;
+		lowSum += (uint32_t)product;
+	}
+	*high = highSum;
+	*low = lowSum;
+}
+
+struct Kernels
+{
+	void	(*mF64Add)(double*, const double*, const double*, size_t);
+	void	(*mF64Mul)(double*, const double*, const double*, size_t);
+	void	(*mF64Scale)(double*, const double*, double, size_t);
+	void	(*mF64Fill)(double*, double, size_t);
+	double	(*mF64Dot)(const double*, const double*, size_t);
+	double	(*mF64Sum)(const double*, size_t);
+	double	(*mF64Min)(const double*, size_t);
+	double	(*mF64Max)(const double*, size_t);
+	void	(*mS32Add)(int32_t*, const int32_t*, const int32_t*, size_t);
+	void	(*mS32Mul)(int32_t*, const int32_t*, const int32_t*, size_t);
+	void	(*mS32Scale)(int32_t*, const int32_t*, int32_t, size_t);
+	void	(*mS32Fill)(int32_t*, int32_t, size_t);
+	int64_t	(*mS32Sum)(const int32_t*, size_t);
+	int32_t	(*mS32Min)(const int32_t*, size_t);
+	int32_t	(*mS32Max)(const int32_t*, size_t);
+};
+
+static Kernels		sKernels;
+static SimdLevel	sLevel;
+
+SimdLevel simdSupported()
+{
+#if defined(SCHEME_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int leaves = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	// AVX2 also needs the OS to save the ymm registers
+	if (leaves >= 7 && avx && osxsave && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+		{
+			return eSimdAVX2;
+		}
+	}
+	return sse2 ? eSimdSSE2 : eSimdScalar;
+#elif defined(SCHEME_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return eSimdAVX2;
+	}
+	return __builtin_cpu_supports("sse2") ? eSimdSSE2 : eSimdScalar;
+#else
+	return eSimdScalar;
+#endif
+}
+
+SimdLevel simdLevel()
+{
+	return sLevel;
+}
+
+// Each level only replaces the kernels it has an instruction for.
+void setSimdLevel(SimdLevel level)
+{
+	if (level > simdSupported())
+	{
+		level = simdSupported();
+	}
+	sLevel = level;
+
+	sKernels.mF64Add	= f64AddScalar;
+	sKernels.mF64Mul	= f64MulScalar;
+	sKernels.mF64Scale	= f64ScaleScalar;
+	sKernels.mF64Fill	= f64FillScalar;
+	sKernels.mF64Dot	= f64DotScalar;
+	sKernels.mF64Sum	= f64SumScalar;
+	sKernels.mF64Min	= f64MinScalar;
+	sKernels.mF64Max	= f64MaxScalar;
+	sKernels.mS32Add	= s32AddScalar;
+	sKernels.mS32Mul	= s32MulScalar;
+	sKernels.mS32Scale	= s32ScaleScalar;
+	sKernels.mS32Fill	= s32FillScalar;
+	sKernels.mS32Sum	= s32SumScalar;
+	sKernels.mS32Min	= s32MinScalar;
+	sKernels.mS32Max	= s32MaxScalar;
+
+#if defined(SCHEME_X86)
+	if (level >= eSimdSSE2)
+	{
+		sKernels.mF64Add	= f64AddSSE2;
+		sKernels.mF64Mul	= f64MulSSE2;
+		sKernels.mF64Scale	= f64ScaleSSE2;
+		sKernels.mF64Fill	= f64FillSSE2;
+		sKernels.mF64Dot	= f64DotSSE2;
+		sKernels.mF64Sum	= f64SumSSE2;
+		sKernels.mF64Min	= f64MinSSE2;
+		sKernels.mF64Max	= f64MaxSSE2;
+		sKernels.mS32Add	= s32AddSSE2;
+		sKernels.mS32Fill	= s32FillSSE2;
+		sKernels.mS32Sum	= s32SumSSE2;
+	}
+	if (level >= eSimdAVX2)
+	{
+		sKernels.mF64Add	= f64AddAVX2;
+		sKernels.mF64Mul	= f64MulAVX2;
+		sKernels.mF64Scale	= f64ScaleAVX2;
+		sKernels.mF64Fill	= f64FillAVX2;
+		sKernels.mF64Dot	= f64DotAVX2;
+		sKernels.mF64Sum	= f64SumAVX2;
+		sKernels.mF64Min	= f64MinAVX2;
+		sKernels.mF64Max	= f64MaxAVX2;
+		sKernels.mS32Add	= s32AddAVX2;
+		sKernels.mS32Mul	= s32MulAVX2;
+		sKernels.mS32Scale	= s32ScaleAVX2;
+		sKernels.mS32Fill	= s32FillAVX2;
+		sKernels.mS32Sum	= s32SumAVX2;
+		sKernels.mS32Min	= s32MinAVX2;
+		sKernels.mS32Max	= s32MaxAVX2;
+	}
+#endif
+}
+
+const char* simdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case eSimdAVX2:		return "avx2";
+	case eSimdSSE2:		return "sse2";
+	default:			return "scalar";
+	}
+}
+
+static SimdLevel simdLevelFromEnvironment()
+{
+	const char* setting = getenv("SCHEME_SIMD");
+	if (setting && strcmp(setting, "scalar") == 0)
+	{
+		return eSimdScalar;
+	}
+	else if (setting && strcmp(setting, "sse2") == 0)
+	{
+		return eSimdSSE2;
+	}
+	return eSimdAVX2;
+}
+
+// picks the kernels before main runs
+static bool sKernelsSelected = (setSimdLevel(simdLevelFromEnvironment()), true);
+
+void	f64Add(double* out, const double* a, const double* b, size_t count)		{ sKernels.mF64Add(out, a, b, count); }
+void	f64Mul(double* out, const double* a, const double* b, size_t count)		{ sKernels.mF64Mul(out, a, b, count); }
+void	f64Scale(double* out, const double* a, double k, size_t count)			{ sKernels.mF64Scale(out, a, k, count); }
+void	f64Fill(double* out, double k, size_t count)								{ sKernels.mF64Fill(out, k, count); }
+double	f64Dot(const double* a, const double* b, size_t count)					{ return sKernels.mF64Dot(a, b, count); }
+double	f64Sum(const double* a, size_t count)										{ return sKernels.mF64Sum(a, count); }
+double	f64Min(const double* a, size_t count)										{ return sKernels.mF64Min(a, count); }
+double	f64Max(const double* a, size_t count)										{ return sKernels.mF64Max(a, count); }
+void	s32Add(int32_t* out, const int32_t* a, const int32_t* b, size_t count)	{ sKernels.mS32Add(out, a, b, count); }
+void	s32Mul(int32_t* out, const int32_t* a, const int32_t* b, size_t count)	{ sKernels.mS32Mul(out, a, b, count); }
+void	s32Scale(int32_t* out, const int32_t* a, int32_t k, size_t count)		{ sKernels.mS32Scale(out, a, k, count); }
+void	s32Fill(int32_t* out, int32_t k, size_t count)							{ sKernels.mS32Fill(out, k, count); }
+int64_t	s32Sum(const int32_t* a, size_t count)									{ return sKernels.mS32Sum(a, count); }
+int32_t	s32Min(const int32_t* a, size_t count)									{ return sKernels.mS32Min(a, count); }
+int32_t	s32Max(const int32_t* a, size_t count)									{ return sKernels.mS32Max(a, count); }
+
+// Per element type glue between the natives, the kernels and the heap.
+template<typename T> struct NumVectorTraits;
+
+template<> struct NumVectorTraits<double>
+{
+	static const char* name() { return "f64vector"; }
+	static const type_info& type() { return eF64Vector; }
+	static F64Vector* alloc(Context* context, uint32_t length) { return gMemory.allocF64Vector(context, length); }
+	static bool element(const Item& item, double* value)
+	{
+		if (!isNumber(item))
+		{
+			return false;
+		}
+		*value = toFlonum(item);
+		return true;
+	}
+	static Item item(double value) { return Item(value); }
+
+	static void add(double* out, const double* a, const double* b, size_t count) { f64Add(out, a, b, count); }
+	static void mul(double* out, const double* a, const double* b, size_t count) { f64Mul(out, a, b, count); }
+	static void scale(double* out, const double* a, double k, size_t count) { f64Scale(out, a, k, count); }
+	static void fill(double* out, double k, size_t count) { f64Fill(out, k, count); }
+	static Item dot(const double* a, const double* b, size_t count) { return Item(f64Dot(a, b, count)); }
+	static Item sum(const double* a, size_t count) { return Item(f64Sum(a, count)); }
+	static double min(const double* a, size_t count) { return f64Min(a, count); }
+	static double max(const double* a, size_t count) { return f64Max(a, count); }
+};
+
+template<> struct NumVectorTraits<int32_t>
+{
+	static const char* name() { return "s32vector"; }
+	static const type_info& type() { return eS32Vector; }
+	static S32Vector* alloc(Context* context, uint32_t length) { return gMemory.allocS32Vector(context, length); }
+	static bool element(const Item& item, int32_t* value)
+	{
+		if (item.type() != eNumber)
+		{
+			return false;
+		}
+		*value = boost::any_cast<Number>(item);
+		return true;
+	}
+	static Item item(int32_t value) { return Item(Number(value)); }
+
+	static void add(int32_t* out, const int32_t* a, const int32_t* b, size_t count) { s32Add(out, a, b, count); }
+	static void mul(int32_t* out, const int32_t* a, const int32_t* b, size_t count) { s32Mul(out, a, b, count); }
+	static void scale(int32_t* out, const int32_t* a, int32_t k, size_t count) { s32Scale(out, a, k, count); }
+	static void fill(int32_t* out, int32_t k, size_t count) { s32Fill(out, k, count); }
+	static Item dot(const int32_t* a, const int32_t* b, size_t count)
+	{
+		int64_t high;
+		uint64_t low;
+		s32Dot(a, b, count, &high, &low);
+		Item word = makeInteger(int64_t(1) << 32);
+		Item lowItem = numAdd(numMul(makeInteger(int64_t(low >> 32)), word), makeInteger(int64_t(low & 0xffffffff)));
+		return numAdd(numMul(makeInteger(high), word), lowItem);
+	}
+	static Item sum(const int32_t* a, size_t count) { return makeInteger(s32Sum(a, count)); }
+	static int32_t min(const int32_t* a, size_t count) { return s32Min(a, count); }
+	static int32_t max(const int32_t* a, size_t count) { return s32Max(a, count); }
+};
+
+template<typename T>
+static NumVector<T>* vectorArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != NumVectorTraits<T>::type())
+	{
+		return nullptr;
+	}
+	return boost::any_cast<NumVector<T>*>(args[index]);
+}
+
+template<typename T>
+static std::string argError(size_t index, const char* what)
+{
+	std::ostringstream ex;
+	ex << "&arg" << index << "-must-eval-to-" << (what ? what : NumVectorTraits<T>::name());
+	return ex.str();
+}
+
+static bool indexArg(const Item* args, uint32_t count, size_t index, uint32_t limit, uint32_t* value)
+{
+	if (index >= count || args[index].type() != eNumber)
+	{
+		return false;
+	}
+	Number number = boost::any_cast<Number>(args[index]);
+	if (number < 0 || (uint32_t)number >= limit)
+	{
+		return false;
+	}
+	*value = (uint32_t)number;
+	return true;
+}
+
+// (make-f64vector n [fill])
+template<typename T>
+Item makeNumVector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	uint32_t length;
+	T fill = 0;
+	if (!indexArg(args, count, 0, 0x7fffffff, &length))
+	{
+		*error = argError<T>(0, "length");
+	}
+	else if (count > 1 && !NumVectorTraits<T>::element(args[1], &fill))
+	{
+		*error = argError<T>(1, "element");
+	}
+	else
+	{
+		auto vector = NumVectorTraits<T>::alloc(context, length);
+		NumVectorTraits<T>::fill(vector->mData, fill, length);
+		return Item(vector);
+	}
+	return Item();
+}
+
+// (f64vector 1.0 2.0 ...)
+template<typename T>
+Item numVector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	std::vector<T> elements(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!NumVectorTraits<T>::element(args[i], &elements[i]))
+		{
+			*error = argError<T>(i, "element");
+			return Item();
+		}
+	}
+
+	auto vector = NumVectorTraits<T>::alloc(context, (uint32_t)elements.size());
+	std::copy(elements.begin(), elements.end(), vector->mData);
+	return Item(vector);
+}
+
+template<typename T>
+Item numVectorLength(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto vector = vectorArg<T>(args, count, 0);
+	if (!vector)
+	{
+		*error = argError<T>(0, nullptr);
+		return Item();
+	}
+	return Item(Number(vector->mLength));
+}
+
+template<typename T>
+Item numVectorRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto vector = vectorArg<T>(args, count, 0);
+	uint32_t index;
+	if (!vector)
+	{
+		*error = argError<T>(0, nullptr);
+	}
+	else if (!indexArg(args, count, 1, vector->mLength, &index))
+	{
+		*error = "&index-out-of-range";
+	}
+	else
+	{
+		return NumVectorTraits<T>::item(vector->mData[index]);
+	}
+	return Item();
+}
+
+template<typename T>
+Item numVectorSet(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto vector = vectorArg<T>(args, count, 0);
+	uint32_t index;
+	T value;
+	if (!vector)
+	{
+		*error = argError<T>(0, nullptr);
+	}
+	else if (!indexArg(args, count, 1, vector->mLength, &index))
+	{
+		*error = "&index-out-of-range";
+	}
+	else if (!NumVectorTraits<T>::element(args[2], &value))
+	{
+		*error = argError<T>(2, "element");
+	}
+	else
+	{
+		vector->mData[index] = value;
+		return Unspecified();
+	}
+	return Item();
+}
+
+template<typename T>
+Item listToNumVector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eCell)
+	{
+		*error = argError<T>(0, "list");
+		return Item();
+	}
+
+	std::vector<T> elements;
+	for (auto cell = boost::any_cast<CellRef>(args[0]); cell; cell = cell->next())
+	{
+		T value;
+		if (!NumVectorTraits<T>::element(cell->mCar, &value))
+		{
+			*error = "&list-element-must-be-number";
+			return Item();
+		}
+		elements.push_back(value);
+	}
+
+	auto vector = NumVectorTraits<T>::alloc(context, (uint32_t)elements.size());
+	std::copy(elements.begin(), elements.end(), vector->mData);
+	return Item(vector);
+}
+
+template<typename T>
+Item numVectorToList(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto vector = vectorArg<T>(args, count, 0);
+	if (!vector)
+	{
+		*error = argError<T>(0, nullptr);
+		return Item();
+	}
+
+	gMemory.reserveCells(context, vector->mLength);
+	CellRef list = nullptr;
+	for (uint32_t i = vector->mLength; i > 0; i--)
+	{
+		list = gMemory.allocCell(context, NumVectorTraits<T>::item(vector->mData[i - 1]), Item(list));
+	}
+	return Item(list);
+}
+
+// (f64vector-add a b) and (f64vector-mul a b) make a new vector
+template<typename T, void (*Kernel)(T*, const T*, const T*, size_t)>
+Item numVectorElementwise(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	auto b = vectorArg<T>(args, count, 1);
+	if (!a || !b)
+	{
+		*error = argError<T>(a ? 1 : 0, nullptr);
+		return Item();
+	}
+	if (a->mLength != b->mLength)
+	{
+		*error = "&length-mismatch";
+		return Item();
+	}
+
+	auto result = NumVectorTraits<T>::alloc(context, a->mLength);
+	Kernel(result->mData, a->mData, b->mData, a->mLength);
+	return Item(result);
+}
+
+template<typename T>
+Item numVectorScale(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	T scale;
+	if (!a)
+	{
+		*error = argError<T>(0, nullptr);
+	}
+	else if (!NumVectorTraits<T>::element(args[1], &scale))
+	{
+		*error = argError<T>(1, "element");
+	}
+	else
+	{
+		auto result = NumVectorTraits<T>::alloc(context, a->mLength);
+		NumVectorTraits<T>::scale(result->mData, a->mData, scale, a->mLength);
+		return Item(result);
+	}
+	return Item();
+}
+
+template<typename T>
+Item numVectorFill(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	T fill;
+	if (!a)
+	{
+		*error = argError<T>(0, nullptr);
+	}
+	else if (!NumVectorTraits<T>::element(args[1], &fill))
+	{
+		*error = argError<T>(1, "element");
+	}
+	else
+	{
+		NumVectorTraits<T>::fill(a->mData, fill, a->mLength);
+		return Unspecified();
+	}
+	return Item();
+}
+
+template<typename T>
+Item numVectorDot(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	auto b = vectorArg<T>(args, count, 1);
+	if (!a || !b)
+	{
+		*error = argError<T>(a ? 1 : 0, nullptr);
+	}
+	else if (a->mLength != b->mLength)
+	{
+		*error = "&length-mismatch";
+	}
+	else
+	{
+		return NumVectorTraits<T>::dot(a->mData, b->mData, a->mLength);
+	}
+	return Item();
+}
+
+template<typename T>
+Item numVectorSum(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	if (!a)
+	{
+		*error = argError<T>(0, nullptr);
+		return Item();
+	}
+	return NumVectorTraits<T>::sum(a->mData, a->mLength);
+}
+
+// (f64vector-min v) and (f64vector-max v); an empty vector has neither
+template<typename T, T (*Kernel)(const T*, size_t)>
+Item numVectorReduce(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	auto a = vectorArg<T>(args, count, 0);
+	if (!a)
+	{
+		*error = argError<T>(0, nullptr);
+	}
+	else if (a->mLength == 0)
+	{
+		*error = "&empty-vector";
+	}
+	else
+	{
+		return NumVectorTraits<T>::item(Kernel(a->mData, a->mLength));
+	}
+	return Item();
+}
+
+template<typename T>
+static void addNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	std::string name = NumVectorTraits<T>::name();
+	definePrimitive(("make-" + name).c_str(), makeNumVector<T>, 1, 2, true);
+	definePrimitive(name.c_str(), numVector<T>, 0, any, true);
+	definePrimitive((name + "-length").c_str(), numVectorLength<T>, 1, 1, false);
+	definePrimitive((name + "-ref").c_str(), numVectorRef<T>, 2, 2, false);
+	definePrimitive((name + "-set!").c_str(), numVectorSet<T>, 3, 3, false);
+	definePrimitive(("list->" + name).c_str(), listToNumVector<T>, 1, 1, true);
+	definePrimitive((name + "->list").c_str(), numVectorToList<T>, 1, 1, true);
+	definePrimitive((name + "-add").c_str(), numVectorElementwise<T, NumVectorTraits<T>::add>, 2, 2, true);
+	definePrimitive((name + "-mul").c_str(), numVectorElementwise<T, NumVectorTraits<T>::mul>, 2, 2, true);
+	definePrimitive((name + "-scale").c_str(), numVectorScale<T>, 2, 2, true);
+	definePrimitive((name + "-fill!").c_str(), numVectorFill<T>, 2, 2, false);
+	definePrimitive((name + "-dot").c_str(), numVectorDot<T>, 2, 2, true);
+	definePrimitive((name + "-sum").c_str(), numVectorSum<T>, 1, 1, true);
+	definePrimitive((name + "-min").c_str(), numVectorReduce<T, NumVectorTraits<T>::min>, 1, 1, false);
+	definePrimitive((name + "-max").c_str(), numVectorReduce<T, NumVectorTraits<T>::max>, 1, 1, false);
+}
+
+void addNumVectorNatives()
+{
+	addNatives<double>();
+	addNatives<int32_t>();
+}
+
+std::string numVectorToString(const Item& item)
+{
+	std::ostringstream text;
+	if (item.type() == eF64Vector)
+	{
+		auto vector = boost::any_cast<F64Vector*>(item);
+		text << "#f64( ";
+		for (uint32_t i = 0; i < vector->mLength; i++)
+		{
+			text << flonumToString(vector->mData[i]) << " ";
+		}
+	}
+	else
+	{
+		auto vector = boost::any_cast<S32Vector*>(item);
+		text << "#s32( ";
+		for (uint32_t i = 0; i < vector->mLength; i++)
+		{
+			text << vector->mData[i] << " ";
+		}
+	}
+	text << ") ";
+	return text.str();
+}
+
+// Every kernel at every supported level against the scalar ones, over lengths
+// that leave each possible tail. The values are small integers so that the
+// f64 sums are exact in any order.
+void test_numvectors()
+{
+	const size_t cMaxCount = 37;
+	double fa[cMaxCount], fb[cMaxCount], fout[cMaxCount], fexpect[cMaxCount];
+	int32_t sa[cMaxCount], sb[cMaxCount], sout[cMaxCount], sexpect[cMaxCount];
+	for (size_t i = 0; i < cMaxCount; i++)
+	{
+		fa[i] = (double)((i * 7) % 19) - 9;
+		fb[i] = (double)((i * 5) % 13) - 4;
+		sa[i] = (int32_t)((i * 7) % 19) - 9;
+		sb[i] = (int32_t)((i * 5) % 13) - 4;
+	}
+	sa[3] = 0x7fffffff;		// wraps when added or multiplied
+	sa[20] = -0x7fffffff - 1;
+
+	SimdLevel original = simdLevel();
+	for (int level = eSimdScalar; level <= simdSupported(); level++)
+	{
+		setSimdLevel((SimdLevel)level);
+		for (size_t count = 0; count <= cMaxCount; count++)
+		{
+			f64Add(fout, fa, fb, count);
+			f64AddScalar(fexpect, fa, fb, count);
+			assert(memcmp(fout, fexpect, count * sizeof(double)) == 0);
+			f64Mul(fout, fa, fb, count);
+			f64MulScalar(fexpect, fa, fb, count);
+			assert(memcmp(fout, fexpect, count * sizeof(double)) == 0);
+			f64Scale(fout, fa, -2.5, count);
+			f64ScaleScalar(fexpect, fa, -2.5, count);
+			assert(memcmp(fout, fexpect, count * sizeof(double)) == 0);
+			f64Fill(fout, 3.0, count);
+			f64FillScalar(fexpect, 3.0, count);
+			assert(memcmp(fout, fexpect, count * sizeof(double)) == 0);
+			assert(f64Dot(fa, fb, count) == f64DotScalar(fa, fb, count));
+			assert(f64Sum(fa, count) == f64SumScalar(fa, count));
+
+			s32Add(sout, sa, sb, count);
+			s32AddScalar(sexpect, sa, sb, count);
+			assert(memcmp(sout, sexpect, count * sizeof(int32_t)) == 0);
+			s32Mul(sout, sa, sb, count);
+			s32MulScalar(sexpect, sa, sb, count);
+			assert(memcmp(sout, sexpect, count * sizeof(int32_t)) == 0);
+			s32Scale(sout, sa, -3, count);
+			s32ScaleScalar(sexpect, sa, -3, count);
+			assert(memcmp(sout, sexpect, count * sizeof(int32_t)) == 0);
+			s32Fill(sout, 5, count);
+			s32FillScalar(sexpect, 5, count);
+			assert(memcmp(sout, sexpect, count * sizeof(int32_t)) == 0);
+			assert(s32Sum(sa, count) == s32SumScalar(sa, count));
+
+			if (count > 0)
+			{
+				assert(f64Min(fa, count) == f64MinScalar(fa, count));
+				assert(f64Max(fa, count) == f64MaxScalar(fa, count));
+				assert(s32Min(sa, count) == s32MinScalar(sa, count));
+				assert(s32Max(sa, count) == s32MaxScalar(sa, count));
+			}
+		}
+	}
+	setSimdLevel(original);
+
+	// the extremes are found wherever they sit
+	assert(f64Max(fa, cMaxCount) == 9);
+	assert(s32Max(sa, cMaxCount) == 0x7fffffff);
+	assert(s32Min(sa, cMaxCount) == -0x7fffffff - 1);
+
+	// (-2^31)^2 twice overflows an int64 but not the split sum
+	int32_t extremes[2] = { -0x7fffffff - 1, -0x7fffffff - 1 };
+	int64_t high;
+	uint64_t low;
+	s32Dot(extremes, extremes, 2, &high, &low);
+	assert(high == (int64_t(1) << 31) && low == 0);
+	assert(numToString(NumVectorTraits<int32_t>::dot(extremes, extremes, 2)) == "9223372036854775808");
+
+	void* block = allocAligned(100);
+	assert(((uintptr_t)block % cVectorAlignment) == 0);
+	freeAligned(block);
+}
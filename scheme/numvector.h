@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "schemetypes.h"
+#include "collectable.h"
+
+void*	allocAligned(size_t bytes);
+void	freeAligned(void* block);
+
+// SRFI-4 style vector of one numeric type. The elements are unboxed and
+// contiguous, in storage aligned for the widest SIMD registers the kernels
+// below use.
+template<typename T>
+struct NumVector : public Collectable<NumVector<T>>
+{
+	T*			mData;
+	uint32_t	mLength;
+
+	NumVector()
+		: mData(nullptr)
+		, mLength(0)
+	{}
+	NumVector(uint32_t length)
+		: mData((T*)allocAligned(length * sizeof(T)))
+		, mLength(length)
+	{}
+	~NumVector()
+	{
+		freeAligned(mData);
+	}
+
+	void mark() override
+	{
+		this->mReachable = true;
+	}
+
+private:
+	NumVector(const NumVector&);
+	NumVector& operator=(const NumVector&);
+};
+
+typedef NumVector<double>		F64Vector;
+typedef NumVector<int32_t>		S32Vector;
+
+extern const type_info& eF64Vector;
+extern const type_info& eS32Vector;
+
+// Which instruction set the bulk kernels use. The best one the CPU supports is
+// picked at startup; SCHEME_SIMD ("scalar", "sse2" or "avx2") can lower it.
+enum SimdLevel
+{
+	eSimdScalar,
+	eSimdSSE2,
+	eSimdAVX2,
+};
+
+SimdLevel	simdSupported();
+SimdLevel	simdLevel();
+void		setSimdLevel(SimdLevel level);
+const char*	simdLevelName(SimdLevel level);
+
+// Bulk kernels. Elementwise results may alias an input. s32 arithmetic wraps
+// like the 32 bit storage does; the s32 reductions are exact.
+void	f64Add(double* out, const double* a, const double* b, size_t count);
+void	f64Mul(double* out, const double* a, const double* b, size_t count);
+void	f64Scale(double* out, const double* a, double k, size_t count);
+void	f64Fill(double* out, double k, size_t count);
+double	f64Dot(const double* a, const double* b, size_t count);
+double	f64Sum(const double* a, size_t count);
+double	f64Min(const double* a, size_t count);		// count > 0
+double	f64Max(const double* a, size_t count);		// count > 0
+
+void	s32Add(int32_t* out, const int32_t* a, const int32_t* b, size_t count);
+void	s32Mul(int32_t* out, const int32_t* a, const int32_t* b, size_t count);
+void	s32Scale(int32_t* out, const int32_t* a, int32_t k, size_t count);
+void	s32Fill(int32_t* out, int32_t k, size_t count);
+int64_t	s32Sum(const int32_t* a, size_t count);
+int32_t	s32Min(const int32_t* a, size_t count);		// count > 0
+int32_t	s32Max(const int32_t* a, size_t count);		// count > 0
+// sum of products as high * 2^32 + low, which can't overflow for any count a
+// vector can have
+void	s32Dot(const int32_t* a, const int32_t* b, size_t count, int64_t* high, uint64_t* low);
+
+std::string	numVectorToString(const Item& vector);
+void	addNumVectorNatives();
+void	test_numvectors();
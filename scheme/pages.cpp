@@ -0,0 +1,279 @@
+#include "stdafx.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pages.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <set>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+PagePolicy pagePolicyFromEnvironment()
+{
+	const char* setting = getenv("SCHEME_PAGES");
+	if (setting && strcmp(setting, "huge") == 0)
+	{
+		return eHugePages;
+	}
+	else if (setting && strcmp(setting, "thp") == 0)
+	{
+		return eTransparentHugePages;
+	}
+	return eSmallPages;
+}
+
+const char* pagePolicyName(PagePolicy policy)
+{
+	switch (policy)
+	{
+	case eHugePages:				return "huge";
+	case eTransparentHugePages:		return "thp";
+	default:						return "small";
+	}
+}
+
+#ifdef _WIN32
+
+// large-page segments are locked and cannot be decommitted, so they are never discarded
+static std::set<void*> sLargePageSegments;
+
+// large pages need SeLockMemoryPrivilege enabled on the process token
+static bool enableLockMemoryPrivilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+				&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+				&& GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return enabled;
+}
+
+void* mapSegment(PagePolicy policy)
+{
+	if (policy == eHugePages)
+	{
+		static bool privileged = enableLockMemoryPrivilege();
+		if (privileged && GetLargePageMinimum() != 0 && cSegmentBytes % GetLargePageMinimum() == 0)
+		{
+			void* base = VirtualAlloc(nullptr, cSegmentBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (base)
+			{
+				sLargePageSegments.insert(base);
+				return base;
+			}
+		}
+	}
+
+	// over-reserve so the segment can be aligned, then commit only the aligned part
+	char* reserved = (char*)VirtualAlloc(nullptr, cSegmentBytes * 2, MEM_RESERVE, PAGE_NOACCESS);
+	if (!reserved)
+	{
+		return nullptr;
+	}
+	char* base = (char*)(((uintptr_t)reserved + cSegmentBytes - 1) & ~(uintptr_t)(cSegmentBytes - 1));
+	return VirtualAlloc(base, cSegmentBytes, MEM_COMMIT, PAGE_READWRITE);
+}
+
+void discardSegment(void* base, PagePolicy policy)
+{
+	if (sLargePageSegments.find(base) == sLargePageSegments.end())
+	{
+		VirtualFree(base, cSegmentBytes, MEM_DECOMMIT);
+	}
+}
+
+bool recommitSegment(void* base, PagePolicy policy)
+{
+	if (sLargePageSegments.find(base) != sLargePageSegments.end())
+	{
+		return true;
+	}
+	return VirtualAlloc(base, cSegmentBytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+void unmapSegment(void* base)
+{
+	if (sLargePageSegments.erase(base))
+	{
+		VirtualFree(base, 0, MEM_RELEASE);
+		return;
+	}
+
+	// release the whole over-sized reservation the segment was carved from
+	MEMORY_BASIC_INFORMATION info;
+	if (VirtualQuery(base, &info, sizeof(info)))
+	{
+		VirtualFree(info.AllocationBase, 0, MEM_RELEASE);
+	}
+}
+
+bool mapFile(const char* path, const void** base, size_t* bytes)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	bool mapped = GetFileSizeEx(file, &size) && (uint64_t)size.QuadPart <= SIZE_MAX;
+	*base = nullptr;
+	*bytes = mapped ? (size_t)size.QuadPart : 0;
+	if (mapped && *bytes > 0)
+	{
+		// the view keeps the mapping and the file open once both handles are closed
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		*base = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		mapped = *base != nullptr;
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	return mapped;
+}
+
+void unmapFile(const void* base, size_t bytes)
+{
+	if (base)
+	{
+		UnmapViewOfFile(base);
+	}
+}
+
+void* mapCode(size_t bytes)
+{
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+bool protectCode(void* base, size_t bytes)
+{
+	DWORD previous;
+	return VirtualProtect(base, bytes, PAGE_EXECUTE_READ, &previous) && FlushInstructionCache(GetCurrentProcess(), base, bytes);
+}
+
+void unmapCode(void* base, size_t bytes)
+{
+	VirtualFree(base, 0, MEM_RELEASE);
+}
+
+#else
+
+void* mapSegment(PagePolicy policy)
+{
+#ifdef MAP_HUGETLB
+	if (policy == eHugePages)
+	{
+		void* base = mmap(nullptr, cSegmentBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED)
+		{
+			return base;
+		}
+	}
+#endif
+
+	// over-map so the segment can be aligned to a huge page boundary, then trim
+	char* mapped = (char*)mmap(nullptr, cSegmentBytes * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	char* base = (char*)(((uintptr_t)mapped + cSegmentBytes - 1) & ~(uintptr_t)(cSegmentBytes - 1));
+	if (base > mapped)
+	{
+		munmap(mapped, base - mapped);
+	}
+	munmap(base + cSegmentBytes, mapped + cSegmentBytes * 2 - (base + cSegmentBytes));
+
+#ifdef MADV_HUGEPAGE
+	if (policy != eSmallPages)
+	{
+		madvise(base, cSegmentBytes, MADV_HUGEPAGE);
+	}
+#endif
+	return base;
+}
+
+void discardSegment(void* base, PagePolicy policy)
+{
+	madvise(base, cSegmentBytes, MADV_DONTNEED);
+}
+
+bool recommitSegment(void* base, PagePolicy policy)
+{
+	// discarded anonymous pages fault back in zero-filled on first touch
+	return true;
+}
+
+void unmapSegment(void* base)
+{
+	munmap(base, cSegmentBytes);
+}
+
+bool mapFile(const char* path, const void** base, size_t* bytes)
+{
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	bool mapped = fstat(file, &info) == 0;
+	*base = nullptr;
+	*bytes = mapped ? (size_t)info.st_size : 0;
+	if (mapped && *bytes > 0)
+	{
+		void* view = mmap(nullptr, *bytes, PROT_READ, MAP_PRIVATE, file, 0);
+		mapped = view != MAP_FAILED;
+		if (mapped)
+		{
+			madvise(view, *bytes, MADV_SEQUENTIAL);
+			*base = view;
+		}
+	}
+	close(file);
+	return mapped;
+}
+
+void unmapFile(const void* base, size_t bytes)
+{
+	if (base)
+	{
+		munmap((void*)base, bytes);
+	}
+}
+
+void* mapCode(size_t bytes)
+{
+	void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return base == MAP_FAILED ? nullptr : base;
+}
+
+bool protectCode(void* base, size_t bytes)
+{
+	return mprotect(base, bytes, PROT_READ | PROT_EXEC) == 0;
+}
+
+void unmapCode(void* base, size_t bytes)
+{
+	munmap(base, bytes);
+}
+
+#endif
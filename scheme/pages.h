@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+// How heap segments are backed. Huge pages cut TLB misses when marking and
+// walking a large heap; the policy is picked once at startup from the
+// SCHEME_PAGES environment variable ("small", "thp" or "huge").
+enum PagePolicy
+{
+	eSmallPages,
+	eTransparentHugePages,
+	eHugePages,
+};
+
+const size_t cSegmentBytes = 2 * 1024 * 1024;
+
+PagePolicy	pagePolicyFromEnvironment();
+const char*	pagePolicyName(PagePolicy policy);
+
+// Segments are cSegmentBytes-aligned runs of cSegmentBytes. Discarding gives
+// the physical pages back to the OS but keeps the address range, so a
+// discarded segment can be recommitted in place.
+void*		mapSegment(PagePolicy policy);
+void		discardSegment(void* base, PagePolicy policy);
+bool		recommitSegment(void* base, PagePolicy policy);
+void		unmapSegment(void* base);
+
+// Maps a whole file read-only; false if it can't be opened. An empty file maps
+// to nullptr. Pages are read in on first touch and stay clean, so the OS can
+// drop them again under pressure.
+bool		mapFile(const char* path, const void** base, size_t* bytes);
+void		unmapFile(const void* base, size_t bytes);
+
+// Pages for generated machine code. They are mapped writable, and made
+// executable and read-only once the code is in, so no page is both at once.
+void*		mapCode(size_t bytes);
+bool		protectCode(void* base, size_t bytes);
+void		unmapCode(void* base, size_t bytes);
@@ -5,10 +5,25 @@
 #include "memory.h"
 #include "symboltable.h"
 #include "list.h"
+#include "numeric.h"
+#include "vector.h"
 
 extern Memory	    gMemory;
 extern SymbolTable  gSymbolTable;
 
+// in hash-consing mode equal literal structure is shared and immutable
+static bool sHashConsing = false;
+
+void Parser::setHashConsing(bool hashConsing)
+{
+	sHashConsing = hashConsing;
+}
+
+static Cell* cons(Context* context, Item car, Item cdr = (CellRef)nullptr)
+{
+	return sHashConsing ? gMemory.hcons(context, car, cdr) : gMemory.allocCell(context, car, cdr);
+}
+
 static bool isSign(char c)
 {
 	return c == '-';
@@ -36,6 +51,12 @@ static Number parseDigits(char*cs, char** rest, Number previous)
 
 static Maybe<Item> parseNumber(char* cs, char** rest)
 {
+	Maybe<Flonum> flonum = parseFlonum(cs, rest);
+	if (flonum.mValid)
+	{
+		return Maybe<Item>(Item(flonum.mV));
+	}
+
 	int32_t sign = 1;
 	if (isSign(*cs))
 	{
@@ -48,12 +69,24 @@ static Maybe<Item> parseNumber(char* cs, char** rest)
 		return Maybe<Item>();
 	}
 
+	// nine digits always fit a fixnum; longer literals are read straight into a bignum
+	size_t count = 0;
+	while (isDigit(cs[count]))
+	{
+		count++;
+	}
+	if (count > 9)
+	{
+		*rest = cs + count;
+		return Maybe<Item>(makeInteger(Bignum::fromDecimal(cs, count, sign < 0)));
+	}
+
 	return Maybe<Item>(Item(parseDigits(cs, rest, 0) * sign));
 }
 
 static bool isSymbolInitial(char c)
 {
-	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' || c == '=' || c == '*' || c == '/' || c == '-' || c == '%';
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' || c == '=' || c == '*' || c == '/' || c == '-' || c == '%' || c == '<' || c == '>';
 }
 
 static bool isSymbolBody(char c)
@@ -151,13 +184,64 @@ static Maybe<Item> parseQuotedForm(Context* context, char*cs, char** rest)
 	Maybe<Item> item;
 	if ((item = Parser::parseForm(context, cs, rest)).mValid)
 	{
-		Cell* qcell = gMemory.allocCell(context, Item(gSymbolTable.GetSymbol("quote")), Item(gMemory.allocCell(context, item.mV)));
+		Cell* qcell = cons(context, Item(gSymbolTable.GetSymbol("quote")), Item(cons(context, item.mV)));
 		return Maybe<Item>(Item(qcell));
 	}
 
 	return Maybe<Item>();
 }
 
+// "..." with \" \\ \n and \t escapes; the text is kept as UTF-8 bytes
+static Maybe<Item> parseString(Context* context, char* cs, char** rest)
+{
+	if (*cs != '"')
+	{
+		return Maybe<Item>();
+	}
+
+	std::string text;
+	for (cs++; *cs != '"'; cs++)
+	{
+		if (*cs == '\0')
+		{
+			return Maybe<Item>();
+		}
+		else if (*cs == '\\' && cs[1] != '\0')
+		{
+			cs++;
+			text.push_back(*cs == 'n' ? '\n' : (*cs == 't' ? '\t' : *cs));
+		}
+		else
+		{
+			text.push_back(*cs);
+		}
+	}
+	*rest = cs + 1;
+	return Maybe<Item>(Item(gMemory.allocString(context, text)));
+}
+
+// #( ... ) reads the elements as a list and copies them into a vector
+static Maybe<Item> parseVector(Context* context, char* cs, char** rest)
+{
+	if (cs[0] != '#' || cs[1] != '(')
+	{
+		return Maybe<Item>();
+	}
+
+	Maybe<Item> list = parseList(context, cs + 1, rest);
+	if (!list.mValid)
+	{
+		return Maybe<Item>();
+	}
+
+	std::vector<Item> elements;
+	for (auto cell = boost::any_cast<CellRef>(list.mV); cell; cell = cell->next())
+	{
+		elements.push_back(cell->mCar);
+	}
+	return Maybe<Item>(Item(makeVector(context, elements)));
+}
+
 static Maybe<Item> parseUnquotedForm(Context* context, char*cs, char** rest)
 {
 	Maybe<Item> item;
@@ -165,6 +249,10 @@ static Maybe<Item> parseUnquotedForm(Context* context, char*cs, char** rest)
 	{
 		return item;
 	}
+	else if ((item = parseString(context, cs, rest)).mValid)
+	{
+		return item;
+	}
 	else if ((item = parseSymbol(cs, rest)).mValid)
 	{
 		return item;
@@ -173,6 +261,10 @@ static Maybe<Item> parseUnquotedForm(Context* context, char*cs, char** rest)
 	{
 		return item;
 	}
+	else if ((item = parseVector(context, cs, rest)).mValid)
+	{
+		return item;
+	}
 	else
 	{
 		return Maybe<Item>();
@@ -213,16 +305,12 @@ static Maybe<Item> parsePair(Context* context, char* cs, char** rest)
 	return Maybe<Item>();
 }
 
+// The tail is parsed before the cell is allocated, so the cells of a list are
+// allocated back to back and come out cdr-coded.
 static Maybe<Cell*> parseForms(Context* context, char* cs, char** rest)
 {
 	Maybe<Item> item;
-	Cell* cell = nullptr;
-	if ((item = Parser::parseForm(context, cs, rest)).mValid)
-	{
-		cell = gMemory.allocCell(context, Item());
-		cell->mCar = item.mV;
-	}
-	else
+	if (!(item = Parser::parseForm(context, cs, rest)).mValid)
 	{
 		return Maybe<Cell*>();
 	}
@@ -230,25 +318,26 @@ static Maybe<Cell*> parseForms(Context* context, char* cs, char** rest)
 	parseAtmosphere(*rest, rest);
 	cs = *rest;
 
+	Item cdr;
 	Maybe<Item> second;
 	if ((second = parsePair(context, cs, rest)).mValid)
 	{
-		cell->mCdr = second.mV;
+		cdr = second.mV;
 	}
 	else
 	{
 		Maybe<Cell*> tail;
 		if ((tail = parseForms(context, cs, rest)).mValid)
 		{
-			cell->mCdr = Item(tail.mV);
+			cdr = Item(tail.mV);
 		}
 		else
 		{
-			cell->mCdr = Item((Cell*)nullptr);
+			cdr = Item((Cell*)nullptr);
 		}
 	}
 
-	return Maybe<Cell*>(cell);
+	return Maybe<Cell*>(cons(context, item.mV, cdr));
 }
 
 static Maybe<Item> parseNil(char* cs, char** rest)
@@ -333,6 +422,20 @@ void test_numbers()
 	assert(boost::any_cast<Number>((parseNumber("100", &rest)).mV) == 100);
 	assert(boost::any_cast<Number>((parseNumber("-123", &rest)).mV) == -123);
 	assert((parseNumber("cat", &rest)).mValid == false);
+	assert(boost::any_cast<Number>((parseNumber("-2147483648", &rest)).mV) == -2147483647 - 1);
+	assert(boost::any_cast<Number>((parseNumber("0000000000042", &rest)).mV) == 42);
+	assert(boost::any_cast<Bignum>((parseNumber("2147483648", &rest)).mV).toString() == "2147483648");
+	assert(boost::any_cast<Bignum>((parseNumber("-98765432109876543210 rest", &rest)).mV).toString() == "-98765432109876543210");
+	assert(std::string(rest) == " rest");
+	assert(boost::any_cast<Flonum>((parseNumber("1.5", &rest)).mV) == 1.5);
+	assert(boost::any_cast<Flonum>((parseNumber("-0.125", &rest)).mV) == -0.125);
+	assert(boost::any_cast<Flonum>((parseNumber("2e3", &rest)).mV) == 2000.0);
+	assert(boost::any_cast<Flonum>((parseNumber("0.1", &rest)).mV) == 0.1);
+	assert(boost::any_cast<Flonum>((parseNumber("1.7976931348623157e308", &rest)).mV) == 1.7976931348623157e308);
+	assert(boost::any_cast<Flonum>((parseNumber("3.14159265358979323846264 rest", &rest)).mV) == 3.141592653589793);
+	assert(std::string(rest) == " rest");
+	assert(boost::any_cast<Number>((parseNumber("5.", &rest)).mV) == 5);
+	assert(std::string(rest) == ".");
 }
 
 void test_comments()
@@ -386,6 +489,20 @@ void test_list()
 	assert(length(boost::any_cast<CellRef>(parseList(gMemory.getRoot(), "( Maddy loves ( horses and unicorns) )", &rest).mV)) == 3);
 	assert(length(boost::any_cast<CellRef>(parseList(gMemory.getRoot(), "( Maddy loves ; inject a comment \n( horses and unicorns) )", &rest).mV)) == 3);
 	assert(!parseList(gMemory.getRoot(), "( Maddy loves ", &rest).mValid);
+
+	Maybe<Item> vector = parseVector(gMemory.getRoot(), "#( 1 (2 3) cat ) rest", &rest);
+	assert(vector.mValid && vector.mV.type() == eVector);
+	assert(boost::any_cast<VectorRef>(vector.mV)->length() == 3);
+	assert(boost::any_cast<VectorRef>(vector.mV)->mElements[2].type() == eSymbol);
+	assert(std::string(rest) == " rest");
+	assert(boost::any_cast<VectorRef>(parseVector(gMemory.getRoot(), "#()", &rest).mV)->length() == 0);
+	assert(!parseVector(gMemory.getRoot(), "#( 1 2", &rest).mValid);
+
+	Maybe<Item> string = parseString(gMemory.getRoot(), "\"say \\\"hi\\\"\\n\" rest", &rest);
+	assert(string.mValid && boost::any_cast<StringRef>(string.mV)->str() == "say \"hi\"\n");
+	assert(std::string(rest) == " rest");
+	assert(boost::any_cast<StringRef>(parseString(gMemory.getRoot(), "\"\xc3\xa9t\xc3\xa9\"", &rest).mV)->mLength == 3);
+	assert(!parseString(gMemory.getRoot(), "\"unterminated", &rest).mValid);
 }
 
 
@@ -397,6 +514,25 @@ void test_quote()
 	assert(Parser::parseForm(gMemory.getRoot(), "'''hello-multiqoute", &rest).mValid);
 }
 
+void test_hashconsing()
+{
+	char* rest;
+	Parser::setHashConsing(true);
+	auto first = Parser::parseForm(gMemory.getRoot(), "(config (depth 3) (keys a b c))", &rest).mV;
+	auto second = Parser::parseForm(gMemory.getRoot(), "( config (depth 3)  (keys a b c) )", &rest).mV;
+	auto other = Parser::parseForm(gMemory.getRoot(), "(config (depth 4) (keys a b c))", &rest).mV;
+	Parser::setHashConsing(false);
+
+	assert(boost::any_cast<CellRef>(first) == boost::any_cast<CellRef>(second));
+	assert(boost::any_cast<CellRef>(first) != boost::any_cast<CellRef>(other));
+	assert(boost::any_cast<CellRef>(first)->mHashConsed);
+	// the shared (keys a b c) tail
+	assert(boost::any_cast<CellRef>(car(cdr(cdr(first)))) == boost::any_cast<CellRef>(car(cdr(cdr(other)))));
+
+	auto fresh = Parser::parseForm(gMemory.getRoot(), "(config (depth 3) (keys a b c))", &rest).mV;
+	assert(boost::any_cast<CellRef>(fresh) != boost::any_cast<CellRef>(first));
+}
+
 void Parser::test()
 {
 	test_numbers();
@@ -405,4 +541,5 @@ void Parser::test()
 	test_atmosphere();
 	test_list();
 	test_quote();
+	test_hashconsing();
 }
\ No newline at end of file
@@ -8,5 +8,6 @@ class Parser
 {
 public:
 	static Maybe<Item> parseForm(Context* context, char* cs, char** rest);
+	static void setHashConsing(bool hashConsing);
 	static void test();
 };
\ No newline at end of file
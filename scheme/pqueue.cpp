@@ -0,0 +1,611 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "pqueue.h"
+#include "memory.h"
+#include "eval.h"
+
+const type_info& ePriorityQueue = typeid(PriorityQueueRef);
+
+uint32_t PriorityQueue::append(const Item& priority, const Item& value)
+{
+	uint32_t handle;
+	if (!mFreeHandles.empty())
+	{
+		handle = mFreeHandles.back();
+		mFreeHandles.pop_back();
+		mPositions[handle] = size();
+	}
+	else
+	{
+		handle = (uint32_t)mPositions.size();
+		mPositions.push_back(size());
+	}
+
+	if (fixnum())
+	{
+		mRanks.push_back(boost::any_cast<Number>(priority));
+	}
+	else
+	{
+		mPriorities.push_back(priority);
+	}
+	mValues.push_back(value);
+	mHandles.push_back(handle);
+	return handle;
+}
+
+// The last entry takes the top's place.
+void PriorityQueue::removeTop()
+{
+	uint32_t last = size() - 1;
+	mPositions[mHandles[0]] = cPopped;
+	mFreeHandles.push_back(mHandles[0]);
+	if (last > 0)
+	{
+		if (fixnum())
+		{
+			mRanks[0] = mRanks[last];
+		}
+		else
+		{
+			mPriorities[0] = std::move(mPriorities[last]);
+		}
+		mValues[0] = std::move(mValues[last]);
+		mHandles[0] = mHandles[last];
+		mPositions[mHandles[0]] = 0;
+	}
+
+	if (fixnum())
+	{
+		mRanks.pop_back();
+	}
+	else
+	{
+		mPriorities.pop_back();
+	}
+	mValues.pop_back();
+	mHandles.pop_back();
+}
+
+void PriorityQueue::setPriority(uint32_t index, const Item& priority)
+{
+	if (fixnum())
+	{
+		mRanks[index] = boost::any_cast<Number>(priority);
+	}
+	else
+	{
+		mPriorities[index] = priority;
+	}
+}
+
+void PriorityQueue::swap(uint32_t first, uint32_t second)
+{
+	if (fixnum())
+	{
+		std::swap(mRanks[first], mRanks[second]);
+	}
+	else
+	{
+		std::swap(mPriorities[first], mPriorities[second]);
+	}
+	std::swap(mValues[first], mValues[second]);
+	std::swap(mHandles[first], mHandles[second]);
+	mPositions[mHandles[first]] = first;
+	mPositions[mHandles[second]] = second;
+}
+
+// The fixnum sifts carry the entry in hand and move the others past it, rather
+// than swapping at every level.
+void PriorityQueue::siftUp(uint32_t index)
+{
+	assert(fixnum());
+	Number rank = mRanks[index];
+	Item value = std::move(mValues[index]);
+	uint32_t handle = mHandles[index];
+
+	while (index > 0)
+	{
+		uint32_t parent = (index - 1) / cArity;
+		if (mRanks[parent] <= rank)
+		{
+			break;
+		}
+		mRanks[index] = mRanks[parent];
+		mValues[index] = std::move(mValues[parent]);
+		mHandles[index] = mHandles[parent];
+		mPositions[mHandles[index]] = index;
+		index = parent;
+	}
+
+	mRanks[index] = rank;
+	mValues[index] = std::move(value);
+	mHandles[index] = handle;
+	mPositions[handle] = index;
+}
+
+void PriorityQueue::siftDown(uint32_t index)
+{
+	assert(fixnum());
+	Number rank = mRanks[index];
+	Item value = std::move(mValues[index]);
+	uint32_t handle = mHandles[index];
+	uint32_t count = size();
+
+	for (;;)
+	{
+		uint32_t first = index * cArity + 1;
+		if (first >= count)
+		{
+			break;
+		}
+		uint32_t best = first;
+		for (uint32_t child = first + 1; child < std::min(first + cArity, count); child++)
+		{
+			if (mRanks[child] < mRanks[best])
+			{
+				best = child;
+			}
+		}
+		if (mRanks[best] >= rank)
+		{
+			break;
+		}
+		mRanks[index] = mRanks[best];
+		mValues[index] = std::move(mValues[best]);
+		mHandles[index] = mHandles[best];
+		mPositions[mHandles[index]] = index;
+		index = best;
+	}
+
+	mRanks[index] = rank;
+	mValues[index] = std::move(value);
+	mHandles[index] = handle;
+	mPositions[handle] = index;
+}
+
+// Bottom up from the last parent: linear time rather than n pushes.
+void PriorityQueue::heapify()
+{
+	for (uint32_t index = size() > 1 ? (size() - 2) / cArity + 1 : 0; index > 0; index--)
+	{
+		siftDown(index - 1);
+	}
+}
+
+void PriorityQueue::mark()
+{
+	if (mReachable)
+	{
+		return;
+	}
+
+	mReachable = true;
+	markItem(mLess);
+	for (auto& priority : mPriorities)
+	{
+		markItem(priority);
+	}
+	for (auto& value : mValues)
+	{
+		markItem(value);
+	}
+}
+
+typedef std::function<void(void)>	Done;
+
+// Asks the queue's procedure whether the entry at first comes out before the
+// one at second. The procedure may change the queue under the sift; positions
+// it has taken away compare false, which ends the sift.
+static void lessBy(PriorityQueueRef queue, uint32_t first, uint32_t second, Context* context, std::function<void(bool)> k)
+{
+	std::vector<Item> args(2);
+	args[0] = queue->mPriorities[first];
+	args[1] = queue->mPriorities[second];
+	apply(queue->mLess, args, context, [queue, first, second, k](Item result) {
+		bool less = result.type() != eNumber || boost::any_cast<Number>(result) != 0;
+		k(less && first < queue->size() && second < queue->size());
+	});
+}
+
+static void siftUpBy(PriorityQueueRef queue, uint32_t index, Context* context, Done k)
+{
+	if (index == 0)
+	{
+		k();
+		return;
+	}
+
+	uint32_t parent = (index - 1) / PriorityQueue::cArity;
+	lessBy(queue, index, parent, context, [queue, index, parent, context, k](bool less) {
+		if (!less)
+		{
+			k();
+			return;
+		}
+		queue->swap(index, parent);
+		siftUpBy(queue, parent, context, k);
+	});
+}
+
+static void bestChildBy(PriorityQueueRef queue, uint32_t best, uint32_t child, uint32_t end, Context* context, std::function<void(uint32_t)> k)
+{
+	if (child >= end)
+	{
+		k(best);
+		return;
+	}
+
+	lessBy(queue, child, best, context, [queue, best, child, end, context, k](bool less) {
+		bestChildBy(queue, less ? child : best, child + 1, end, context, k);
+	});
+}
+
+static void siftDownBy(PriorityQueueRef queue, uint32_t index, Context* context, Done k)
+{
+	uint32_t first = index * PriorityQueue::cArity + 1;
+	if (first >= queue->size())
+	{
+		k();
+		return;
+	}
+
+	uint32_t end = std::min(first + PriorityQueue::cArity, queue->size());
+	bestChildBy(queue, first, first + 1, end, context, [queue, index, context, k](uint32_t best) {
+		lessBy(queue, best, index, context, [queue, index, best, context, k](bool less) {
+			if (!less)
+			{
+				k();
+				return;
+			}
+			queue->swap(index, best);
+			siftDownBy(queue, best, context, k);
+		});
+	});
+}
+
+// Sifts down every parent below 'next', last first. Each one continues through
+// the trampoline, so a large heap doesn't grow the C++ stack.
+static void heapifyBy(PriorityQueueRef queue, uint32_t next, Context* context, Done k)
+{
+	if (next == 0)
+	{
+		k();
+		return;
+	}
+
+	siftDownBy(queue, next - 1, context, [queue, next, context, k]() {
+		yield([queue, next, context, k]() {
+			heapifyBy(queue, next - 1, context, k);
+		});
+	});
+}
+
+// Puts the entry at index back in heap order, whichever way its priority moved.
+static void restore(PriorityQueueRef queue, uint32_t index, Context* context, Done k)
+{
+	uint32_t handle = queue->mHandles[index];
+	if (queue->fixnum())
+	{
+		queue->siftUp(index);
+		queue->siftDown(queue->mPositions[handle]);
+		k();
+		return;
+	}
+
+	// the queue may be reachable from nowhere else while its procedure runs
+	gMemory.pushRoot(Item(queue));
+	siftUpBy(queue, index, context, [queue, handle, context, k]() {
+		Done finish = [k]() {
+			gMemory.popRoots(1);
+			k();
+		};
+		if (queue->live(handle))
+		{
+			siftDownBy(queue, queue->mPositions[handle], context, finish);
+		}
+		else
+		{
+			finish();
+		}
+	});
+}
+
+static PriorityQueueRef queueArg(const Item* args, uint32_t count, size_t index)
+{
+	if (index >= count || args[index].type() != ePriorityQueue)
+	{
+		return nullptr;
+	}
+	return boost::any_cast<PriorityQueueRef>(args[index]);
+}
+
+// (make-pq) orders by fixnum priority, smallest first; (make-pq less?) by a
+// procedure.
+Item makePq(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (count > 0 && args[0].type() != eProc)
+	{
+		*error = "&arg0-must-eval-to-proc";
+		return Item();
+	}
+
+	PriorityQueueRef queue = gMemory.allocPriorityQueue(context);
+	if (count > 0)
+	{
+		queue->mLess = args[0];
+	}
+	return Item(queue);
+}
+
+Item pqp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(queueArg(args, count, 0) ? 1 : 0));
+}
+
+Item pqSize(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		*error = "&arg0-must-eval-to-pq";
+		return Item();
+	}
+	return Item(Number(queue->size()));
+}
+
+Item pqEmpty(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		*error = "&arg0-must-eval-to-pq";
+		return Item();
+	}
+	return Item(Number(queue->size() == 0 ? 1 : 0));
+}
+
+// (pq-push! queue priority value) answers the entry's handle.
+void pqPush(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		raiseError("&arg0-must-eval-to-pq", k);
+	}
+	else if (queue->fixnum() && args[1].type() != eNumber)
+	{
+		raiseError("&arg1-must-eval-to-fixnum", k);
+	}
+	else
+	{
+		uint32_t handle = queue->append(args[1], args[2]);
+		restore(queue, queue->size() - 1, context, [handle, k]() {
+			k(Item(Number(handle)));
+		});
+	}
+}
+
+template<bool Priority>
+Item pqPeek(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		*error = "&arg0-must-eval-to-pq";
+	}
+	else if (queue->size() == 0)
+	{
+		*error = "&pq-is-empty";
+	}
+	else
+	{
+		return Priority ? queue->priority(0) : queue->mValues[0];
+	}
+	return Item();
+}
+
+void pqPop(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		raiseError("&arg0-must-eval-to-pq", k);
+		return;
+	}
+	else if (queue->size() == 0)
+	{
+		raiseError("&pq-is-empty", k);
+		return;
+	}
+
+	Item value = queue->mValues[0];
+	queue->removeTop();
+	if (queue->size() == 0)
+	{
+		k(value);
+		return;
+	}
+	gMemory.pushRoot(value);
+	restore(queue, 0, context, [value, k]() {
+		gMemory.popRoots(1);
+		k(value);
+	});
+}
+
+// (pq-decrease-key! queue handle priority) gives a pushed entry a new
+// priority; it moves whichever way the priority did.
+void pqDecreaseKey(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	PriorityQueueRef queue = queueArg(args, count, 0);
+	if (!queue)
+	{
+		raiseError("&arg0-must-eval-to-pq", k);
+	}
+	else if (args[1].type() != eNumber || boost::any_cast<Number>(args[1]) < 0 || !queue->live(boost::any_cast<Number>(args[1])))
+	{
+		raiseError("&arg1-must-eval-to-live-handle", k);
+	}
+	else if (queue->fixnum() && args[2].type() != eNumber)
+	{
+		raiseError("&arg2-must-eval-to-fixnum", k);
+	}
+	else
+	{
+		uint32_t index = queue->mPositions[boost::any_cast<Number>(args[1])];
+		queue->setPriority(index, args[2]);
+		restore(queue, index, context, [k]() {
+			k(Unspecified());
+		});
+	}
+}
+
+// (list->pq alist [less?]) heapifies (priority . value) pairs in linear time.
+// Their handles count up from 0 in list order.
+void listToPq(const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	if (args[0].type() != eCell)
+	{
+		raiseError("&arg0-must-eval-to-list", k);
+		return;
+	}
+	else if (count > 1 && args[1].type() != eProc)
+	{
+		raiseError("&arg1-must-eval-to-proc", k);
+		return;
+	}
+
+	bool fixnum = count < 2;
+	for (CellRef cell = boost::any_cast<CellRef>(args[0]); cell; cell = cell->next())
+	{
+		if (cell->mCar.type() != eCell || !boost::any_cast<CellRef>(cell->mCar) || (fixnum && boost::any_cast<CellRef>(cell->mCar)->mCar.type() != eNumber))
+		{
+			raiseError(fixnum ? "&arg0-must-eval-to-alist-with-fixnum-priorities" : "&arg0-must-eval-to-alist", k);
+			return;
+		}
+	}
+
+	gMemory.pushRoot(args[0]);
+	if (!fixnum)
+	{
+		gMemory.pushRoot(args[1]);
+	}
+	PriorityQueueRef queue = gMemory.allocPriorityQueue(context);
+	gMemory.popRoots(fixnum ? 1 : 2);
+	if (!fixnum)
+	{
+		queue->mLess = args[1];
+	}
+	for (CellRef cell = boost::any_cast<CellRef>(args[0]); cell; cell = cell->next())
+	{
+		CellRef entry = boost::any_cast<CellRef>(cell->mCar);
+		queue->append(entry->mCar, entry->cdr());
+	}
+
+	if (fixnum)
+	{
+		queue->heapify();
+		k(Item(queue));
+		return;
+	}
+	gMemory.pushRoot(Item(queue));
+	uint32_t parents = queue->size() > 1 ? (queue->size() - 2) / PriorityQueue::cArity + 1 : 0;
+	heapifyBy(queue, parents, context, [queue, k]() {
+		gMemory.popRoots(1);
+		k(Item(queue));
+	});
+}
+
+void addPriorityQueueNatives()
+{
+	definePrimitive("make-pq", makePq, 0, 1, true);
+	definePrimitive("pq?", pqp, 1, 1, false);
+	definePrimitive("pq-size", pqSize, 1, 1, false);
+	definePrimitive("pq-empty?", pqEmpty, 1, 1, false);
+	defineCallingPrimitive("pq-push!", pqPush, 3, 3);
+	definePrimitive("pq-peek", pqPeek<false>, 1, 1, false);
+	definePrimitive("pq-peek-priority", pqPeek<true>, 1, 1, false);
+	defineCallingPrimitive("pq-pop!", pqPop, 1, 1);
+	defineCallingPrimitive("pq-decrease-key!", pqDecreaseKey, 3, 3);
+	defineCallingPrimitive("list->pq", listToPq, 1, 2);
+}
+
+static bool ordered(const PriorityQueue& queue)
+{
+	for (uint32_t i = 1; i < queue.size(); i++)
+	{
+		if (queue.mRanks[(i - 1) / PriorityQueue::cArity] > queue.mRanks[i] || queue.mPositions[queue.mHandles[i]] != i)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static Number popTop(PriorityQueue& queue)
+{
+	Number top = queue.mRanks[0];
+	queue.removeTop();
+	if (queue.size() > 0)
+	{
+		queue.siftDown(0);
+	}
+	return top;
+}
+
+void test_pqueue()
+{
+	// pushes in a scrambled order pop out sorted
+	PriorityQueue queue;
+	std::vector<uint32_t> handles;
+	for (Number i = 0; i < 1000; i++)
+	{
+		handles.push_back(queue.append(Item(Number(i * 7919 % 1000)), Item(i)));
+		queue.siftUp(queue.size() - 1);
+	}
+	assert(ordered(queue));
+	for (Number i = 0; i < 500; i++)
+	{
+		Number top = popTop(queue);
+		assert(top == i);
+	}
+	assert(queue.size() == 500 && ordered(queue));
+
+	// decrease-key moves an entry to the front; popped handles are reused
+	uint32_t handle = 0;
+	for (uint32_t i = 0; i < handles.size(); i++)
+	{
+		if (i * 7919 % 1000 == 900)
+		{
+			handle = handles[i];
+		}
+	}
+	assert(queue.live(handle));
+	uint32_t index = queue.mPositions[handle];
+	queue.setPriority(index, Item(Number(-1)));
+	queue.siftUp(index);
+	assert(ordered(queue) && queue.mHandles[0] == handle);
+	Number top = popTop(queue);
+	assert(top == -1 && !queue.live(handle));
+	uint32_t reused = queue.append(Item(Number(5000)), Item(Number(0)));
+	assert(reused == handle);
+	queue.siftUp(queue.size() - 1);
+
+	// heapify matches pushing one at a time
+	PriorityQueue bulk;
+	for (Number i = 0; i < 1000; i++)
+	{
+		bulk.append(Item(Number(i * 7919 % 1000)), Item(i));
+	}
+	bulk.heapify();
+	assert(ordered(bulk));
+	for (Number i = 0; i < 1000; i++)
+	{
+		Number top = popTop(bulk);
+		assert(top == i);
+	}
+	assert(bulk.size() == 0);
+}
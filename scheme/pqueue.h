@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// A min-heap in one array, four children to a node: half the depth of a binary
+// heap, and a node's children share a cache line. Entries are ordered either
+// by fixnum priority, compared inline, or by a Scheme procedure (less? a b).
+// Pushing hands back a handle that names the entry until it is popped, so its
+// priority can be changed in place; popped handles are reused.
+struct PriorityQueue : public Collectable<PriorityQueue>
+{
+	const static uint32_t cArity = 4;
+	const static uint32_t cPopped = 0xffffffff;
+
+	Item					mLess;			// Unspecified in fixnum mode
+	std::vector<Number>		mRanks;			// fixnum mode: the priorities
+	std::vector<Item>		mPriorities;	// otherwise
+	std::vector<Item>		mValues;
+	std::vector<uint32_t>	mHandles;		// heap index to handle
+	std::vector<uint32_t>	mPositions;		// handle to heap index, or cPopped
+	std::vector<uint32_t>	mFreeHandles;
+
+	PriorityQueue()
+		: mLess(Unspecified())
+	{}
+
+	bool		fixnum() const { return mLess.type() != eProc; }
+	uint32_t	size() const { return (uint32_t)mValues.size(); }
+	Item		priority(uint32_t index) const { return fixnum() ? Item(mRanks[index]) : mPriorities[index]; }
+	bool		live(uint32_t handle) const { return handle < mPositions.size() && mPositions[handle] != cPopped; }
+
+	// These leave the heap order to be restored by the caller.
+	uint32_t	append(const Item& priority, const Item& value);		// the new entry's handle
+	void		removeTop();
+	void		setPriority(uint32_t index, const Item& priority);
+	void		swap(uint32_t first, uint32_t second);
+
+	// Heap order in fixnum mode; a comparator calls back into Scheme, so the
+	// natives restore the order in continuation passing style instead.
+	void		siftUp(uint32_t index);
+	void		siftDown(uint32_t index);
+	void		heapify();
+
+	void		mark() override;
+};
+
+typedef PriorityQueue*		PriorityQueueRef;
+
+extern const type_info& ePriorityQueue;
+
+void	addPriorityQueueNatives();
+void	test_pqueue();
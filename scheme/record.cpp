@@ -0,0 +1,208 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <sstream>
+#include <vector>
+#include "record.h"
+#include "symboltable.h"
+#include "context.h"
+#include "memory.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+extern std::string print(Item);
+
+const type_info& eRecordType	= typeid(RecordTypeRef);
+const type_info& eRecord		= typeid(RecordRef);
+
+void Record::mark()
+{
+	if (mReachable)
+	{
+		return;
+	}
+
+	mReachable = true;
+	for (auto& slot : mSlots)
+	{
+		markItem(slot);
+	}
+}
+
+std::string recordToString(RecordRef record)
+{
+	std::ostringstream text;
+	text << "#<" << gSymbolTable.GetString(record->mType->mName) << " ";
+	for (auto& slot : record->mSlots)
+	{
+		text << print(slot);
+	}
+	text << "> ";
+	return text.str();
+}
+
+// The elements of a proper list, or false if it isn't one.
+static bool listElements(const Item& list, std::vector<Item>* elements)
+{
+	if (list.type() != eCell)
+	{
+		return false;
+	}
+	for (CellRef cell = boost::any_cast<CellRef>(list); cell; cell = cell->next())
+	{
+		elements->push_back(cell->mCar);
+		if (cell->cdr().type() != eCell)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool allSymbols(const std::vector<Item>& items)
+{
+	for (auto& item : items)
+	{
+		if (item.type() != eSymbol)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static int32_t fieldIndex(const RecordType& type, Symbol field)
+{
+	for (size_t i = 0; i < type.mFields.size(); i++)
+	{
+		if (type.mFields[i] == field)
+		{
+			return (int32_t)i;
+		}
+	}
+	return -1;
+}
+
+static Item constructor(RecordTypeRef type, const std::vector<uint32_t>& slots)
+{
+	auto calls = [type, slots](const Item* args, uint32_t count, Context* context, Continuation k) {
+		for (uint32_t i = 0; i < count; i++)
+		{
+			gMemory.pushRoot(args[i]);
+		}
+		RecordRef record = gMemory.allocRecord(context, type);
+		gMemory.popRoots(count);
+
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			record->mSlots[slots[i]] = args[i];
+		}
+		k(Item(record));
+	};
+	return callingPrimitiveProc(calls, (uint32_t)slots.size(), (uint32_t)slots.size());
+}
+
+static Item predicate(RecordTypeRef type)
+{
+	auto calls = [type](const Item* args, uint32_t count, Context* context, Continuation k) {
+		bool is = args[0].type() == eRecord && boost::any_cast<RecordRef>(args[0])->mType == type;
+		k(Item(Number(is ? 1 : 0)));
+	};
+	return callingPrimitiveProc(calls, 1, 1);
+}
+
+static Item accessor(RecordTypeRef type, uint32_t slot)
+{
+	auto calls = [type, slot](const Item* args, uint32_t count, Context* context, Continuation k) {
+		if (args[0].type() != eRecord || boost::any_cast<RecordRef>(args[0])->mType != type)
+		{
+			raiseError("&arg0-must-eval-to-" + gSymbolTable.GetString(type->mName), k);
+			return;
+		}
+		k(boost::any_cast<RecordRef>(args[0])->mSlots[slot]);
+	};
+	return callingPrimitiveProc(calls, 1, 1);
+}
+
+static Item modifier(RecordTypeRef type, uint32_t slot)
+{
+	auto calls = [type, slot](const Item* args, uint32_t count, Context* context, Continuation k) {
+		if (args[0].type() != eRecord || boost::any_cast<RecordRef>(args[0])->mType != type)
+		{
+			raiseError("&arg0-must-eval-to-" + gSymbolTable.GetString(type->mName), k);
+			return;
+		}
+		boost::any_cast<RecordRef>(args[0])->mSlots[slot] = args[1];
+		k(Unspecified());
+	};
+	return callingPrimitiveProc(calls, 2, 2);
+}
+
+// (define-record-type name (constructor field ...) predicate (field accessor [modifier]) ...)
+// Nothing is evaluated; the descriptor and the procedures are bound in the
+// defining context.
+void defineRecordType(Item pair, Context* context, Continuation k)
+{
+	std::vector<Item> parts;
+	if (!listElements(pair, &parts) || parts.size() < 3 || parts[0].type() != eSymbol || parts[2].type() != eSymbol)
+	{
+		raiseError("&malformed-record-type", k);
+		return;
+	}
+
+	auto type = std::make_shared<RecordType>();
+	type->mName = boost::any_cast<Symbol>(parts[0]);
+	std::vector< std::vector<Item> > fields(parts.size() - 3);
+	for (size_t i = 3; i < parts.size(); i++)
+	{
+		std::vector<Item>& field = fields[i - 3];
+		if (!listElements(parts[i], &field) || field.size() < 2 || field.size() > 3 || !allSymbols(field))
+		{
+			raiseError("&malformed-record-field", k);
+			return;
+		}
+		type->mFields.push_back(boost::any_cast<Symbol>(field[0]));
+	}
+
+	std::vector<Item> signature;
+	if (!listElements(parts[1], &signature) || signature.empty() || !allSymbols(signature))
+	{
+		raiseError("&malformed-record-constructor", k);
+		return;
+	}
+	std::vector<uint32_t> slots;
+	for (size_t i = 1; i < signature.size(); i++)
+	{
+		int32_t slot = fieldIndex(*type, boost::any_cast<Symbol>(signature[i]));
+		if (slot < 0)
+		{
+			raiseError("&constructor-names-unknown-field", k);
+			return;
+		}
+		slots.push_back(slot);
+	}
+
+	RecordTypeRef descriptor = type;
+	context->Set(descriptor->mName, Item(descriptor));
+	context->Set(boost::any_cast<Symbol>(signature[0]), constructor(descriptor, slots));
+	context->Set(boost::any_cast<Symbol>(parts[2]), predicate(descriptor));
+	for (uint32_t slot = 0; slot < fields.size(); slot++)
+	{
+		context->Set(boost::any_cast<Symbol>(fields[slot][1]), accessor(descriptor, slot));
+		if (fields[slot].size() == 3)
+		{
+			context->Set(boost::any_cast<Symbol>(fields[slot][2]), modifier(descriptor, slot));
+		}
+	}
+	k(Item(descriptor->mName));
+}
+
+Item recordp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(args[0].type() == eRecord ? 1 : 0));
+}
+
+void addRecordNatives()
+{
+	defineSyntax("define-record-type", defineRecordType);
+	definePrimitive("record?", recordp, 1, 1, false);
+}
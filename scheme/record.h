@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// What define-record-type declares: the type's name and its fields in slot
+// order. The accessors it defines capture the descriptor and their slot index,
+// so nothing is looked up by name once the type is defined.
+struct RecordType
+{
+	Symbol				mName;
+	std::vector<Symbol>	mFields;
+};
+
+typedef std::shared_ptr<const RecordType>	RecordTypeRef;
+
+// An instance: its descriptor and one contiguous slot per field.
+struct Record : public Collectable<Record>
+{
+	RecordTypeRef		mType;
+	std::vector<Item>	mSlots;
+
+	Record()
+	{}
+	Record(RecordTypeRef type)
+		: mType(type)
+		, mSlots(type->mFields.size(), Item(Unspecified()))
+	{}
+
+	void mark() override;
+};
+
+typedef Record*		RecordRef;
+
+extern const type_info& eRecordType;
+extern const type_info& eRecord;
+
+std::string	recordToString(RecordRef record);
+void		addRecordNatives();
@@ -0,0 +1,315 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include "rope.h"
+#include "memory.h"
+#include "eval.h"
+
+const type_info& eRope = typeid(RopeRef);
+
+static uint32_t height(const RopeTree& tree)
+{
+	return tree ? tree->mHeight : 0;
+}
+
+RopeTree ropeLeaf(StringBuffer buffer, uint32_t offset, uint32_t bytes, uint32_t length)
+{
+	if (bytes == 0)
+	{
+		return RopeTree();
+	}
+
+	auto leaf = std::make_shared<RopeNode>();
+	leaf->mBuffer = buffer;
+	leaf->mOffset = offset;
+	leaf->mBytes = bytes;
+	leaf->mLength = length;
+	leaf->mHeight = 0;
+	return leaf;
+}
+
+static RopeTree node(const RopeTree& left, const RopeTree& right)
+{
+	auto concat = std::make_shared<RopeNode>();
+	concat->mLeft = left;
+	concat->mRight = right;
+	concat->mOffset = 0;
+	concat->mBytes = left->mBytes + right->mBytes;
+	concat->mLength = left->mLength + right->mLength;
+	concat->mHeight = 1 + std::max(left->mHeight, right->mHeight);
+	return concat;
+}
+
+// Joins two trees whose heights differ by at most two, rotating once or twice
+// to bring the difference back to one.
+static RopeTree balance(const RopeTree& left, const RopeTree& right)
+{
+	if (height(left) > height(right) + 1)
+	{
+		if (height(left->mLeft) >= height(left->mRight))
+		{
+			return node(left->mLeft, node(left->mRight, right));
+		}
+		const RopeTree& middle = left->mRight;
+		return node(node(left->mLeft, middle->mLeft), node(middle->mRight, right));
+	}
+	else if (height(right) > height(left) + 1)
+	{
+		if (height(right->mRight) >= height(right->mLeft))
+		{
+			return node(node(left, right->mLeft), right->mRight);
+		}
+		const RopeTree& middle = right->mLeft;
+		return node(node(left, middle->mLeft), node(middle->mRight, right->mRight));
+	}
+	return node(left, right);
+}
+
+// The shorter tree is joined in down the taller one's spine, so a
+// concatenation costs the difference in their heights.
+RopeTree ropeConcat(const RopeTree& left, const RopeTree& right)
+{
+	if (!left)
+	{
+		return right;
+	}
+	else if (!right)
+	{
+		return left;
+	}
+
+	// keep appends of small pieces from growing a leaf per piece
+	if (left->leaf() && right->leaf() && left->mBytes + right->mBytes <= RopeNode::cLeafBytes)
+	{
+		auto text = std::make_shared<std::string>(left->mBuffer->data() + left->mOffset, left->mBytes);
+		text->append(right->mBuffer->data() + right->mOffset, right->mBytes);
+		return ropeLeaf(text, 0, (uint32_t)text->size(), left->mLength + right->mLength);
+	}
+
+	if (left->mHeight > right->mHeight + 1)
+	{
+		return balance(left->mLeft, ropeConcat(left->mRight, right));
+	}
+	else if (right->mHeight > left->mHeight + 1)
+	{
+		return balance(ropeConcat(left, right->mLeft), right->mRight);
+	}
+	return node(left, right);
+}
+
+// Code points [start, end). Whole subtrees are shared; only the two edges of
+// the range are cut, as new slices of their leaves' buffers.
+RopeTree ropeSubstring(const RopeTree& tree, uint32_t start, uint32_t end)
+{
+	if (!tree || start >= end)
+	{
+		return RopeTree();
+	}
+	else if (start == 0 && end == tree->mLength)
+	{
+		return tree;
+	}
+	else if (tree->leaf())
+	{
+		String slice(tree->mBuffer, tree->mOffset, tree->mBytes, tree->mLength);
+		uint32_t begin = slice.byteOffset(start);
+		return ropeLeaf(tree->mBuffer, tree->mOffset + begin, slice.byteOffset(end) - begin, end - start);
+	}
+
+	uint32_t split = tree->mLeft->mLength;
+	if (end <= split)
+	{
+		return ropeSubstring(tree->mLeft, start, end);
+	}
+	else if (start >= split)
+	{
+		return ropeSubstring(tree->mRight, start - split, end - split);
+	}
+	return ropeConcat(ropeSubstring(tree->mLeft, start, split), ropeSubstring(tree->mRight, 0, end - split));
+}
+
+void ropeAppendTo(const RopeTree& tree, std::string& out)
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	out.reserve(out.size() + tree->mBytes);
+	std::vector<const RopeNode*> stack(1, tree.get());
+	while (!stack.empty())
+	{
+		const RopeNode* rope = stack.back();
+		stack.pop_back();
+		if (rope->leaf())
+		{
+			out.append(rope->mBuffer->data() + rope->mOffset, rope->mBytes);
+		}
+		else
+		{
+			stack.push_back(rope->mRight.get());
+			stack.push_back(rope->mLeft.get());
+		}
+	}
+}
+
+std::string Rope::str() const
+{
+	std::string text;
+	ropeAppendTo(mTree, text);
+	return text;
+}
+
+// Strings and ropes both read as trees; anything else doesn't.
+static bool treeArg(const Item& item, RopeTree* tree)
+{
+	if (item.type() == eRope)
+	{
+		*tree = boost::any_cast<RopeRef>(item)->mTree;
+		return true;
+	}
+	else if (item.type() == eString)
+	{
+		auto string = boost::any_cast<StringRef>(item);
+		*tree = ropeLeaf(string->mBuffer, string->mOffset, string->mBytes, string->mLength);
+		return true;
+	}
+	return false;
+}
+
+// (rope-append x ...) of strings and ropes; (rope-append s) turns a string into a rope
+Item ropeAppend(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	RopeTree tree;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		RopeTree piece;
+		if (!treeArg(args[i], &piece))
+		{
+			*error = "&args-must-eval-to-strings-or-ropes";
+			return Item();
+		}
+		tree = ropeConcat(tree, piece);
+	}
+	return Item(gMemory.allocRope(context, tree));
+}
+
+Item ropep(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(args[0].type() == eRope ? 1 : 0));
+}
+
+Item ropeLength(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eRope)
+	{
+		*error = "&arg0-must-eval-to-rope";
+		return Item();
+	}
+	return Item(Number(boost::any_cast<RopeRef>(args[0])->length()));
+}
+
+// (rope-substring r start [end])
+Item ropeSubstringProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eRope)
+	{
+		*error = "&arg0-must-eval-to-rope";
+		return Item();
+	}
+
+	RopeTree tree = boost::any_cast<RopeRef>(args[0])->mTree;
+	Number length = tree ? tree->mLength : 0;
+	Number start = args[1].type() == eNumber ? boost::any_cast<Number>(args[1]) : -1;
+	Number end = count > 2 && args[2].type() == eNumber ? boost::any_cast<Number>(args[2]) : length;
+	if (start < 0 || end < start || end > length)
+	{
+		*error = "&index-out-of-range";
+		return Item();
+	}
+	return Item(gMemory.allocRope(context, ropeSubstring(tree, start, end)));
+}
+
+Item ropeToString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eRope)
+	{
+		*error = "&arg0-must-eval-to-rope";
+		return Item();
+	}
+	return Item(gMemory.allocString(context, boost::any_cast<RopeRef>(args[0])->str()));
+}
+
+void addRopeNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("rope-append", ropeAppend, 0, any, true);
+	definePrimitive("rope?", ropep, 1, 1, false);
+	definePrimitive("rope-length", ropeLength, 1, 1, false);
+	definePrimitive("rope-substring", ropeSubstringProc, 2, 3, true);
+	definePrimitive("rope->string", ropeToString, 1, 1, true);
+}
+
+static bool balanced(const RopeTree& tree)
+{
+	if (!tree || tree->leaf())
+	{
+		return true;
+	}
+	uint32_t left = height(tree->mLeft), right = height(tree->mRight);
+	return (left > right ? left - right : right - left) <= 1 && balanced(tree->mLeft) && balanced(tree->mRight);
+}
+
+static RopeTree leafOf(const std::string& text)
+{
+	auto buffer = std::make_shared<const std::string>(text);
+	return ropeLeaf(buffer, 0, (uint32_t)text.size(), String::countCodePoints(text.data(), text.size()));
+}
+
+void test_ropes()
+{
+	// many appends stay balanced and read back in order
+	RopeTree tree;
+	std::string expected;
+	for (int i = 0; i < 5000; i++)
+	{
+		std::string piece = std::to_string((long long)i) + std::string(i % 700, 'x') + ",";
+		tree = ropeConcat(tree, leafOf(piece));
+		expected += piece;
+	}
+	assert(balanced(tree));
+	assert(tree->mBytes == expected.size());
+	assert(tree->mHeight < 30);
+	std::string flat;
+	ropeAppendTo(tree, flat);
+	assert(flat == expected);
+
+	// prepends and joins of similar trees too
+	RopeTree front;
+	for (int i = 0; i < 1000; i++)
+	{
+		front = ropeConcat(leafOf(std::string(600, 'a' + i % 26)), front);
+	}
+	RopeTree both = ropeConcat(front, tree);
+	assert(balanced(front) && balanced(both));
+	assert(both->mLength == front->mLength + tree->mLength);
+
+	// substrings share the leaves' buffers and cut across any number of them
+	std::string cut;
+	ropeAppendTo(ropeSubstring(tree, 1234, 987654), cut);
+	assert(cut == expected.substr(1234, 987654 - 1234));
+	RopeTree single = ropeSubstring(tree, 3, 5);
+	assert(single->leaf() && single->mBytes == 2);
+	assert(!ropeSubstring(tree, 10, 10));
+
+	// code point indexing through multi-byte leaves
+	RopeTree accented = ropeConcat(leafOf("caf\xc3\xa9 "), leafOf(std::string(600, 'z') + "na\xc3\xafve"));
+	assert(accented->mLength == 610);
+	std::string word;
+	ropeAppendTo(ropeSubstring(accented, 3, 6), word);
+	assert(word == "\xc3\xa9 z");
+	word.clear();
+	ropeAppendTo(ropeSubstring(accented, 605, 609), word);
+	assert(word == "na\xc3\xafv");
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include "schemetypes.h"
+#include "collectable.h"
+#include "schemestring.h"
+
+struct RopeNode;
+typedef std::shared_ptr<const RopeNode>	RopeTree;
+
+// An immutable, height balanced concatenation tree. Leaves are slices of
+// string buffers, so a rope built from strings shares their text; only leaves
+// shorter than cLeafBytes are copied together when appended.
+struct RopeNode
+{
+	const static uint32_t cLeafBytes = 512;
+
+	RopeTree		mLeft;			// null in a leaf
+	RopeTree		mRight;
+	StringBuffer	mBuffer;		// leaf text
+	uint32_t		mOffset;
+	uint32_t		mBytes;
+	uint32_t		mLength;		// code points
+	uint32_t		mHeight;		// 0 for a leaf
+
+	bool leaf() const { return !mLeft; }
+};
+
+RopeTree	ropeLeaf(StringBuffer buffer, uint32_t offset, uint32_t bytes, uint32_t length);
+RopeTree	ropeConcat(const RopeTree& left, const RopeTree& right);
+RopeTree	ropeSubstring(const RopeTree& tree, uint32_t start, uint32_t end);
+void		ropeAppendTo(const RopeTree& tree, std::string& out);
+
+// A rope as a heap object; the tree itself is reference counted.
+struct Rope : public Collectable<Rope>
+{
+	RopeTree	mTree;
+
+	Rope()
+	{}
+	Rope(RopeTree tree)
+		: mTree(tree)
+	{}
+
+	uint32_t	length() const { return mTree ? mTree->mLength : 0; }
+	std::string	str() const;
+	void		mark() override { mReachable = true; }
+};
+
+typedef Rope*	RopeRef;
+
+extern const type_info& eRope;
+
+void	addRopeNatives();
+void	test_ropes();
@@ -1,8 +1,11 @@
 // scheme.cpp : Defines the entry point for the console application.
 //
 #include "stdafx.h"
+#include <algorithm>
 #include <map>
+#include <set>
 #include <assert.h>
+#include <math.h>
 #include <sstream>
 #include <functional>
 #include "boost\any.hpp"
@@ -14,23 +17,163 @@
 #include "memory.h"
 #include "parser.h"
 #include "list.h"
+#include "cellheap.h"
+#include "bench.h"
+#include "numeric.h"
+#include "numvector.h"
+#include "vector.h"
+#include "schemestring.h"
+#include "rope.h"
+#include "bytevector.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "record.h"
+#include "btree.h"
+#include "pqueue.h"
+#include "analyze.h"
+#include "vm.h"
+#include "aot.h"
+#include "jit.h"
+#include "walker.h"
+#include "eval.h"
 
 bool gTrace = false;
 bool gVerboseGC = false;
+EvalMode gEvalMode = eWalk;
 
 SymbolTable gSymbolTable;
 Memory		gMemory;
 
-struct Context;
-void eval(Item item, Context* context, std::function<void(Item)> k);
+static std::function<void(void)>									gNext;
+static std::function<void(std::string, std::function<void(Item)>)>	gThrow = [](std::string msg, std::function<void(Item)> k){ puts(msg.c_str()); };
+
+void raiseError(const std::string& ex, Continuation k)
+{
+	gThrow(ex, k);
+}
+
+void defineNative(const char* name, Native native)
+{
+	gMemory.getRoot()->Set(gSymbolTable.GetSymbol(name), Item( Proc(native) ));
+}
+
+// What a primitive is called as by code that hands it the forms, such as a
+// native calling the proc it was given.
+struct PrimitiveCall
+{
+	std::shared_ptr<const Primitive>	mPrimitive;
+
+	void operator()(Item pair, Context* context, Continuation k) const
+	{
+		auto primitive = mPrimitive;
+		evalArgs(pair, context, [primitive, context, k](const std::vector<Item>& values) {
+			callPrimitive(*primitive, values.empty() ? nullptr : &values[0], (uint32_t)values.size(), context, k);
+		});
+	}
+};
+
+static Item primitiveProc(const std::shared_ptr<const Primitive>& primitive)
+{
+	PrimitiveCall call = { primitive };
+	Proc proc(call);
+	proc.mPrimitive = primitive.get();
+	return Item(proc);
+}
+
+void definePrimitive(const char* name, PrimitiveFn fn, uint32_t minArgs, uint32_t maxArgs, bool allocates)
+{
+	auto primitive = std::make_shared<Primitive>();
+	primitive->mFn = fn;
+	primitive->mMinArgs = minArgs;
+	primitive->mMaxArgs = maxArgs;
+	primitive->mAllocates = allocates;
+	gMemory.getRoot()->Set(gSymbolTable.GetSymbol(name), primitiveProc(primitive));
+}
+
+Item callingPrimitiveProc(PrimitiveCalls calls, uint32_t minArgs, uint32_t maxArgs)
+{
+	auto primitive = std::make_shared<Primitive>();
+	primitive->mFn = nullptr;
+	primitive->mCalls = calls;
+	primitive->mMinArgs = minArgs;
+	primitive->mMaxArgs = maxArgs;
+	primitive->mAllocates = false;
+	return primitiveProc(primitive);
+}
+
+void defineCallingPrimitive(const char* name, PrimitiveCalls calls, uint32_t minArgs, uint32_t maxArgs)
+{
+	gMemory.getRoot()->Set(gSymbolTable.GetSymbol(name), callingPrimitiveProc(calls, minArgs, maxArgs));
+}
+
+bool callPrimitive(const Primitive& primitive, const Item* args, uint32_t count, Context* context, Item* result, std::string* error)
+{
+	if (count < primitive.mMinArgs || count > primitive.mMaxArgs)
+	{
+		*error = "&wrong-number-of-args";
+		return false;
+	}
+	if (!primitive.mAllocates)
+	{
+		*result = primitive.mFn(args, count, context, error);
+		return error->empty();
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		gMemory.pushRoot(args[i]);
+	}
+	*result = primitive.mFn(args, count, context, error);
+	gMemory.popRoots(count);
+	return error->empty();
+}
+
+void callPrimitive(const Primitive& primitive, const Item* args, uint32_t count, Context* context, Continuation k)
+{
+	if (primitive.mCalls)
+	{
+		if (count < primitive.mMinArgs || count > primitive.mMaxArgs)
+		{
+			raiseError("&wrong-number-of-args", k);
+			return;
+		}
+		primitive.mCalls(args, count, context, k);
+		return;
+	}
+
+	Item result;
+	std::string error;
+	if (callPrimitive(primitive, args, count, context, &result, &error))
+	{
+		k(result);
+	}
+	else
+	{
+		raiseError(error, k);
+	}
+}
+
+static std::set<Symbol> gSyntax;
+
+void defineSyntax(const char* name, Native native)
+{
+	defineNative(name, native);
+	gSyntax.insert(gSymbolTable.GetSymbol(name));
+}
+
+bool isSyntax(Symbol symbol)
+{
+	return gSyntax.count(symbol) != 0;
+}
+
 
 std::string print(Item item)
 {
 	std::stringstream sstream;
 
-	if (item.type() == eNumber)
+	if (isNumber(item))
 	{
-		sstream << boost::any_cast<Number>(item) << " ";
+		sstream << numToString(item) << " ";
 	}
 	else if (item.type() == eSymbol)
 	{
@@ -40,7 +183,7 @@ std::string print(Item item)
 	{
 		if (boost::any_cast<CellRef>(item))
 		{
-			sstream << "( " << print(boost::any_cast<CellRef>(item)->mCar) << ". " << print(boost::any_cast<CellRef>(item)->mCdr) << ") ";
+			sstream << "( " << print(boost::any_cast<CellRef>(item)->mCar) << ". " << print(boost::any_cast<CellRef>(item)->cdr()) << ") ";
 		}
 		else
 		{
@@ -58,6 +201,60 @@ std::string print(Item item)
 			sstream << "native proc or continuation";
 		}
 	}
+	else if (item.type() == eVector)
+	{
+		sstream << vectorToString(boost::any_cast<VectorRef>(item));
+	}
+	else if (item.type() == eString)
+	{
+		auto string = boost::any_cast<StringRef>(item);
+		sstream << stringLiteral(string->data(), string->mBytes) << " ";
+	}
+	else if (item.type() == eRope)
+	{
+		std::string text = boost::any_cast<RopeRef>(item)->str();
+		sstream << stringLiteral(text.data(), text.size()) << " ";
+	}
+	else if (item.type() == eBytevector)
+	{
+		sstream << bytevectorToString(boost::any_cast<BytevectorRef>(item));
+	}
+	else if (item.type() == eHashTable)
+	{
+		sstream << "hashtable ";
+	}
+	else if (item.type() == eHamt)
+	{
+		sstream << (boost::any_cast<HamtRef>(item)->mEdit ? "transient-hamt " : "hamt ");
+	}
+	else if (item.type() == eRecord)
+	{
+		sstream << recordToString(boost::any_cast<RecordRef>(item));
+	}
+	else if (item.type() == eRecordType)
+	{
+		sstream << "#<record-type " << gSymbolTable.GetString(boost::any_cast<RecordTypeRef>(item)->mName) << "> ";
+	}
+	else if (item.type() == eBTree)
+	{
+		sstream << "btree ";
+	}
+	else if (item.type() == ePriorityQueue)
+	{
+		sstream << "pq ";
+	}
+	else if (item.type() == ePort)
+	{
+		sstream << "port ";
+	}
+	else if (item.type() == eEof)
+	{
+		sstream << "eof ";
+	}
+	else if (item.type() == eF64Vector || item.type() == eS32Vector)
+	{
+		sstream << numVectorToString(item);
+	}
 	else if (item.type() == eUnspecified)
 	{
 		sstream << "unspecified ";
@@ -66,106 +263,254 @@ std::string print(Item item)
 	return sstream.str();
 }
 
-template<typename T>
-void typecheck(Item item, std::string ex, std::function<void(Item)> k)
+// Primitives are handed their arguments evaluated, so they neither evaluate
+// nor make continuations of their own.
+
+static bool isPair(const Item& item)
+{
+	return item.type() == eCell && item.get<CellRef>() != nullptr;
+}
+
+static bool numberArgs(const Item* args, uint32_t count, std::string* error)
 {
-	if (item.type() != typeid(T))
+	for (uint32_t i = 0; i < count; i++)
 	{
-		gThrow(ex, k);
+		if (!isNumber(args[i]))
+		{
+			*error = "&arg" + std::to_string(i) + "-must-eval-to-number";
+			return false;
+		}
+	}
+	return true;
+}
+
+Item cons(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(gMemory.allocCell(context, args[0], args[1]));
+}
+
+Item null(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(args[0].type() == eCell && args[0].get<CellRef>() == nullptr ? 1 : 0));
+}
+
+Item carProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!isPair(args[0]))
+	{
+		*error = "&arg0-must-eval-to-pair";
+		return Item();
+	}
+	return args[0].get<CellRef>()->mCar;
+}
+
+Item cdrProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!isPair(args[0]))
+	{
+		*error = "&arg0-must-eval-to-pair";
+		return Item();
+	}
+	return args[0].get<CellRef>()->cdr();
+}
+
+Item hcons(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(gMemory.hcons(context, args[0], args[1]));
+}
+
+Item setCarProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!isPair(args[0]))
+	{
+		*error = "&arg0-must-eval-to-pair";
+	}
+	else if (args[0].get<CellRef>()->mHashConsed)
+	{
+		*error = "&immutable-pair";
 	}
 	else
 	{
-		k(item);
+		args[0].get<CellRef>()->mCar = args[1];
 	}
+	return Unspecified();
 }
 
-void cons(Item pair, Context* context, std::function<void(Item)> k )
+// splits a cdr-coded run at the mutated cell; the rest of the run is untouched
+Item setCdrProc(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, pair, k](Item first){
-		eval(car(cdr(pair)), context, [first, k,context](Item second){
-			k(Item( gMemory.allocCell(context, first, second)));
-		}); });
+	if (!isPair(args[0]))
+	{
+		*error = "&arg0-must-eval-to-pair";
+	}
+	else if (args[0].get<CellRef>()->mHashConsed)
+	{
+		*error = "&immutable-pair";
+	}
+	else
+	{
+		args[0].get<CellRef>()->setCdr(args[1]);
+	}
+	return Unspecified();
 }
 
-void null(Item pair, Context* context, std::function<void(Item)> k)
+Item list(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [k](Item item){
-		k(Item((item.type() == eCell &&  boost::any_cast<CellRef>(item) == nullptr) ? 1 : 0));
-	});
+	gMemory.reserveCells(context, count);
+	CellRef list = nullptr;
+	for (uint32_t i = count; i > 0; i--)
+	{
+		list = gMemory.allocCell(context, args[i - 1], Item(list));
+	}
+	return Item(list);
 }
 
-void carProc(Item pair,Context* context, std::function<void(Item)> k)
+// (apply f a ... list) calls f on the a's and the elements of the list, with
+// apply's own continuation, so a call through it is still a tail call.
+void applyProc(const Item* values, uint32_t count, Context* context, Continuation k)
 {
-	eval(car(pair), context, [k](Item item){
-		k(car(item));
-	});
+	if (values[count - 1].type() != eCell)
+	{
+		raiseError("&apply-needs-a-list", k);
+		return;
+	}
+	std::vector<Item> args(values + 1, values + count - 1);
+	for (auto cell = values[count - 1].get<CellRef>(); cell; cell = cell->next())
+	{
+		args.push_back(cell->mCar);
+	}
+	apply(values[0], args, context, k);
 }
 
-void cdrProc(Item pair,Context* context, std::function<void(Item)> k)
+Item mul(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [k](Item item){
-		k(cdr(item));
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	Item product = Item(Number(1));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		product = numMul(product, args[i]);
+	}
+	return product;
 }
 
-void mul(Item pair, Context* context, std::function<void(Item)> k)
+Item add(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		typecheck<Number>(first, "&arg0-must-eval-to-number", [pair, k, context](Item firstnumber){
-			eval(car(cdr(pair)), context, [firstnumber, k](Item second){
-				typecheck<Number>(second, "&arg1-must-eval-to-number", [firstnumber,k](Item secondnumber) {
-					k(Item(boost::any_cast<Number>(firstnumber)* boost::any_cast<Number>(secondnumber)));
-				});
-			});
-		});
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	Item sum = Item(Number(0));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		sum = numAdd(sum, args[i]);
+	}
+	return sum;
 }
 
-void add(Item pair, Context* context, std::function<void(Item)> k)
+// (- x) negates, (- x y ...) subtracts the rest from the first
+Item sub(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		eval(car(cdr(pair)), context, [first, k](Item second){
-			k(Item( boost::any_cast<Number>(first) + boost::any_cast<Number>(second)));
-		});
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	if (count == 1)
+	{
+		return numSub(Item(Number(0)), args[0]);
+	}
+	Item difference = args[0];
+	for (uint32_t i = 1; i < count; i++)
+	{
+		difference = numSub(difference, args[i]);
+	}
+	return difference;
 }
 
-void sub(Item pair, Context* context, std::function<void(Item)> k)
+Item bidiv(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		eval(car(cdr(pair)), context, [first, k](Item second){
-			k(Item( boost::any_cast<Number>(first) - boost::any_cast<Number>(second)));
-		});
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	if (numZero(args[1]))
+	{
+		*error = "&division-by-zero";
+		return Item();
+	}
+	return numQuotient(args[0], args[1]);
 }
 
+Item mod(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	if (numZero(args[1]))
+	{
+		*error = "&division-by-zero";
+		return Item();
+	}
+	return numRemainder(args[0], args[1]);
+}
 
-void bidiv(Item pair, Context* context, std::function<void(Item)> k)
+Item exactToInexact(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		eval(car(cdr(pair)), context, [first, k](Item second){
-			k(Item( boost::any_cast<Number>(first) / boost::any_cast<Number>(second)));
-		});
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	return Item(toFlonum(args[0]));
 }
 
+Item inexactToExact(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	Item number = args[0];
+	if (isExact(number))
+	{
+		return number;
+	}
 
-void mod(Item pair, Context* context, std::function<void(Item)> k)
+	Flonum value = toFlonum(number);
+	if (value != value || value - value != 0)
+	{
+		*error = "&no-exact-representation";
+		return Item();
+	}
+	else if (value >= -9.2e18 && value <= 9.2e18)
+	{
+		return makeInteger((int64_t)value);
+	}
+
+	// |value| >= 2^63 is an integer, so its shortest form has no fraction
+	std::ostringstream digits;
+	digits.precision(0);
+	digits << std::fixed << (value < 0 ? -value : value);
+	std::string text = digits.str();
+	return makeInteger(Bignum::fromDecimal(text.c_str(), text.size(), value < 0));
+}
+
+Item biSqrt(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		eval(car(cdr(pair)), context, [first, k](Item second){
-			k(Item( boost::any_cast<Number>(first) %  boost::any_cast<Number>(second) ));
-		});
-	});
+	if (!numberArgs(args, count, error))
+	{
+		return Item();
+	}
+	return Item(sqrt(toFlonum(args[0])));
 }
 
-void biprint(Item pair, Context* context, std::function<void(Item)> k)
+Item biprint(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		puts(print(first).c_str());
-		putchar('\n');
-		k( Unspecified() );
-	});
+	puts(print(args[0]).c_str());
+	putchar('\n');
+	return Unspecified();
 }
 
 template<typename T>
@@ -184,6 +529,14 @@ int compareShallow(Item first, Item second)
 	{
 		return compareAny<Number>(first, second);
 	}
+	else if (first.type() == eBignum)
+	{
+		return numCompare(first, second) == 0 ? 1 : 0;
+	}
+	else if (first.type() == eFlonum)
+	{
+		return compareAny<Flonum>(first, second);
+	}
 	else if (first.type() == eProc)
 	{
 		return compareAny<Proc>(first, second);
@@ -192,6 +545,62 @@ int compareShallow(Item first, Item second)
 	{
 		return compareAny<Symbol>(first, second);
 	}
+	else if (first.type() == eVector)
+	{
+		return compareAny<VectorRef>(first, second);
+	}
+	else if (first.type() == eString)
+	{
+		return compareAny<StringRef>(first, second);
+	}
+	else if (first.type() == ePort)
+	{
+		return compareAny<PortRef>(first, second);
+	}
+	else if (first.type() == eRope)
+	{
+		return compareAny<RopeRef>(first, second);
+	}
+	else if (first.type() == eBytevector)
+	{
+		return compareAny<BytevectorRef>(first, second);
+	}
+	else if (first.type() == eHashTable)
+	{
+		return compareAny<HashTableRef>(first, second);
+	}
+	else if (first.type() == eHamt)
+	{
+		return compareAny<HamtRef>(first, second);
+	}
+	else if (first.type() == eRecord)
+	{
+		return compareAny<RecordRef>(first, second);
+	}
+	else if (first.type() == eRecordType)
+	{
+		return compareAny<RecordTypeRef>(first, second);
+	}
+	else if (first.type() == eBTree)
+	{
+		return compareAny<BTreeRef>(first, second);
+	}
+	else if (first.type() == ePriorityQueue)
+	{
+		return compareAny<PriorityQueueRef>(first, second);
+	}
+	else if (first.type() == eEof)
+	{
+		return 1;
+	}
+	else if (first.type() == eF64Vector)
+	{
+		return compareAny<F64Vector*>(first, second);
+	}
+	else if (first.type() == eS32Vector)
+	{
+		return compareAny<S32Vector*>(first, second);
+	}
 	else
 	{
 		return compareAny<CellRef>(first, second);
@@ -200,13 +609,20 @@ int compareShallow(Item first, Item second)
 	return 0;
 }
 
-void compare(Item pair, Context* context, std::function<void(Item)> k)
+// = compares numbers by value, so (= 1 1.0) holds although the types differ
+Item compare(const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	eval(car(pair), context, [context, k, pair](Item first) {
-		eval(car(cdr(pair)), context, [first, k](Item second){	
-			k(compareShallow(first, second));
-		});
-	});
+	for (uint32_t i = 1; i < count; i++)
+	{
+		const Item& first = args[i - 1];
+		const Item& second = args[i];
+		bool same = isNumber(first) && isNumber(second) ? numEqual(first, second) : compareShallow(first, second) != 0;
+		if (!same)
+		{
+			return Item(Number(0));
+		}
+	}
+	return Item(Number(1));
 }
 
 bool compareDeep(Item first, Item second)
@@ -222,27 +638,50 @@ bool compareDeep(Item first, Item second)
 			auto cell0 = boost::any_cast<CellRef>(first);
 			auto cell1 = boost::any_cast<CellRef>(second);
 
-			if (!cell0)
+			// shared (e.g. hash-consed) structure is equal without a walk
+			if (cell0 == cell1)
 			{
-				return !cell1;
+				return true;
+			}
+
+			if (!cell0 || !cell1)
+			{
+				return false;
 			}
 
 			if (compareDeep(cell0->mCar, cell1->mCar))
 			{
-				return compareDeep(cell0->mCdr, cell1->mCdr);
+				return compareDeep(cell0->cdr(), cell1->cdr());
 			}
 			return false;
 		}
+		else if (first.type() == eVector)
+		{
+			return vectorEqual(boost::any_cast<VectorRef>(first), boost::any_cast<VectorRef>(second), compareDeep);
+		}
+		else if (first.type() == eString)
+		{
+			return stringEqual(boost::any_cast<StringRef>(first), boost::any_cast<StringRef>(second));
+		}
+		else if (first.type() == eRope)
+		{
+			return boost::any_cast<RopeRef>(first)->str() == boost::any_cast<RopeRef>(second)->str();
+		}
+		else if (first.type() == eBytevector)
+		{
+			return bytevectorEqual(boost::any_cast<BytevectorRef>(first), boost::any_cast<BytevectorRef>(second));
+		}
+		else if (first.type() == eHamt)
+		{
+			return hamtEqual(boost::any_cast<HamtRef>(first), boost::any_cast<HamtRef>(second), compareDeep);
+		}
 		else
 		{
-			return compareShallow(first, second);
+			return compareShallow(first, second) != 0;
 		}
 	}
 }
 
-static std::function<void(void)>									gNext;
-static std::function<void(std::string, std::function<void(Item)>)>	gThrow = [](std::string msg, std::function<void(Item)> k){ puts(msg.c_str()); };
-
 void yield(std::function<void(void)> k)
 {
 	gNext = k;
@@ -250,280 +689,293 @@ void yield(std::function<void(void)> k)
 
 void mapeval(Item in, Context* context, std::function<void(Item)> k)
 {
-	if (boost::any_cast<CellRef>(in) == nullptr)
+	Walker::eval(in, context, k, true);
+}
+
+void evalArgs(Item pair, Context* context, std::function<void(const std::vector<Item>&)> k)
+{
+	mapeval(pair, context, [k](Item values) {
+		std::vector<Item> args;
+		for (auto cell = boost::any_cast<CellRef>(values); cell; cell = cell->next())
+		{
+			args.push_back(cell->mCar);
+		}
+		k(args);
+	});
+}
+
+// Calls proc on values that are already evaluated. A native evaluates its
+// argument list, so symbols and lists in it are quoted first.
+void apply(Item proc, const std::vector<Item>& args, Context* context, Continuation k)
+{
+	apply(proc, args.empty() ? nullptr : &args[0], (uint32_t)args.size(), context, k);
+}
+
+// A body answers its caller through this, from the trampoline, so returns
+// out of deep recursion don't nest on the C++ stack. A tail call hands it on
+// as it is.
+struct Return
+{
+	std::shared_ptr<const Continuation>	mK;
+
+	void operator()(Item value) const
 	{
-		k(Item((Cell*)nullptr));
+		auto k = mK;
+		Held<Item> held(value);
+		yield([k, held](){ (*k)(held.get()); });
 	}
-	else
+
+	// An error drops every return pending above it. Each one owns the next,
+	// so they are let go one at a time rather than by nested destructors. The
+	// list is never freed, as frames still hold returns when statics go.
+	~Return()
 	{
-		eval(boost::any_cast<CellRef>(in)->mCar, context, [in, context, k](Item result){
-			mapeval(boost::any_cast<CellRef>(in)->mCdr, context, [context, result, k](Item rest){
-				k(Item( gMemory.allocCell(context, result, rest)));
-			});
-		});
+		static auto sDropped = new std::vector< std::shared_ptr<const Continuation> >();
+		static bool sDropping = false;
+		if (!mK.unique())
+		{
+			return;
+		}
+		sDropped->push_back(mK);
+		mK.reset();
+		if (sDropping)
+		{
+			return;
+		}
+		sDropping = true;
+		while (!sDropped->empty())
+		{
+			auto k = sDropped->back();
+			sDropped->pop_back();
+		}
+		sDropping = false;
 	}
-}
+};
 
-void eval_begin(Item body, Context* context, std::function<void(Item)> k)
+// Runs a closure's body in a frame already binding its parameters: the
+// analyzed body if it has one, otherwise the body form.
+static void enter(const Proc& callee, Context* frame, Continuation k)
 {
-	if (!boost::any_cast<CellRef>(cdr(body)))
+	if (!k.target<Return>())
+	{
+		Return answer = { std::make_shared<const Continuation>(k) };
+		k = answer;
+	}
+
+	Held<Context*> scope(frame);
+	if (callee.mCode)
 	{
-		eval(car(body), context, k);
+		auto code = callee.mCode;
+		frame->mCode = code;
+		yield([code, scope, k](){ code->exec(scope.get(), k); });
 	}
 	else
 	{
-		eval(car(body), context, [body, context, k](Item){ eval_begin(cdr(body), context, k); });
+		Held<Item> body(car(cdr(Item(callee.mProc))));
+		yield([body, scope, k](){ eval(body.get(), scope.get(), k); });
 	}
 }
 
-void eval_letstar_rec(Item defs, Context* context, std::function<void(Context*)> k)
+// How many parameters a parameter list names, and whether it ends in a rest
+// parameter.
+static uint32_t namedParams(Item params, bool* rest)
 {
-	if (!boost::any_cast<CellRef>(defs))
+	uint32_t named = 0;
+	while (params.type() == eCell)
 	{
-		k( context);
-	}
-	else
-	{
-		Item defpair = car(defs);
-		Item symbol = car(defpair);
-		Item def = car(cdr(defpair));
-		auto newcontext = gMemory.allocContext( context, context);
-		eval(def, context, [newcontext, context, defs, k](Item item){
-			Symbol symbol = boost::any_cast<Symbol>(car(car(defs)));
-			newcontext->Set(symbol, item);
-			eval_letstar_rec(cdr(defs), newcontext, k);
-		});
+		CellRef param = boost::any_cast<CellRef>(params);
+		if (!param)
+		{
+			break;
+		}
+		named++;
+		params = param->cdr();
 	}
+	*rest = params.type() == eSymbol;
+	return named;
 }
 
-void eval_let_rec(Item defs, Context* evalcontext, Context* defcontext, std::function<void(Context*)> k)
+// Binds the parameters straight from the values; only a declared rest
+// parameter has a list consed, and only of the values past the named ones.
+// Null if there are too few values, or too many and no rest parameter, or
+// if the context heap is exhausted.
+Context* bindArgs(const Proc& callee, const Item* args, uint32_t count, Context* context, std::string* error)
 {
-	if (!boost::any_cast<CellRef>(defs))
+	auto params = car(Item(callee.mProc));
+	bool rest = false;
+	uint32_t named = namedParams(params, &rest);
+	if (count < named || (count > named && !rest))
 	{
-		k(defcontext);
+		*error = "&wrong-number-of-args";
+		return nullptr;
 	}
-	else
+	for (uint32_t i = 0; i < count; i++)
 	{
-		Item defpair = car(defs);
-		Item symbol = car(defpair);
-		Item def = car(cdr(defpair));
-		eval(def, evalcontext, [defcontext, evalcontext,defs,k](Item item){
-			Symbol symbol = boost::any_cast<Symbol>(car(car(defs)));
-			defcontext->Set( symbol, item);
-			eval_let_rec(cdr(defs), evalcontext, defcontext, k);
-		});
+		gMemory.pushRoot(args[i]);
 	}
-}
 
-void eval_let(Item item, Context* context, std::function<void(Item)> k)
-{
-	// (let ((x <def>)* ) <body>) 
-	Symbol let = boost::any_cast<Symbol>(car(item));
-	Item defs = car(cdr(item));
-	Item body = car(cdr(cdr(item)));
-	auto newContext = gMemory.allocContext(context,context);
-	if ( let== gSymbolTable.GetSymbol("let"))
+	CellRef list = nullptr;
+	if (rest && count > named)
 	{
-		eval_let_rec(defs, context, newContext, [body, k](Context* c){ eval(body, c, k); });
+		gMemory.reserveCells(context, count - named);
+		for (uint32_t i = count; i > named; i--)
+		{
+			list = gMemory.allocCell(context, args[i - 1], Item(list));
+		}
 	}
-	else if ( let == gSymbolTable.GetSymbol("let*"))
+	gMemory.pushRoot(Item(list));
+	auto frame = gMemory.allocContext(context, params, args, count, Item(list), callee.mClosure);
+	gMemory.popRoots(count + 1);
+	if (!frame)
 	{
-		eval_letstar_rec(defs, context, [body, k](Context* c){ eval(body, c, k); });
+		*error = "&out-of-memory";
 	}
+	return frame;
 }
 
-
-void eval_define(Item item, Context* context, std::function<void(Item)> k)
+void apply(Item proc, const Item* args, uint32_t count, Context* context, Continuation k)
 {
-	Item value, name, params;
-	params = car(cdr(item));
+	const Proc* callee = proc.peek<Proc>();
+	if (!callee)
+	{
+		raiseError("&did-not-eval-to-proc", k);
+		return;
+	}
 
-	// (define x ...)
-	if (params.type() == eSymbol)
+	if (callee->mPrimitive)
 	{
-		name = car(cdr(item));
+		callPrimitive(*callee->mPrimitive, args, count, context, k);
+		return;
+	}
 
-		// (define x y )
-		auto lst = boost::any_cast<CellRef>(item);
-		if (lst->length() == 3)
-		{
-			eval(car(cdr(cdr(item))), context, [name, context, k](Item value){
-				context->Set(boost::any_cast<Symbol>(name), value);
-				k(value);
-			});
-		}
-		// (define x )
-		else
+	if (!callee->mNative)
+	{
+		gMemory.pushRoot(proc);
+		std::string error;
+		auto frame = bindArgs(*callee, args, count, context, &error);
+		gMemory.popRoots(1);
+		if (!frame)
 		{
-			context->Set(boost::any_cast<Symbol>(name), Unspecified());
-			k(Unspecified());
+			raiseError(error, k);
+			return;
 		}
+		enter(*callee, frame, k);
+		return;
 	}
-	// (define (f ...) (body))
-	else if (params.type() == eCell)
-	{
-		name = car(params);
-		auto arglist = cdr(params);
-		auto body = car(cdr(cdr(item)));
 
-		value = Proc( gMemory.allocCell(context, arglist, Item( gMemory.allocCell(context, body))), context);
-		context->Set(boost::any_cast<Symbol>(name), value);
-		k(value);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		gMemory.pushRoot(args[i]);
 	}
-	else
+	gMemory.reserveCells(context, count * 3);
+	gMemory.popRoots(count);
+
+	CellRef list = nullptr;
+	for (uint32_t i = count; i > 0; i--)
 	{
-		gThrow("&invalid-define",k);
+		Item arg = args[i - 1];
+		if (arg.type() == eSymbol || (arg.type() == eCell && boost::any_cast<CellRef>(arg)))
+		{
+			Symbol quote = gSymbolTable.GetSymbol("quote");
+			arg = Item(gMemory.allocCell(context, Item(quote), Item(gMemory.allocCell(context, arg))));
+		}
+		list = gMemory.allocCell(context, arg, Item(list));
 	}
+	callee->mNative(Item(list), context, k);
 }
 
-void eval_if(Item item, Context* context, std::function<void(Item)> k )
+void eval(Item item, Context* context, std::function<void(Item)> k )
 {
-	eval(car(cdr(item)), context, [item, context, k](Item b){
-		if (boost::any_cast<Number>(b))
-		{
-			eval(car(cdr(cdr(item))), context, k);
-		}
-		else if (length(boost::any_cast<CellRef>(item)) > 3)
-		{
-			eval(car(cdr(cdr(cdr(item)))), context, k);
-		}
-		else
-		{
-			k(Unspecified());
-		}
-	});
+	gNext = nullptr;
+	Walker::eval(item, context, k, false);
 }
 
-void eval_proc(Item item, Context* context, std::function<void(Item)> k)
+void addNativeFns()
 {
-	eval(car(item), context, [item, k, context](Item proc){
-		if (proc.type() != eProc)
-		{
-			gThrow("&did-not-eval-to-proc\n",k);
-		}
-		else if (boost::any_cast<Proc>(proc).mNative)
-		{
-			(boost::any_cast<Proc>(proc).mNative)(Item(boost::any_cast<CellRef>(cdr(item))), context, k);
-		}
-		else
-		{
-			auto params = car(Item(boost::any_cast<Proc>(proc).mProc));
-			auto body = car(cdr(Item(boost::any_cast<Proc>(proc).mProc)));
-			mapeval(cdr(item), context, [context, params, proc, body, k](Item arglist){
-				auto newContext = gMemory.allocContext(context, params, boost::any_cast<CellRef>(arglist), boost::any_cast<Proc>(proc).mClosure);
-				yield([body, newContext, k](){ eval(body, newContext, k); });
-			});
-		}
-	});
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("cons", cons, 2, 2, true);
+	definePrimitive("hcons", hcons, 2, 2, true);
+	definePrimitive("car", carProc, 1, 1, false);
+	definePrimitive("cdr", cdrProc, 1, 1, false);
+	definePrimitive("set-car!", setCarProc, 2, 2, false);
+	definePrimitive("set-cdr!", setCdrProc, 2, 2, false);
+	definePrimitive("list", list, 0, any, true);
+	defineCallingPrimitive("apply", applyProc, 2, any);
+	definePrimitive("=", compare, 2, any, false);
+	definePrimitive("null?", null, 1, 1, false);
+	definePrimitive("+", add, 0, any, false);
+	definePrimitive("-", sub, 1, any, false);
+	definePrimitive("*", mul, 0, any, false);
+	definePrimitive("/", bidiv, 2, 2, false);
+	definePrimitive("%", mod, 2, 2, false);
+	definePrimitive("exact->inexact", exactToInexact, 1, 1, false);
+	definePrimitive("inexact->exact", inexactToExact, 1, 1, false);
+	definePrimitive("sqrt", biSqrt, 1, 1, false);
+	definePrimitive("print", biprint, 1, 1, false);
+
+	addNumVectorNatives();
+	addVectorNatives();
+	addStringNatives();
+	addRopeNatives();
+	addBytevectorNatives();
+	addHashTableNatives();
+	addHamtNatives();
+	addRecordNatives();
+	addBTreeNatives();
+	addPriorityQueueNatives();
+	addContinuationNatives();
 }
 
-void eval(Item item, Context* context, std::function<void(Item)> k )
+void tcoeval(Item form, Context* context, std::function<void(Item)> k)
 {
-	gNext = nullptr;
-	if (gTrace)
-	{
-		printf("eval: %s\n", print(item).c_str());
-	}
-	
-	if (item.type() == eNumber)
-	{
-		k(item);
-	}
-	else if (item.type() == eSymbol)
+	switch (gEvalMode)
 	{
-		k(context->Lookup( boost::any_cast<Symbol>(item)));
-	}
-	else if (item.type() == eCell)
-	{
-		if ( !boost::any_cast<CellRef>( item ) )
-		{
-			k(item);
-		}
-		else if (car(item).type() == eSymbol )
-		{
-			Symbol symbol = boost::any_cast<Symbol>( car(item) );
-			if (symbol == gSymbolTable.GetSymbol("quote"))
-			{
-				k(car(cdr(item)));
-			}
-			else if (symbol == gSymbolTable.GetSymbol("define"))
-			{
-				eval_define(item, context, k);
-			}
-			else if (symbol == gSymbolTable.GetSymbol("set!"))
-			{
-				eval(car(cdr(cdr(item))), context, [context, item, k](Item v){ 
-					context->Set( boost::any_cast<Symbol>(car(cdr(item))), v); k(v); 
-				});
-			}
-			else if (symbol == gSymbolTable.GetSymbol("if"))
-			{
-				eval_if(item, context, k);
-			}
-			else if (symbol == gSymbolTable.GetSymbol("lambda"))
-			{
-				k( Proc( boost::any_cast<CellRef>( cdr(item)), context));
-			}
-			else if (symbol == gSymbolTable.GetSymbol("callcc"))
-			{
-				Item cc = Proc([k](Item item, Context* c, std::function<void(Item)>){
-					eval(car(item), c, [k](Item e) {
-						k(e);
-					});
-				});
-				context->Set(boost::any_cast<Symbol>(car(cdr(item))), cc);
-				eval(car(cdr(cdr(item))), context, [](Item item){
-					auto s = print(item);
-					puts(s.c_str());
-					putchar(' cc\n');
-				});
-			}
-			else if (symbol == gSymbolTable.GetSymbol("let")|| 
-				     symbol == gSymbolTable.GetSymbol("let*"))
-			{
-				eval_let(item, context, k);
-			}
-			else if (symbol == gSymbolTable.GetSymbol("begin"))
-			{
-				eval_begin(cdr(item), context, k);
-			}
-			else
-			{
-				eval_proc(item, context, k);
-			}
-		}
-		else
-		{
-			eval_proc(item, context, k);
-		}
-	}
-	else
-	{
-		k(Unspecified());
+	case eWalk:
+		yield([form,context,k](){ eval(form, context, k); });
+		break;
+	case eAnalyze:
+		yield([form,context,k](){ execute(form, context, k); });
+		break;
+	case eBytecode:
+		yield([form,context,k](){ runCompiled(form, context, k); });
+		break;
 	}
+	trampoline();
 }
 
-void addNativeFns()
+void trampoline()
 {
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("cons"), Item( Proc(cons) ));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("car"), Item( Proc(carProc) ));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("cdr"), Item( Proc( cdrProc) ));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("="), Item( Proc( compare )));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("null?"), Item( Proc(null)));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("+"), Item( Proc(add) ));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("-"), Item( Proc( sub )));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("*"), Item( Proc(mul)));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("/"), Item( Proc(bidiv)));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("%"), Item( Proc(mod)));
-	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("print"), Item( Proc(biprint)));
+	Walker::Outside outside;
+	// a step that finishes without yielding or evaluating must not run again
+	while (gNext) {
+		auto next = std::move(gNext);
+		gNext = nullptr;
+		next();
+	}
 }
 
-void tcoeval(Item form, Context* context, std::function<void(Item)> k)
+static const char* sModeNames[] = { "walk", "analyze", "vm" };
+
+// ,mode [walk|analyze|vm] shows or changes how forms are run.
+static void command(const char* line)
 {
-	yield([form,context,k](){ eval(form, context, k); });
-	while (gNext) {
-		gNext();
+	std::string name;
+	std::stringstream(line) >> name;
+	if (name == "mode")
+	{
+		std::string mode;
+		std::stringstream(line + name.size()) >> mode;
+		for (int i = eWalk; i <= eBytecode; i++)
+		{
+			if (mode == sModeNames[i])
+			{
+				gEvalMode = (EvalMode)i;
+			}
+		}
+		printf("mode %s\n", sModeNames[gEvalMode]);
+		return;
 	}
+	puts("unknown command\n");
 }
 
 void repl()
@@ -534,6 +986,11 @@ void repl()
 		char* rest;
 		printf(">>");
 		gets_s(buffer, sizeof( buffer ));
+		if (buffer[0] == ',')
+		{
+			command(buffer + 1);
+			continue;
+		}
 		Maybe<Item> form = Parser::parseForm(gMemory.getRoot(), buffer, &rest);
 		if (form.mValid)
 		{
@@ -578,6 +1035,20 @@ void evals_to_number(char* datum, int32_t value, Context* context = gMemory.getR
 	});
 }
 
+// The error is caught rather than printed, so which one was raised can be checked.
+void evals_to_error(char* datum, const char* error, Context* context = gMemory.getRoot())
+{
+	char* rest;
+	auto item = Parser::parseForm(context, datum, &rest);
+	assert(item.mValid);
+	std::string raised;
+	auto thrown = gThrow;
+	gThrow = [&raised](std::string msg, std::function<void(Item)>) { raised = msg; };
+	tcoeval(item.mV, context, [](Item) { assert(!"a raised error answers nothing"); });
+	gThrow = thrown;
+	assert(raised == error);
+}
+
 void evals_to_symbol(char* datum, const char* symbol, Context* context = gMemory.getRoot())
 {
 	char* rest;
@@ -592,12 +1063,41 @@ void evals_to_symbol(char* datum, const char* symbol, Context* context = gMemory
 
 void test_eval()
 {
+	char* rest;
 	evals_to_number( "10", 10);
 	evals_to_number("(+ 10 1)", 11);
 	evals_to_number("(* 10 10)", 100);
 	evals_to_number("(/ 10 2)", 5);
 	evals_to_number("(- 10 2)", 8);
 	evals_to_number("(% 3 2)", 1);
+	evals_to_number("(- -2147483647 1)", -2147483647 - 1);
+	eval_same("(+ 2147483647 1)", "2147483648");
+	eval_same("(- -2147483647 2)", "-2147483649");
+	eval_same("(* 65536 65536)", "4294967296");
+	eval_same("(* 4294967296 4294967296)", "18446744073709551616");
+	eval_same("(/ -2147483648 -1)", "2147483648");
+	evals_to_number("(- (* 65536 65536) 4294967295)", 1);
+	evals_to_number("(/ 18446744073709551616 17179869184)", 1073741824);
+	evals_to_number("(% 18446744073709551617 10)", 7);
+	eval_same("(+ 1.5 2)", "3.5");
+	eval_same("(* 2 0.25)", "0.5");
+	eval_same("(/ 1.0 2)", "0.5");
+	eval_same("(- 4294967296 0.5)", "4294967295.5");
+	eval_same("(% 7.5 2)", "1.5");
+	eval_same("(exact->inexact 3)", "3.0");
+	eval_same("(inexact->exact 3.0)", "3");
+	eval_same("(inexact->exact 1e20)", "100000000000000000000");
+	eval_same("(sqrt 16)", "4.0");
+	evals_to_number("(= 1 1.0)", 1);
+	evals_to_number("(= 0.5 1)", 0);
+	assert(numToString(Item(0.1)) == "0.1");
+	assert(numToString(Item(0.1 + 0.2)) == "0.30000000000000004");
+	assert(numToString(Item(1e21)) == "1e+21");
+	assert(numToString(Item(-2.0)) == "-2.0");
+	assert(numToString(Item(1.0 / 3)) == "0.3333333333333333");
+	tcoeval(Parser::parseForm(gMemory.getRoot(), "(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))", &rest).mV, gMemory.getRoot(), [](Item){});
+	eval_same("(fact 30)", "265252859812191058636308480000000");
+	evals_to_number("(/ (fact 30) (fact 28))", 870);
 	evals_to_symbol("(quote cat)", "cat");
 	evals_to_symbol("(if 1 'true 'false)", "true");
 	evals_to_symbol("(if 0 'true 'false)", "false");
@@ -607,11 +1107,137 @@ void test_eval()
 	evals_to_number("( let ((x 5) (y 2)) (+ x y ) )", 7);
 	evals_to_number("(let* ((x 5) (y x)) (+ x y) )", 10);
 	evals_to_number("( begin (set! something 10) something)", 10);
-	char* rest;
+	tcoeval(Parser::parseForm(gMemory.getRoot(), "(define (h x) x)", &rest).mV, gMemory.getRoot(), [](Item){});
+	evals_to_number("(h 1)", 1);
+	evals_to_error("(h)", "&wrong-number-of-args");
+	evals_to_error("(h 1 2 3)", "&wrong-number-of-args");
+	evals_to_error("((lambda (a b) a) 1)", "&wrong-number-of-args");
+	evals_to_error("((lambda (a b . more) a) 1)", "&wrong-number-of-args");
+	evals_to_error("(apply h (list 1 2))", "&wrong-number-of-args");
+	evals_to_error("(car 1 2)", "&wrong-number-of-args");
 	auto list = Parser::parseForm(gMemory.getRoot(),"('a 'b (+ 1 2))", &rest).mV;
 	mapeval(list, gMemory.getRoot(), [](Item item){ puts(print(item).c_str()); });
 }
 
+// Each loop calls itself in tail position through a different form, checking
+// how much of the C++ stack it has used on every iteration.
+static const char*	sStackBase;
+static size_t		sStackUsed;
+
+static void stackCheck(Item pair, Context* context, Continuation k)
+{
+	char here;
+	sStackUsed = std::max(sStackUsed, (size_t)(sStackBase - &here));
+	eval(car(pair), context, k);
+}
+
+void test_tail_calls()
+{
+	char* rest;
+	const char* loops[] = {
+		"(define (loop n) (if (= (stack-check n) 0) 'done (loop (- n 1))))",
+		"(define (loop n) (begin (stack-check n) (if (= n 0) 'done (loop (- n 1)))))",
+		"(define (loop n) (let ((m (stack-check n))) (let* ((k m)) (if (= k 0) 'done (loop (- k 1))))))",
+		"(define (loop n) (callcc k (if (= (stack-check n) 0) 'done (loop (- n 1)))))",
+		"(define (loop n) (if (= (stack-check n) 0) 'done (apply loop (list (- n 1)))))",
+	};
+	const size_t cStackLimit = 16 * 1024;
+	char base;
+	sStackBase = &base;
+	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("stack-check"), Item(Proc(stackCheck)));
+
+	for (auto loop : loops)
+	{
+		tcoeval(Parser::parseForm(gMemory.getRoot(), loop, &rest).mV, gMemory.getRoot(), [](Item){});
+		sStackUsed = 0;
+		Item result;
+		tcoeval(Parser::parseForm(gMemory.getRoot(), "(loop 100000)", &rest).mV, gMemory.getRoot(), [&result](Item item) {
+			result = item;
+		});
+		assert(result.type() == eSymbol && result.get<Symbol>() == gSymbolTable.GetSymbol("done"));
+		assert(sStackUsed < cStackLimit);
+	}
+}
+
+// Non-tail recursion, deep and with collections along the way: neither the
+// calls nor the returns may nest on the C++ stack, and frames only a pending
+// return refers to must survive.
+void test_deep_calls()
+{
+	char* rest;
+	const char* defines[] = {
+		"(define (build n) (if (= (stack-check n) 0) '() (cons n (build (- n 1)))))",
+		"(define (len l) (if (null? l) 0 (+ 1 (stack-check (len (cdr l))))))",
+		"(define (fib n) (if (= n 0) 0 (if (= n 1) 1 (+ (fib (- n 1)) (fib (- n 2))))))",
+	};
+	const size_t cStackLimit = 16 * 1024;
+	char base;
+	sStackBase = &base;
+	gMemory.getRoot()->Set(gSymbolTable.GetSymbol("stack-check"), Item(Proc(stackCheck)));
+
+	for (auto define : defines)
+	{
+		tcoeval(Parser::parseForm(gMemory.getRoot(), define, &rest).mV, gMemory.getRoot(), [](Item){});
+	}
+	sStackUsed = 0;
+	evals_to_number("(len (build 20000))", 20000);
+	assert(sStackUsed < cStackLimit);
+	evals_to_number("(fib 18)", 2584);
+}
+
+// A closure called often enough to be compiled again, and made machine code
+// where it can be, raises the same errors as before.
+void test_hot_errors()
+{
+	char* rest;
+	const char* defines[] = {
+		"(define (bad n) (if (= n 0) (car n) n))",
+		"(define (bad-loop i) (if (= i 0) 0 (begin (bad i) (bad-loop (- i 1)))))",
+	};
+	for (auto define : defines)
+	{
+		tcoeval(Parser::parseForm(gMemory.getRoot(), define, &rest).mV, gMemory.getRoot(), [](Item){});
+	}
+	evals_to_number("(bad-loop 100)", 0);
+	evals_to_error("(bad 0)", "&arg0-must-eval-to-pair");
+	evals_to_error("(bad)", "&wrong-number-of-args");
+	evals_to_error("(bad-loop 'x)", "&arg0-must-eval-to-number");
+}
+
+// A collection in the middle of a form leaves alone what the form has yet to
+// evaluate: its quoted constants, its strings and the sources of its lambdas.
+void test_collect_mid_form()
+{
+	defineNative("collect", [](Item pair, Context* context, Continuation k) {
+		gMemory.gc(context);
+		k(Unspecified());
+	});
+	eval_same("(begin (collect) '(1 2 3))", "'(1 2 3)");
+	eval_same("(string-append \"ab\" (begin (collect) \"cd\"))", "\"abcd\"");
+	eval_same("((lambda () (begin (collect) '(1 2 3))))", "'(1 2 3)");
+	evals_to_number("(begin (collect) (define (g x) (+ x 1)) (g 41))", 42);
+}
+
+// Recursion that never ends runs out of frames and raises an error rather
+// than bringing the process down; evaluation carries on afterwards.
+void test_out_of_memory()
+{
+	char* rest;
+	const char* defines[] = {
+		"(define (down n) (+ 1 (down n)))",
+		"(define (down-let n) (let ((m n)) (+ 1 (down-let m))))",
+	};
+	for (auto define : defines)
+	{
+		tcoeval(Parser::parseForm(gMemory.getRoot(), define, &rest).mV, gMemory.getRoot(), [](Item){});
+	}
+	gMemory.limitContexts(1);
+	evals_to_error("(down 0)", "&out-of-memory");
+	evals_to_error("(down-let 0)", "&out-of-memory");
+	gMemory.limitContexts();
+	evals_to_number("(len (build 20000))", 20000);
+}
+
 void test_context()
 {
 	char* rest;
@@ -645,6 +1271,16 @@ void test_context()
 
 	eval_same("(map inc '(1 2 3))", "'(2 3 4)", context);
 
+	// only a rest parameter gets a list, of the arguments past the named ones
+	tcoeval(Parser::parseForm(context, "(define (tail a b . more) more)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define all (lambda args args))", &rest).mV, context, [](Item){});
+	eval_same("(tail 1 2 3 4)", "'(3 4)", context);
+	eval_same("(tail 1 2)", "()", context);
+	eval_same("(apply tail '(1 2 3))", "'(3)", context);
+	eval_same("(all 1 (+ 1 1))", "'(1 2)", context);
+	eval_same("(all)", "()", context);
+	evals_to_number("((lambda (a b) b) 1 2)", 2, context);
+
 	evals_to_number("(begin "
 					 "(define ( f x ) (" 
 						"callcc ret ( if (= x 10) (ret x)" 
@@ -653,6 +1289,436 @@ void test_context()
 					  , 10);
 }
 
+void test_lists()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	// consecutive conses are cdr-coded but read back like any other list
+	CellRef parsed = boost::any_cast<CellRef>(Parser::parseForm(context, "(1 2 3)", &rest).mV);
+	assert(parsed->mCdrCode < eCdrAside && sizeof(Cell) < sizeof(WideCell));
+	assert(length(parsed) == 3 && parsed->length() == 3);
+	assert(boost::any_cast<Number>(car(cdr(cdr(Item(parsed))))) == 3);
+
+	tcoeval(Parser::parseForm(context, "(define xs (list 1 (+ 1 1) 3))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define ys (cdr xs))", &rest).mV, context, [](Item){});
+	eval_same("xs", "'(1 2 3)", context);
+
+	// set-cdr! splits the run: xs changes, the tail it used to share does not
+	tcoeval(Parser::parseForm(context, "(set-cdr! xs '(9))", &rest).mV, context, [](Item){});
+	eval_same("xs", "'(1 9)", context);
+	eval_same("ys", "'(2 3)", context);
+	// a cdr the cell can't code is kept aside, and marked from the cell
+	CellRef xs = context->Lookup(gSymbolTable.GetSymbol("xs")).get<CellRef>();
+	assert(xs->mCdrCode == eCdrNear);
+	tcoeval(Parser::parseForm(context, "(set-cdr! xs (string-append \"ni\" \"ne\"))", &rest).mV, context, [](Item){});
+	assert(xs->mCdrCode == eCdrAside);
+	gMemory.gc(context);
+	eval_same("(string-length (cdr xs))", "4", context);
+	tcoeval(Parser::parseForm(context, "(set-cdr! xs ys)", &rest).mV, context, [](Item){});
+	assert(xs->mCdrCode < eCdrAside);
+	eval_same("xs", "'(1 2 3)", context);
+	// a cdr no cell next to it could code gets a wide cell
+	CellRef dotted = boost::any_cast<CellRef>(Parser::parseForm(context, "(1 . 2)", &rest).mV);
+	assert(dotted->mCdrCode == eCdrWide && boost::any_cast<Number>(dotted->cdr()) == 2);
+	tcoeval(Parser::parseForm(context, "(set-car! ys 'two)", &rest).mV, context, [](Item){});
+	eval_same("ys", "'(two 3)", context);
+
+	eval_same("(cons 1 (cons 2 ()))", "'(1 2)", context);
+	eval_same("(= (hcons 1 (hcons 2 ())) (hcons 1 (hcons 2 ())))", "1", context);
+	eval_same("(= (cons 1 (cons 2 ())) (cons 1 (cons 2 ())))", "0", context);
+	eval_same("'(1 2 . 3)", "(cons 1 (cons 2 3))", context);
+}
+
+void test_primitives()
+{
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+	evals_to_number("(+ 1 2 3)", 6, context);
+	evals_to_number("(+)", 0, context);
+	evals_to_number("(- 5)", -5, context);
+	evals_to_number("(- 10 1 2)", 7, context);
+	evals_to_number("(* 2 3 4)", 24, context);
+	evals_to_number("(= 1 1 1)", 1, context);
+	evals_to_number("(= 1 1 2)", 0, context);
+	evals_to_number("(apply + (list 1 2 3))", 6, context);
+	eval_same("(list)", "()", context);
+	eval_same("(apply list '(1 2))", "'(1 2)", context);
+
+	// the arguments arrive as a plain array, checked against the arity first
+	Item plusItem = context->Lookup(gSymbolTable.GetSymbol("+"));
+	Item carItem = context->Lookup(gSymbolTable.GetSymbol("car"));
+	const Proc* plus = plusItem.peek<Proc>();
+	const Proc* car = carItem.peek<Proc>();
+	assert(plus->mPrimitive && car->mPrimitive);
+	Item args[] = { Item(Number(2)), Item(Number(40)) };
+	Item result;
+	std::string error;
+	bool called = callPrimitive(*plus->mPrimitive, args, 2, context, &result, &error);
+	assert(called && result.get<Number>() == 42);
+	called = callPrimitive(*car->mPrimitive, args, 2, context, &result, &error);
+	assert(!called && error == "&wrong-number-of-args");
+	called = callPrimitive(*car->mPrimitive, args, 1, context, &result, &error);
+	assert(!called && error == "&arg0-must-eval-to-pair");
+
+	// the module natives are primitives too; those that call back into Scheme
+	// answer through a continuation
+	Item vectorRefItem = context->Lookup(gSymbolTable.GetSymbol("vector-ref"));
+	Item forEachItem = context->Lookup(gSymbolTable.GetSymbol("btree-for-each"));
+	const Proc* vectorRef = vectorRefItem.peek<Proc>();
+	const Proc* forEach = forEachItem.peek<Proc>();
+	assert(vectorRef->mPrimitive && vectorRef->mPrimitive->mFn);
+	assert(forEach->mPrimitive && !forEach->mPrimitive->mFn && forEach->mPrimitive->mCalls);
+	evals_to_error("(vector-ref (vector 1) 0 0)", "&wrong-number-of-args");
+	evals_to_error("(btree-for-each (make-btree))", "&wrong-number-of-args");
+	evals_to_error("(call/cc)", "&wrong-number-of-args");
+}
+
+void test_numvector_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define xs (f64vector 1 2.5 -3))", &rest).mV, context, [](Item){});
+	eval_same("(f64vector-length xs)", "3", context);
+	eval_same("(f64vector-ref xs 1)", "2.5", context);
+	eval_same("(f64vector->list (f64vector-add xs xs))", "'(2.0 5.0 -6.0)", context);
+	eval_same("(f64vector->list (f64vector-mul xs (f64vector 2 2 2)))", "'(2.0 5.0 -6.0)", context);
+	eval_same("(f64vector->list (f64vector-scale xs 2))", "'(2.0 5.0 -6.0)", context);
+	eval_same("(f64vector-dot xs xs)", "16.25", context);
+	eval_same("(f64vector-sum xs)", "0.5", context);
+	eval_same("(f64vector-min xs)", "-3.0", context);
+	eval_same("(f64vector-max xs)", "2.5", context);
+	tcoeval(Parser::parseForm(context, "(f64vector-set! xs 0 10)", &rest).mV, context, [](Item){});
+	eval_same("(f64vector-ref xs 0)", "10.0", context);
+	tcoeval(Parser::parseForm(context, "(f64vector-fill! xs 0.5)", &rest).mV, context, [](Item){});
+	eval_same("(f64vector-sum xs)", "1.5", context);
+	eval_same("(f64vector-sum (make-f64vector 100 0.25))", "25.0", context);
+
+	tcoeval(Parser::parseForm(context, "(define ns (list->s32vector '(1 2 3 4 5 6 7 8 9 10)))", &rest).mV, context, [](Item){});
+	eval_same("(s32vector-sum ns)", "55", context);
+	eval_same("(s32vector-dot ns ns)", "385", context);
+	eval_same("(s32vector-max (s32vector-scale ns -1))", "-1", context);
+	eval_same("(s32vector->list (s32vector-add (s32vector 2147483647) (s32vector 1)))", "'(-2147483648)", context);
+	eval_same("(s32vector-sum (make-s32vector 4 2147483647))", "8589934588", context);
+	eval_same("(s32vector-ref ns 9)", "10", context);
+
+	// the vectors are traced from the context and survive a collection
+	gMemory.gc(context);
+	eval_same("(f64vector-length xs)", "3", context);
+	eval_same("(s32vector-min ns)", "1", context);
+}
+
+void test_vectors()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define v (make-vector 3 'x))", &rest).mV, context, [](Item){});
+	eval_same("(vector-length v)", "3", context);
+	eval_same("(vector-ref v 2)", "'x", context);
+	tcoeval(Parser::parseForm(context, "(vector-set! v 1 (list 1 2))", &rest).mV, context, [](Item){});
+	eval_same("(vector->list v)", "'(x (1 2) x)", context);
+	eval_same("(vector-ref (list->vector '(a b c d)) 3)", "'d", context);
+	evals_to_error("(list->vector '(1 2 . 3))", "&arg0-must-eval-to-list", context);
+	eval_same("(vector-ref #(1 (+ 1 1) 3) 1)", "'(+ 1 1)", context);
+	eval_same("(vector 1 (+ 1 1) 3)", "#(1 2 3)", context);
+	eval_same("(vector->list #())", "'()", context);
+
+	// O(1) indexing: a long vector is read back end to end
+	tcoeval(Parser::parseForm(context, "(define big (make-vector 100000 7))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(vector-set! big 99999 8)", &rest).mV, context, [](Item){});
+	eval_same("(vector-ref big 99999)", "8", context);
+
+	// elements are traced through the vector
+	gMemory.gc(context);
+	eval_same("(vector-ref v 1)", "'(1 2)", context);
+}
+
+void test_strings()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define s \"hello, world\")", &rest).mV, context, [](Item){});
+	eval_same("(string-length s)", "12", context);
+	eval_same("(substring s 7)", "\"world\"", context);
+	eval_same("(substring (substring s 7 12) 1 3)", "\"or\"", context);
+	eval_same("(string-append (substring s 0 5) \"!\")", "\"hello!\"", context);
+	eval_same("(string=? (substring s 0 5) \"hello\")", "1", context);
+	eval_same("(string<? \"abc\" \"abd\")", "1", context);
+	eval_same("(string->symbol \"cat\")", "'cat", context);
+	eval_same("(symbol->string 'cat)", "\"cat\"", context);
+	eval_same("(number->string 2.5)", "\"2.5\"", context);
+	eval_same("(string->number \"-42\")", "-42", context);
+	eval_same("(string->number \"42x\")", "0", context);
+
+	// substrings of UTF-8 text count code points, and share the buffer
+	tcoeval(Parser::parseForm(context, "(define u \"na\xc3\xafve caf\xc3\xa9\")", &rest).mV, context, [](Item){});
+	eval_same("(string-length u)", "10", context);
+	eval_same("(substring u 2 5)", "\"\xc3\xafve\"", context);
+	CellRef form = boost::any_cast<CellRef>(Parser::parseForm(context, "(substring u 6)", &rest).mV);
+	tcoeval(Item(form), context, [context](Item item) {
+		StringRef whole = boost::any_cast<StringRef>(context->Lookup(gSymbolTable.GetSymbol("u")));
+		assert(boost::any_cast<StringRef>(item)->mBuffer == whole->mBuffer);
+	});
+
+	// ports: build output, then read it back a line at a time
+	tcoeval(Parser::parseForm(context, "(define out (open-output-string))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(display \"one \" out)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(display 1 out)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(write \"\\ntwo\" out)", &rest).mV, context, [](Item){});
+	eval_same("(get-output-string out)", "\"one 1\\\"\\\\ntwo\\\" \"", context);
+	tcoeval(Parser::parseForm(context, "(define in (open-input-string \"first\\nsecond\"))", &rest).mV, context, [](Item){});
+	eval_same("(read-line in)", "\"first\"", context);
+	eval_same("(read-line in)", "\"second\"", context);
+	eval_same("(eof-object? (read-line in))", "1", context);
+
+	gMemory.gc(context);
+	eval_same("s", "\"hello, world\"", context);
+}
+
+void test_bytevector_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define b (bytevector 1 2 3 4 255 0 0 128))", &rest).mV, context, [](Item){});
+	eval_same("(bytevector-length b)", "8", context);
+	eval_same("(bytevector-u8-ref b 4)", "255", context);
+	eval_same("(bytevector-s8-ref b 4)", "-1", context);
+	eval_same("(bytevector-u16-ref b 0 'little)", "513", context);
+	eval_same("(bytevector-u16-ref b 0 'big)", "258", context);
+	eval_same("(bytevector-u32-ref b 0)", "67305985", context);
+	eval_same("(bytevector-s32-ref b 4 'little)", "-2147483393", context);
+	eval_same("(bytevector-u64-ref b 0 'little)", "9223373132138742273", context);
+	eval_same("(bytevector-s64-ref b 0 'little)", "-9223370941570809343", context);
+	tcoeval(Parser::parseForm(context, "(bytevector-u32-set! b 0 4294967295 'big)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(bytevector-s16-set! b 6 -2 'big)", &rest).mV, context, [](Item){});
+	eval_same("b", "(bytevector 255 255 255 255 255 0 255 254)", context);
+	tcoeval(Parser::parseForm(context, "(bytevector-u64-set! b 0 18446744073709551615)", &rest).mV, context, [](Item){});
+	eval_same("(bytevector-u64-ref b 0)", "18446744073709551615", context);
+
+	// slices are windows onto the same bytes
+	tcoeval(Parser::parseForm(context, "(define s (bytevector-slice b 2 5))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(bytevector-u8-set! s 0 7)", &rest).mV, context, [](Item){});
+	eval_same("(bytevector-u8-ref b 2)", "7", context);
+	eval_same("(bytevector-length s)", "3", context);
+	eval_same("(make-bytevector 3 9)", "(bytevector 9 9 9)", context);
+	eval_same("(utf8->string (string->utf8 \"caf\xc3\xa9\"))", "\"caf\xc3\xa9\"", context);
+
+	// a mapped file reads like any other bytevector but can't be written
+	FILE* file = fopen("bytevector-natives.tmp", "wb");
+	fputs("line one\nline two\n", file);
+	fclose(file);
+	tcoeval(Parser::parseForm(context, "(define f (file->bytevector \"bytevector-natives.tmp\"))", &rest).mV, context, [](Item){});
+	eval_same("(bytevector-length f)", "18", context);
+	eval_same("(utf8->string (bytevector-slice f 9 17))", "\"line two\"", context);
+	eval_same("(bytevector-u8-ref (bytevector-copy f) 4)", "32", context);
+	gMemory.gc(context);
+	eval_same("(utf8->string f 0 4)", "\"line\"", context);
+	remove("bytevector-natives.tmp");
+}
+
+void test_hashtable_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define t (make-eq-hashtable))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hashtable-set! t 'apple 1)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hashtable-set! t 'pear (list 2 3))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hashtable-set! t 'apple 4)", &rest).mV, context, [](Item){});
+	eval_same("(hashtable-size t)", "2", context);
+	eval_same("(hashtable-ref t 'apple 0)", "4", context);
+	eval_same("(hashtable-ref t 'plum 'none)", "'none", context);
+	eval_same("(hashtable-contains? t 'pear)", "1", context);
+	tcoeval(Parser::parseForm(context, "(hashtable-delete! t 'apple)", &rest).mV, context, [](Item){});
+	eval_same("(hashtable->alist t)", "'((pear 2 3))", context);
+
+	// equal tables find keys that were built separately, eq tables don't
+	tcoeval(Parser::parseForm(context, "(define e (make-equal-hashtable))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hashtable-set! e (list 1 \"two\" #(3)) 'found)", &rest).mV, context, [](Item){});
+	eval_same("(hashtable-ref e (list 1 \"two\" #(3)) 0)", "'found", context);
+	tcoeval(Parser::parseForm(context, "(define q (make-eqv-hashtable))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hashtable-set! q (list 1) 'found)", &rest).mV, context, [](Item){});
+	eval_same("(hashtable-ref q (list 1) 0)", "0", context);
+	tcoeval(Parser::parseForm(context, "(hashtable-set! q 12345678901234567890 'big)", &rest).mV, context, [](Item){});
+	eval_same("(hashtable-ref q 12345678901234567890 0)", "'big", context);
+
+	// keys and values are traced through the table
+	gMemory.gc(context);
+	eval_same("(hashtable-ref t 'pear 0)", "'(2 3)", context);
+	eval_same("(vector-length (hashtable-keys e))", "1", context);
+}
+
+void test_hamt_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define m (hamt 'a 1 'b 2))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define m2 (hamt-set m 'c (list 3)))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define m3 (hamt-delete m2 'a))", &rest).mV, context, [](Item){});
+	eval_same("(hamt-size m)", "2", context);
+	eval_same("(hamt-size m2)", "3", context);
+	eval_same("(hamt-ref m2 'c)", "'(3)", context);
+	eval_same("(hamt-ref m 'c 'missing)", "'missing", context);
+	eval_same("(hamt-contains? m3 'a)", "0", context);
+	eval_same("(hamt-contains? m2 'a)", "1", context);
+	eval_same("(hamt-ref (hamt \"key\" 'v) (substring \"a key\" 2))", "'v", context);
+	eval_same("m3", "(hamt 'c '(3) 'b 2)", context);
+
+	// a transient is updated in place, then frozen
+	tcoeval(Parser::parseForm(context, "(define t (hamt-transient m))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hamt-set! t 'z 26)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(hamt-delete! t 'a)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define frozen (hamt-persistent! t))", &rest).mV, context, [](Item){});
+	eval_same("frozen", "(hamt 'b 2 'z 26)", context);
+	eval_same("(hamt-size m)", "2", context);
+
+	// bulk loading; later pairs win
+	tcoeval(Parser::parseForm(context, "(define (pairs n acc) (if (= n 0) acc (pairs (- n 1) (cons (cons n (* n n)) acc))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define big (alist->hamt (pairs 5000 '((1 . one)))))", &rest).mV, context, [](Item){});
+	eval_same("(hamt-size big)", "5000", context);
+	eval_same("(hamt-ref big 4000)", "16000000", context);
+	eval_same("(hamt-ref big 1)", "'one", context);
+
+	// entries in every version are traced
+	gMemory.gc(context);
+	eval_same("(hamt-ref m2 'c)", "'(3)", context);
+	eval_same("(hamt-ref big 77)", "5929", context);
+}
+
+void test_records()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define-record-type <point> (make-point x y) point? (x point-x set-point-x!) (y point-y) (tag point-tag set-point-tag!))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define p (make-point 1 (list 2)))", &rest).mV, context, [](Item){});
+	eval_same("(point-x p)", "1", context);
+	eval_same("(point-y p)", "'(2)", context);
+	eval_same("(point? p)", "1", context);
+	eval_same("(point? (list 1 2))", "0", context);
+	eval_same("(record? p)", "1", context);
+	tcoeval(Parser::parseForm(context, "(set-point-x! p 10)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(set-point-tag! p 'origin)", &rest).mV, context, [](Item){});
+	eval_same("(+ (point-x p) 1)", "11", context);
+	eval_same("(point-tag p)", "'origin", context);
+
+	// another type with the same layout is still a different type
+	tcoeval(Parser::parseForm(context, "(define-record-type <pair2> (make-pair2 x y) pair2? (x pair2-x) (y pair2-y))", &rest).mV, context, [](Item){});
+	eval_same("(point? (make-pair2 1 2))", "0", context);
+	eval_same("(pair2-y (make-pair2 1 2))", "2", context);
+
+	// slots are traced
+	gMemory.gc(context);
+	eval_same("(point-y p)", "'(2)", context);
+}
+
+void test_btree_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define t (make-btree))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define (fill n) (if (= n 0) 0 (begin (btree-set! t (% (* n 37) 101) (list n)) (fill (- n 1)))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(fill 100)", &rest).mV, context, [](Item){});
+	eval_same("(btree-size t)", "100", context);
+	eval_same("(btree-ref t 74)", "'(2)", context);
+	eval_same("(btree-ref t 0 'missing)", "'missing", context);
+	eval_same("(btree? t)", "1", context);
+
+	// a range visits keys low <= key < high in order
+	tcoeval(Parser::parseForm(context, "(define out (open-output-string))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(btree-range t 3 7 (lambda (k v) (display k out)))", &rest).mV, context, [](Item){});
+	eval_same("(get-output-string out)", "\"3456\"", context);
+
+	// the procedure may change the tree as it goes
+	tcoeval(Parser::parseForm(context, "(btree-for-each t (lambda (k v) (btree-delete! t k)))", &rest).mV, context, [](Item){});
+	eval_same("(btree-size t)", "0", context);
+
+	// bulk loading, symbol and string keys
+	tcoeval(Parser::parseForm(context, "(define s (alist->btree (list (cons 1 'one) (cons 'apple 2) (cons 'banana 3) (cons \"pear\" 4))))", &rest).mV, context, [](Item){});
+	eval_same("(btree-ref s 'banana)", "3", context);
+	eval_same("(btree-ref s (substring \"a pear\" 2))", "4", context);
+	eval_same("(btree->alist s)", "(list (cons 1 'one) (cons 'apple 2) (cons 'banana 3) (cons \"pear\" 4))", context);
+	tcoeval(Parser::parseForm(context, "(define out (open-output-string))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(btree-range s 'a 'b (lambda (k v) (display v out)))", &rest).mV, context, [](Item){});
+	eval_same("(get-output-string out)", "\"2\"", context);
+
+	// a long scan runs in constant stack, and values are traced
+	tcoeval(Parser::parseForm(context, "(define (pairs n acc) (if (= n 0) acc (pairs (- n 1) (cons (cons n (list n)) acc))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define big (alist->btree (pairs 20000 '())))", &rest).mV, context, [](Item){});
+	gMemory.gc(context);
+	tcoeval(Parser::parseForm(context, "(define total (make-vector 1 0))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(btree-for-each big (lambda (k v) (vector-set! total 0 (+ (vector-ref total 0) (car v)))))", &rest).mV, context, [](Item){});
+	eval_same("(vector-ref total 0)", "200010000", context);
+}
+
+void test_pqueue_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	// fixnum priorities, smallest first
+	tcoeval(Parser::parseForm(context, "(define q (make-pq))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(pq-push! q 5 'five)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define h (pq-push! q 9 (list 'nine)))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(pq-push! q 1 'one)", &rest).mV, context, [](Item){});
+	eval_same("(pq-size q)", "3", context);
+	eval_same("(pq-peek q)", "'one", context);
+	eval_same("(pq-peek-priority q)", "1", context);
+	eval_same("(pq-pop! q)", "'one", context);
+	tcoeval(Parser::parseForm(context, "(pq-decrease-key! q h 0)", &rest).mV, context, [](Item){});
+	gMemory.gc(context);
+	eval_same("(pq-pop! q)", "'(nine)", context);
+	eval_same("(pq-pop! q)", "'five", context);
+	eval_same("(pq-empty? q)", "1", context);
+
+	// a procedure orders any priorities; here, strings, last first
+	tcoeval(Parser::parseForm(context, "(define m (list->pq (list (cons \"c\" 'c) (cons \"g\" 'g) (cons \"e\" 'e) (cons \"a\" 'a)) (lambda (a b) (string<? b a))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(pq-push! m \"f\" 'f)", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(pq-decrease-key! m 3 \"z\")", &rest).mV, context, [](Item){});
+	eval_same("(pq-pop! m)", "'a", context);
+	eval_same("(pq-pop! m)", "'g", context);
+	eval_same("(pq-pop! m)", "'f", context);
+	eval_same("(pq-pop! m)", "'e", context);
+	eval_same("(pq-size m)", "1", context);
+
+	// heapifying a long list through the procedure runs in constant stack
+	tcoeval(Parser::parseForm(context, "(define (pairs n acc) (if (= n 0) acc (pairs (- n 1) (cons (cons (number->string (% (* n 7919) 20000)) n) acc))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define big (list->pq (pairs 20000 '()) string<?))", &rest).mV, context, [](Item){});
+	eval_same("(pq-peek-priority big)", "\"0\"", context);
+	eval_same("(pq-pop! big)", "20000", context);
+	eval_same("(pq-peek-priority big)", "\"1\"", context);
+}
+
+void test_rope_natives()
+{
+	char* rest;
+	Context* context = gMemory.allocContext(gMemory.getRoot(), gMemory.getRoot());
+
+	tcoeval(Parser::parseForm(context, "(define r (rope-append \"hello\" \", \"))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define r (rope-append r \"world\"))", &rest).mV, context, [](Item){});
+	eval_same("(rope? r)", "1", context);
+	eval_same("(rope-length r)", "12", context);
+	eval_same("(rope->string r)", "\"hello, world\"", context);
+	eval_same("(rope->string (rope-substring r 4 9))", "\"o, wo\"", context);
+	eval_same("(rope->string (rope-append r r))", "\"hello, worldhello, world\"", context);
+
+	// a report built by appending in a loop, written out through a port
+	tcoeval(Parser::parseForm(context, "(define (build n acc) (if (= n 0) acc (build (- n 1) (rope-append acc (number->string n) \" \"))))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(define report (build 2000 (rope-append)))", &rest).mV, context, [](Item){});
+	eval_same("(rope->string (rope-substring report 0 10))", "\"2000 1999 \"", context);
+	tcoeval(Parser::parseForm(context, "(define out (open-output-string))", &rest).mV, context, [](Item){});
+	tcoeval(Parser::parseForm(context, "(display report out)", &rest).mV, context, [](Item){});
+	eval_same("(string-length (get-output-string out))", "(rope-length report)", context);
+
+	gMemory.gc(context);
+	eval_same("(rope->string r)", "\"hello, world\"", context);
+}
+
 void test_any()
 {
 	boost::any  typeless = boost::any( 10.0 );
@@ -665,16 +1731,153 @@ void test_any()
 	assert(typeid(f) == typeid(std::function<void()>));
 }
 
+// scheme -aot file.scm out.cpp writes the C++ for a file's forms, registered
+// under the file's name without its directory or extension.
+static int translateFile(const char* path, const char* outPath)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		printf("can't read %s\n", path);
+		return 1;
+	}
+	std::string source;
+	char buffer[4096];
+	size_t bytes;
+	while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		source.append(buffer, bytes);
+	}
+	fclose(file);
+
+	std::string name = path;
+	size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		name = name.substr(slash + 1);
+	}
+	name = name.substr(0, name.find('.'));
+
+	std::string out;
+	std::string error;
+	if (!translate(source, name, &out, &error))
+	{
+		printf("%s: %s\n", path, error.c_str());
+		return 1;
+	}
+	file = fopen(outPath, "wb");
+	if (!file)
+	{
+		printf("can't write %s\n", outPath);
+		return 1;
+	}
+	fwrite(out.data(), 1, out.size(), file);
+	fclose(file);
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
+	if (argc > 1 && std::string(argv[1]) == "-bench")
+	{
+		addNativeFns();
+		runBenchmarks();
+		return 0;
+	}
+
+	if (argc > 3 && std::string(argv[1]) == "-aot")
+	{
+		addNativeFns();
+		return translateFile(argv[2], argv[3]);
+	}
+
+	// runs a program translated with -aot and linked in
+	if (argc > 2 && std::string(argv[1]) == "-run")
+	{
+		addNativeFns();
+		bool found = runScript(argv[2], gMemory.getRoot(), [](Item item) {
+			puts(print(item).c_str());
+		});
+		if (!found)
+		{
+			printf("no program %s\n", argv[2]);
+		}
+		return found ? 0 : 1;
+	}
+
+	// the repl's flags may come in any order, e.g. -vm -hashcons
+	EvalMode mode = eWalk;
+	bool hashCons = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string flag = argv[i];
+		if (flag == "-analyze")
+		{
+			mode = eAnalyze;
+		}
+		else if (flag == "-vm")
+		{
+			mode = eBytecode;
+		}
+		else if (flag == "-hashcons")
+		{
+			hashCons = true;
+		}
+	}
+
 	test_any();
 
 	addNativeFns();
 
 	Parser::test();
+	Bignum::test();
+	CellHeap::test();
+	Memory::test();
 
-	test_eval();
+	// the evaluator's tests run in every mode
+	for (int i = eWalk; i <= eBytecode; i++)
+	{
+		gEvalMode = (EvalMode)i;
+		test_eval();
+		test_tail_calls();
+		test_deep_calls();
+		test_out_of_memory();
+		test_hot_errors();
+		test_collect_mid_form();
+	}
+	test_walker();
+	test_continuations();
+	gEvalMode = eWalk;
+	test_analyze();
+	test_vm();
+	test_jit();
+	test_aot();
 	test_context();
+	test_lists();
+	test_primitives();
+	test_numvectors();
+	test_numvector_natives();
+	test_vectors();
+	test_strings();
+	test_ropes();
+	test_rope_natives();
+	test_bytevectors();
+	test_bytevector_natives();
+	test_hashtables();
+	test_hashtable_natives();
+	test_hamt();
+	test_hamt_natives();
+	test_records();
+	test_btree();
+	test_btree_natives();
+	test_pqueue();
+	test_pqueue_natives();
+
+	if (hashCons)
+	{
+		Parser::setHashConsing(true);
+	}
 
+	gEvalMode = mode;
 	repl();
 }
@@ -0,0 +1,354 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "schemestring.h"
+#include "rope.h"
+#include "symboltable.h"
+#include "numeric.h"
+#include "memory.h"
+#include "parser.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+extern std::string print(Item);
+
+const type_info& eString	= typeid(StringRef);
+const type_info& ePort		= typeid(PortRef);
+const type_info& eEof		= typeid(Eof);
+
+static bool isContinuationByte(char c)
+{
+	return (c & 0xc0) == 0x80;
+}
+
+uint32_t String::countCodePoints(const char* text, size_t bytes)
+{
+	uint32_t count = 0;
+	for (size_t i = 0; i < bytes; i++)
+	{
+		count += isContinuationByte(text[i]) ? 0 : 1;
+	}
+	return count;
+}
+
+// Byte offset of code point 'index' (which may be mLength) from data().
+uint32_t String::byteOffset(uint32_t index) const
+{
+	if (ascii())
+	{
+		return index;
+	}
+
+	const char* text = data();
+	uint32_t offset = 0;
+	for (; index > 0; index--)
+	{
+		offset++;
+		while (offset < mBytes && isContinuationByte(text[offset]))
+		{
+			offset++;
+		}
+	}
+	return offset;
+}
+
+std::string stringLiteral(const char* text, size_t bytes)
+{
+	std::string literal = "\"";
+	for (size_t i = 0; i < bytes; i++)
+	{
+		switch (text[i])
+		{
+		case '"':	literal += "\\\"";	break;
+		case '\\':	literal += "\\\\";	break;
+		case '\n':	literal += "\\n";	break;
+		case '\t':	literal += "\\t";	break;
+		default:	literal += text[i];	break;
+		}
+	}
+	return literal + "\"";
+}
+
+bool stringEqual(StringRef first, StringRef second)
+{
+	return first->mBytes == second->mBytes && memcmp(first->data(), second->data(), first->mBytes) == 0;
+}
+
+static int stringCompare(StringRef first, StringRef second)
+{
+	int order = memcmp(first->data(), second->data(), std::min(first->mBytes, second->mBytes));
+	if (order != 0)
+	{
+		return order;
+	}
+	return first->mBytes < second->mBytes ? -1 : (first->mBytes > second->mBytes ? 1 : 0);
+}
+
+static StringRef stringArg(const Item& arg)
+{
+	return arg.type() == eString ? boost::any_cast<StringRef>(arg) : nullptr;
+}
+
+static PortRef portArg(const Item& arg, bool input)
+{
+	if (arg.type() != ePort)
+	{
+		return nullptr;
+	}
+	PortRef port = boost::any_cast<PortRef>(arg);
+	return (port->mInput != nullptr) == input ? port : nullptr;
+}
+
+// The text display shows: strings without their quotes, anything else as print does.
+static std::string displayText(const Item& item)
+{
+	if (item.type() == eString)
+	{
+		return boost::any_cast<StringRef>(item)->str();
+	}
+
+	std::string text = print(item);
+	if (!text.empty() && text.back() == ' ')
+	{
+		text.pop_back();
+	}
+	return text;
+}
+
+Item stringp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(stringArg(args[0]) ? 1 : 0));
+}
+
+Item stringLength(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef string = stringArg(args[0]);
+	if (!string)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+	return Item(Number(string->mLength));
+}
+
+// (substring s start [end]) shares s's buffer
+Item substring(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef string = stringArg(args[0]);
+	if (!string)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+
+	Number start = args[1].type() == eNumber ? boost::any_cast<Number>(args[1]) : -1;
+	Number end = count > 2 && args[2].type() == eNumber ? boost::any_cast<Number>(args[2]) : (Number)string->mLength;
+	if (start < 0 || end < start || (uint32_t)end > string->mLength)
+	{
+		*error = "&index-out-of-range";
+		return Item();
+	}
+
+	uint32_t begin = string->byteOffset(start);
+	uint32_t bytes = string->byteOffset(end) - begin;
+	StringBuffer buffer = string->mBuffer;
+	uint32_t offset = string->mOffset + begin;
+	return Item(gMemory.allocString(context, buffer, offset, bytes, end - start));
+}
+
+Item stringAppend(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	std::string text;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		StringRef string = stringArg(args[i]);
+		if (!string)
+		{
+			*error = "&args-must-eval-to-strings";
+			return Item();
+		}
+		text.append(string->data(), string->mBytes);
+	}
+	return Item(gMemory.allocString(context, text));
+}
+
+template<bool (*Test)(int order)>
+Item stringCompareProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef first = stringArg(args[0]);
+	StringRef second = stringArg(args[1]);
+	if (!first || !second)
+	{
+		*error = first ? "&arg1-must-eval-to-string" : "&arg0-must-eval-to-string";
+		return Item();
+	}
+	return Item(Number(Test(stringCompare(first, second)) ? 1 : 0));
+}
+
+static bool isEqualOrder(int order) { return order == 0; }
+static bool isLessOrder(int order) { return order < 0; }
+
+Item stringToSymbol(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef string = stringArg(args[0]);
+	if (!string)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+	return Item(gSymbolTable.GetSymbol(string->str()));
+}
+
+Item symbolToString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eSymbol)
+	{
+		*error = "&arg0-must-eval-to-symbol";
+		return Item();
+	}
+	return Item(gMemory.allocString(context, gSymbolTable.GetString(boost::any_cast<Symbol>(args[0]))));
+}
+
+Item numberToString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (!isNumber(args[0]))
+	{
+		*error = "&arg0-must-eval-to-number";
+		return Item();
+	}
+	return Item(gMemory.allocString(context, numToString(args[0])));
+}
+
+// #f (0) unless the whole string reads as one number
+Item stringToNumber(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef string = stringArg(args[0]);
+	if (!string)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+
+	std::vector<char> text(string->data(), string->data() + string->mBytes);
+	text.push_back('\0');
+	char* rest;
+	Maybe<Item> number = Parser::parseForm(context, &text[0], &rest);
+	return number.mValid && isNumber(number.mV) && *rest == '\0' ? number.mV : Item(Number(0));
+}
+
+Item openOutputString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(gMemory.allocPort(context));
+}
+
+Item openInputString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	StringRef string = stringArg(args[0]);
+	if (!string)
+	{
+		*error = "&arg0-must-eval-to-string";
+		return Item();
+	}
+	return Item(gMemory.allocPort(context, string));
+}
+
+// (display x [port]) and (write x [port]); without a port they go to stdout
+template<bool Display>
+Item writeProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	std::string console;
+	std::string* out = &console;
+	if (count > 1)
+	{
+		PortRef port = portArg(args[1], false);
+		if (!port)
+		{
+			*error = "&arg1-must-eval-to-output-port";
+			return Item();
+		}
+		out = &port->mOutput;
+	}
+
+	// a rope's leaves are copied straight to the output, never flattened first
+	if (Display && args[0].type() == eRope)
+	{
+		ropeAppendTo(boost::any_cast<RopeRef>(args[0])->mTree, *out);
+	}
+	else
+	{
+		*out += Display ? displayText(args[0]) : print(args[0]);
+	}
+
+	if (out == &console)
+	{
+		fwrite(console.data(), 1, console.size(), stdout);
+	}
+	return Unspecified();
+}
+
+Item getOutputString(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	PortRef port = portArg(args[0], false);
+	if (!port)
+	{
+		*error = "&arg0-must-eval-to-output-port";
+		return Item();
+	}
+	return Item(gMemory.allocString(context, port->mOutput));
+}
+
+// The next line without its newline, or the eof object once the port is drained.
+Item readLine(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	PortRef port = portArg(args[0], true);
+	if (!port)
+	{
+		*error = "&arg0-must-eval-to-input-port";
+		return Item();
+	}
+	if (port->mPosition >= port->mEnd)
+	{
+		return Item(Eof());
+	}
+
+	const char* text = port->mInput->data();
+	uint32_t begin = port->mPosition, end = begin;
+	while (end < port->mEnd && text[end] != '\n')
+	{
+		end++;
+	}
+	port->mPosition = end < port->mEnd ? end + 1 : end;
+
+	StringBuffer buffer = port->mInput;
+	return Item(gMemory.allocString(context, buffer, begin, end - begin, String::countCodePoints(text + begin, end - begin)));
+}
+
+Item eofObjectp(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(Number(args[0].type() == eEof ? 1 : 0));
+}
+
+void addStringNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("string?", stringp, 1, 1, false);
+	definePrimitive("string-length", stringLength, 1, 1, false);
+	definePrimitive("substring", substring, 2, 3, true);
+	definePrimitive("string-append", stringAppend, 0, any, true);
+	definePrimitive("string=?", stringCompareProc<isEqualOrder>, 2, 2, false);
+	definePrimitive("string<?", stringCompareProc<isLessOrder>, 2, 2, false);
+	definePrimitive("string->symbol", stringToSymbol, 1, 1, false);
+	definePrimitive("symbol->string", symbolToString, 1, 1, true);
+	definePrimitive("number->string", numberToString, 1, 1, true);
+	definePrimitive("string->number", stringToNumber, 1, 1, true);
+	definePrimitive("open-output-string", openOutputString, 0, 0, true);
+	definePrimitive("open-input-string", openInputString, 1, 1, true);
+	definePrimitive("display", writeProc<true>, 1, 2, false);
+	definePrimitive("write", writeProc<false>, 1, 2, false);
+	definePrimitive("get-output-string", getOutputString, 1, 1, true);
+	definePrimitive("read-line", readLine, 1, 1, true);
+	definePrimitive("eof-object?", eofObjectp, 1, 1, false);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// UTF-8 text shared between a string and the substrings taken from it.
+typedef std::shared_ptr<const std::string>	StringBuffer;
+
+// An immutable string: a slice of a shared buffer. Substrings are new slices
+// of the same buffer, so taking one copies nothing. Indices count code points;
+// an all-ASCII string (the usual case) indexes its bytes directly.
+struct String : public Collectable<String>
+{
+	StringBuffer	mBuffer;
+	uint32_t		mOffset;		// bytes into mBuffer
+	uint32_t		mBytes;
+	uint32_t		mLength;		// code points
+
+	String()
+		: mOffset(0)
+		, mBytes(0)
+		, mLength(0)
+	{}
+	String(StringBuffer buffer, uint32_t offset, uint32_t bytes, uint32_t length)
+		: mBuffer(buffer)
+		, mOffset(offset)
+		, mBytes(bytes)
+		, mLength(length)
+	{}
+
+	const char*	data() const { return mBuffer ? mBuffer->data() + mOffset : ""; }
+	std::string	str() const { return std::string(data(), mBytes); }
+	bool		ascii() const { return mLength == mBytes; }
+	uint32_t	byteOffset(uint32_t index) const;
+	void		mark() override { mReachable = true; }
+
+	static uint32_t countCodePoints(const char* text, size_t bytes);
+};
+
+typedef String*		StringRef;
+
+extern const type_info& eString;
+
+// A string port. An output port is the mutable builder: appends are amortised
+// constant time and get-output-string copies the text out once. An input port
+// reads through a string's slice of its buffer without copying it.
+struct Port : public Collectable<Port>
+{
+	std::string		mOutput;
+	StringBuffer	mInput;			// null for an output port
+	uint32_t		mPosition;		// next byte to read
+	uint32_t		mEnd;
+
+	Port()
+		: mPosition(0)
+		, mEnd(0)
+	{}
+	Port(StringBuffer input, uint32_t begin, uint32_t end)
+		: mInput(input)
+		, mPosition(begin)
+		, mEnd(end)
+	{}
+
+	void	mark() override { mReachable = true; }
+};
+
+typedef Port*		PortRef;
+
+struct Eof {};
+
+extern const type_info& ePort;
+extern const type_info& eEof;
+
+std::string	stringLiteral(const char* text, size_t bytes);
+bool		stringEqual(StringRef first, StringRef second);
+void		addStringNatives();
@@ -1,5 +1,18 @@
 #include "stdafx.h"
+#include <unordered_map>
 #include "schemetypes.h"
+#include "context.h"
+#include "memory.h"
+#include "numvector.h"
+#include "vector.h"
+#include "schemestring.h"
+#include "rope.h"
+#include "bytevector.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "record.h"
+#include "btree.h"
+#include "pqueue.h"
 
 const type_info& eUnspecified	= typeid(Unspecified);
 const type_info& eSymbol		= typeid(Symbol);
@@ -7,36 +20,210 @@ const type_info& eNumber		= typeid(Number);
 const type_info& eCell			= typeid(CellRef);
 const type_info& eProc			= typeid(Proc);
 
-Number Cell::length()
+void markItem(const Item& item)
 {
-	auto cell = boost::any_cast<CellRef>(mCdr);
-	if (cell)
+	if (item.type() == eCell)
+	{
+		if (auto cell = boost::any_cast<CellRef>(item))
+		{
+			cell->mark();
+		}
+	}
+	else if (item.type() == eProc)
+	{
+		auto proc = boost::any_cast<Proc>(item);
+		if (proc.mProc)
+		{
+			proc.mProc->mark();
+		}
+		if (proc.mClosure)
+		{
+			proc.mClosure->mark();
+		}
+		if (proc.mRoots)
+		{
+			proc.mRoots->markRoots();
+		}
+	}
+	else if (item.type() == eVector)
+	{
+		boost::any_cast<VectorRef>(item)->mark();
+	}
+	else if (item.type() == eString)
+	{
+		boost::any_cast<StringRef>(item)->mark();
+	}
+	else if (item.type() == ePort)
+	{
+		boost::any_cast<PortRef>(item)->mark();
+	}
+	else if (item.type() == eRope)
+	{
+		boost::any_cast<RopeRef>(item)->mark();
+	}
+	else if (item.type() == eBytevector)
+	{
+		boost::any_cast<BytevectorRef>(item)->mark();
+	}
+	else if (item.type() == eHashTable)
+	{
+		boost::any_cast<HashTableRef>(item)->mark();
+	}
+	else if (item.type() == eHamt)
+	{
+		boost::any_cast<HamtRef>(item)->mark();
+	}
+	else if (item.type() == eRecord)
+	{
+		boost::any_cast<RecordRef>(item)->mark();
+	}
+	else if (item.type() == eBTree)
+	{
+		boost::any_cast<BTreeRef>(item)->mark();
+	}
+	else if (item.type() == ePriorityQueue)
 	{
-		return 1 + cell->length();
+		boost::any_cast<PriorityQueueRef>(item)->mark();
 	}
-	else
+	else if (item.type() == eF64Vector)
 	{
-		return 1;
+		boost::any_cast<F64Vector*>(item)->mark();
+	}
+	else if (item.type() == eS32Vector)
+	{
+		boost::any_cast<S32Vector*>(item)->mark();
 	}
 }
 
-void Cell::mark()
+// Cdrs Cells couldn't code after a set-cdr!. Never freed, so cells destroyed
+// during static destruction can still drop theirs.
+static std::unordered_map<const Cell*, Item>& asideCdrs()
+{
+	static auto cdrs = new std::unordered_map<const Cell*, Item>;
+	return *cdrs;
+}
+
+Cell::~Cell()
 {
-	if ( mReachable)
+	if (mCdrCode == eCdrAside)
 	{
+		asideCdrs().erase(this);
+	}
+}
+
+CdrCode Cell::code(const Cell* at, const Item& cdr)
+{
+	if (cdr.type() == eCell)
+	{
+		auto cell = boost::any_cast<CellRef>(cdr);
+		if (cell == nullptr)
+		{
+			return eCdrNil;
+		}
+		else if (cell == at + 1)
+		{
+			return eCdrNext;
+		}
+		else if (cell == at - 1)
+		{
+			return eCdrPrevious;
+		}
+		ptrdiff_t offset = (const char*)cell - (const char*)at;
+		if (offset == (int32_t)offset)
+		{
+			return eCdrNear;
+		}
+	}
+	return eCdrAside;
+}
+
+const Item& Cell::heldCdr() const
+{
+	if (mCdrCode == eCdrWide)
+	{
+		return static_cast<const WideCell*>(this)->mCdr;
+	}
+	return asideCdrs().find(this)->second;
+}
+
+Item Cell::cdr() const
+{
+	switch (mCdrCode)
+	{
+	case eCdrNil:		return Item((CellRef)nullptr);
+	case eCdrNext:		return Item((CellRef)(this + 1));
+	case eCdrPrevious:	return Item((CellRef)(this - 1));
+	case eCdrNear:		return Item((CellRef)((const char*)this + mCdrOffset));
+	default:			return heldCdr();
+	}
+}
+
+void Cell::setCdr(Item cdr)
+{
+	if (mCdrCode == eCdrWide)
+	{
+		static_cast<WideCell*>(this)->mCdr = cdr;
 		return;
 	}
 
-	mReachable = true;
-	if ( mCar.type() == eCell && boost::any_cast<CellRef>(mCar))
+	if (mCdrCode == eCdrAside)
 	{
-		auto cell = boost::any_cast<CellRef>(mCar);
-		cell->mark();
+		asideCdrs().erase(this);
 	}
+	mCdrCode = code(this, cdr);
+	if (mCdrCode == eCdrNear)
+	{
+		mCdrOffset = (int32_t)((const char*)boost::any_cast<CellRef>(cdr) - (const char*)this);
+	}
+	else if (mCdrCode == eCdrAside)
+	{
+		asideCdrs()[this] = cdr;
+	}
+}
 
-	if ( mCdr.type() == eCell && boost::any_cast<CellRef>(mCdr))
+// The following cell of a list, or nullptr at the end of a proper or dotted list.
+Cell* Cell::next() const
+{
+	switch (mCdrCode)
+	{
+	case eCdrNil:		return nullptr;
+	case eCdrNext:		return (CellRef)(this + 1);
+	case eCdrPrevious:	return (CellRef)(this - 1);
+	case eCdrNear:		return (CellRef)((const char*)this + mCdrOffset);
+	default:
+	{
+		const Item& cdr = heldCdr();
+		return cdr.type() == eCell ? boost::any_cast<CellRef>(cdr) : nullptr;
+	}
+	}
+}
+
+Number Cell::length()
+{
+	Number count = 1;
+	auto cell = next();
+	while (cell)
 	{
-		auto cell = boost::any_cast<CellRef>(mCdr);
-		cell->mark();
+		count++;
+		cell = cell->next();
+	}
+
+	return count;
+}
+
+void Cell::mark()
+{
+	// recurse on cars, loop along the cdr chain so long lists don't exhaust the stack
+	Cell* cell = this;
+	while (cell && !cell->mReachable)
+	{
+		cell->mReachable = true;
+		markItem(cell->mCar);
+		if (cell->mCdrCode >= eCdrAside && cell->heldCdr().type() != eCell)
+		{
+			markItem(cell->heldCdr());
+		}
+
+		cell = cell->next();
 	}
 }
\ No newline at end of file
@@ -2,30 +2,56 @@
 
 #include <stdint.h>
 #include <functional>
+#include <memory>
+#include <string>
 #include "collectable.h"
-#include "boost\any.hpp"
+#include "item.h"
 
 struct Context;
 
-typedef boost::any Item;
 typedef std::function<void(Item)>  Continuation;
 typedef std::function<void(Item, Context*, Continuation)> Native;
 
 struct Cell;
+struct Node;
+struct RootSet;
+
+// A native handed its arguments evaluated, count of them from args, which
+// answers straight away: with its value, or with error set.
+typedef Item (*PrimitiveFn)(const Item* args, uint32_t count, Context* context, std::string* error);
+// One that calls back into Scheme, or that was made at run time around data
+// of its own, answers through k instead.
+typedef std::function<void(const Item* args, uint32_t count, Context* context, Continuation k)> PrimitiveCalls;
+
+struct Primitive
+{
+	const static uint32_t cAnyArgs = 0xffffffff;
+
+	PrimitiveFn		mFn;
+	PrimitiveCalls	mCalls;			// when there is no mFn
+	uint32_t		mMinArgs;
+	uint32_t		mMaxArgs;
+	bool			mAllocates;		// may collect, so its arguments are rooted for the call
+};
 
 struct Proc {
 	Cell*		mProc;
 	Context*	mClosure;
 	Native		mNative;
+	std::shared_ptr<const Node>	mCode;		// the analyzed body, for a closure made by analyzed code
+	std::shared_ptr<RootSet>	mRoots;		// what a native holds on to that the collector has to see
+	const Primitive*			mPrimitive;	// for a primitive, which evaluators call on their own values
 	Proc(Native native)
 		: mNative(native)
 		, mProc(nullptr)
 		, mClosure(nullptr)
+		, mPrimitive(nullptr)
 	{}
 	Proc(Cell* proc, Context* closure)
 		: mNative(nullptr)
 		, mProc(proc)
 		, mClosure(closure)
+		, mPrimitive(nullptr)
 	{}
 	bool operator==(Proc& rhs) const
 	{
@@ -48,23 +74,79 @@ extern const type_info& eNumber;// = typeid(Number);
 extern const type_info& eCell;// = typeid(CellRef);
 extern const type_info& eProc;// = typeid(Proc);
 
+// Marks whatever heap object an item refers to; anything else is ignored.
+void markItem(const Item& item);
+
+// How a cell's cdr is stored. Lists are usually consed tail first from an
+// address-ordered free list, so the cdr is very often the neighbouring cell,
+// and otherwise a cell not far off. A Cell only has room for its car and codes
+// such cdrs in itself; a cons whose cdr is no cell, or one out of reach, gets
+// a WideCell, which holds the cdr. Any mutation goes through setCdr, which
+// re-codes (and so splits a run) as needed. A cdr a Cell can't code once
+// set-cdr! has been at it is kept in a side table.
+enum CdrCode
+{
+	eCdrNil,			// cdr is the empty list
+	eCdrNext,			// cdr is this + 1
+	eCdrPrevious,		// cdr is this - 1
+	eCdrNear,			// cdr is mCdrOffset bytes from this
+	eCdrAside,			// cdr is held in the side table
+	eCdrWide,			// cdr is held in the WideCell's mCdr
+};
+
 struct Cell : public Collectable<Cell>
 {
+	// ahead of the car, where they fit in the header's padding
+	uint8_t		mCdrCode;
+	bool		mHashConsed;	// shared through Memory::hcons, must not be mutated
+	int32_t		mCdrOffset;
 	Item		mCar;
-	Item		mCdr;
 	Cell()
-		: mCdr()
+		: mCdrCode(eCdrNil)
+		, mHashConsed(false)
+		, mCdrOffset(0)
 		, mCar()
 	{}
 	Cell(Item car, Item cdr)
-		: mCar(car)
-		, mCdr(cdr)
-	{}
+		: mCdrCode(eCdrNil)
+		, mHashConsed(false)
+		, mCdrOffset(0)
+		, mCar(car)
+	{
+		setCdr(cdr);
+	}
 	Cell(Item car)
-		: mCar(car)
-		, mCdr((CellRef)nullptr)
+		: mCdrCode(eCdrNil)
+		, mHashConsed(false)
+		, mCdrOffset(0)
+		, mCar(car)
 	{}
+	~Cell();
 
+	Item  cdr() const;
+	void  setCdr(Item cdr);
+	Cell* next() const;
 	void  mark() override;
 	Number length();
+
+	// how a Cell at the address would code the cdr; eCdrAside if it can't
+	static CdrCode code(const Cell* at, const Item& cdr);
+
+private:
+	const Item& heldCdr() const;
+};
+
+struct WideCell : public Cell
+{
+	Item		mCdr;
+	WideCell()
+	{
+		mCdrCode = eCdrWide;
+	}
+	WideCell(Item car, Item cdr)
+		: Cell(car)
+		, mCdr(cdr)
+	{
+		mCdrCode = eCdrWide;
+	}
 };
@@ -0,0 +1,209 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <algorithm>
+#include <sstream>
+#include "vector.h"
+#include "memory.h"
+#include "eval.h"
+
+extern std::string print(Item);
+
+const type_info& eVector = typeid(VectorRef);
+
+void Vector::mark()
+{
+	if (mReachable)
+	{
+		return;
+	}
+
+	mReachable = true;
+	for (auto& element : mElements)
+	{
+		markItem(element);
+	}
+}
+
+std::string vectorToString(VectorRef vector)
+{
+	std::ostringstream text;
+	text << "#( ";
+	for (auto& element : vector->mElements)
+	{
+		text << print(element);
+	}
+	text << ") ";
+	return text.str();
+}
+
+bool vectorEqual(VectorRef first, VectorRef second, bool (*equal)(Item, Item))
+{
+	if (first == second)
+	{
+		return true;
+	}
+	if (first->length() != second->length())
+	{
+		return false;
+	}
+	for (uint32_t i = 0; i < first->length(); i++)
+	{
+		if (!equal(first->mElements[i], second->mElements[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static VectorRef vectorArg(const Item& arg)
+{
+	return arg.type() == eVector ? boost::any_cast<VectorRef>(arg) : nullptr;
+}
+
+static bool indexArg(const Item& arg, uint32_t limit, uint32_t* value)
+{
+	if (arg.type() != eNumber)
+	{
+		return false;
+	}
+	Number number = boost::any_cast<Number>(arg);
+	if (number < 0 || (uint32_t)number >= limit)
+	{
+		return false;
+	}
+	*value = (uint32_t)number;
+	return true;
+}
+
+// The items may be reachable from nowhere else yet, so they are pinned in
+// case the allocation collects.
+VectorRef makeVector(Context* context, const std::vector<Item>& elements)
+{
+	for (auto& element : elements)
+	{
+		gMemory.pushRoot(element);
+	}
+	VectorRef vector = gMemory.allocVector(context, (uint32_t)elements.size());
+	gMemory.popRoots(elements.size());
+
+	std::copy(elements.begin(), elements.end(), vector->mElements.begin());
+	return vector;
+}
+
+// (make-vector n [fill])
+Item makeVectorProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	uint32_t length;
+	if (!indexArg(args[0], 0x7fffffff, &length))
+	{
+		*error = "&arg0-must-eval-to-length";
+		return Item();
+	}
+	return Item(gMemory.allocVector(context, length, count > 1 ? args[1] : Item(Unspecified())));
+}
+
+Item vectorProc(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	return Item(makeVector(context, std::vector<Item>(args, args + count)));
+}
+
+Item vectorLength(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	VectorRef vector = vectorArg(args[0]);
+	if (!vector)
+	{
+		*error = "&arg0-must-eval-to-vector";
+		return Item();
+	}
+	return Item(Number(vector->length()));
+}
+
+Item vectorRef(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	VectorRef vector = vectorArg(args[0]);
+	uint32_t index;
+	if (!vector)
+	{
+		*error = "&arg0-must-eval-to-vector";
+		return Item();
+	}
+	if (!indexArg(args[1], vector->length(), &index))
+	{
+		*error = "&index-out-of-range";
+		return Item();
+	}
+	return vector->mElements[index];
+}
+
+Item vectorSet(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	VectorRef vector = vectorArg(args[0]);
+	uint32_t index;
+	if (!vector)
+	{
+		*error = "&arg0-must-eval-to-vector";
+	}
+	else if (!indexArg(args[1], vector->length(), &index))
+	{
+		*error = "&index-out-of-range";
+	}
+	else
+	{
+		vector->mElements[index] = args[2];
+	}
+	return Unspecified();
+}
+
+Item vectorToList(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	VectorRef vector = vectorArg(args[0]);
+	if (!vector)
+	{
+		*error = "&arg0-must-eval-to-vector";
+		return Item();
+	}
+
+	gMemory.reserveCells(context, vector->length());
+	CellRef list = nullptr;
+	for (uint32_t i = vector->length(); i > 0; i--)
+	{
+		list = gMemory.allocCell(context, vector->mElements[i - 1], Item(list));
+	}
+	return Item(list);
+}
+
+Item listToVector(const Item* args, uint32_t count, Context* context, std::string* error)
+{
+	if (args[0].type() != eCell)
+	{
+		*error = "&arg0-must-eval-to-list";
+		return Item();
+	}
+
+	// a dotted tail makes it no list, rather than being dropped
+	std::vector<Item> elements;
+	Item rest = args[0];
+	for (; rest.type() == eCell && boost::any_cast<CellRef>(rest); rest = boost::any_cast<CellRef>(rest)->cdr())
+	{
+		elements.push_back(boost::any_cast<CellRef>(rest)->mCar);
+	}
+	if (rest.type() != eCell)
+	{
+		*error = "&arg0-must-eval-to-list";
+		return Item();
+	}
+	return Item(makeVector(context, elements));
+}
+
+void addVectorNatives()
+{
+	const uint32_t any = Primitive::cAnyArgs;
+	definePrimitive("make-vector", makeVectorProc, 1, 2, true);
+	definePrimitive("vector", vectorProc, 0, any, true);
+	definePrimitive("vector-length", vectorLength, 1, 1, false);
+	definePrimitive("vector-ref", vectorRef, 2, 2, false);
+	definePrimitive("vector-set!", vectorSet, 3, 3, false);
+	definePrimitive("vector->list", vectorToList, 1, 1, true);
+	definePrimitive("list->vector", listToVector, 1, 1, true);
+}
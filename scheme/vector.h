@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "collectable.h"
+
+// A fixed length vector of arbitrary items in one contiguous block, so
+// indexing is O(1) where a list needs a walk.
+struct Vector : public Collectable<Vector>
+{
+	std::vector<Item>	mElements;
+
+	Vector()
+	{}
+	Vector(uint32_t length, Item fill)
+		: mElements(length, fill)
+	{}
+
+	uint32_t length() const { return (uint32_t)mElements.size(); }
+	void mark() override;
+};
+
+typedef Vector*		VectorRef;
+
+extern const type_info& eVector;
+
+VectorRef	makeVector(Context* context, const std::vector<Item>& elements);
+std::string	vectorToString(VectorRef vector);
+bool		vectorEqual(VectorRef first, VectorRef second, bool (*equal)(Item, Item));
+void		addVectorNatives();
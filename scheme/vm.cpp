@@ -0,0 +1,775 @@
+#include "stdafx.h"
+#include <assert.h>
+#include <sstream>
+#include "vm.h"
+#include "machine.h"
+#include "jit.h"
+#include "context.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "parser.h"
+#include "list.h"
+#include "numeric.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+Item add(const Item* args, uint32_t count, Context* context, std::string* error);
+Item sub(const Item* args, uint32_t count, Context* context, std::string* error);
+Item mul(const Item* args, uint32_t count, Context* context, std::string* error);
+Item compare(const Item* args, uint32_t count, Context* context, std::string* error);
+Item null(const Item* args, uint32_t count, Context* context, std::string* error);
+
+bool gTierUp = true;
+
+// GCC and Clang can jump straight from one instruction to the next through a
+// table of label addresses; elsewhere the loop dispatches through a switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+Assembler::Assembler(Context* globals)
+	: mChunk(std::make_shared<Chunk>())
+	, mGlobals(globals)
+{}
+
+void Assembler::operand(uint32_t value)
+{
+	assert(value <= 0xffff);
+	mChunk->mCode.push_back((uint8_t)value);
+	mChunk->mCode.push_back((uint8_t)(value >> 8));
+}
+
+void Assembler::emit(Op op)
+{
+	mChunk->mCode.push_back((uint8_t)op);
+}
+
+void Assembler::emit(Op op, uint32_t operand)
+{
+	emit(op);
+	this->operand(operand);
+}
+
+void Assembler::emit(Op op, uint32_t first, uint32_t second)
+{
+	emit(op);
+	operand(first);
+	operand(second);
+}
+
+size_t Assembler::jump(Op op)
+{
+	emit(op, 0);
+	return mChunk->mCode.size() - 2;
+}
+
+void Assembler::patch(size_t at)
+{
+	uint32_t target = (uint32_t)mChunk->mCode.size();
+	assert(target <= 0xffff);
+	mChunk->mCode[at] = (uint8_t)target;
+	mChunk->mCode[at + 1] = (uint8_t)(target >> 8);
+}
+
+// Symbols and numbers are shared; anything else gets a slot of its own.
+uint32_t Assembler::constant(const Item& item)
+{
+	auto& constants = mChunk->mConstants;
+	if (item.type() == eSymbol || item.type() == eNumber)
+	{
+		for (size_t i = 0; i < constants.size(); i++)
+		{
+			if (constants[i].type() == item.type() && constants[i].bits() == item.bits())
+			{
+				return (uint32_t)i;
+			}
+		}
+	}
+	constants.push_back(item);
+	return (uint32_t)constants.size() - 1;
+}
+
+uint32_t Assembler::lambda(const ChunkLambda& lambda)
+{
+	mChunk->mLambdas.push_back(lambda);
+	return (uint32_t)mChunk->mLambdas.size() - 1;
+}
+
+uint32_t Assembler::error(const std::string& error)
+{
+	mChunk->mErrors.push_back(error);
+	return (uint32_t)mChunk->mErrors.size() - 1;
+}
+
+struct Inlined
+{
+	PrimitiveFn	mFn;
+	uint32_t	mCount;
+	Op			mOp;
+};
+
+static const Inlined sInlined[] = {
+	{ add, 2, eOpAdd },
+	{ sub, 2, eOpSub },
+	{ mul, 2, eOpMul },
+	{ compare, 2, eOpNumEqual },
+	{ null, 1, eOpNullP },
+};
+
+// Only a global still bound to the native itself is inlined, and from then on
+// rebinding it invalidates the chunk.
+Op Assembler::primitive(Symbol symbol, uint32_t count)
+{
+	if (!mGlobals)
+	{
+		return cOpCount;
+	}
+	Item bound = mGlobals->Lookup(symbol);
+	const Proc* proc = bound.peek<Proc>();
+	const Primitive* primitive = proc ? proc->mPrimitive : nullptr;
+	if (!primitive)
+	{
+		return cOpCount;
+	}
+	for (auto& inlined : sInlined)
+	{
+		if (inlined.mFn == primitive->mFn && inlined.mCount == count)
+		{
+			watchBinding(symbol);
+			return inlined.mOp;
+		}
+	}
+	return cOpCount;
+}
+
+ChunkRef Assembler::finish(const NodeRef& body, bool native)
+{
+	mChunk->mBody = body;
+	mChunk->mEpoch = gBindingEpoch;
+	if (native)
+	{
+		mChunk->mNative = jit(*mChunk);
+		mChunk->mCompiled = mChunk->mNative ? mChunk->mNative->entry() : nullptr;
+	}
+	ChunkRef chunk = mChunk;
+	mChunk = std::make_shared<Chunk>();
+	return chunk;
+}
+
+Chunk::Chunk()
+	: mEpoch(0)
+	, mCompiled(nullptr)
+	, mCalls(0)
+{}
+
+// A chunk's closures all close over the same chain of frames past the ones its
+// code binds, so one hot copy serves each of them.
+ChunkRef Chunk::hot(Context* closure) const
+{
+	if (mHot && mHot->mEpoch != gBindingEpoch)
+	{
+		mHot.reset();
+		mCalls = 0;
+	}
+	if (!mHot && mBody && ++mCalls >= cHotCalls)
+	{
+		Assembler out(closure);
+		mBody->compile(out, true);
+		mHot = out.finish(mBody, true);
+	}
+	return mHot;
+}
+
+OperandStack::~OperandStack()
+{
+	clear();
+	::operator delete(mBase);
+}
+
+// Doubles the room, moving the items over; pointers into the stack go stale.
+void OperandStack::grow()
+{
+	size_t count = size();
+	size_t room = mLimit - mBase;
+	room = room ? room * 2 : 64;
+	Item* base = (Item*)::operator new(room * sizeof(Item));
+	for (size_t i = 0; i < count; i++)
+	{
+		new (&base[i]) Item(std::move(mBase[i]));
+		mBase[i].~Item();
+	}
+	::operator delete(mBase);
+	mBase = base;
+	mTop = base + count;
+	mLimit = base + room;
+}
+
+void OperandStack::insert(Item* at, const Item& item)
+{
+	size_t index = at - mBase;
+	Item copy(item);
+	push_back(Item());
+	for (size_t i = size() - 1; i > index; i--)
+	{
+		mBase[i] = std::move(mBase[i - 1]);
+	}
+	mBase[index] = std::move(copy);
+}
+
+Machine::Machine(const ChunkRef& chunk, Context* context, const Continuation& k)
+	: mTop(chunk)
+	, mDone(k)
+	, mTicket(0)
+	, mWaiting(false)
+	, mCalling(false)
+	, mAnswered(false)
+{
+	Frame frame = { chunk.get(), 0, context, 0 };
+	mFrames.push_back(frame);
+	gMemory.addRootSet(this);
+}
+
+Machine::~Machine()
+{
+	gMemory.removeRootSet(this);
+}
+
+void Machine::markRoots()
+{
+	for (auto& item : mStack)
+	{
+		markItem(item);
+	}
+	// a chunk's constants and lambda sources are cut from the form it was
+	// compiled from, which nothing else may hold while it runs
+	for (auto& frame : mFrames)
+	{
+		frame.mContext->mark();
+		for (auto& constant : frame.mChunk->mConstants)
+		{
+			markItem(constant);
+		}
+		for (auto& lambda : frame.mChunk->mLambdas)
+		{
+			if (lambda.mSource)
+			{
+				lambda.mSource->mark();
+			}
+			markItem(lambda.mParams);
+			markItem(lambda.mBody);
+		}
+	}
+	markItem(mAnswer);
+}
+
+Continuation Machine::resumer()
+{
+	auto self = shared_from_this();
+	uint32_t ticket = ++mTicket;
+	mWaiting = true;
+	mAnswered = false;
+	return [self, ticket](Item value) { self->resume(ticket, value); };
+}
+
+// An escape continuation only ever returns once; one the machine has already
+// moved past can't resume it.
+void Machine::resume(uint32_t ticket, const Item& value)
+{
+	if (!mWaiting || ticket != mTicket)
+	{
+		raiseError("&continuation-reentered", mDone);
+		return;
+	}
+
+	mWaiting = false;
+	if (mCalling)
+	{
+		mAnswered = true;
+		mAnswer = value;
+		return;
+	}
+	mStack.push_back(value);
+	run();
+}
+
+// After a call out: false if the machine has to wait for the answer.
+bool Machine::await(uint32_t base)
+{
+	mCalling = false;
+	mStack.resize(base);
+	if (!mAnswered)
+	{
+		return false;
+	}
+	mStack.push_back(mAnswer);
+	mAnswer = Item();
+	mAnswered = false;
+	return true;
+}
+
+// Calls the proc below the top count items. False if the machine stops, to
+// wait or because it has handed its continuation on.
+bool Machine::call(uint32_t count, bool tail)
+{
+	uint32_t base = (uint32_t)mStack.size() - count - 1;
+	const Proc* callee = mStack[base].peek<Proc>();
+	const Chunk* chunk = callee && callee->mCode ? dynamic_cast<const Chunk*>(callee->mCode.get()) : nullptr;
+	Context* context = mFrames.back().mContext;
+
+	if (chunk)
+	{
+		ChunkRef hot = gTierUp ? chunk->hot(callee->mClosure) : ChunkRef();
+		std::string error;
+		Context* frame = bindArgs(*callee, count ? &mStack[base + 1] : nullptr, count, context, &error);
+		if (!frame)
+		{
+			fail(error);
+			return false;
+		}
+		if (hot)
+		{
+			chunk = hot.get();
+			frame->mCode = hot;
+		}
+		else
+		{
+			frame->mCode = callee->mCode;
+		}
+		if (tail)
+		{
+			base = mFrames.back().mBase;
+			mFrames.pop_back();
+		}
+		mStack.resize(base);
+		Frame callFrame = { chunk, 0, frame, base };
+		mFrames.push_back(callFrame);
+		return true;
+	}
+
+	// the last call of the outermost chunk answers for the whole machine
+	if (tail && mFrames.size() == 1)
+	{
+		mFrames.clear();
+		Item proc = mStack[base];
+		std::vector<Item> args(mStack.begin() + base + 1, mStack.end());
+		mStack.clear();
+		Continuation done = mDone;
+		apply(proc, args, context, done);
+		return false;
+	}
+
+	// a primitive answers on the spot, in place of itself and its arguments
+	if (callee && callee->mPrimitive && callee->mPrimitive->mFn)
+	{
+		Item result;
+		std::string error;
+		if (!callPrimitive(*callee->mPrimitive, count ? &mStack[base + 1] : nullptr, count, context, &result, &error))
+		{
+			fail(error);
+			return false;
+		}
+		mStack.resize(base);
+		mStack.push_back(result);
+		return true;
+	}
+
+	mCalling = true;
+	apply(mStack[base], &mStack[base + 1], count, context, resumer());
+	return await(base);
+}
+
+bool Machine::eval(const Item& form, bool tail)
+{
+	if (tail && mFrames.size() == 1)
+	{
+		Context* context = mFrames.back().mContext;
+		mFrames.clear();
+		mStack.clear();
+		Continuation done = mDone;
+		::eval(form, context, done);
+		return false;
+	}
+
+	uint32_t base = (uint32_t)mStack.size();
+	mCalling = true;
+	::eval(form, mFrames.back().mContext, resumer());
+	return await(base);
+}
+
+// Compiled code has the frame to itself until it calls, returns or stops.
+bool Machine::compiled()
+{
+	while (CompiledChunk compiled = mFrames.back().mChunk->mCompiled)
+	{
+		if (!compiled(*this))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void Machine::run()
+{
+	auto self = shared_from_this();
+	Frame* frame;
+	const uint8_t* code;
+	const uint8_t* pc;
+	const Item* constants;
+	Context* context;
+	uint32_t count;
+
+#define VM_LOAD() \
+	if (!compiled()) \
+	{ \
+		return; \
+	} \
+	frame = &mFrames.back(); \
+	code = frame->mChunk->mCode.data(); \
+	pc = code + frame->mPc; \
+	constants = frame->mChunk->mConstants.data(); \
+	context = frame->mContext
+#define VM_SAVE() \
+	frame->mPc = (uint32_t)(pc - code)
+#define VM_OPERAND() \
+	(pc += 2, (uint32_t)pc[-2] | ((uint32_t)pc[-1] << 8))
+#define VM_SYMBOL() \
+	constants[VM_OPERAND()].get<Symbol>()
+
+#if VM_COMPUTED_GOTO
+	static void* const sLabels[cOpCount] = {
+		&&op_eOpConst, &&op_eOpLocal, &&op_eOpGlobal, &&op_eOpDynamic, &&op_eOpAssign, &&op_eOpPop,
+		&&op_eOpJump, &&op_eOpJumpIfFalse, &&op_eOpClosure, &&op_eOpCall, &&op_eOpTailCall,
+		&&op_eOpReturn, &&op_eOpEnter, &&op_eOpBind, &&op_eOpLeave, &&op_eOpEval, &&op_eOpFail,
+		&&op_eOpAdd, &&op_eOpSub, &&op_eOpMul, &&op_eOpNumEqual, &&op_eOpNullP
+	};
+#define VM_CASE(op)		op_##op
+#define VM_NEXT()		goto *sLabels[*pc++]
+#else
+#define VM_CASE(op)		case op
+#define VM_NEXT()		continue
+#endif
+
+	VM_LOAD();
+#if VM_COMPUTED_GOTO
+	VM_NEXT();
+#else
+	for (;;)
+	{
+		switch (*pc++)
+		{
+#endif
+	VM_CASE(eOpConst):
+		push(constants[VM_OPERAND()]);
+		VM_NEXT();
+
+	VM_CASE(eOpLocal):
+	{
+		uint32_t depth = VM_OPERAND();
+		local(context, depth, VM_SYMBOL());
+		VM_NEXT();
+	}
+
+	VM_CASE(eOpGlobal):
+	{
+		uint32_t depth = VM_OPERAND();
+		global(context, depth, VM_SYMBOL());
+		VM_NEXT();
+	}
+
+	VM_CASE(eOpDynamic):
+		dynamic(context, VM_SYMBOL());
+		VM_NEXT();
+
+	VM_CASE(eOpAssign):
+		assign(context, VM_SYMBOL());
+		VM_NEXT();
+
+	VM_CASE(eOpPop):
+		pop();
+		VM_NEXT();
+
+	VM_CASE(eOpJump):
+		pc = code + VM_OPERAND();
+		VM_NEXT();
+
+	VM_CASE(eOpJumpIfFalse):
+	{
+		uint32_t target = VM_OPERAND();
+		if (!test())
+		{
+			pc = code + target;
+		}
+		VM_NEXT();
+	}
+
+	VM_CASE(eOpClosure):
+		closure(context, frame->mChunk->mLambdas[VM_OPERAND()]);
+		VM_NEXT();
+
+	VM_CASE(eOpCall):
+		count = VM_OPERAND();
+		VM_SAVE();
+		if (!call(count, false))
+		{
+			return;
+		}
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(eOpTailCall):
+		count = VM_OPERAND();
+		VM_SAVE();
+		if (!call(count, true))
+		{
+			return;
+		}
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(eOpReturn):
+		if (!ret())
+		{
+			return;
+		}
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(eOpEnter):
+		context = enter();
+		if (!context)
+		{
+			return;
+		}
+		VM_NEXT();
+
+	VM_CASE(eOpBind):
+		bind(context, VM_SYMBOL());
+		VM_NEXT();
+
+	VM_CASE(eOpLeave):
+		context = leave(VM_OPERAND());
+		VM_NEXT();
+
+	VM_CASE(eOpEval):
+	{
+		const Item& form = constants[VM_OPERAND()];
+		VM_SAVE();
+		if (!eval(form, *pc == eOpReturn))
+		{
+			return;
+		}
+		VM_LOAD();
+		VM_NEXT();
+	}
+
+	VM_CASE(eOpFail):
+		fail(frame->mChunk->mErrors[VM_OPERAND()]);
+		return;
+
+	VM_CASE(eOpAdd):
+		if (!primitive(eOpAdd))
+		{
+			count = 2;
+			goto call_global;
+		}
+		pc += 4;
+		VM_NEXT();
+
+	VM_CASE(eOpSub):
+		if (!primitive(eOpSub))
+		{
+			count = 2;
+			goto call_global;
+		}
+		pc += 4;
+		VM_NEXT();
+
+	VM_CASE(eOpMul):
+		if (!primitive(eOpMul))
+		{
+			count = 2;
+			goto call_global;
+		}
+		pc += 4;
+		VM_NEXT();
+
+	VM_CASE(eOpNumEqual):
+		if (!primitive(eOpNumEqual))
+		{
+			count = 2;
+			goto call_global;
+		}
+		pc += 4;
+		VM_NEXT();
+
+	VM_CASE(eOpNullP):
+		if (!primitive(eOpNullP))
+		{
+			count = 1;
+			goto call_global;
+		}
+		pc += 4;
+		VM_NEXT();
+
+	call_global:
+	{
+		uint32_t depth = VM_OPERAND();
+		Symbol symbol = VM_SYMBOL();
+		VM_SAVE();
+		if (!callGlobal(context, depth, symbol, count))
+		{
+			return;
+		}
+		VM_LOAD();
+		VM_NEXT();
+	}
+
+#if !VM_COMPUTED_GOTO
+		}
+	}
+#endif
+
+#undef VM_LOAD
+#undef VM_SAVE
+#undef VM_OPERAND
+#undef VM_SYMBOL
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+void Chunk::exec(Context* context, const Continuation& k) const
+{
+	auto machine = std::make_shared<Machine>(std::static_pointer_cast<const Chunk>(shared_from_this()), context, k);
+	machine->run();
+}
+
+void Chunk::compile(Assembler& out, bool tail) const
+{
+	assert(!"a chunk is already compiled");
+}
+
+ChunkRef compile(Item form)
+{
+	Assembler out;
+	analyze(form)->compile(out, true);
+	return out.finish();
+}
+
+void runCompiled(Item form, Context* context, Continuation k)
+{
+	ChunkRef chunk = compile(form);
+	// the form its constants come from lives until its value is delivered
+	Held<Item> source(form);
+	auto machine = std::make_shared<Machine>(chunk, context, [source, k](Item value) {
+		k(value);
+	});
+	machine->run();
+}
+
+static const char* sOpNames[cOpCount] = {
+	"const", "local", "global", "dynamic", "assign", "pop", "jump", "jump-if-false",
+	"closure", "call", "tail-call", "return", "enter", "bind", "leave", "eval", "fail",
+	"add", "sub", "mul", "num-equal", "null?"
+};
+
+static const uint32_t sOperands[cOpCount] = {
+	1, 2, 2, 1, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 1, 1,
+	2, 2, 2, 2, 2
+};
+
+// One instruction a line, with symbol operands by name.
+std::string disassemble(const Chunk& chunk)
+{
+	std::stringstream out;
+	for (size_t pc = 0; pc < chunk.mCode.size();)
+	{
+		uint8_t op = chunk.mCode[pc++];
+		out << sOpNames[op];
+		for (uint32_t i = 0; i < sOperands[op]; i++, pc += 2)
+		{
+			uint32_t operand = chunk.mCode[pc] | (chunk.mCode[pc + 1] << 8);
+			bool symbol = (op == eOpLocal || op == eOpGlobal || op >= eOpAdd) ? i == 1 : (op == eOpDynamic || op == eOpAssign || op == eOpBind);
+			if (symbol)
+			{
+				out << " " << gSymbolTable.GetString(chunk.mConstants[operand].get<Symbol>());
+			}
+			else
+			{
+				out << " " << operand;
+			}
+		}
+		out << "\n";
+	}
+	return out.str();
+}
+
+void test_vm()
+{
+	char* rest;
+	Context* context = gMemory.getRoot();
+
+	// a tail call comes back to a return only when it calls something else
+	ChunkRef chunk = compile(Parser::parseForm(context, "(lambda (n) (if (= n 0) 1 (f (- n 1))))", &rest).mV);
+	assert(disassemble(*chunk) == "closure 0\nreturn\n");
+	assert(disassemble(*chunk->mLambdas[0].mChunk) ==
+		"global 1 =\n"
+		"local 0 n\n"
+		"const 2\n"
+		"call 2\n"
+		"jump-if-false 23\n"
+		"const 3\n"
+		"return\n"
+		"global 1 f\n"
+		"global 1 -\n"
+		"local 0 n\n"
+		"const 3\n"
+		"call 2\n"
+		"tail-call 1\n"
+		"return\n");
+
+	// let binds last to first in one frame, and leaves it unless in tail position
+	chunk = compile(Parser::parseForm(context, "(begin (let ((a 1) (b 2)) (list a b)) 3)", &rest).mV);
+	assert(disassemble(*chunk) ==
+		"const 0\n"
+		"const 1\n"
+		"enter\n"
+		"bind b\n"
+		"bind a\n"
+		"global 1 list\n"
+		"local 0 a\n"
+		"local 0 b\n"
+		"call 2\n"
+		"leave 1\n"
+		"pop\n"
+		"const 5\n"
+		"return\n");
+
+	// compiled code calls compiled code without a continuation, and still calls natives
+	bool ran = false;
+	runCompiled(Parser::parseForm(context, "(begin (define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1)))) (count 5000 0))", &rest).mV, context, [&ran](Item result) {
+		assert(boost::any_cast<Number>(result) == 5000);
+		ran = true;
+	});
+	assert(ran);
+
+	// a closure called often enough runs a copy with its primitives inlined,
+	// until one of them is rebound
+	Symbol plus = gSymbolTable.GetSymbol("+");
+	Item primitive = context->Lookup(plus);
+	runCompiled(Parser::parseForm(context, "(begin (define (inc2 n) (+ n 2)) (define (loop i) (if (= i 0) 0 (begin (inc2 i) (loop (- i 1))))) (loop 100))", &rest).mV, context, [](Item) {});
+	Item proc = context->Lookup(gSymbolTable.GetSymbol("inc2"));
+	const Proc* inc2 = proc.peek<Proc>();
+	const Chunk* cold = dynamic_cast<const Chunk*>(inc2->mCode.get());
+	ChunkRef hot = cold->hot(inc2->mClosure);
+	assert(hot && disassemble(*hot) == "local 0 n\nconst 1\nadd 1 +\nreturn\n");
+
+	Number answer = 0;
+	runCompiled(Parser::parseForm(context, "(begin (define (+ a b) (- a b)) (inc2 5))", &rest).mV, context, [&answer](Item result) {
+		answer = boost::any_cast<Number>(result);
+	});
+	assert(answer == 3);
+	assert(!cold->hot(inc2->mClosure));
+	context->Set(plus, primitive);
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "schemetypes.h"
+#include "analyze.h"
+
+// Bytecode for analyzed forms. An instruction is a one byte opcode followed by
+// its operands, each a 16 bit little endian index.
+enum Op
+{
+	eOpConst,			// constant				push mConstants[constant]
+	eOpLocal,			// depth, symbol		push a variable a known frame binds
+	eOpGlobal,			// depth, symbol		push a variable past the known frames
+	eOpDynamic,			// symbol				push a variable found by name
+	eOpAssign,			// symbol				bind the top in the innermost frame, leaving it
+	eOpPop,
+	eOpJump,			// target
+	eOpJumpIfFalse,		// target				pop, and jump unless it is true
+	eOpClosure,			// lambda				push a closure over the current frame
+	eOpCall,			// count				call the proc below count arguments
+	eOpTailCall,		// count				the same, in place of the current call
+	eOpReturn,
+	eOpEnter,			//						make a frame inside the current one
+	eOpBind,			// symbol				pop into the innermost frame
+	eOpLeave,			// count				drop that many frames
+	eOpEval,			// form					evaluate mConstants[form] with eval
+	eOpFail,			// error				raise mErrors[error]
+	// A primitive inlined into a hot chunk, named by its global as for
+	// eOpGlobal. Fixnums are worked on in place; anything else, or any
+	// primitive rebound since, makes it call what the global is bound to now.
+	eOpAdd,				// depth, symbol		(+ a b)
+	eOpSub,				// depth, symbol		(- a b)
+	eOpMul,				// depth, symbol		(* a b)
+	eOpNumEqual,		// depth, symbol		(= a b)
+	eOpNullP,			// depth, symbol		(null? a)
+	cOpCount
+};
+
+struct Chunk;
+class Machine;
+class NativeCode;
+typedef std::shared_ptr<const Chunk>	ChunkRef;
+typedef std::shared_ptr<const NativeCode>	NativeCodeRef;
+// A chunk compiled to C++: runs the machine's top frame from its pc, and
+// answers false when the machine stops, true when another frame is on top.
+typedef bool (*CompiledChunk)(Machine& machine);
+
+// What a closure instruction needs: the lambda's source, as a Lambda node
+// keeps it, and its compiled body.
+struct ChunkLambda
+{
+	CellRef		mSource;		// null for a define
+	Item		mParams;
+	Item		mBody;
+	ChunkRef	mChunk;
+};
+
+// Calls a closure's chunk takes before it is compiled again with primitives inlined.
+const uint32_t cHotCalls = 64;
+extern bool gTierUp;
+
+// The compiled body of a closure, or a whole form. As a Node it runs on a
+// machine of its own, so a closure compiled here can be called from anywhere.
+struct Chunk : public Node, public std::enable_shared_from_this<Chunk>
+{
+	std::vector<uint8_t>		mCode;
+	std::vector<Item>			mConstants;
+	std::vector<ChunkLambda>	mLambdas;
+	std::vector<std::string>	mErrors;
+	NodeRef						mBody;			// what it was compiled from, to compile again
+	uint32_t					mEpoch;			// gBindingEpoch when its primitives were inlined
+	CompiledChunk				mCompiled;		// runs in place of mCode, if set
+	NativeCodeRef				mNative;		// the pages mCompiled points into, if they were made for it
+
+	Chunk();
+
+	// The chunk a call to a closure over closure should run: this one, or once
+	// it has been called often enough, a copy with the primitives its globals
+	// are bound to inlined, and run as machine code where it can be. The copy
+	// is dropped once any of them is rebound.
+	ChunkRef hot(Context* closure) const;
+
+	void exec(Context* context, const Continuation& k) const override;
+	void compile(Assembler& out, bool tail) const override;
+
+private:
+	mutable uint32_t			mCalls;
+	mutable ChunkRef			mHot;
+};
+
+// Builds a chunk. Nodes compile themselves through it. Given the frame a
+// closure's globals are looked up from, it inlines the primitives they name.
+class Assembler
+{
+public:
+	Assembler(Context* globals = nullptr);
+
+	void		emit(Op op);
+	void		emit(Op op, uint32_t operand);
+	void		emit(Op op, uint32_t first, uint32_t second);
+	// returns where the target goes, for patch
+	size_t		jump(Op op);
+	// points the jump at the next instruction
+	void		patch(size_t at);
+
+	uint32_t	constant(const Item& item);
+	uint32_t	lambda(const ChunkLambda& lambda);
+	uint32_t	error(const std::string& error);
+	// the op for a call of the global symbol with count arguments; cOpCount if
+	// it isn't bound to a primitive that can be inlined
+	Op			primitive(Symbol symbol, uint32_t count);
+	// lambdas inside the chunk compile against the same globals
+	Context*	globals() const { return mGlobals; }
+
+	// native also has the JIT make machine code for the chunk
+	ChunkRef	finish(const NodeRef& body = NodeRef(), bool native = false);
+
+private:
+	std::shared_ptr<Chunk>	mChunk;
+	Context*				mGlobals;
+
+	void		operand(uint32_t value);
+};
+
+ChunkRef	compile(Item form);
+// compiles the form and runs it
+void		runCompiled(Item form, Context* context, Continuation k);
+std::string	disassemble(const Chunk& chunk);
+void		test_vm();
@@ -0,0 +1,1098 @@
+#include "stdafx.h"
+#include <assert.h>
+#include "walker.h"
+#include "analyze.h"
+#include "context.h"
+#include "symboltable.h"
+#include "memory.h"
+#include "parser.h"
+#include "list.h"
+#include "eval.h"
+
+extern SymbolTable gSymbolTable;
+
+void tcoeval(Item form, Context* context, std::function<void(Item)> k);
+
+static bool		sKeywordsReady = false;
+static Symbol	sQuote, sDefine, sSet, sIf, sLambda, sCallcc, sLet, sLetStar, sBegin;
+
+static void initKeywords()
+{
+	if (sKeywordsReady)
+	{
+		return;
+	}
+	sQuote		= gSymbolTable.GetSymbol("quote");
+	sDefine		= gSymbolTable.GetSymbol("define");
+	sSet		= gSymbolTable.GetSymbol("set!");
+	sIf			= gSymbolTable.GetSymbol("if");
+	sLambda		= gSymbolTable.GetSymbol("lambda");
+	sCallcc		= gSymbolTable.GetSymbol("callcc");
+	sLet		= gSymbolTable.GetSymbol("let");
+	sLetStar	= gSymbolTable.GetSymbol("let*");
+	sBegin		= gSymbolTable.GetSymbol("begin");
+	sKeywordsReady = true;
+}
+
+static bool isNull(const Item& item)
+{
+	return item.type() == eCell && item.get<CellRef>() == nullptr;
+}
+
+// The (before . after) of each dynamic-wind being run, innermost first.
+static Item sWinds = Item((CellRef)nullptr);
+
+struct WindRoots : public RootSet
+{
+	void markRoots() override
+	{
+		markItem(sWinds);
+	}
+};
+
+Walker* Walker::sCalling = nullptr;
+
+Walker::Outside::Outside()
+	: mCalling(sCalling)
+{
+	sCalling = nullptr;
+}
+
+Walker::Outside::~Outside()
+{
+	sCalling = mCalling;
+}
+
+Walker::Walker(const Continuation& k)
+	: mDone(k)
+	, mEvaluating(false)
+	, mContext(nullptr)
+	, mTicket(0)
+	, mCalling(false)
+	, mAnswered(false)
+	, mStarted(false)
+{
+	initKeywords();
+	gMemory.addRootSet(this);
+}
+
+Walker::~Walker()
+{
+	gMemory.removeRootSet(this);
+}
+
+static void markStack(const std::vector<Walker::Frame>& frames, const std::vector<Item>& values)
+{
+	for (auto& frame : frames)
+	{
+		markItem(frame.mForm);
+		markItem(frame.mBody);
+		if (frame.mContext)
+		{
+			frame.mContext->mark();
+		}
+		if (frame.mScope)
+		{
+			frame.mScope->mark();
+		}
+	}
+	for (auto& item : values)
+	{
+		markItem(item);
+	}
+}
+
+void Walker::markRoots()
+{
+	markStack(mFrames, mValues);
+	markItem(mForm);
+	if (mContext)
+	{
+		mContext->mark();
+	}
+	markItem(mValue);
+	markItem(mAnswer);
+}
+
+void Walker::Captured::markRoots()
+{
+	markStack(mFrames, mValues);
+	markItem(mWinds);
+}
+
+// Symbols, atoms and quoted forms, which need no frames.
+static bool immediate(const Item& form, Context* context, Item* value)
+{
+	if (form.type() == eSymbol)
+	{
+		*value = context->Lookup(form.get<Symbol>());
+		return true;
+	}
+	if (form.type() != eCell || isNull(form))
+	{
+		*value = form;
+		return true;
+	}
+	Item head = car(form);
+	if (head.type() == eSymbol && head.get<Symbol>() == sQuote)
+	{
+		*value = car(cdr(form));
+		return true;
+	}
+	return false;
+}
+
+void Walker::eval(const Item& form, Context* context, const Continuation& k, bool list)
+{
+	// most of what natives evaluate is an argument answered straight away
+	Item value;
+	if (!list && sKeywordsReady && immediate(form, context, &value))
+	{
+		if (gTrace)
+		{
+			printf("eval: %s\n", print(form).c_str());
+		}
+		k(value);
+		return;
+	}
+
+	// a tail call carries on in the walker its continuation would resume
+	if (const Resumer* resumer = k.target<Resumer>())
+	{
+		if (resumer->mWalker->replace(resumer->mTicket, form, context, list))
+		{
+			return;
+		}
+	}
+
+	Walker* calling = sCalling;
+	if (calling && calling->mCalling && !calling->mStarted && !calling->mAnswered)
+	{
+		calling->mNatives.push_back(k);
+		calling->push(eFrameNative, Item(), nullptr);
+		calling->mStarted = true;
+		calling->start(form, context, list);
+		return;
+	}
+
+	auto walker = std::make_shared<Walker>(k);
+	walker->start(form, context, list);
+	walker->run();
+}
+
+void Walker::start(const Item& form, Context* context, bool list)
+{
+	if (!list)
+	{
+		evaluate(form, context);
+	}
+	else if (isNull(form))
+	{
+		answer(form);
+	}
+	else
+	{
+		push(eFrameList, form, context);
+		mFrames.back().mBase = (uint32_t)mValues.size();
+		evaluate(car(form), context);
+	}
+}
+
+void Walker::push(FrameKind kind, const Item& form, Context* context)
+{
+	Frame frame = { kind, 0, form, Item(), context, nullptr };
+	mFrames.push_back(frame);
+}
+
+void Walker::evaluate(const Item& form, Context* context)
+{
+	mEvaluating = true;
+	mForm = form;
+	mContext = context;
+}
+
+void Walker::answer(const Item& value)
+{
+	mEvaluating = false;
+	mValue = value;
+}
+
+void Walker::run()
+{
+	auto self = shared_from_this();
+	for (;;)
+	{
+		if (!(mEvaluating ? step() : ret()))
+		{
+			return;
+		}
+	}
+}
+
+// One form: either its value, or the frame that waits on a part of it and
+// the part to evaluate next.
+bool Walker::step()
+{
+	const Item form = mForm;
+	Context* context = mContext;
+	if (gTrace)
+	{
+		printf("eval: %s\n", print(form).c_str());
+	}
+
+	// numbers, vectors and every other atom evaluate to themselves
+	Item value;
+	if (immediate(form, context, &value))
+	{
+		answer(value);
+		return true;
+	}
+
+	Item head = car(form);
+	if (head.type() == eSymbol)
+	{
+		Symbol symbol = head.get<Symbol>();
+		if (symbol == sDefine)
+		{
+			Item params = car(cdr(form));
+			// (define x y)
+			if (params.type() == eSymbol)
+			{
+				if (!isNull(cdr(cdr(form))))
+				{
+					push(eFrameAssign, params, context);
+					evaluate(car(cdr(cdr(form))), context);
+				}
+				else
+				{
+					context->Set(params.get<Symbol>(), Unspecified());
+					answer(Unspecified());
+				}
+				return true;
+			}
+			// (define (f ...) body)
+			else if (params.type() == eCell)
+			{
+				Item body = car(cdr(cdr(form)));
+				Item proc = Proc(gMemory.allocCell(context, cdr(params), Item(gMemory.allocCell(context, body))), context);
+				context->Set(car(params).get<Symbol>(), proc);
+				answer(proc);
+				return true;
+			}
+			return fail("&invalid-define");
+		}
+		else if (symbol == sSet)
+		{
+			push(eFrameAssign, car(cdr(form)), context);
+			evaluate(car(cdr(cdr(form))), context);
+			return true;
+		}
+		else if (symbol == sIf)
+		{
+			push(eFrameIf, form, context);
+			evaluate(car(cdr(form)), context);
+			return true;
+		}
+		else if (symbol == sLambda)
+		{
+			answer(Proc(cdr(form).get<CellRef>(), context));
+			return true;
+		}
+		else if (symbol == sCallcc)
+		{
+			// the body is in tail position, so the continuation is the stack as it is
+			context->Set(car(cdr(form)).get<Symbol>(), capture());
+			evaluate(car(cdr(cdr(form))), context);
+			return true;
+		}
+		else if (symbol == sLet || symbol == sLetStar)
+		{
+			// (let ((x <def>)*) <body>)
+			push(symbol == sLet ? eFrameLet : eFrameLetStar, car(cdr(form)), context);
+			Frame& frame = mFrames.back();
+			frame.mBody = car(cdr(cdr(form)));
+			frame.mScope = symbol == sLet ? gMemory.allocContext(context, context) : nullptr;
+			if (symbol == sLet && !frame.mScope)
+			{
+				return fail("&out-of-memory");
+			}
+			return bindings();
+		}
+		else if (symbol == sBegin)
+		{
+			Item body = cdr(form);
+			if (!isNull(cdr(body)))
+			{
+				push(eFrameBegin, cdr(body), context);
+			}
+			evaluate(car(body), context);
+			return true;
+		}
+	}
+
+	push(eFrameOperator, form, context);
+	evaluate(head, context);
+	return true;
+}
+
+// Evaluates the next of a let's bindings, or its body once they are made.
+bool Walker::bindings()
+{
+	Frame& frame = mFrames.back();
+	if (isNull(frame.mForm))
+	{
+		Item body = frame.mBody;
+		Context* context = frame.mKind == eFrameLet ? frame.mScope : frame.mContext;
+		mFrames.pop_back();
+		evaluate(body, context);
+	}
+	else
+	{
+		evaluate(car(cdr(car(frame.mForm))), frame.mContext);
+	}
+	return true;
+}
+
+// Hands mValue to the frame on top.
+bool Walker::ret()
+{
+	if (mFrames.empty())
+	{
+		mDone(mValue);
+		return false;
+	}
+
+	Frame& frame = mFrames.back();
+	switch (frame.mKind)
+	{
+	case eFrameNative:
+		return resumeNative();
+
+	case eFrameIf:
+	{
+		Item form = frame.mForm;
+		Context* context = frame.mContext;
+		mFrames.pop_back();
+		bool test = mValue.type() != eNumber || mValue.get<Number>() != 0;
+		if (test)
+		{
+			evaluate(car(cdr(cdr(form))), context);
+		}
+		else if (!isNull(cdr(cdr(cdr(form)))))
+		{
+			evaluate(car(cdr(cdr(cdr(form)))), context);
+		}
+		else
+		{
+			answer(Unspecified());
+		}
+		return true;
+	}
+
+	case eFrameBegin:
+	{
+		Item body = frame.mForm;
+		Context* context = frame.mContext;
+		if (isNull(cdr(body)))
+		{
+			mFrames.pop_back();
+		}
+		else
+		{
+			frame.mForm = cdr(body);
+		}
+		evaluate(car(body), context);
+		return true;
+	}
+
+	case eFrameAssign:
+		frame.mContext->Set(frame.mForm.get<Symbol>(), mValue);
+		mFrames.pop_back();
+		return true;
+
+	case eFrameLet:
+	case eFrameLetStar:
+	{
+		Symbol symbol = car(car(frame.mForm)).get<Symbol>();
+		if (frame.mKind == eFrameLetStar)
+		{
+			frame.mContext = gMemory.allocContext(frame.mContext, frame.mContext);
+			if (!frame.mContext)
+			{
+				return fail("&out-of-memory");
+			}
+			frame.mContext->Set(symbol, mValue);
+		}
+		else
+		{
+			frame.mScope->Set(symbol, mValue);
+		}
+		frame.mForm = cdr(frame.mForm);
+		return bindings();
+	}
+
+	case eFrameOperator:
+	{
+		const Proc* callee = mValue.peek<Proc>();
+		if (!callee)
+		{
+			return fail("&did-not-eval-to-proc\n");
+		}
+		if (callee->mNative && !callee->mPrimitive && !callee->mNative.target<Continue>())
+		{
+			// natives get their arguments unevaluated
+			Item args = cdr(frame.mForm);
+			Context* context = frame.mContext;
+			Item proc = std::move(mValue);
+			mFrames.pop_back();
+			return callNative(proc.peek<Proc>()->mNative, args, context);
+		}
+		frame.mKind = eFrameArgs;
+		frame.mBase = (uint32_t)mValues.size();
+		frame.mForm = cdr(frame.mForm);
+		mValues.push_back(std::move(mValue));
+		if (isNull(frame.mForm))
+		{
+			return call();
+		}
+		evaluate(car(frame.mForm), frame.mContext);
+		return true;
+	}
+
+	case eFrameArgs:
+		mValues.push_back(std::move(mValue));
+		frame.mForm = cdr(frame.mForm);
+		if (isNull(frame.mForm))
+		{
+			return call();
+		}
+		evaluate(car(frame.mForm), frame.mContext);
+		return true;
+
+	case eFrameList:
+	{
+		mValues.push_back(std::move(mValue));
+		Item rest = cdr(frame.mForm);
+		if (!isNull(rest))
+		{
+			frame.mForm = rest;
+			evaluate(car(rest), frame.mContext);
+			return true;
+		}
+
+		// the values stay on the stack while the list is made from the end
+		uint32_t base = frame.mBase;
+		Context* context = frame.mContext;
+		mFrames.pop_back();
+		answer(Item((CellRef)nullptr));
+		for (size_t i = mValues.size(); i > base; i--)
+		{
+			mValue = Item(gMemory.allocCell(context, mValues[i - 1], mValue));
+		}
+		mValues.resize(base);
+		return true;
+	}
+
+	case eFrameApply:
+		mValues.push_back(std::move(mValue));
+		return call();
+
+	case eFrameWind:
+	{
+		// before, then the thunk inside the wind, then after, then the thunk's value
+		Context* context = frame.mContext;
+		switch (frame.mBase++)
+		{
+		case 0:
+			return callThunk(car(frame.mForm), context);
+		case 1:
+			sWinds = Item(gMemory.allocCell(context, frame.mForm, sWinds));
+			return callThunk(frame.mBody, context);
+		case 2:
+			frame.mBody = mValue;
+			sWinds = cdr(sWinds);
+			return callThunk(cdr(frame.mForm), context);
+		default:
+		{
+			Item value = frame.mBody;
+			mFrames.pop_back();
+			answer(value);
+			return true;
+		}
+		}
+	}
+
+	case eFrameRewind:
+	{
+		uint32_t next = (uint32_t)frame.mBody.get<Number>();
+		if (next == mValues.size())
+		{
+			Item value = frame.mForm;
+			sWinds = mValues[frame.mBase];
+			mValues.resize(frame.mBase);
+			mFrames.pop_back();
+			answer(value);
+			return true;
+		}
+		frame.mBody = Item((Number)(next + 2));
+		sWinds = mValues[next + 1];
+		return callThunk(mValues[next], frame.mContext);
+	}
+
+	default:
+		assert(!"a call out answers through its resumer");
+		return false;
+	}
+}
+
+// Calls the closure below the arguments of the frame on top, which it
+// replaces: a body runs in the frame the call was made from.
+bool Walker::call()
+{
+	Frame& frame = mFrames.back();
+	uint32_t base = frame.mBase;
+	Context* context = frame.mContext;
+	mFrames.pop_back();
+
+	const Proc* callee = mValues[base].peek<Proc>();
+	uint32_t count = (uint32_t)mValues.size() - base - 1;
+	if (!callee)
+	{
+		return fail("&did-not-eval-to-proc\n");
+	}
+	if (callee->mPrimitive && callee->mPrimitive->mFn)
+	{
+		// answered on the spot, from the values on the stack
+		Item result;
+		std::string error;
+		bool called = callPrimitive(*callee->mPrimitive, count ? &mValues[base + 1] : nullptr, count, context, &result, &error);
+		mValues.resize(base);
+		if (!called)
+		{
+			return fail(error);
+		}
+		answer(result);
+		return true;
+	}
+	if (callee->mNative)
+	{
+		if (const Continue* jump = callee->mNative.target<Continue>())
+		{
+			auto captured = jump->mCaptured;
+			Item value = count ? mValues[base + 1] : Item(Unspecified());
+			mValues.resize(base);
+			auto walker = restore(*captured, value);
+			if (!walker)
+			{
+				return fail("&continuation-reentered");
+			}
+			if (walker.get() == this)
+			{
+				return true;
+			}
+			walker->resumeLater();
+			return false;
+		}
+
+		// called with values, by a primitive calling back into Scheme, call/cc
+		// or dynamic-wind
+		Item proc = mValues[base];
+		std::vector<Item> args(mValues.begin() + base + 1, mValues.end());
+		mValues.resize(base);
+		push(eFrameAnswer, Item(), nullptr);
+		mFrames.back().mBase = ++mTicket;
+		Walker* calling = sCalling;
+		sCalling = this;
+		mCalling = true;
+		::apply(proc, args, context, resumer());
+		sCalling = calling;
+		return await();
+	}
+
+	std::string error;
+	Context* scope = bindArgs(*callee, count ? &mValues[base + 1] : nullptr, count, context, &error);
+	if (!scope)
+	{
+		return fail(error);
+	}
+	if (callee->mCode)
+	{
+		auto code = callee->mCode;
+		scope->mCode = code;
+		mValues.resize(base);
+		push(eFrameAnswer, Item(), nullptr);
+		mFrames.back().mBase = ++mTicket;
+		Walker* calling = sCalling;
+		sCalling = this;
+		mCalling = true;
+		code->exec(scope, resumer());
+		sCalling = calling;
+		return await();
+	}
+
+	Item body = car(cdr(Item(callee->mProc)));
+	mValues.resize(base);
+	evaluate(body, scope);
+	return true;
+}
+
+bool Walker::callNative(const Native& native, const Item& args, Context* context)
+{
+	push(eFrameAnswer, Item(), nullptr);
+	mFrames.back().mBase = ++mTicket;
+	Walker* calling = sCalling;
+	sCalling = this;
+	mCalling = true;
+	native(args, context, resumer());
+	sCalling = calling;
+	return await();
+}
+
+// Hands mValue to the continuation of a native that evaluated.
+bool Walker::resumeNative()
+{
+	Continuation k = std::move(mNatives.back());
+	mNatives.pop_back();
+	mFrames.pop_back();
+	Walker* calling = sCalling;
+	sCalling = this;
+	mCalling = true;
+	k(mValue);
+	sCalling = calling;
+	return await();
+}
+
+// After a call out: false if the walker has to wait for the answer.
+bool Walker::await()
+{
+	mCalling = false;
+	if (mAnswered)
+	{
+		mAnswered = false;
+		answer(mAnswer);
+		mAnswer = Item();
+		return true;
+	}
+	if (mStarted)
+	{
+		mStarted = false;
+		return true;
+	}
+	return false;
+}
+
+bool Walker::fail(const std::string& error)
+{
+	mFrames.clear();
+	mValues.clear();
+	mNatives.clear();
+	raiseError(error, mDone);
+	return false;
+}
+
+Continuation Walker::resumer()
+{
+	Resumer resumer = { shared_from_this(), mTicket };
+	return resumer;
+}
+
+// A call out answers once, while its frame is on top.
+void Walker::resume(uint32_t ticket, const Item& value)
+{
+	if (mAnswered || mFrames.empty() || mFrames.back().mKind != eFrameAnswer || mFrames.back().mBase != ticket)
+	{
+		raiseError("&continuation-reentered", mDone);
+		return;
+	}
+
+	mFrames.pop_back();
+	if (mCalling)
+	{
+		mAnswered = true;
+		mAnswer = value;
+		return;
+	}
+	answer(value);
+	run();
+}
+
+bool Walker::replace(uint32_t ticket, const Item& form, Context* context, bool list)
+{
+	if (!take(ticket))
+	{
+		return false;
+	}
+
+	start(form, context, list);
+	proceed();
+	return true;
+}
+
+bool Walker::take(uint32_t ticket)
+{
+	if (mAnswered || mStarted || mFrames.empty() || mFrames.back().mKind != eFrameAnswer || mFrames.back().mBase != ticket)
+	{
+		return false;
+	}
+
+	mFrames.pop_back();
+	return true;
+}
+
+// Carries on with what was put on the stack from a call out: on return from
+// it if the walker is calling out, otherwise now.
+void Walker::proceed()
+{
+	if (mCalling)
+	{
+		mStarted = true;
+	}
+	else
+	{
+		run();
+	}
+}
+
+// The same, for a jump, which may come from anywhere: from the trampoline
+// rather than nested in whatever jumped.
+void Walker::resumeLater()
+{
+	if (mCalling)
+	{
+		mStarted = true;
+		return;
+	}
+	auto self = shared_from_this();
+	yield([self]() { self->run(); });
+}
+
+// Calls a procedure of no arguments, from the frame on top.
+bool Walker::callThunk(Item proc, Context* context)
+{
+	push(eFrameApply, Item(), context);
+	mFrames.back().mBase = (uint32_t)mValues.size();
+	mValues.push_back(proc);
+	return call();
+}
+
+// The continuation of the form being evaluated, as a procedure.
+Item Walker::capture()
+{
+	auto captured = std::make_shared<Captured>();
+	captured->mHome = shared_from_this();
+	captured->mFrames = mFrames;
+	captured->mValues = mValues;
+	captured->mNatives = mNatives;
+	captured->mDone = mDone;
+	captured->mWinds = sWinds;
+	captured->mOuterTicket = 0;
+	if (sCalling && sCalling != this && !sCalling->mFrames.empty() && sCalling->mFrames.back().mKind == eFrameAnswer)
+	{
+		captured->mOuter = sCalling->shared_from_this();
+		captured->mOuterTicket = sCalling->mFrames.back().mBase;
+	}
+	Continue jump = { captured };
+	Proc proc(jump);
+	proc.mRoots = captured;
+	return Item(proc);
+}
+
+// The argument comes quoted from apply; a walker calling a continuation
+// evaluates it on its own stack.
+void Walker::Continue::operator()(Item args, Context* context, Continuation k) const
+{
+	auto captured = mCaptured;
+	if (isNull(args))
+	{
+		if (auto walker = restore(*captured, Unspecified()))
+		{
+			walker->resumeLater();
+		}
+		else
+		{
+			raiseError("&continuation-reentered", k);
+		}
+		return;
+	}
+	::eval(car(args), context, [captured, k](Item value) {
+		if (auto walker = restore(*captured, value))
+		{
+			walker->resumeLater();
+		}
+		else
+		{
+			raiseError("&continuation-reentered", k);
+		}
+	});
+}
+
+bool Walker::Captured::resumable() const
+{
+	if (mOuterTicket == 0)
+	{
+		return true;
+	}
+	auto outer = mOuter.lock();
+	return outer && !outer->mAnswered && !outer->mFrames.empty() && outer->mFrames.back().mKind == eFrameAnswer && outer->mFrames.back().mBase == mOuterTicket;
+}
+
+// Copies a continuation's stack back, over the walker it was captured on if
+// there was a stack to capture and that walker lives: the call outs waiting in
+// it answer that walker. The value is returned once the winds are rewound.
+std::shared_ptr<Walker> Walker::restore(const Captured& captured, const Item& value)
+{
+	// refused before any before runs or the winds move
+	if (!captured.resumable())
+	{
+		return std::shared_ptr<Walker>();
+	}
+
+	std::shared_ptr<Walker> walker;
+	if (!captured.mFrames.empty())
+	{
+		walker = captured.mHome.lock();
+	}
+	if (!walker)
+	{
+		walker = std::make_shared<Walker>(captured.mDone);
+	}
+	walker->mFrames = captured.mFrames;
+	walker->mValues = captured.mValues;
+	walker->mNatives = captured.mNatives;
+	walker->mDone = captured.mDone;
+	walker->mAnswered = false;
+	walker->mAnswer = Item();
+	walker->rewind(captured.mWinds, value);
+	return walker;
+}
+
+static bool sameList(const Item& a, const Item& b)
+{
+	return a.get<CellRef>() == b.get<CellRef>();
+}
+
+static size_t length(Item list)
+{
+	size_t count = 0;
+	for (; !isNull(list); list = cdr(list))
+	{
+		count++;
+	}
+	return count;
+}
+
+// Leaves the winds in force for the dynamic-winds that are being run, then
+// returns the value: the afters of those left innermost first, then the
+// befores of those entered outermost first, each with the winds outside it.
+void Walker::rewind(const Item& winds, const Item& value)
+{
+	if (sameList(sWinds, winds))
+	{
+		answer(value);
+		return;
+	}
+
+	Item from = sWinds;
+	Item to = winds;
+	size_t fromLength = length(from);
+	size_t toLength = length(to);
+	for (; fromLength > toLength; fromLength--)
+	{
+		from = cdr(from);
+	}
+	for (; toLength > fromLength; toLength--)
+	{
+		to = cdr(to);
+	}
+	while (!sameList(from, to))
+	{
+		from = cdr(from);
+		to = cdr(to);
+	}
+
+	uint32_t base = (uint32_t)mValues.size();
+	mValues.push_back(winds);
+	for (Item wind = sWinds; !sameList(wind, from); wind = cdr(wind))
+	{
+		mValues.push_back(cdr(car(wind)));
+		mValues.push_back(cdr(wind));
+	}
+	size_t befores = mValues.size();
+	for (Item wind = winds; !sameList(wind, from); wind = cdr(wind))
+	{
+		mValues.push_back(car(car(wind)));
+		mValues.push_back(cdr(wind));
+	}
+	for (size_t i = befores, j = mValues.size() - 2; i < j; i += 2, j -= 2)
+	{
+		std::swap(mValues[i], mValues[j]);
+		std::swap(mValues[i + 1], mValues[j + 1]);
+	}
+
+	push(eFrameRewind, value, gMemory.getRoot());
+	mFrames.back().mBase = base;
+	mFrames.back().mBody = Item((Number)(base + 1));
+	answer(Unspecified());
+}
+
+std::shared_ptr<Walker> Walker::adopt(const Continuation& k)
+{
+	if (const Resumer* resumer = k.target<Resumer>())
+	{
+		if (resumer->mWalker->take(resumer->mTicket))
+		{
+			return resumer->mWalker;
+		}
+	}
+	return std::make_shared<Walker>(k);
+}
+
+// (call-with-current-continuation f) calls f on the continuation of the call.
+void Walker::callWithContinuation(const Item* values, uint32_t count, Context* context, Continuation k)
+{
+	auto walker = adopt(k);
+	Item cc = walker->capture();
+	walker->push(eFrameApply, Item(), context);
+	walker->mFrames.back().mBase = (uint32_t)walker->mValues.size();
+	walker->mValues.push_back(values[0]);
+	walker->answer(cc);
+	walker->proceed();
+}
+
+// (dynamic-wind before thunk after) calls the thunk with before called on the
+// way into it and after on the way out, however either way is taken.
+void Walker::dynamicWind(const Item* values, uint32_t count, Context* context, Continuation k)
+{
+	auto walker = adopt(k);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		gMemory.pushRoot(values[i]);
+	}
+	Item wind = Item(gMemory.allocCell(context, values[0], values[2]));
+	gMemory.popRoots(count);
+	walker->push(eFrameWind, wind, context);
+	walker->mFrames.back().mBody = values[1];
+	walker->answer(Unspecified());
+	walker->proceed();
+}
+
+void addContinuationNatives()
+{
+	static bool sRooted = false;
+	if (!sRooted)
+	{
+		gMemory.addRootSet(new WindRoots());
+		sRooted = true;
+	}
+	defineCallingPrimitive("call-with-current-continuation", Walker::callWithContinuation, 1, 1);
+	defineCallingPrimitive("call/cc", Walker::callWithContinuation, 1, 1);
+	defineCallingPrimitive("dynamic-wind", Walker::dynamicWind, 3, 3);
+}
+
+void test_walker()
+{
+	char* rest;
+	Context* context = gMemory.getRoot();
+	EvalMode mode = gEvalMode;
+	gEvalMode = eWalk;
+
+	// a recursion far deeper than the C++ stack would take as nested calls
+	tcoeval(Parser::parseForm(context, "(define (count-down n) (if (= n 0) 0 (+ 1 (count-down (- n 1)))))", &rest).mV, context, [](Item){});
+	Number result = 0;
+	tcoeval(Parser::parseForm(context, "(count-down 200000)", &rest).mV, context, [&result](Item item) {
+		result = item.get<Number>();
+	});
+	assert(result == 200000);
+
+	// natives evaluate on the walker that calls them, and lists come back whole
+	Item list;
+	tcoeval(Parser::parseForm(context, "(list (let* ((a 1) (b (+ a 1))) b) (let ((a 5)) (begin (set! a 3) a)) 'c)", &rest).mV, context, [&list](Item item) {
+		list = item;
+	});
+	assert(print(list) == "( 2 . ( 3 . ( c . () ) ) ) ");
+
+	// an escape unwinds the walker, past the natives waiting on it
+	tcoeval(Parser::parseForm(context, "(define (escape x) (callcc ret (+ 1 (ret x))))", &rest).mV, context, [](Item){});
+	result = 0;
+	tcoeval(Parser::parseForm(context, "(+ 1 (escape 5))", &rest).mV, context, [&result](Item item) {
+		result = item.get<Number>();
+	});
+	assert(result == 6);
+
+	gEvalMode = mode;
+}
+
+// What a form answered last, which a continuation re-entered later answers too.
+static Item sAnswered;
+
+static Item evalString(const char* text)
+{
+	char* rest;
+	Context* context = gMemory.getRoot();
+	sAnswered = Item();
+	tcoeval(Parser::parseForm(context, text, &rest).mV, context, [](Item item) {
+		sAnswered = item;
+	});
+	return sAnswered;
+}
+
+void test_continuations()
+{
+	EvalMode mode = gEvalMode;
+	for (int i = eWalk; i <= eAnalyze; i++)
+	{
+		gEvalMode = (EvalMode)i;
+
+		// a continuation returns again from where it was captured, after the
+		// form that captured it has been answered
+		evalString("(define saved (list 0))");
+		std::vector<Number> results;
+		char* rest;
+		Context* context = gMemory.getRoot();
+		tcoeval(Parser::parseForm(context, "(+ 100 (call/cc (lambda (k) (begin (set-car! saved k) 1))))", &rest).mV, context, [&results](Item item) {
+			results.push_back(item.get<Number>());
+		});
+		evalString("((car saved) 5)");
+		evalString("((car saved) 7)");
+		assert(results.size() == 3 && results[0] == 101 && results[1] == 105 && results[2] == 107);
+
+		// backtracking: each choice is taken again once what follows it fails
+		evalString("(define fails (list '()))");
+		evalString("(define (fail) (let ((f (car (car fails)))) (begin (set-car! fails (cdr (car fails))) (f 0))))");
+		evalString("(define (choose a b) (callcc k (begin (set-car! fails (cons (lambda (x) (k b)) (car fails))) a)))");
+		Item found = evalString("(let* ((x (choose 1 2)) (y (choose 3 4))) (if (= (+ x y) 6) (list x y) (fail)))");
+		assert(print(found) == "( 2 . ( 4 . () ) ) ");
+		evalString("(define (choose-from xs) (if (null? xs) (fail) (callcc k (begin (set-car! fails (cons (lambda (x) (k (choose-from (cdr xs)))) (car fails))) (car xs)))))");
+		evalString("(define sides '(1 2 3 4 5 6 7 8 9 10 11 12 13))");
+		found = evalString("(let* ((a (choose-from sides)) (b (choose-from sides)) (c (choose-from sides))) (if (= (+ (* a a) (* b b)) (* c c)) (if (= c 13) (list a b c) (fail)) (fail)))");
+		assert(print(found) == "( 5 . ( 12 . ( 13 . () ) ) ) ");
+
+		// the befores and afters run on every way in and out
+		evalString("(define trail (list '()))");
+		evalString("(define (note x) (set-car! trail (cons x (car trail))))");
+		evalString("(dynamic-wind (lambda () (note 'in)) (lambda () (note 'during)) (lambda () (note 'out)))");
+		Item trail = evalString("(car trail)");
+		assert(print(trail) == "( out . ( during . ( in . () ) ) ) ");
+
+		evalString("(set-car! trail '())");
+		Item escaped = evalString("(call-with-current-continuation (lambda (k) (dynamic-wind (lambda () (note 'in)) (lambda () (k 'escaped)) (lambda () (note 'out)))))");
+		assert(print(escaped) == "escaped ");
+		trail = evalString("(car trail)");
+		assert(print(trail) == "( out . ( in . () ) ) ");
+		evalString("(set-car! trail '())");
+		evalString("(dynamic-wind (lambda () (note 'in)) (lambda () (call/cc (lambda (k) (begin (set-car! saved k) 'first)))) (lambda () (note 'out)))");
+		evalString("((car saved) 'again)");
+		trail = evalString("(car trail)");
+		assert(print(trail) == "( out . ( in . ( out . ( in . () ) ) ) ) ");
+
+		// analyzed code returns through the wind's call out once only, so going
+		// back in is refused before the before runs, and the winds stay as they are
+		evalString("(set-car! trail '())");
+		evalString("(dynamic-wind (lambda () (note 'in)) (lambda () (+ 1 (call/cc (lambda (k) (begin (set-car! saved k) 1))))) (lambda () (note 'out)))");
+		evalString("((car saved) 5)");
+		evalString("(call/cc (lambda (k) (k 'escaped)))");
+		trail = evalString("(car trail)");
+		assert(print(trail) == (i == eWalk ? "( out . ( in . ( out . ( in . () ) ) ) ) " : "( out . ( in . () ) ) "));
+	}
+	gEvalMode = mode;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "schemetypes.h"
+#include "context.h"
+#include "memory.h"
+#include "eval.h"
+
+// Walks forms with what is left to do held in typed frames on a contiguous
+// stack rather than in nested continuations, so evaluating a form pushes and
+// pops records that allocate nothing once the stack has grown, and a deep
+// recursion is limited by memory rather than by the C++ stack. The walker is
+// registered with the collector, which traces the forms, frames and values on
+// its stack, for as long as it lives.
+//
+// Natives still answer through a continuation, as for the machine: straight
+// away if they answer before returning, from the trampoline if they yield
+// first. When a native the walker is calling evaluates, its continuation goes
+// on the stack as a frame of its own and the walker carries on with the form,
+// rather than a walker being started on top of the native. A primitive's
+// arguments are evaluated onto the stack, as a closure's are, and it answers
+// from there on the spot.
+//
+// No frame is pushed for a form in tail position, so a loop through if,
+// begin, let, let* or callcc runs in constant space. Nor is one kept for a call
+// out whose continuation is the walker's own: a native or a machine that
+// evaluates in tail position with it carries on in the walker in place of its
+// frame.
+//
+// A continuation is a copy of the stack when it is captured, so capturing one
+// costs what is live on the stack and nothing else. Invoking it copies the
+// stack back, into the walker it was captured on if that still lives, and
+// returns the value from there, as many times as it is invoked; the winds
+// dynamic-wind left between the two are unwound and rewound on the way.
+class Walker : public RootSet, public std::enable_shared_from_this<Walker>
+{
+public:
+	enum FrameKind
+	{
+		eFrameAnswer,		// a call out, until it answers through the ticket in mBase
+		eFrameNative,		// a native's continuation, the top of mNatives
+		eFrameIf,			// mForm is the if, waiting on its test
+		eFrameBegin,		// mForm is the rest of the body
+		eFrameAssign,		// mForm is the symbol define or set! binds
+		eFrameLet,			// mForm is the rest of the bindings, made in mScope
+		eFrameLetStar,		// the same, each in a frame inside the last
+		eFrameOperator,		// mForm is the call, waiting on the operator
+		eFrameArgs,			// mForm is the rest of the arguments, the proc at mBase
+		eFrameList,			// mForm is the rest of a list being evaluated from mBase
+		eFrameApply,		// the proc at mBase, to be called on the value returned to it
+		eFrameWind,			// mForm is the (before . after) of a dynamic-wind at stage mBase
+		eFrameRewind		// the winds to leave at mBase, the befores and afters from mBody to run, then mForm
+	};
+
+	struct Frame
+	{
+		FrameKind	mKind;
+		uint32_t	mBase;			// where the frame's values start, its ticket, or its stage
+		Item		mForm;
+		Item		mBody;			// a let's body, a dynamic-wind's thunk and then its value
+		Context*	mContext;
+		Context*	mScope;			// the frame a let binds in
+	};
+
+	// While one lives, eval starts a walker of its own rather than adding to
+	// one calling out further up, for a trampoline that runs steps to the end.
+	struct Outside
+	{
+		Outside();
+		~Outside();
+		Walker*	mCalling;
+	};
+
+	Walker(const Continuation& k);
+	~Walker();
+
+	// evaluates the form, or each element of the list, on the walker this is
+	// called from if it is calling out, otherwise on a new one
+	static void	eval(const Item& form, Context* context, const Continuation& k, bool list);
+
+	void		run();
+	void		markRoots() override;
+
+	size_t		depth() const { return mFrames.size(); }
+
+private:
+	// What a call out is handed, to answer the frame that waits on it.
+	struct Resumer
+	{
+		std::shared_ptr<Walker>	mWalker;
+		uint32_t				mTicket;
+
+		void operator()(Item value) const { mWalker->resume(mTicket, value); }
+	};
+
+	// A continuation: the stack as it was, and the winds in force.
+	struct Captured : public RootSet
+	{
+		std::weak_ptr<Walker>		mHome;
+		std::vector<Frame>			mFrames;
+		std::vector<Item>			mValues;
+		std::vector<Continuation>	mNatives;
+		Continuation				mDone;
+		Item						mWinds;
+		// the call out of another walker that mDone answers in the end, if it
+		// was waiting when the continuation was captured; once that has been
+		// answered the continuation can't be returned through again
+		std::weak_ptr<Walker>		mOuter;
+		uint32_t					mOuterTicket;
+
+		bool	resumable() const;
+		void	markRoots() override;
+	};
+
+	// The native a continuation is called as.
+	struct Continue
+	{
+		std::shared_ptr<Captured>	mCaptured;
+
+		void operator()(Item args, Context* context, Continuation k) const;
+	};
+
+	std::vector<Frame>			mFrames;
+	std::vector<Item>			mValues;
+	std::vector<Continuation>	mNatives;
+	Continuation				mDone;
+	bool						mEvaluating;	// mForm is to be evaluated, rather than mValue returned
+	Item						mForm;
+	Context*					mContext;
+	Item						mValue;
+	uint32_t					mTicket;
+	bool						mCalling;		// inside a call out, so an answer is picked up on return
+	bool						mAnswered;
+	bool						mStarted;		// something the call out evaluates is on the stack
+	Item						mAnswer;
+
+	static Walker*				sCalling;
+
+	void		start(const Item& form, Context* context, bool list);
+	void		push(FrameKind kind, const Item& form, Context* context);
+	void		evaluate(const Item& form, Context* context);
+	void		answer(const Item& value);
+	bool		step();
+	bool		bindings();
+	bool		ret();
+	bool		call();
+	bool		callNative(const Native& native, const Item& args, Context* context);
+	bool		resumeNative();
+	bool		await();
+	bool		fail(const std::string& error);
+	Continuation	resumer();
+	void		resume(uint32_t ticket, const Item& value);
+	// evaluates in place of the call out waiting on the ticket, if it is on top
+	bool		replace(uint32_t ticket, const Item& form, Context* context, bool list);
+
+	// takes the call out waiting on the ticket off the stack, if it is on top
+	bool		take(uint32_t ticket);
+	void		proceed();
+	void		resumeLater();
+	bool		callThunk(Item proc, Context* context);
+	Item		capture();
+	void		rewind(const Item& winds, const Item& value);
+
+	// the walker a native answering k carries on in
+	static std::shared_ptr<Walker>	adopt(const Continuation& k);
+	// null, having touched nothing, if the continuation can't be resumed
+	static std::shared_ptr<Walker>	restore(const Captured& captured, const Item& value);
+	static void	callWithContinuation(const Item* values, uint32_t count, Context* context, Continuation k);
+	static void	dynamicWind(const Item* values, uint32_t count, Context* context, Continuation k);
+
+	friend void	addContinuationNatives();
+};
+
+void	addContinuationNatives();
+
+void	test_walker();
+void	test_continuations();